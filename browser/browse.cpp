@@ -59,9 +59,9 @@ class FoldStateSearchOutOfRangeException : exception {
 };
 
 struct FoldStateByPhysLineSearcher {
-    unsigned target, vislines_before;
+    LineNo target, vislines_before;
 
-    FoldStateByPhysLineSearcher(unsigned target)
+    FoldStateByPhysLineSearcher(LineNo target)
         : target(target), vislines_before(0)
     {
     }
@@ -94,9 +94,9 @@ struct FoldStateByPhysLineSearcher {
 };
 
 struct FoldStateByVisLineSearcher {
-    unsigned target, vislines_before, physlines_before;
+    LineNo target, vislines_before, physlines_before;
 
-    FoldStateByVisLineSearcher(unsigned target)
+    FoldStateByVisLineSearcher(LineNo target)
         : target(target), vislines_before(0), physlines_before(0)
     {
     }
@@ -131,7 +131,7 @@ struct FoldStateByVisLineSearcher {
 };
 
 struct FoldStateEndOfListSearcher {
-    unsigned vislines_before = 0;
+    LineNo vislines_before = 0;
 
     FoldStateEndOfListSearcher() = default;
     FoldStateEndOfListSearcher(const FoldStateEndOfListSearcher &) = delete;
@@ -173,7 +173,7 @@ void DecodedTraceLine::got_event(InstructionEvent &ev)
     iev = make_unique<InstructionEvent>(ev);
 }
 
-HighlightedLine::HighlightedLine(const string &text, const ParseParams &pparams,
+HighlightedLine::HighlightedLine(StringRef text, const ParseParams &pparams,
                                  size_t display_len)
     : text(text), display_len(display_len), disassembly_start(display_len),
       highlights(display_len, HL_NONE), iev(nullptr),
@@ -188,7 +188,7 @@ HighlightedLine::HighlightedLine(const string &text, const ParseParams &pparams,
     }
 }
 
-HighlightedLine::HighlightedLine(const string &text, const ParseParams &pparams)
+HighlightedLine::HighlightedLine(StringRef text, const ParseParams &pparams)
     : HighlightedLine(text, pparams, text.size())
 {
 }
@@ -339,7 +339,9 @@ void HighlightedLine::replace_instruction(Browser &br)
                              iev->disassembly.substr(operand_end);
 
     highlights.resize(disassembly_start);
-    text = text.substr(0, disassembly_start) + new_disassembly;
+    replaced_text.assign(text.data(), min(disassembly_start, text.size()));
+    replaced_text += new_disassembly;
+    text = replaced_text;
     highlights.resize(text.size(), HL_DISASSEMBLY);
     display_len = text.size();
 }
@@ -355,7 +357,7 @@ Browser::TraceView::TraceView(Browser &br) : br(br), index(br.index)
     }
 }
 
-void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
+void Browser::TraceView::set_fold_state(LineNo firstline, LineNo lastline,
                                         unsigned mindepth, unsigned maxdepth)
 {
     FoldStatePayload fsp, fsp_found;
@@ -391,7 +393,7 @@ void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
             fsp_part.first_physical_line = fsp.last_physical_line + 1;
             fsp_part.n_physical_lines = (fsp_part.last_physical_line -
                                          fsp_part.first_physical_line + 1);
-            unsigned first_quasivis_line_after =
+            LineNo first_quasivis_line_after =
                 fsp_part.first_quasivis_line + fsp_part.n_visible_lines;
             fsp_part.n_visible_lines = br.lrt_translate_range(
                 fsp_part.first_physical_line - 1, fsp_part.last_physical_line,
@@ -404,7 +406,7 @@ void Browser::TraceView::set_fold_state(unsigned firstline, unsigned lastline,
     fold_states.insert(fsp);
 }
 
-unsigned Browser::TraceView::visible_to_physical_line(unsigned visline)
+LineNo Browser::TraceView::visible_to_physical_line(LineNo visline)
 {
     FoldStatePayload fsp;
 
@@ -413,7 +415,7 @@ unsigned Browser::TraceView::visible_to_physical_line(unsigned visline)
      */
     FoldStateByVisLineSearcher searcher(visline);
     bool ret = fold_states.search(ref(searcher), &fsp);
-    unsigned physline = 1 + searcher.physlines_before;
+    LineNo physline = 1 + searcher.physlines_before;
     if (ret)
         physline += br.lrt_translate_range(
             fsp.first_quasivis_line,
@@ -422,10 +424,10 @@ unsigned Browser::TraceView::visible_to_physical_line(unsigned visline)
     return physline;
 }
 
-unsigned Browser::TraceView::physical_to_visible_line(unsigned physline)
+LineNo Browser::TraceView::physical_to_visible_line(LineNo physline)
 {
     FoldStatePayload fsp;
-    unsigned vislines_before;
+    LineNo vislines_before;
 
     /*
      * Find which fold_states range we're in.
@@ -440,14 +442,14 @@ unsigned Browser::TraceView::physical_to_visible_line(unsigned physline)
     return vislines_before;
 }
 
-unsigned Browser::TraceView::total_visible_lines()
+LineNo Browser::TraceView::total_visible_lines()
 {
     FoldStateEndOfListSearcher searcher;
     fold_states.search(ref(searcher), nullptr);
     return searcher.vislines_before;
 }
 
-bool Browser::get_node_by_physline(unsigned physline, SeqOrderPayload *node,
+bool Browser::get_node_by_physline(LineNo physline, SeqOrderPayload *node,
                                    unsigned *offset_within_node)
 {
     bool ret = node_at_line(physline, node);
@@ -456,7 +458,7 @@ bool Browser::get_node_by_physline(unsigned physline, SeqOrderPayload *node,
     return ret;
 }
 
-bool Browser::TraceView::get_node_by_visline(unsigned visline,
+bool Browser::TraceView::get_node_by_visline(LineNo visline,
                                              SeqOrderPayload *node,
                                              unsigned *offset_within_node)
 {
@@ -468,11 +470,11 @@ void Browser::TraceView::update_visible_node()
 {
     // visline_of_next_node is the first visible node after this
     // one.
-    unsigned visline_of_next_node =
+    LineNo visline_of_next_node =
         physical_to_visible_line(curr_logical_node.trace_file_firstline +
                                  curr_logical_node.trace_file_lines);
     if (visline_of_next_node >= 1) {
-        unsigned physline_of_prev_node =
+        LineNo physline_of_prev_node =
             visible_to_physical_line(visline_of_next_node - 1);
         bool ret = br.node_at_line(physline_of_prev_node, &curr_visible_node);
         (void)ret; // squash compiler warning if asserts compiled out
@@ -485,9 +487,9 @@ void Browser::TraceView::update_visible_node()
 void Browser::TraceView::visible_to_logical_node(SeqOrderPayload &visnode,
                                                  SeqOrderPayload *lognode)
 {
-    unsigned curr_last_visline = physical_to_visible_line(
+    LineNo curr_last_visline = physical_to_visible_line(
         visnode.trace_file_firstline + visnode.trace_file_lines - 1);
-    unsigned physline_of_target_node =
+    LineNo physline_of_target_node =
         visible_to_physical_line(curr_last_visline + 1) - 1;
     bool ret = br.node_at_line(physline_of_target_node, lognode);
     (void)ret; // squash compiler warning if asserts compiled out
@@ -507,7 +509,7 @@ bool Browser::TraceView::goto_time(Time t)
     return true;
 }
 
-bool Browser::TraceView::goto_physline(unsigned line)
+bool Browser::TraceView::goto_physline(LineNo line)
 {
     if (!br.node_at_line(line, &curr_logical_node))
         return false;
@@ -515,7 +517,7 @@ bool Browser::TraceView::goto_physline(unsigned line)
     return true;
 }
 
-bool Browser::TraceView::goto_visline(unsigned line)
+bool Browser::TraceView::goto_visline(LineNo line)
 {
     bool ok = false;
 
@@ -576,8 +578,8 @@ bool Browser::TraceView::lookup_register(const RegisterId &r, uint64_t &out)
      */
     if (r == REG_pc) {
         SeqOrderPayload next_logical_node;
-        unsigned target_line = (curr_logical_node.trace_file_firstline +
-                                curr_logical_node.trace_file_lines);
+        LineNo target_line = (curr_logical_node.trace_file_firstline +
+                              curr_logical_node.trace_file_lines);
         bool got_next_node = br.node_at_line(target_line, &next_logical_node);
         if (got_next_node)
             out = next_logical_node.pc;
@@ -608,17 +610,12 @@ bool Browser::TraceView::lookup_register(const RegisterId &r, uint64_t &out)
 
 bool Browser::TraceView::goto_pc(unsigned long long pc, int dir)
 {
-    pc &= ~(unsigned long long)1;
-    ByPCPayload pcfinder, pcfound;
-    pcfinder.pc = pc;
-    pcfinder.trace_file_firstline = curr_logical_node.trace_file_firstline +
-                                    curr_logical_node.trace_file_lines +
-                                    (dir > 0 ? +1 : -1);
-    bool ret = (dir > 0 ? index.bypctree.succ(index.bypcroot, pcfinder,
-                                              &pcfound, nullptr)
-                        : index.bypctree.pred(index.bypcroot, pcfinder,
-                                              &pcfound, nullptr));
-    if (!ret || pcfound.pc != pc)
+    LineNo found_line;
+    if (!br.find_pc_visit(pc,
+                          curr_logical_node.trace_file_firstline +
+                              curr_logical_node.trace_file_lines +
+                              (dir > 0 ? +1 : -1),
+                          dir, &found_line))
         return false;
 
     /*
@@ -634,7 +631,7 @@ bool Browser::TraceView::goto_pc(unsigned long long pc, int dir)
      * likely wanted to look at the register and stack arguments
      * set up by the caller.)
      */
-    unsigned target_line = pcfound.trace_file_firstline;
+    LineNo target_line = found_line;
     if (target_line > 0)
         target_line--;
     return goto_physline(target_line);
@@ -747,8 +744,8 @@ bool Browser::TraceView::get_current_pc(unsigned long long &pc)
      * _before_ the execution of.
      */
     SeqOrderPayload next_logical_node;
-    unsigned target_line = (curr_logical_node.trace_file_firstline +
-                            curr_logical_node.trace_file_lines);
+    LineNo target_line = (curr_logical_node.trace_file_firstline +
+                          curr_logical_node.trace_file_lines);
     if (!br.node_at_line(target_line, &next_logical_node))
         return false;
     pc = next_logical_node.pc;
@@ -758,7 +755,7 @@ bool Browser::TraceView::get_current_pc(unsigned long long &pc)
 bool Browser::TraceView::next_visible_node(SeqOrderPayload &node,
                                            SeqOrderPayload *ret)
 {
-    unsigned curr_last_visline = physical_to_visible_line(
+    LineNo curr_last_visline = physical_to_visible_line(
         node.trace_file_firstline + node.trace_file_lines - 1);
     return get_node_by_visline(curr_last_visline + 1, ret);
 }
@@ -766,7 +763,7 @@ bool Browser::TraceView::next_visible_node(SeqOrderPayload &node,
 bool Browser::TraceView::prev_visible_node(SeqOrderPayload &node,
                                            SeqOrderPayload *ret)
 {
-    unsigned curr_first_visline =
+    LineNo curr_first_visline =
         physical_to_visible_line(node.trace_file_firstline);
     return (curr_first_visline > 1 &&
             get_node_by_visline(curr_first_visline - 1, ret));
@@ -783,7 +780,7 @@ bool Browser::TraceView::prev_visible_node(SeqOrderPayload *ret)
 }
 
 bool Browser::TraceView::physline_range_for_containing_function(
-    SeqOrderPayload &node, unsigned *firstline, unsigned *lastline,
+    SeqOrderPayload &node, LineNo *firstline, LineNo *lastline,
     unsigned *depth)
 {
     // First, find out the depth of the function in question.
@@ -805,13 +802,13 @@ bool Browser::TraceView::physline_range_for_containing_function(
 
     // Now find the limits of the function at this depth, by searching
     // for the next/previous node at less than fold_depth.
-    unsigned physlinehere = node.trace_file_firstline + node.trace_file_lines;
+    LineNo physlinehere = node.trace_file_firstline + node.trace_file_lines;
 
-    unsigned foldedlineafter =
+    LineNo foldedlineafter =
         br.lrt_translate(physlinehere - 1, 0, UINT_MAX, 0, fold_depth);
-    unsigned physlineafter =
+    LineNo physlineafter =
         br.lrt_translate(foldedlineafter, 0, fold_depth, 0, UINT_MAX) + 1;
-    unsigned physlinefirstwithin =
+    LineNo physlinefirstwithin =
         br.lrt_translate(foldedlineafter - 1, 0, fold_depth, 0, UINT_MAX) + 2;
 
     *firstline = physlinefirstwithin;
@@ -821,7 +818,7 @@ bool Browser::TraceView::physline_range_for_containing_function(
 }
 
 bool Browser::TraceView::physline_range_for_folded_function_after(
-    SeqOrderPayload &visnode, unsigned *firstline, unsigned *lastline,
+    SeqOrderPayload &visnode, LineNo *firstline, LineNo *lastline,
     unsigned *depth)
 {
     SeqOrderPayload lognode;
@@ -838,8 +835,10 @@ bool Browser::TraceView::physline_range_for_folded_function_after(
 
 auto Browser::TraceView::node_fold_state(SeqOrderPayload &node) -> NodeFoldState
 {
-    SeqOrderPayload succ;
-    if (br.get_next_node(node, &succ) && succ.call_depth > node.call_depth) {
+    SeqCursor cursor(br);
+    if (cursor.seek_line(node.trace_file_firstline) && cursor.next() &&
+        cursor.node().call_depth > node.call_depth) {
+        const SeqOrderPayload &succ = cursor.node();
         // This node's physical successor is at a higher call depth,
         // so it's a function call. To find out if it's folded, see if
         // its _visible_ successor is also its physical one.
@@ -883,7 +882,7 @@ size_t format_reg_length(const RegisterId &r)
 
 void Browser::format_reg(string &dispstr, string &disptype, const RegisterId &r,
                          OFF_T memroot, OFF_T diff_memroot,
-                         unsigned diff_minline)
+                         LineNo diff_minline)
 {
     unsigned iflags = get_iflags(memroot);
     Addr roffset = reg_offset(r, iflags);
@@ -1011,7 +1010,7 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
                                   Addr addr, bool addr_known,
                                   int bytes_per_line, int addr_chars,
                                   OFF_T memroot, OFF_T diff_memroot,
-                                  unsigned diff_minline)
+                                  LineNo diff_minline)
 {
     dispaddr.clear();
     typeaddr.clear();
@@ -1093,7 +1092,7 @@ void Browser::format_memory_split(string &dispaddr, string &typeaddr,
 void Browser::format_memory(string &line, string &type, Addr addr,
                             bool addr_known, int bytes_per_line, int addr_chars,
                             size_t &hexpos, OFF_T memroot, OFF_T diff_memroot,
-                            unsigned diff_minline)
+                            LineNo diff_minline)
 {
     string dispaddr, typeaddr, disphex, typehex, dispchars, typechars;
 
@@ -30,19 +30,19 @@
 #include <utility>
 
 struct FoldStatePayload {
-    unsigned first_physical_line, last_physical_line;
+    LineNo first_physical_line, last_physical_line;
     // first_quasivis_line gives the indiex of what _would_ be the
     // first visible line in this region, if the entire buffer was at
     // this particular min/max depth. In other words, this is a value
     // you can pass to lrt_translate_range to compute offsets within
     // this region.
-    unsigned first_quasivis_line;
+    LineNo first_quasivis_line;
     unsigned mindepth, maxdepth;
-    unsigned n_physical_lines, n_visible_lines;
+    LineNo n_physical_lines, n_visible_lines;
     int cmp(const FoldStatePayload &rhs) const;
 };
 struct FoldStateAnnotation {
-    unsigned n_physical_lines{0}, n_visible_lines{0};
+    LineNo n_physical_lines{0}, n_visible_lines{0};
     FoldStateAnnotation() = default;
     FoldStateAnnotation(const FoldStateAnnotation &) = default;
     FoldStateAnnotation(const FoldStatePayload &payload)
@@ -100,15 +100,15 @@ class Browser : public IndexNavigator {
       public:
         TraceView(Browser &br);
 
-        unsigned visible_to_physical_line(unsigned visline);
-        unsigned physical_to_visible_line(unsigned physline);
-        unsigned total_visible_lines();
-        bool get_node_by_visline(unsigned visline, SeqOrderPayload *node,
+        LineNo visible_to_physical_line(LineNo visline);
+        LineNo physical_to_visible_line(LineNo physline);
+        LineNo total_visible_lines();
+        bool get_node_by_visline(LineNo visline, SeqOrderPayload *node,
                                  unsigned *offset_within_node = NULL);
 
         bool goto_time(Time t);
-        bool goto_physline(unsigned line);
-        bool goto_visline(unsigned line);
+        bool goto_physline(LineNo line);
+        bool goto_visline(LineNo line);
         bool goto_buffer_limit(bool end);
         bool goto_pc(unsigned long long pc, int dir);
         bool goto_cpu_exception(int dir);
@@ -138,15 +138,15 @@ class Browser : public IndexNavigator {
         // function in question being unfolded, and none of its
         // subfunctions.
         bool physline_range_for_containing_function(SeqOrderPayload &node,
-                                                    unsigned *firstline,
-                                                    unsigned *lastline,
+                                                    LineNo *firstline,
+                                                    LineNo *lastline,
                                                     unsigned *depth);
         bool physline_range_for_folded_function_after(SeqOrderPayload &node,
-                                                      unsigned *firstline,
-                                                      unsigned *lastline,
+                                                      LineNo *firstline,
+                                                      LineNo *lastline,
                                                       unsigned *depth);
 
-        void set_fold_state(unsigned firstline, unsigned lastline,
+        void set_fold_state(LineNo firstline, LineNo lastline,
                             unsigned mindepth, unsigned maxdepth);
 
         // This function can evaluate an expression which refers to
@@ -159,7 +159,7 @@ class Browser : public IndexNavigator {
     Browser(const Browser &) = delete;
     Browser(Browser &&) = delete;
 
-    bool get_node_by_physline(unsigned physline, SeqOrderPayload *node,
+    bool get_node_by_physline(LineNo physline, SeqOrderPayload *node,
                               unsigned *offset_within_node = NULL);
 
     // Fills in dispstr with a string of the form 'regname=value',
@@ -174,7 +174,7 @@ class Browser : public IndexNavigator {
     //           changed its value between memroot and diff_memroot.
     void format_reg(std::string &dispstr, std::string &disptype,
                     const RegisterId &r, OFF_T memroot, OFF_T diff_memroot = 0,
-                    unsigned diff_minline = 0);
+                    LineNo diff_minline = 0);
 
     // Similar, but fills in the same output variables with a hex dump
     // of memory. One extra value pair can occur in disptype:
@@ -197,13 +197,13 @@ class Browser : public IndexNavigator {
     void format_memory(std::string &dispstr, std::string &disptype, Addr addr,
                        bool addr_known, int bytes_per_line, int addr_chars,
                        size_t &hexpos, OFF_T memroot, OFF_T diff_memroot = 0,
-                       unsigned diff_minline = 0);
+                       LineNo diff_minline = 0);
     void format_memory_split(std::string &dispaddr, std::string &typeaddr,
                              std::string &disphex, std::string &typehex,
                              std::string &dispchars, std::string &typechars,
                              Addr addr, bool addr_known, int bytes_per_line,
                              int addr_chars, OFF_T memroot,
-                             OFF_T diff_memroot = 0, unsigned diff_minline = 0);
+                             OFF_T diff_memroot = 0, LineNo diff_minline = 0);
 
     bool lookup_register(const std::string &name, RegisterId &r);
     bool get_memory_word(Addr addr, Addr size, OFF_T memroot,
@@ -243,19 +243,25 @@ class DecodedTraceLine : public ParseReceiver {
     virtual void got_event(InstructionEvent &ev) override;
 };
 
+// A trace line split into highlighted regions. 'text' refers to the
+// caller's copy of the line, which must outlive this object, until
+// replace_instruction() rewrites it into a string of our own.
 class HighlightedLine : public ParseReceiver {
+    std::string replaced_text;
+
   public:
-    std::string text;
+    StringRef text;
     size_t display_len;
     size_t disassembly_start;
     std::vector<HighlightClass> highlights;
     std::unique_ptr<InstructionEvent> iev;
     bool non_executed_instruction;
 
-    HighlightedLine(const std::string &text, const ParseParams &pparams,
+    HighlightedLine(StringRef text, const ParseParams &pparams,
                     size_t display_len);
-    explicit HighlightedLine(const std::string &text,
-                             const ParseParams &pparams);
+    explicit HighlightedLine(StringRef text, const ParseParams &pparams);
+    HighlightedLine(const HighlightedLine &) = delete;
+    HighlightedLine &operator=(const HighlightedLine &) = delete;
     void replace_instruction(Browser &br);
 
     HighlightClass highlight_at(size_t i, bool enable_highlighting = true) const
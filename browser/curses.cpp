@@ -644,7 +644,7 @@ class TraceBuffer : public Window {
     // _physical_ lines in the trace file are numbered from 1. But
     // visible lines are numbered from zero, because that's more
     // sensible in the absence of conventions saying otherwise.
-    unsigned visline_scrtop;
+    LineNo visline_scrtop;
 
     // Highlighted individual event (trace line) within the current
     // visible node, if any. Indexed from 0 (first event of the node)
@@ -701,9 +701,9 @@ class TraceBuffer : public Window {
         // than the whole screen.
         //
         // These two values form a [top,bot) half-open interval.
-        unsigned visline_top = vu.physical_to_visible_line(
+        LineNo visline_top = vu.physical_to_visible_line(
             vu.curr_visible_node.trace_file_firstline);
-        unsigned visline_bot =
+        LineNo visline_bot =
             visline_top +
             min((unsigned)hm1, (unsigned)vu.curr_visible_node.trace_file_lines);
 
@@ -716,7 +716,7 @@ class TraceBuffer : public Window {
         // We do need to recentre, in which case, use posn and posd to
         // work out how many visible lines we want to place above
         // visline_top.
-        unsigned linesabove = (hm1 - (visline_bot - visline_top)) * posn / posd;
+        LineNo linesabove = (hm1 - (visline_bot - visline_top)) * posn / posd;
         // Special case to avoid going off the top of the file.
         linesabove = min(linesabove, visline_top);
 
@@ -743,7 +743,7 @@ class TraceBuffer : public Window {
     void add_mdisp(MemoryDisplayStartAddr address);
     void remove_mdisp(MemoryDisplay *mdisp);
     void update_other_windows();
-    void update_other_windows_diff(unsigned prev_line);
+    void update_other_windows_diff(LineNo prev_line);
 
     void goto_time(Time t)
     {
@@ -754,7 +754,7 @@ class TraceBuffer : public Window {
         }
     }
 
-    void goto_physline(unsigned t)
+    void goto_physline(LineNo t)
     {
         if (vu.goto_physline(t)) {
             selected_event = UINT_MAX;
@@ -826,15 +826,15 @@ class TraceBuffer : public Window {
         unsigned lineoffset;
         bool ok;
         int yy = 0;
+        vector<StringRef> tracelines;
+        string tracebuf;
 
         ok = vu.get_node_by_visline(visline_scrtop, &payload, &lineoffset);
         while (ok) {
-            vector<string> tracelines = br.index.get_trace_lines(payload);
+            br.index.get_trace_line_refs(payload, tracelines, tracebuf);
 
             for (unsigned i = lineoffset; i < tracelines.size(); i++) {
-                string &line = tracelines[i];
-
-                HighlightedLine hl(line, br.index.parseParams(), w);
+                HighlightedLine hl(tracelines[i], br.index.parseParams(), w);
                 if (br.has_image() && substitute_branch_targets)
                     hl.replace_instruction(br);
 
@@ -909,7 +909,7 @@ class TraceBuffer : public Window {
         last_keystroke = c;
 
         if (c == KEY_DOWN) {
-            unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+            LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
             if (vu.next_visible_node(&vu.curr_visible_node)) {
                 vu.update_logical_node();
                 update_scrtop(false, 1, 1);
@@ -919,7 +919,7 @@ class TraceBuffer : public Window {
             }
             return true;
         } else if (c == KEY_UP) {
-            unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+            LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
             if (vu.prev_visible_node(&vu.curr_visible_node)) {
                 vu.update_logical_node();
                 update_scrtop(false, 0, 1);
@@ -958,14 +958,16 @@ class TraceBuffer : public Window {
                 selected_event = UINT_MAX;
             return true;
         } else if (c == '\r' || c == '\n') {
-            SeqOrderPayload ref_node;
-            if (!br.get_previous_node(vu.curr_visible_node, &ref_node))
-                ref_node = vu.curr_visible_node;
+            SeqOrderPayload ref_node = vu.curr_visible_node;
+            SeqCursor cursor(br);
+            if (cursor.seek_line(ref_node.trace_file_firstline) &&
+                cursor.prev())
+                ref_node = cursor.node();
 
             DecodedTraceLine dtl(
                 br.index.parseParams(),
                 br.index.get_trace_line(vu.curr_visible_node, selected_event));
-            unsigned line = 0;
+            LineNo line = 0;
             if (dtl.mev) {
                 line = br.getmem(ref_node.memory_root, 'm', dtl.mev->addr,
                                  dtl.mev->size, NULL, NULL);
@@ -990,7 +992,8 @@ class TraceBuffer : public Window {
             // itself visible; ']' completely unfolds everything from
             // the start to the end of this function's execution.
 
-            unsigned firstline, lastline, depth;
+            LineNo firstline, lastline;
+            unsigned depth;
             if (!vu.physline_range_for_containing_function(
                     vu.curr_visible_node, &firstline, &lastline, &depth)) {
                 screen->minibuf_error(_("No function call to fold up here"));
@@ -1016,7 +1019,8 @@ class TraceBuffer : public Window {
             return true;
         } else if (c == '+' || c == '=') {
             // Unfold one function call at the cursor position.
-            unsigned firstline, lastline, depth;
+            LineNo firstline, lastline;
+            unsigned depth;
             if (!vu.physline_range_for_folded_function_after(
                     vu.curr_visible_node, &firstline, &lastline, &depth)) {
                 screen->minibuf_error(_("No function call to unfold here"));
@@ -1199,7 +1203,7 @@ class RegisterDisplay : public Window {
     bool interpret_address;
     bool locked;
     OFF_T memroot, ext_memroot;
-    unsigned line, ext_line;
+    LineNo line, ext_line;
     int w, h;
     int reg_selected;
     TraceBuffer *tbuf;
@@ -1207,7 +1211,7 @@ class RegisterDisplay : public Window {
     int top_line;
     vector<int> regs_per_line, reg_to_line;
     OFF_T diff_memroot;
-    unsigned diff_minline;
+    LineNo diff_minline;
 
   protected:
     vector<RegisterId> regs;
@@ -1229,7 +1233,7 @@ class RegisterDisplay : public Window {
         top_line = 0;
     }
 
-    void set_memroot(OFF_T memroot_, unsigned line_)
+    void set_memroot(OFF_T memroot_, LineNo line_)
     {
         ext_memroot = memroot_;
         ext_line = line_;
@@ -1240,7 +1244,7 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void goto_physline(unsigned line_)
+    void goto_physline(LineNo line_)
     {
         SeqOrderPayload found_node;
         if (br.node_at_line(line_, &found_node)) {
@@ -1260,9 +1264,9 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void setup_diff_lines(unsigned line1, unsigned line2)
+    void setup_diff_lines(LineNo line1, LineNo line2)
     {
-        unsigned linemin = min(line1, line2), linemax = max(line1, line2);
+        LineNo linemin = min(line1, line2), linemax = max(line1, line2);
         SeqOrderPayload found_node;
         if (linemin != linemax && br.node_at_line(linemax, &found_node)) {
             diff_memroot = found_node.memory_root;
@@ -1272,7 +1276,7 @@ class RegisterDisplay : public Window {
         }
     }
 
-    void diff_against_if_not_locked(unsigned line_)
+    void diff_against_if_not_locked(LineNo line_)
     {
         if (!locked)
             setup_diff_lines(line_, line);
@@ -1521,7 +1525,7 @@ class RegisterDisplay : public Window {
         } else if (c == '\r' || c == '\n') {
             const RegisterId &r = regs[reg_selected];
             unsigned iflags = br.get_iflags(memroot);
-            unsigned line = br.getmem(memroot, 'r', reg_offset(r, iflags),
+            LineNo line = br.getmem(memroot, 'r', reg_offset(r, iflags),
                                       reg_size(r), NULL, NULL);
             if (line)
                 tbuf->goto_physline(line);
@@ -1661,7 +1665,7 @@ class MemoryDisplay : public Window {
     Browser &br;
     bool locked;
     OFF_T memroot, ext_memroot;
-    unsigned line, ext_line;
+    LineNo line, ext_line;
     int w, h;
     Addr start_addr, cursor_addr;
     bool addrs_known;
@@ -1672,7 +1676,7 @@ class MemoryDisplay : public Window {
     int desired_height;
     char minibuf_reqtype;
     OFF_T diff_memroot;
-    unsigned diff_minline;
+    LineNo diff_minline;
 
   public:
     MemoryDisplay(Browser &br, TraceBuffer *tbuf, MemoryDisplayStartAddr addr)
@@ -1748,7 +1752,7 @@ class MemoryDisplay : public Window {
         h = h_;
     }
 
-    void set_memroot(OFF_T memroot_, unsigned line_)
+    void set_memroot(OFF_T memroot_, LineNo line_)
     {
         ext_memroot = memroot_;
         ext_line = line_;
@@ -1762,7 +1766,7 @@ class MemoryDisplay : public Window {
             compute_cursor_addr();
     }
 
-    void goto_physline(unsigned line_)
+    void goto_physline(LineNo line_)
     {
         SeqOrderPayload found_node;
         if (br.node_at_line(line_, &found_node)) {
@@ -1782,7 +1786,7 @@ class MemoryDisplay : public Window {
         }
     }
 
-    void setup_diff_lines(unsigned line1, unsigned line2)
+    void setup_diff_lines(LineNo line1, LineNo line2)
     {
         Time linemin = min(line1, line2), linemax = max(line1, line2);
         SeqOrderPayload found_node;
@@ -1794,7 +1798,7 @@ class MemoryDisplay : public Window {
         }
     }
 
-    void diff_against_if_not_locked(unsigned line_)
+    void diff_against_if_not_locked(LineNo line_)
     {
         if (!locked)
             setup_diff_lines(line_, line);
@@ -1980,7 +1984,7 @@ class MemoryDisplay : public Window {
                 c = '1';
             Addr prov_size = c - '0';
             Addr prov_start = cursor_addr & ~(prov_size - 1);
-            unsigned line =
+            LineNo line =
                 br.getmem(memroot, 'm', prov_start, prov_size, NULL, NULL);
             if (line)
                 tbuf->goto_physline(line);
@@ -2198,7 +2202,7 @@ void TraceBuffer::update_other_windows()
                            vu.curr_logical_node.trace_file_firstline);
 }
 
-void TraceBuffer::update_other_windows_diff(unsigned line)
+void TraceBuffer::update_other_windows_diff(LineNo line)
 {
     if (crdisp)
         crdisp->diff_against_if_not_locked(line);
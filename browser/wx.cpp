@@ -580,7 +580,7 @@ class TextViewWindow : public wxFrame {
     wxToolBar *toolbar;
     wxTextCtrl *lineedit;
 
-    void set_lineedit(unsigned line);
+    void set_lineedit(LineNo line);
 
     wxMenu *contextmenu;
 
@@ -607,7 +607,7 @@ class TextViewWindow : public wxFrame {
     void lineedit_activated(wxCommandEvent &event);
     void lineedit_unfocused(wxFocusEvent &event);
     virtual void reset_lineedit() = 0;
-    virtual void activate_lineedit(unsigned line) = 0;
+    virtual void activate_lineedit(LineNo line) = 0;
 
     virtual void redraw_canvas(unsigned line_start, unsigned line_limit) = 0;
 
@@ -850,7 +850,7 @@ void TextViewCanvas::add_highlighted_line(int x, int y,
 
         logpos.char_index = start;
         x += add_text(x, y, hc, ColourId::AreaBackground,
-                      hl.text.substr(start, len), logpos);
+                      string(hl.text.data() + start, len), logpos);
     }
 }
 
@@ -1301,10 +1301,10 @@ auto TextViewWindow::logpos_dist_colmajor(const LogicalPos &lhs,
 void TextViewWindow::lineedit_activated(wxCommandEvent &event)
 {
     string value = lineedit->GetValue().ToStdString();
-    unsigned line;
+    LineNo line;
 
     try {
-        line = stoul(value);
+        line = stoull(value);
     } catch (invalid_argument) {
         return;
     } catch (out_of_range) {
@@ -1320,7 +1320,7 @@ void TextViewWindow::lineedit_unfocused(wxFocusEvent &event)
     reset_lineedit();
 }
 
-void TextViewWindow::set_lineedit(unsigned line)
+void TextViewWindow::set_lineedit(LineNo line)
 {
     ostringstream oss;
     oss << line;
@@ -1343,7 +1343,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
     static void close_all();
 
     OFF_T memroot = 0, diff_memroot = 0;
-    unsigned line, diff_minline;
+    LineNo line, diff_minline;
 
     TraceWindow *tw;
     wxChoice *linkcombo;
@@ -1353,7 +1353,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
     virtual ~SubsidiaryView();
 
     virtual void reset_lineedit() override { set_lineedit(line); }
-    virtual void activate_lineedit(unsigned line_) override
+    virtual void activate_lineedit(LineNo line_) override
     {
         SeqOrderPayload node;
         if (br.node_at_line(line_, &node)) {
@@ -1366,7 +1366,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
 
     virtual void memroot_changed() { }
 
-    void update_line(OFF_T memroot_, unsigned line_)
+    void update_line(OFF_T memroot_, LineNo line_)
     {
         memroot = memroot_;
         line = line_;
@@ -1379,7 +1379,7 @@ class SubsidiaryView : public TextViewWindow, public SubsidiaryViewListNode {
         diff_minline = 0;
     }
 
-    void diff_against(OFF_T diff_memroot_, unsigned diff_minline_)
+    void diff_against(OFF_T diff_memroot_, LineNo diff_minline_)
     {
         diff_memroot = diff_memroot_;
         diff_minline = diff_minline_;
@@ -1559,7 +1559,8 @@ class TraceWindow : public TextViewWindow {
 
         FunctionRange(Browser::TraceView &vu) : vu(vu), br(vu.br) {}
 
-        unsigned firstline, lastline, depth;
+        LineNo firstline, lastline;
+        unsigned depth;
         SeqOrderPayload callnode, firstnode, lastnode;
         bool initialised = false;
 
@@ -1594,7 +1595,7 @@ class TraceWindow : public TextViewWindow {
 
     struct FoldChangeWrapper {
         TraceWindow &tw;
-        unsigned physline_wintop;
+        LineNo physline_wintop;
         double fraction_wintop;
         bool done = false;
         FoldChangeWrapper(TraceWindow *twp) : tw(*twp)
@@ -1667,7 +1668,7 @@ class TraceWindow : public TextViewWindow {
     void mem_prompt_dialog_closed(wxCloseEvent &event);
 
     virtual void reset_lineedit() override;
-    virtual void activate_lineedit(unsigned line) override;
+    virtual void activate_lineedit(LineNo line) override;
 
     wxWindowID mi_fold_all;
     wxWindowID mi_unfold_all;
@@ -1729,13 +1730,13 @@ class TraceWindow : public TextViewWindow {
 
     SubsidiaryViewListNode subview_list;
     void update_subviews();
-    void tell_subviews_to_diff_against(OFF_T memroot, unsigned line);
+    void tell_subviews_to_diff_against(OFF_T memroot, LineNo line);
 
   public:
     TraceWindow(GuiTarmacBrowserApp *app, Browser &br);
     ~TraceWindow();
 
-    void goto_physline(unsigned line);
+    void goto_physline(LineNo line);
     void add_subview(SubsidiaryView *sv);
 };
 
@@ -2047,14 +2048,14 @@ void TraceWindow::update_subviews()
                          vu.curr_logical_node.trace_file_firstline);
 }
 
-void TraceWindow::tell_subviews_to_diff_against(OFF_T memroot, unsigned line)
+void TraceWindow::tell_subviews_to_diff_against(OFF_T memroot, LineNo line)
 {
     // We have to provide the memory root from the later of the two
     // times, and the line number from the earlier one (because diff
     // lookups are done by looking in the later tree for a list of
     // changes dated after a given line).
     OFF_T curr_root = vu.curr_logical_node.memory_root;
-    unsigned curr_line = vu.curr_logical_node.trace_file_firstline;
+    LineNo curr_line = vu.curr_logical_node.trace_file_firstline;
 
     if (curr_line < line)
         line = curr_line;
@@ -2070,7 +2071,8 @@ unsigned TraceWindow::n_display_lines() { return vu.total_visible_lines(); }
 void TraceWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
 {
     SeqOrderPayload node;
-    vector<string> node_lines;
+    vector<StringRef> node_lines;
+    string node_buf;
     unsigned lineofnode = 0;
 
     controls.clear();
@@ -2082,7 +2084,7 @@ void TraceWindow::redraw_canvas(unsigned line_start, unsigned line_limit)
             // to display.
             if (!vu.get_node_by_visline(line, &node, &lineofnode))
                 break;
-            node_lines = br.index.get_trace_lines(node);
+            br.index.get_trace_line_refs(node, node_lines, node_buf);
         }
 
         unsigned lineofnode_old = lineofnode;
@@ -2199,9 +2201,9 @@ bool TraceWindow::prepare_context_menu(const LogicalPos &logpos)
             contextmenu->Append(mi_unfold_full, _("Unfold completely"));
         }
 
-        SeqOrderPayload prev_node;
-        if (br.get_previous_node(node, &prev_node))
-            context_menu_memroot = prev_node.memory_root;
+        SeqCursor cursor(br);
+        if (cursor.seek_line(node.trace_file_firstline) && cursor.prev())
+            context_menu_memroot = cursor.node().memory_root;
         else
             context_menu_memroot = 0;
         DecodedTraceLine dtl(br.index.parseParams(),
@@ -2254,7 +2256,7 @@ void TraceWindow::provenance_menuaction(wxCommandEvent &event)
     if (!context_menu_memtype)
         return; // just in case
 
-    unsigned line =
+    LineNo line =
         br.getmem(context_menu_memroot, context_menu_memtype,
                   context_menu_start, context_menu_size, nullptr, nullptr);
     if (line)
@@ -2277,18 +2279,19 @@ void TraceWindow::clipboard_get_paste_data(ostream &os, LogicalPos start,
                                            LogicalPos end)
 {
     SeqOrderPayload node;
-    vector<string> node_lines;
+    vector<StringRef> node_lines;
+    string node_buf;
     LogicalPos pos = start;
 
     if (!br.get_node_by_physline(pos.y0, &node, nullptr))
         return;
-    node_lines = br.index.get_trace_lines(node);
+    br.index.get_trace_line_refs(node, node_lines, node_buf);
 
     for (; logpos_cmp(pos, end) <= 0; pos.y1++) {
         if (pos.y1 >= node_lines.size()) {
             if (!vu.next_visible_node(node, &node))
                 return;
-            node_lines = br.index.get_trace_lines(node);
+            br.index.get_trace_line_refs(node, node_lines, node_buf);
             pos.y0 = node.trace_file_firstline;
             pos.y1 = 0;
         }
@@ -2296,7 +2299,7 @@ void TraceWindow::clipboard_get_paste_data(ostream &os, LogicalPos start,
         HighlightedLine hl(node_lines[pos.y1], br.index.parseParams());
         if (br.has_image() && substitute_branch_targets)
             hl.replace_instruction(br);
-        string &s = hl.text;
+        string s = hl.text.str();
 
         if (pos.y0 == end.y0 && pos.y1 == end.y1) {
             s = s.substr(0, min((size_t)end.char_index + 1, s.size()));
@@ -2342,7 +2345,7 @@ void TraceWindow::unfold_ui_action(const FunctionRange &fnrange, bool full)
 
     unsigned depth = full ? UINT_MAX : fnrange.depth;
 
-    unsigned prev_position = vu.curr_visible_node.trace_file_firstline;
+    LineNo prev_position = vu.curr_visible_node.trace_file_firstline;
 
     for (FoldChangeWrapper fcw(this); fcw.progress();)
         vu.set_fold_state(fnrange.firstline, fnrange.lastline, 0, depth);
@@ -2379,8 +2382,8 @@ void TraceWindow::update_location(UpdateLocationType type)
 void TraceWindow::keep_visnode_in_view(bool strict_centre)
 {
     auto &vis = vu.curr_visible_node;
-    unsigned phystop = vis.trace_file_firstline;
-    unsigned physbot = phystop + vis.trace_file_lines;
+    LineNo phystop = vis.trace_file_firstline;
+    LineNo physbot = phystop + vis.trace_file_lines;
 
     int screen_lines = drawing_area->height() / line_height;
 
@@ -2565,9 +2568,9 @@ void TraceWindow::reset_lineedit()
                  vu.curr_logical_node.trace_file_lines - 1);
 }
 
-void TraceWindow::activate_lineedit(unsigned line) { goto_physline(line); }
+void TraceWindow::activate_lineedit(LineNo line) { goto_physline(line); }
 
-void TraceWindow::goto_physline(unsigned line)
+void TraceWindow::goto_physline(LineNo line)
 {
     if (vu.goto_physline(line)) {
         update_location(UpdateLocationType::NewVis);
@@ -2669,7 +2672,7 @@ bool TraceWindow::keypress(wxKeyEvent &event)
     case WXK_UP:
     case WXK_NUMPAD_UP: {
         OFF_T prev_memroot = vu.curr_logical_node.memory_root;
-        unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+        LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
         if (vu.prev_visible_node(&vu.curr_visible_node)) {
             update_location(UpdateLocationType::NewVis);
             tell_subviews_to_diff_against(prev_memroot, prev_line);
@@ -2680,7 +2683,7 @@ bool TraceWindow::keypress(wxKeyEvent &event)
     case WXK_DOWN:
     case WXK_NUMPAD_DOWN: {
         OFF_T prev_memroot = vu.curr_logical_node.memory_root;
-        unsigned prev_line = vu.curr_logical_node.trace_file_firstline;
+        LineNo prev_line = vu.curr_logical_node.trace_file_firstline;
         if (vu.next_visible_node(&vu.curr_visible_node)) {
             update_location(UpdateLocationType::NewVis);
             tell_subviews_to_diff_against(prev_memroot, prev_line);
@@ -2839,7 +2842,7 @@ void RegisterWindow::provenance_query(RegisterId r)
     unsigned iflags = br.get_iflags(memroot);
     Addr roffset = reg_offset(r, iflags);
     size_t rsize = reg_size(r);
-    unsigned line = br.getmem(memroot, 'r', roffset, rsize, nullptr, nullptr);
+    LineNo line = br.getmem(memroot, 'r', roffset, rsize, nullptr, nullptr);
     if (line)
         tw->goto_physline(line);
 }
@@ -3206,7 +3209,7 @@ void MemoryWindow::provenance_query(Addr start, Addr size)
 {
     if (!tw)
         return;
-    unsigned line = br.getmem(memroot, 'm', start, size, nullptr, nullptr);
+    LineNo line = br.getmem(memroot, 'm', start, size, nullptr, nullptr);
     if (line)
         tw->goto_physline(line);
 }
@@ -3422,9 +3425,9 @@ class WXGUIReporter : public Reporter {
     void indexing_status(const TracePair &trace,
                          IndexUpdateCheck status) override;
     void indexing_warning(const string &trace_filename,
-                          unsigned lineno, const string &msg) override;
+                          LineNo lineno, const string &msg) override;
     void indexing_error(const string &trace_filename,
-                        unsigned lineno, const string &msg) override;
+                        LineNo lineno, const string &msg) override;
     void indexing_start(streampos total) override;
     void indexing_progress(streampos pos) override;
     void indexing_done() override;
@@ -3529,9 +3532,19 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
         oss << endl
             << _("(index file was not generated by this version of the tool)");
         break;
+      case IndexUpdateCheck::WrongByteOrder:
+        oss << endl
+            << _("(index file was generated on a host of the opposite "
+                 "endianness)");
+        break;
       case IndexUpdateCheck::Incomplete:
         oss << endl << _("(previous index file generation was not completed)");
         break;
+      case IndexUpdateCheck::WrongParams:
+        oss << endl
+            << _("(index file was generated with different options selecting "
+                 "what to index)");
+        break;
       case IndexUpdateCheck::OK:
         oss << endl << _("(not actually indexing)");
         break;
@@ -3545,7 +3558,7 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
 }
 
 void WXGUIReporter::indexing_warning(const string &trace_filename,
-                                     unsigned lineno, const string &msg)
+                                     LineNo lineno, const string &msg)
 {
     // Not really sure what we can usefully do with warnings during
     // indexing. I suppose we could try to put them on standard error
@@ -3554,7 +3567,7 @@ void WXGUIReporter::indexing_warning(const string &trace_filename,
 }
 
 void WXGUIReporter::indexing_error(const string &trace_filename,
-                                   unsigned lineno, const string &msg)
+                                   LineNo lineno, const string &msg)
 {
     ostringstream oss;
     oss << trace_filename << ":" << lineno << ": " << msg;
@@ -19,6 +19,7 @@
 #ifndef TARMAC_ARGPARSE_HH
 #define TARMAC_ARGPARSE_HH
 
+#include <climits>
 #include <deque>
 #include <functional>
 #include <map>
@@ -36,6 +37,12 @@ class ArgparseError : public std::exception {
     const std::string &msg() const { return Msg; }
 };
 
+// Parse the whole of an option value as an unsigned integer, in
+// decimal or (with a leading 0x) hex. Throws ArgparseError if it isn't
+// one, has anything after it, or is more than 'max'.
+unsigned long long parse_uint(const std::string &s,
+                              unsigned long long max = ULLONG_MAX);
+
 class ArgparseSpecialAction : public std::exception {
 };
 class ArgparseHelpAction : public ArgparseSpecialAction {
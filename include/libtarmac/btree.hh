@@ -0,0 +1,791 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_BTREE_HH
+#define LIBTARMAC_BTREE_HH
+
+#include "libtarmac/disktree.hh"
+
+#include <cassert>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * A persistent B+-tree stored in an Arena, as an alternative to
+ * AVLDisk for the index structures that only need insertion and
+ * ordered lookup.
+ *
+ * It takes the same Payload and Annotation types as AVLDisk, with the
+ * same cmp() contract, and provides the same persistence model as
+ * AVLDisk's non-refcounting mode: nodes below the high-water mark
+ * set by commit() are never modified, and an insertion copies the
+ * path from the root to the affected leaf instead.
+ *
+ * Every node occupies NodeSize bytes, so with the default size a
+ * node is one page and a lookup faults in one page per level, instead
+ * of one per binary tree node visited. Leaf nodes hold the payloads
+ * themselves. Internal nodes hold, for each child, its offset, a copy
+ * of the largest payload in that child's subtree (to steer searches
+ * by), and the annotation of the whole subtree.
+ *
+ * Unlike AVLDisk, there's no remove(), no refcounting mode, and no
+ * walk() or search(), because those expose the shape of a binary
+ * tree.
+ */
+template <class Payload, class Annotation = EmptyAnnotation<Payload>,
+          size_t NodeSize = 4096>
+class BTreeDisk {
+    friend class BTreeTest; // so the unit test can look inside
+
+    Arena &arena;
+
+    // High-water mark, as in AVLDisk.
+    OFF_T hwm;
+
+    struct diskheader {
+        diskint<unsigned, 2> count;
+        char leaf;
+    };
+    struct diskchild {
+        diskoff offset;
+        Payload max;
+        Annotation annotation;
+    };
+
+    static constexpr size_t leaf_capacity =
+        (NodeSize - sizeof(diskheader)) / sizeof(Payload);
+    static constexpr size_t internal_capacity =
+        (NodeSize - sizeof(diskheader)) / sizeof(diskchild);
+    static_assert(leaf_capacity >= 4 && internal_capacity >= 4,
+                  "B-tree node size too small for its payload");
+
+    const diskheader &header(OFF_T offset) const
+    {
+        return *arena.getptr<diskheader>(offset);
+    }
+    static OFF_T entry_offset(OFF_T offset, unsigned index)
+    {
+        return offset + sizeof(diskheader) + index * sizeof(Payload);
+    }
+    const Payload &entry(OFF_T offset, unsigned index) const
+    {
+        return *arena.getptr<Payload>(entry_offset(offset, index));
+    }
+    diskchild &child(OFF_T offset, unsigned index) const
+    {
+        return *arena.getptr<diskchild>(offset + sizeof(diskheader) +
+                                        index * sizeof(diskchild));
+    }
+
+    // In-memory copy of a node, used while modifying the tree. The
+    // lookup functions work directly on the arena instead, since they
+    // never allocate and so can't cause it to be remapped.
+    struct childref {
+        OFF_T offset;
+        Payload max;
+        Annotation annotation;
+    };
+    struct node {
+        OFF_T offset;
+        bool leaf;
+        std::vector<Payload> entries;    // if leaf
+        std::vector<childref> children; // if !leaf
+
+        size_t size() const { return leaf ? entries.size() : children.size(); }
+    };
+
+    node get(OFF_T offset) const
+    {
+        node n;
+        const diskheader &h = header(offset);
+        n.offset = offset;
+        n.leaf = h.leaf;
+        unsigned count = h.count;
+        for (unsigned i = 0; i < count; i++) {
+            if (n.leaf) {
+                n.entries.push_back(entry(offset, i));
+            } else {
+                const diskchild &dc = child(offset, i);
+                n.children.push_back({dc.offset, dc.max, dc.annotation});
+            }
+        }
+        return n;
+    }
+
+    // Write a node back to the arena, in place if it's still mutable,
+    // or else (or if it's new) to a freshly allocated node.
+    void put(node &n)
+    {
+        if (!n.offset || n.offset < hwm)
+            n.offset = arena.alloc(NodeSize);
+
+        diskheader &h = *arena.getptr<diskheader>(n.offset);
+        h.count = n.size();
+        h.leaf = n.leaf;
+        for (size_t i = 0; i < n.size(); i++) {
+            if (n.leaf) {
+                *arena.getptr<Payload>(entry_offset(n.offset, i)) =
+                    n.entries[i];
+            } else {
+                diskchild &dc = child(n.offset, i);
+                dc.offset = n.children[i].offset;
+                dc.max = n.children[i].max;
+                dc.annotation = n.children[i].annotation;
+            }
+        }
+    }
+
+    // Binary search: return the index of the first of 'count' items
+    // for which pred(item(i)) is true, or 'count' if there's none.
+    template <class Item, class Pred>
+    static unsigned first_true(unsigned count, Item item, Pred pred)
+    {
+        unsigned lo = 0, hi = count;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (pred(item(mid)))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    // Summarise a node as it will appear in its parent.
+    static childref summary(const node &n)
+    {
+        childref ref;
+        ref.offset = n.offset;
+        if (n.leaf) {
+            ref.max = n.entries.back();
+            ref.annotation = Annotation(n.entries[0]);
+            for (size_t i = 1; i < n.entries.size(); i++)
+                ref.annotation =
+                    Annotation(ref.annotation, Annotation(n.entries[i]));
+        } else {
+            ref.max = n.children.back().max;
+            ref.annotation = n.children[0].annotation;
+            for (size_t i = 1; i < n.children.size(); i++)
+                ref.annotation =
+                    Annotation(ref.annotation, n.children[i].annotation);
+        }
+        return ref;
+    }
+
+    // Insert into the subtree at 'offset', returning the replacement
+    // for that subtree, and if the node overflowed, a second subtree
+    // to go immediately after it.
+    bool insert_main(OFF_T offset, const Payload &payload, childref *out,
+                     childref *split_out)
+    {
+        node n = get(offset);
+        if (n.leaf) {
+            size_t i = first_true(
+                n.entries.size(),
+                [&](unsigned i) -> const Payload & { return n.entries[i]; },
+                [&](const Payload &p) { return payload.cmp(p) <= 0; });
+            assert(i == n.entries.size() || payload.cmp(n.entries[i]) != 0);
+            n.entries.insert(n.entries.begin() + i, payload);
+        } else {
+            size_t i = first_true(
+                n.children.size() - 1,
+                [&](unsigned i) -> const Payload & {
+                    return n.children[i].max;
+                },
+                [&](const Payload &p) { return payload.cmp(p) <= 0; });
+            childref sub, subsplit;
+            bool split =
+                insert_main(n.children[i].offset, payload, &sub, &subsplit);
+            n.children[i] = sub;
+            if (split)
+                n.children.insert(n.children.begin() + i + 1, subsplit);
+        }
+
+        if (n.size() <= (n.leaf ? +leaf_capacity : +internal_capacity)) {
+            put(n);
+            *out = summary(n);
+            return false;
+        }
+
+        node right;
+        right.offset = 0;
+        right.leaf = n.leaf;
+        size_t half = n.size() / 2;
+        if (n.leaf) {
+            right.entries.assign(n.entries.begin() + half, n.entries.end());
+            n.entries.resize(half);
+        } else {
+            right.children.assign(n.children.begin() + half, n.children.end());
+            n.children.resize(half);
+        }
+        put(n);
+        put(right);
+        *out = summary(n);
+        *split_out = summary(right);
+        return true;
+    }
+
+    // Accessors for first_true, to search the payloads of a leaf or
+    // the maximum payloads of an internal node's children.
+    auto entry_at(OFF_T offset) const
+    {
+        return [this, offset](unsigned i) -> const Payload & {
+            return entry(offset, i);
+        };
+    }
+    auto max_at(OFF_T offset) const
+    {
+        return [this, offset](unsigned i) -> const Payload & {
+            return child(offset, i).max;
+        };
+    }
+
+    // A location of a payload in a leaf.
+    struct position {
+        OFF_T leaf;
+        unsigned index;
+    };
+
+    // Find the first payload for which 'pred' is true, given that
+    // 'pred' is false for some prefix of the tree and true after it.
+    template <class Pred>
+    bool first_where(OFF_T offset, Pred pred, position *pos) const
+    {
+        while (offset) {
+            const diskheader &h = header(offset);
+            unsigned count = h.count, i;
+            if (h.leaf) {
+                i = first_true(count, entry_at(offset), pred);
+                if (i == count)
+                    return false;
+                pos->leaf = offset;
+                pos->index = i;
+                return true;
+            }
+            i = first_true(count, max_at(offset), pred);
+            if (i == count)
+                return false;
+            offset = child(offset, i).offset;
+        }
+        return false;
+    }
+
+    // Find the last payload in a subtree.
+    bool last(OFF_T offset, position *pos) const
+    {
+        while (offset) {
+            const diskheader &h = header(offset);
+            unsigned count = h.count;
+            if (h.leaf) {
+                pos->leaf = offset;
+                pos->index = count - 1;
+                return true;
+            }
+            offset = child(offset, count - 1).offset;
+        }
+        return false;
+    }
+
+    // Find the last payload for which 'pred' is false, with the same
+    // condition on 'pred' as first_where.
+    template <class Pred>
+    bool last_where_not(OFF_T offset, Pred pred, position *pos) const
+    {
+        if (!offset)
+            return false;
+        const diskheader &h = header(offset);
+        unsigned count = h.count, i;
+        if (h.leaf) {
+            i = first_true(count, entry_at(offset), pred);
+            if (i == 0)
+                return false;
+            pos->leaf = offset;
+            pos->index = i - 1;
+            return true;
+        }
+
+        // Child i is the first one containing anything satisfying
+        // 'pred'. The answer is inside it, unless it begins with such
+        // a payload, in which case it's the last thing in child i-1.
+        i = first_true(count, max_at(offset), pred);
+        if (i < count && last_where_not(child(offset, i).offset, pred, pos))
+            return true;
+        return i > 0 && last(child(offset, i - 1).offset, pos);
+    }
+
+    bool output(bool ret, const position &pos, Payload *payload_out,
+                OFF_T *offset_out) const
+    {
+        if (ret) {
+            if (payload_out)
+                *payload_out = entry(pos.leaf, pos.index);
+            if (offset_out)
+                *offset_out = entry_offset(pos.leaf, pos.index);
+        }
+        return ret;
+    }
+
+  public:
+    BTreeDisk(Arena &arena) : arena(arena) { hwm = arena.curr_offset(); }
+
+    void commit() { hwm = arena.curr_offset(); }
+
+    OFF_T insert(OFF_T oldroot, Payload payload)
+    {
+        node n;
+        if (!oldroot) {
+            n.offset = 0;
+            n.leaf = true;
+            n.entries.push_back(payload);
+            put(n);
+            return n.offset;
+        }
+
+        childref sub, subsplit;
+        if (!insert_main(oldroot, payload, &sub, &subsplit))
+            return sub.offset;
+
+        // The root overflowed, so the tree grows by a level.
+        n.offset = 0;
+        n.leaf = false;
+        n.children.push_back(sub);
+        n.children.push_back(subsplit);
+        put(n);
+        return n.offset;
+    }
+
+    // Make a new tree out of 'count' payloads, as AVLDisk::build does.
+    // Each node is filled up in turn, from left to right, at each
+    // level, and only the node being filled at each level is kept in
+    // memory.
+    template <class Source> OFF_T build(size_t count, Source next)
+    {
+        if (!count)
+            return 0;
+
+        std::vector<node> open(1);
+        open[0].leaf = true;
+        auto finish = [&](size_t level) {
+            node &n = open[level];
+            n.offset = 0;
+            put(n);
+            childref ref = summary(n);
+            n.entries.clear();
+            n.children.clear();
+            return ref;
+        };
+
+        for (size_t i = 0; i < count; i++) {
+            open[0].entries.push_back(next());
+            for (size_t level = 0;
+                 open[level].size() ==
+                 (level ? +internal_capacity : +leaf_capacity);
+                 level++) {
+                childref ref = finish(level);
+                if (level + 1 == open.size()) {
+                    open.emplace_back();
+                    open.back().leaf = false;
+                }
+                open[level + 1].children.push_back(ref);
+            }
+        }
+
+        // Write out the partly filled nodes, from the bottom up. A top
+        // node with a single child isn't needed at all.
+        for (size_t level = 0;; level++) {
+            bool top = level + 1 == open.size();
+            if (top && level && open[level].size() == 1)
+                return open[level].children[0].offset;
+            if (!open[level].size())
+                continue;
+            childref ref = finish(level);
+            if (top)
+                return ref.offset;
+            open[level + 1].children.push_back(ref);
+        }
+    }
+
+    // The lookup functions below behave like the AVLDisk functions of
+    // the same names. The offset returned is that of the payload
+    // itself within its leaf node.
+
+    template <class PayloadComparable>
+    bool find(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        return find_leftmost(root, keyfinder, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool find_leftmost(OFF_T root, const PayloadComparable &keyfinder,
+                       Payload *payload_out, OFF_T *offset_out) const
+    {
+        position pos;
+        bool ret = first_where(
+            root, [&](const Payload &p) { return keyfinder.cmp(p) <= 0; },
+            &pos);
+        ret = ret && keyfinder.cmp(entry(pos.leaf, pos.index)) == 0;
+        return output(ret, pos, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool find_rightmost(OFF_T root, const PayloadComparable &keyfinder,
+                        Payload *payload_out, OFF_T *offset_out) const
+    {
+        position pos;
+        bool ret = last_where_not(
+            root, [&](const Payload &p) { return keyfinder.cmp(p) < 0; },
+            &pos);
+        ret = ret && keyfinder.cmp(entry(pos.leaf, pos.index)) == 0;
+        return output(ret, pos, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool succ(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        position pos;
+        bool ret = first_where(
+            root, [&](const Payload &p) { return keyfinder.cmp(p) < 0; },
+            &pos);
+        return output(ret, pos, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool pred(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        position pos;
+        bool ret = last_where_not(
+            root, [&](const Payload &p) { return keyfinder.cmp(p) <= 0; },
+            &pos);
+        return output(ret, pos, payload_out, offset_out);
+    }
+
+    using SimpleVisitor = std::function<void(const Payload &, OFF_T)>;
+
+    void visit(OFF_T offset, SimpleVisitor visitor) const
+    {
+        if (!offset)
+            return;
+
+        const diskheader &h = header(offset);
+        unsigned count = h.count;
+        for (unsigned i = 0; i < count; i++) {
+            if (h.leaf)
+                visitor(entry(offset, i), entry_offset(offset, i));
+            else
+                visit(child(offset, i).offset, visitor);
+        }
+    }
+
+    using RangeVisitor = std::function<bool(const Payload &, OFF_T)>;
+
+    // Equivalent of AVLDisk::visit_range.
+    template <class PayloadComparable>
+    bool visit_range(OFF_T offset, const PayloadComparable &keyfinder,
+                     const RangeVisitor &visitor) const
+    {
+        if (!offset)
+            return true;
+
+        const diskheader &h = header(offset);
+        unsigned count = h.count;
+        auto reached = [&](const Payload &p) { return keyfinder.cmp(p) <= 0; };
+        if (h.leaf) {
+            for (unsigned i = first_true(count, entry_at(offset), reached);
+                 i < count && keyfinder.cmp(entry(offset, i)) == 0; i++)
+                if (!visitor(entry(offset, i), entry_offset(offset, i)))
+                    return false;
+            return true;
+        }
+
+        // Stop after the child in which the matching run ends
+        for (unsigned i = first_true(count, max_at(offset), reached);
+             i < count; i++) {
+            if (!visit_range(child(offset, i).offset, keyfinder, visitor))
+                return false;
+            if (keyfinder.cmp(child(offset, i).max) < 0)
+                break;
+        }
+        return true;
+    }
+
+    using NodeContentsVisitor =
+        std::function<void(const Payload &, const Annotation &)>;
+
+    // Equivalent of AVLDisk::byteswap. The visitor sees every payload
+    // in the leaves, and an annotation made from just that payload.
+    void byteswap(OFF_T offset, bool to_native,
+                  std::unordered_set<OFF_T> &done,
+                  const NodeContentsVisitor &visitor)
+    {
+        std::vector<OFF_T> stack{offset};
+        while (!stack.empty()) {
+            OFF_T off = stack.back();
+            stack.pop_back();
+            if (!off || !done.insert(off).second)
+                continue;
+
+            diskheader &h = *arena.getptr<diskheader>(off);
+            if (to_native)
+                h.count.byteswap();
+            unsigned count = h.count;
+            for (unsigned i = 0; i < count; i++) {
+                if (h.leaf) {
+                    Payload &p = *arena.getptr<Payload>(entry_offset(off, i));
+                    if (to_native)
+                        p.byteswap();
+                    visitor(p, Annotation(p));
+                    if (!to_native)
+                        p.byteswap();
+                } else {
+                    diskchild &dc = child(off, i);
+                    if (to_native)
+                        dc.offset.byteswap();
+                    stack.push_back(dc.offset);
+                    if (!to_native)
+                        dc.offset.byteswap();
+                    dc.max.byteswap();
+                    dc.annotation.byteswap();
+                }
+            }
+            if (!to_native)
+                h.count.byteswap();
+        }
+    }
+
+    // Equivalents of AVLDisk::relayout_place and relayout_copy. Each
+    // node is already a page, so they're simply placed in depth-first
+    // order. As in byteswap, the visitor sees the leaf payloads, while
+    // 'translate' sees the maximum payloads in internal nodes too.
+    void relayout_place(OFF_T offset, RelayoutMap &relocation,
+                        const NodeContentsVisitor &visitor) const
+    {
+        if (!relocation.place(offset, NodeSize))
+            return;
+
+        const diskheader &h = header(offset);
+        unsigned count = h.count;
+        for (unsigned i = 0; i < count; i++) {
+            if (h.leaf) {
+                visitor(entry(offset, i), Annotation(entry(offset, i)));
+            } else {
+                relayout_place(child(offset, i).offset, relocation, visitor);
+            }
+        }
+    }
+
+    using NodeContentsTranslator = std::function<void(Payload &, Annotation &)>;
+
+    void relayout_copy(OFF_T offset, const RelayoutMap &relocation,
+                       Arena &dest, std::unordered_set<OFF_T> &done,
+                       const NodeContentsTranslator &translate) const
+    {
+        if (!offset || !done.insert(offset).second)
+            return;
+
+        OFF_T newoff = relocation(offset);
+        memcpy(dest.getptr<char>(newoff), arena.getptr<char>(offset),
+               NodeSize);
+        unsigned count = header(offset).count;
+        for (unsigned i = 0; i < count; i++) {
+            if (header(offset).leaf) {
+                Payload &p = *dest.getptr<Payload>(entry_offset(newoff, i));
+                Annotation a(p);
+                translate(p, a);
+            } else {
+                diskchild &dc = *dest.getptr<diskchild>(
+                    newoff + sizeof(diskheader) + i * sizeof(diskchild));
+                relayout_copy(dc.offset, relocation, dest, done, translate);
+                dc.offset = relocation(dc.offset);
+                translate(dc.max, dc.annotation);
+            }
+        }
+    }
+};
+
+/*
+ * Identifies which implementation an index structure uses. These
+ * values are stored in the index file header.
+ */
+enum class TreeType : char { AVL = 'A', BTree = 'B' };
+
+/*
+ * Wrapper that dispatches to either an AVLDisk or a BTreeDisk,
+ * chosen at run time, for index structures whose type is selectable.
+ * It supports the operations the two have in common.
+ */
+template <class Payload, class Annotation = EmptyAnnotation<Payload>>
+class SelectableTree {
+    TreeType type;
+    AVLDisk<Payload, Annotation> avl;
+    BTreeDisk<Payload, Annotation> btree;
+
+  public:
+    SelectableTree(Arena &arena, TreeType type = TreeType::AVL)
+        : type(type), avl(arena), btree(arena)
+    {
+    }
+
+    TreeType tree_type() const { return type; }
+    void set_tree_type(TreeType newtype) { type = newtype; }
+
+    // Direct access to the AVL tree, for the operations only it
+    // supports. Only valid if tree_type() is AVL.
+    AVLDisk<Payload, Annotation> &as_avl()
+    {
+        assert(type == TreeType::AVL);
+        return avl;
+    }
+    const AVLDisk<Payload, Annotation> &as_avl() const
+    {
+        assert(type == TreeType::AVL);
+        return avl;
+    }
+
+    void commit()
+    {
+        avl.commit();
+        btree.commit();
+    }
+
+    template <class Source> OFF_T build(size_t count, Source next)
+    {
+        return type == TreeType::AVL ? avl.build(count, next)
+                                     : btree.build(count, next);
+    }
+
+    OFF_T insert(OFF_T oldroot, Payload payload)
+    {
+        return type == TreeType::AVL ? avl.insert(oldroot, payload)
+                                     : btree.insert(oldroot, payload);
+    }
+
+    template <class PayloadComparable>
+    bool find(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        return type == TreeType::AVL
+                   ? avl.find(root, keyfinder, payload_out, offset_out)
+                   : btree.find(root, keyfinder, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool find_leftmost(OFF_T root, const PayloadComparable &keyfinder,
+                       Payload *payload_out, OFF_T *offset_out) const
+    {
+        return type == TreeType::AVL
+                   ? avl.find_leftmost(root, keyfinder, payload_out,
+                                       offset_out)
+                   : btree.find_leftmost(root, keyfinder, payload_out,
+                                         offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool find_rightmost(OFF_T root, const PayloadComparable &keyfinder,
+                        Payload *payload_out, OFF_T *offset_out) const
+    {
+        return type == TreeType::AVL
+                   ? avl.find_rightmost(root, keyfinder, payload_out,
+                                        offset_out)
+                   : btree.find_rightmost(root, keyfinder, payload_out,
+                                          offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool succ(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        return type == TreeType::AVL
+                   ? avl.succ(root, keyfinder, payload_out, offset_out)
+                   : btree.succ(root, keyfinder, payload_out, offset_out);
+    }
+
+    template <class PayloadComparable>
+    bool pred(OFF_T root, const PayloadComparable &keyfinder,
+              Payload *payload_out, OFF_T *offset_out) const
+    {
+        return type == TreeType::AVL
+                   ? avl.pred(root, keyfinder, payload_out, offset_out)
+                   : btree.pred(root, keyfinder, payload_out, offset_out);
+    }
+
+    void visit(OFF_T root,
+               std::function<void(const Payload &, OFF_T)> visitor) const
+    {
+        if (type == TreeType::AVL)
+            avl.visit(root, visitor);
+        else
+            btree.visit(root, visitor);
+    }
+
+    template <class PayloadComparable>
+    bool visit_range(OFF_T root, const PayloadComparable &keyfinder,
+                     std::function<bool(const Payload &, OFF_T)> visitor) const
+    {
+        return type == TreeType::AVL
+                   ? avl.visit_range(root, keyfinder, visitor)
+                   : btree.visit_range(root, keyfinder, visitor);
+    }
+
+    void byteswap(
+        OFF_T root, bool to_native, std::unordered_set<OFF_T> &done,
+        std::function<void(const Payload &, const Annotation &)> visitor)
+    {
+        if (type == TreeType::AVL)
+            avl.byteswap(root, to_native, done, visitor);
+        else
+            btree.byteswap(root, to_native, done, visitor);
+    }
+
+    void relayout_place(
+        OFF_T root, RelayoutMap &relocation,
+        std::function<void(const Payload &, const Annotation &)> visitor) const
+    {
+        if (type == TreeType::AVL)
+            avl.relayout_place(root, relocation, visitor);
+        else
+            btree.relayout_place(root, relocation, visitor);
+    }
+
+    void relayout_copy(OFF_T root, const RelayoutMap &relocation,
+                       Arena &dest, std::unordered_set<OFF_T> &done,
+                       std::function<void(Payload &, Annotation &)> translate)
+        const
+    {
+        if (type == TreeType::AVL)
+            avl.relayout_copy(root, relocation, dest, done, translate);
+        else
+            btree.relayout_copy(root, relocation, dest, done, translate);
+    }
+
+    void enable_cache(unsigned bits)
+    {
+        // A B-tree node is too big to be worth caching decoded.
+        avl.enable_cache(bits);
+    }
+
+    typename AVLDisk<Payload, Annotation>::CacheStats cache_stats() const
+    {
+        return avl.cache_stats();
+    }
+};
+
+#endif // LIBTARMAC_BTREE_HH
@@ -19,12 +19,17 @@
 #ifndef TARMAC_CALLINFO_HH
 #define TARMAC_CALLINFO_HH
 
+#include "libtarmac/calltree.hh"
 #include "libtarmac/index.hh"
 #include "libtarmac/misc.hh"
 
 #include <string>
 #include <vector>
 
+// Every visit to a given address in the trace, in order, found
+// through the by-PC tree
+std::vector<TarmacSite> find_calls(const IndexNavigator &IN, Addr addr);
+
 class CallInfo : public IndexNavigator {
     using IndexNavigator::IndexNavigator;
 
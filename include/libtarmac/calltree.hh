@@ -27,18 +27,18 @@
 #include <vector>
 
 struct TarmacSite {
-    Addr addr;            // PC address
-    Time time;            // Time
-    unsigned tarmac_line; // Line number in the trace
-    OFF_T tarmac_pos;     // Offset (in bytes) in the trace
+    Addr addr;          // PC address
+    Time time;          // Time
+    LineNo tarmac_line; // Line number in the trace
+    OFF_T tarmac_pos;   // Offset (in bytes) in the trace
 
-    constexpr TarmacSite(Addr addr, Time time, unsigned tarmac_line,
+    constexpr TarmacSite(Addr addr, Time time, LineNo tarmac_line,
                          OFF_T tarmac_pos)
         : addr(addr), time(time), tarmac_line(tarmac_line),
           tarmac_pos(tarmac_pos)
     {
     }
-    constexpr TarmacSite(Addr addr, unsigned line)
+    constexpr TarmacSite(Addr addr, LineNo line)
         : addr(addr), time(0), tarmac_line(line), tarmac_pos(0)
     {
     }
@@ -24,10 +24,20 @@
 // if they have been found by CMake.
 #include "libtarmac/platform.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 // Base class for a memory arena that will contain the index data structures.
 class Arena {
@@ -35,9 +45,20 @@ class Arena {
     OFF_T curr_size = 0, next_offset = 0;
     void *mapping = nullptr;
 
+    // Offsets from 'split' onwards are in 'upper' rather than
+    // 'mapping'. Only an OverlayArena sets these.
+    OFF_T split = std::numeric_limits<OFF_T>::max();
+    void *upper = nullptr;
+
   private:
     virtual void resize(size_t newsize) = 0; // must update curr_size
 
+    inline char *addr(OFF_T offset) const
+    {
+        return offset < split ? (char *)mapping + offset
+                              : (char *)upper + (offset - split);
+    }
+
   public:
     virtual ~Arena() = default;
 
@@ -48,14 +69,14 @@ class Arena {
     {
         assert(0 <= offset && (OFF_T)sizeof(T) <= next_offset &&
                offset <= next_offset - (OFF_T)sizeof(T));
-        return (T *)((char *)mapping + offset);
+        return (T *)addr(offset);
     }
 
     template <class T> inline const T *getptr(OFF_T offset) const
     {
         assert(0 <= offset && (OFF_T)sizeof(T) <= next_offset &&
                offset <= next_offset - (OFF_T)sizeof(T));
-        return (const T *)((char *)mapping + offset);
+        return (const T *)addr(offset);
     }
 
     template <class T> inline T *newptr()
@@ -91,14 +112,92 @@ class MemArena: public Arena {
     ~MemArena();
 };
 
-template <class Int> class diskint {
-    unsigned char bytes[sizeof(Int)];
+// Read-only view of part of another arena, in which offset 0 is the
+// start of that part. Used for the shards of a sharded index, and the
+// views of a per-CPU index, whose internal file offsets are relative
+// to where each part begins. The other arena must not be resized
+// while the view exists; the second constructor also keeps it alive.
+class ArenaView: public Arena {
+    std::shared_ptr<Arena> parent;
+
+    void resize(size_t newsize) override;
+
+  public:
+    ArenaView(Arena &parent, OFF_T base, OFF_T size);
+    ArenaView(std::shared_ptr<Arena> parent, OFF_T base, OFF_T size);
+};
+
+// Arena that extends another one without modifying it: the existing
+// contents of the other arena appear at the same offsets, and anything
+// allocated afterwards goes in a block of ordinary memory. Used to
+// build memory trees on top of a finished index, which may be mapped
+// read-only and shared with other processes. The existing contents
+// must not be written to, and the other arena must not be resized
+// while this one exists.
+class OverlayArena: public Arena {
+    std::shared_ptr<Arena> lower;
+
+    void resize(size_t newsize) override;
+
+  public:
+    OverlayArena(std::shared_ptr<Arena> lower);
+    ~OverlayArena();
+
+    // Memory used by the contents allocated in this arena
+    size_t upper_size() const { return next_offset - split; }
+};
+
+// Record of where each piece of an index is being moved to, when
+// relayout_index copies it into a fresh file. place() allocates the
+// new location of a piece of the old file in the destination arena,
+// the first time it's called for a given old offset; translating an
+// offset afterwards is then a lookup.
+class RelayoutMap {
+    Arena &dest;
+    std::unordered_map<OFF_T, OFF_T> map;
+
+  public:
+    RelayoutMap(Arena &dest) : dest(dest) {}
+
+    bool place(OFF_T offset, size_t size)
+    {
+        if (!offset || map.count(offset))
+            return false;
+        map[offset] = dest.alloc(size);
+        return true;
+    }
+
+    OFF_T operator()(OFF_T offset) const
+    {
+        if (!offset)
+            return 0;
+        auto it = map.find(offset);
+        assert(it != map.end() && "translating an offset that wasn't placed");
+        return it->second;
+    }
+};
+
+// An integer stored in the index file in the byte order of the host
+// that wrote it, so that reading or writing one is a single memcpy,
+// which compiles to a plain (possibly unaligned) load or store. The
+// FileHeader records which byte order was used, and byteswap() below
+// lets a whole index be converted for a host of the other endianness.
+//
+// By default it occupies as many bytes as its value type, but a
+// narrower width can be specified for fields whose values are known
+// never to need the whole range, so as to keep index nodes small.
+// Then only the low-order bytes are stored.
+template <class Int, size_t Bytes = sizeof(Int)> class diskint {
+    static_assert(Bytes <= sizeof(Int), "diskint wider than its value type");
+    unsigned char bytes[Bytes];
+
+    // Offset of the stored bytes within an in-memory Int
+    static constexpr size_t low_bytes = HOST_BIG_ENDIAN ? sizeof(Int) - Bytes
+                                                        : 0;
+
     inline void set(Int val)
     {
-        for (size_t i = 0; i < sizeof(bytes); i++) {
-            bytes[sizeof(bytes) - 1 - i] = val;
-            val >>= 8;
-        }
+        memcpy(bytes, (const unsigned char *)&val + low_bytes, Bytes);
     }
 
   public:
@@ -112,14 +211,24 @@ template <class Int> class diskint {
     Int value() const
     {
         Int ret = 0;
-        for (size_t i = 0; i < sizeof(bytes); i++) {
-            ret = (ret << 8) + bytes[i];
-        }
+        memcpy((unsigned char *)&ret + low_bytes, bytes, Bytes);
         return ret;
     }
     inline operator Int() const { return value(); }
+
+    // Reverse the stored byte order in place.
+    void byteswap() { std::reverse(bytes, bytes + Bytes); }
 };
 
+// Width of a file offset (into either the index or the trace file) as
+// stored inside the index. 48 bits allows files of up to 256TiB,
+// which is far beyond anything we expect to see, and saves two bytes
+// on every tree link and data pointer compared to a full OFF_T.
+// Arena::alloc refuses to grow an index past this limit.
+constexpr size_t DISK_OFFSET_BYTES = 6;
+constexpr OFF_T MAX_DISK_OFFSET = ((OFF_T)1 << (8 * DISK_OFFSET_BYTES)) - 1;
+using diskoff = diskint<OFF_T, DISK_OFFSET_BYTES>;
+
 enum class WalkOrder { Preorder, Inorder, Postorder };
 
 template <class Payload> class EmptyAnnotation {
@@ -127,6 +236,7 @@ template <class Payload> class EmptyAnnotation {
     EmptyAnnotation() {}
     EmptyAnnotation(const Payload &) {}
     EmptyAnnotation(const EmptyAnnotation &, const EmptyAnnotation &) {}
+    void byteswap() {}
 };
 
 template <class Payload, class Annotation = EmptyAnnotation<Payload>>
@@ -172,12 +282,38 @@ class AVLDisk {
         Annotation annotation;
     };
 
+    // On-disk layout of a node. Links are narrowed to diskoff, and
+    // the height to a single byte (an AVL tree of height 256 would
+    // need more nodes than could be addressed anyway).
+    //
+    // There's no reference count field here, because only trees in
+    // refcounting mode need one. In that mode, each node is allocated
+    // with a refcount immediately _before_ the disknode, at offset
+    // (node offset - sizeof(refcount_t)). Trees in the persistent
+    // high-water-mark mode, which is what makes up nearly all of an
+    // index file, don't pay for it at all.
     struct disknode {
-        diskint<OFF_T> lc, rc;
-        diskint<int> height, refcount;
+        diskoff lc, rc;
+        diskint<int, 1> height;
         Payload payload;
         Annotation annotation;
     };
+    using refcount_t = diskint<int>;
+
+    static void byteswap_disknode(disknode &dn)
+    {
+        dn.lc.byteswap();
+        dn.rc.byteswap();
+        dn.height.byteswap();
+        dn.payload.byteswap();
+        dn.annotation.byteswap();
+    }
+
+    refcount_t &refcount(OFF_T offset) const
+    {
+        assert(refcounting);
+        return *arena.getptr<refcount_t>(offset - sizeof(refcount_t));
+    }
 
     // When this tree structure is used in a mode where we aren't
     // trying to record everything for ever, nodes can be freed, in
@@ -194,12 +330,15 @@ class AVLDisk {
             freenode &fn = *arena.getptr<freenode>(freehead);
             newnode = freehead;
             freehead = fn.next;
+        } else if (refcounting) {
+            newnode = arena.alloc(sizeof(refcount_t) + sizeof(disknode)) +
+                      sizeof(refcount_t);
         } else {
             newnode = arena.alloc(sizeof(disknode));
         }
 
-        disknode &dn = *arena.getptr<disknode>(newnode);
-        dn.refcount = 0;
+        if (refcounting)
+            refcount(newnode) = 0;
         return newnode;
     }
 
@@ -210,10 +349,10 @@ class AVLDisk {
         if (!offset)
             return 1;    // the null pointer doesn't get adjusted anyway
 
-        disknode &dn = *arena.getptr<disknode>(offset);
-        int rc = dn.refcount;
+        refcount_t &refs = refcount(offset);
+        int rc = refs;
         rc += adj;
-        dn.refcount = rc;
+        refs = rc;
         return rc;
     }
 
@@ -238,6 +377,87 @@ class AVLDisk {
         }
     }
 
+    // Optional cache of decoded nodes, enabled by enable_cache(). It's
+    // direct-mapped, indexed by a hash of the node offset, and only
+    // ever holds nodes below the high-water mark, which can't be
+    // rewritten by further tree operations. (The non-const walk() can
+    // still modify them, so put() writes through to the cache.)
+    //
+    // Lookups can be made from several threads at once without any
+    // locking. Each slot keeps its node in atomic words, with a
+    // sequence number that's odd while the slot is being written, so
+    // a reader can tell if the copy it got was consistent, and reads
+    // the node from the arena instead if not. A thread that wants to
+    // fill a slot that's already being filled just doesn't bother.
+    // The hit and miss counts are spread over a few counters, each
+    // padded out to a cache line of its own and placed at an aligned
+    // address by hand (C++14 new[] ignores over-alignment), so that
+    // threads don't all contend for one.
+    static constexpr size_t CACHE_WORDS =
+        (sizeof(node) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    struct CacheSlot {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint64_t> words[CACHE_WORDS];
+    };
+    static constexpr size_t CACHE_LINE = 64;
+    struct CacheCounts {
+        std::atomic<uint64_t> hits, misses;
+        char pad[CACHE_LINE - 2 * sizeof(std::atomic<uint64_t>)];
+    };
+    static_assert(sizeof(CacheCounts) == CACHE_LINE,
+                  "each counter should fill exactly one cache line");
+    static constexpr unsigned CACHE_COUNT_BITS = 4;
+    std::unique_ptr<CacheSlot[]> cache;
+    std::unique_ptr<char[]> cache_count_storage;
+    CacheCounts *cache_counts = nullptr;
+    unsigned cache_bits = 0;
+
+    CacheSlot *cache_slot(OFF_T offset) const
+    {
+        if (!cache || refcounting || offset >= hwm)
+            return nullptr;
+        uint64_t hash = (uint64_t)offset * 0x9E3779B97F4A7C15ULL;
+        return &cache[hash >> (64 - cache_bits)];
+    }
+
+    CacheCounts &cache_count(const CacheSlot *slot) const
+    {
+        return cache_counts[(slot - cache.get()) &
+                            ((1U << CACHE_COUNT_BITS) - 1)];
+    }
+
+    bool cache_load(const CacheSlot &slot, OFF_T offset, node &n) const
+    {
+        uint32_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            return false;
+        uint64_t buf[CACHE_WORDS];
+        for (size_t i = 0; i < CACHE_WORDS; i++)
+            buf[i] = slot.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            return false;
+        memcpy(&n, buf, sizeof(node));
+        return n.offset == offset;
+    }
+
+    void cache_store(CacheSlot &slot, const node &n) const
+    {
+        static_assert(std::is_trivially_copyable<node>::value,
+                      "cached nodes are copied as raw words");
+        uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+        if ((seq & 1) ||
+            !slot.seq.compare_exchange_strong(seq, seq + 1,
+                                              std::memory_order_acquire))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t buf[CACHE_WORDS] = {};
+        memcpy(buf, &n, sizeof(node));
+        for (size_t i = 0; i < CACHE_WORDS; i++)
+            slot.words[i].store(buf[i], std::memory_order_relaxed);
+        slot.seq.store(seq + 2, std::memory_order_release);
+    }
+
     void put(node &n)
     {
         disknode &dn = *arena.getptr<disknode>(n.offset);
@@ -246,6 +466,11 @@ class AVLDisk {
         dn.height = n.height;
         dn.payload = n.payload;
         dn.annotation = n.annotation;
+
+        CacheSlot *slot = cache_slot(n.offset);
+        node cached;
+        if (slot && cache_load(*slot, n.offset, cached))
+            cache_store(*slot, n);
     }
 
     node get(OFF_T offset) const
@@ -255,15 +480,28 @@ class AVLDisk {
             n.offset = 0;
             n.lc = n.rc = 0;
             n.height = 0;
-        } else {
-            disknode &dn = *arena.getptr<disknode>(offset);
-            n.offset = offset;
-            n.lc = dn.lc;
-            n.rc = dn.rc;
-            n.height = dn.height;
-            n.payload = dn.payload;
-            n.annotation = dn.annotation;
+            return n;
+        }
+
+        CacheSlot *slot = cache_slot(offset);
+        if (slot) {
+            if (cache_load(*slot, offset, n)) {
+                cache_count(slot).hits.fetch_add(1, std::memory_order_relaxed);
+                return n;
+            }
+            cache_count(slot).misses.fetch_add(1, std::memory_order_relaxed);
         }
+
+        disknode &dn = *arena.getptr<disknode>(offset);
+        n.offset = offset;
+        n.lc = dn.lc;
+        n.rc = dn.rc;
+        n.height = dn.height;
+        n.payload = dn.payload;
+        n.annotation = dn.annotation;
+
+        if (slot)
+            cache_store(*slot, n);
         return n;
     }
 
@@ -271,8 +509,7 @@ class AVLDisk {
         if (!refcounting) {
             return n.offset < hwm;
         } else {
-            disknode &dn = *arena.getptr<disknode>(n.offset);
-            return dn.refcount > 1;
+            return n.offset && refcount(n.offset) > 1;
         }
     }
 
@@ -372,6 +609,23 @@ class AVLDisk {
         return root;
     }
 
+    // Build a perfectly balanced subtree out of the next 'count'
+    // payloads that 'next' returns.
+    template <class Source> node build_main(size_t count, Source &next)
+    {
+        if (!count)
+            return get(0);
+        size_t nleft = (count - 1) / 2;
+        node lc = build_main(nleft, next);
+        node n;
+        n.offset = alloc_node();
+        n.lc = n.rc = 0;
+        n.payload = next();
+        node rc = build_main(count - 1 - nleft, next);
+        rewrite(n, lc.offset, rc.offset, false);
+        return n;
+    }
+
     template <class PayloadComparable>
     node remove_main(node &root, const PayloadComparable *keyfinder,
                      node *removed, bool must_modify)
@@ -572,6 +826,51 @@ class AVLDisk {
         hwm = arena.curr_offset();
     }
 
+    // Enable the decoded-node cache described above, with 2^bits
+    // entries. Only useful in non-refcounting mode, and only for
+    // nodes committed before they're looked up, which in practice
+    // means trees being read from a finished index.
+    void enable_cache(unsigned bits)
+    {
+        assert(0 < bits && bits < 32);
+        cache_bits = bits;
+        // Zero words decode as a node at offset 0, which is never
+        // looked up, so every slot starts out empty
+        cache.reset(new CacheSlot[(size_t)1 << bits]);
+        for (size_t i = 0; i < ((size_t)1 << bits); i++) {
+            cache[i].seq.store(0, std::memory_order_relaxed);
+            for (auto &word : cache[i].words)
+                word.store(0, std::memory_order_relaxed);
+        }
+        // Allocate one spare line, so that there's room to round the
+        // start of the counters up to a line boundary
+        cache_count_storage.reset(
+            new char[((1U << CACHE_COUNT_BITS) + 1) * CACHE_LINE]);
+        uintptr_t base = (uintptr_t)cache_count_storage.get();
+        base = (base + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+        cache_counts = reinterpret_cast<CacheCounts *>(base);
+        for (unsigned i = 0; i < (1U << CACHE_COUNT_BITS); i++) {
+            new (&cache_counts[i]) CacheCounts;
+            cache_counts[i].hits.store(0, std::memory_order_relaxed);
+            cache_counts[i].misses.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    struct CacheStats {
+        uint64_t hits, misses;
+    };
+    CacheStats cache_stats() const
+    {
+        CacheStats stats = {0, 0};
+        for (unsigned i = 0; cache_counts && i < (1U << CACHE_COUNT_BITS);
+             i++) {
+            stats.hits += cache_counts[i].hits.load(std::memory_order_relaxed);
+            stats.misses +=
+                cache_counts[i].misses.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
     OFF_T clone_tree(OFF_T root)
     {
         adjust_refcount(root, +1);
@@ -688,6 +987,114 @@ class AVLDisk {
         return ret;
     }
 
+    // A position in the tree, which remembers the path down to it
+    // from the root, so that it can move to the next or previous node
+    // in amortised constant time instead of searching again from the
+    // root each time. It's only valid while the tree it points into
+    // is unchanged, and it's off the end (valid() is false) if a move
+    // or search finds nothing.
+    class Cursor {
+        const AVLDisk *tree;
+        OFF_T root;
+        std::vector<node> path; // from the root to the current node
+
+        void descend(OFF_T offset, bool leftwards)
+        {
+            while (offset) {
+                path.push_back(tree->get(offset));
+                offset = leftwards ? path.back().lc : path.back().rc;
+            }
+        }
+
+        bool step(bool forwards)
+        {
+            if (path.empty())
+                return false;
+
+            // The neighbouring node is the extreme one in the subtree
+            // on that side, if there is one; otherwise it's the
+            // nearest ancestor we're on the other side of.
+            OFF_T child = forwards ? path.back().rc : path.back().lc;
+            if (child) {
+                path.push_back(tree->get(child));
+                descend(forwards ? path.back().lc : path.back().rc,
+                        forwards);
+                return true;
+            }
+            while (true) {
+                OFF_T from = path.back().offset;
+                path.pop_back();
+                if (path.empty())
+                    return false;
+                if ((forwards ? path.back().lc : path.back().rc) == from)
+                    return true;
+            }
+        }
+
+      public:
+        Cursor(const AVLDisk &tree, OFF_T root) : tree(&tree), root(root) {}
+
+        bool valid() const { return !path.empty(); }
+        const Payload &payload() const { return path.back().payload; }
+        const Annotation &annotation() const
+        {
+            return path.back().annotation;
+        }
+        OFF_T offset() const { return path.back().offset; }
+
+        // Move to the first or last node of the whole tree
+        bool first()
+        {
+            path.clear();
+            descend(root, true);
+            return valid();
+        }
+        bool last()
+        {
+            path.clear();
+            descend(root, false);
+            return valid();
+        }
+
+        // Move to a node matching 'keyfinder', in the same way as
+        // find(), or the rightmost such node as find_rightmost()
+        template <class PayloadComparable>
+        bool seek(const PayloadComparable &keyfinder, bool rightmost = false)
+        {
+            path.clear();
+            size_t found = 0;
+            for (OFF_T offset = root; offset;) {
+                path.push_back(tree->get(offset));
+                int cmp = keyfinder.cmp(path.back().payload);
+                if (cmp == 0) {
+                    found = path.size();
+                    if (!rightmost)
+                        break;
+                }
+                offset = cmp < 0 ? path.back().lc : path.back().rc;
+            }
+            path.resize(found);
+            return valid();
+        }
+
+        bool next() { return step(true); }
+        bool prev() { return step(false); }
+        void clear() { path.clear(); }
+    };
+
+    Cursor cursor(OFF_T root) const { return Cursor(*this, root); }
+
+    // Make a new tree out of 'count' payloads, which successive calls
+    // to next() return in increasing order, and return its root. This
+    // is much quicker than inserting them one at a time, since nothing
+    // has to be searched for or rebalanced.
+    template <class Source> OFF_T build(size_t count, Source next)
+    {
+        node root = build_main(count, next);
+        adjust_refcount(root, +1);
+        return root.offset;
+    }
+
     OFF_T insert(OFF_T oldroot, Payload payload)
     {
         node root = get(oldroot);
@@ -813,6 +1220,156 @@ class AVLDisk {
         visitor(n.payload, nodeoff);
         visit(n.rc, visitor);
     }
+
+    using AnnotationFilter = std::function<bool(const Annotation &)>;
+
+    // Visit in order every node whose payload, made into an
+    // annotation of its own, satisfies 'filter', skipping every
+    // subtree whose annotation doesn't. So 'filter' must accept the
+    // annotation of a subtree whenever it would accept any node in
+    // it, such as a test of a maximum stored in the annotation.
+    void visit_where(OFF_T nodeoff, const AnnotationFilter &filter,
+                     const SimpleVisitor &visitor) const
+    {
+        if (!nodeoff)
+            return;
+
+        const node n = get(nodeoff);
+        if (!filter(n.annotation))
+            return;
+        visit_where(n.lc, filter, visitor);
+        if (filter(Annotation(n.payload)))
+            visitor(n.payload, nodeoff);
+        visit_where(n.rc, filter, visitor);
+    }
+
+    // Visitor for visit_range, which returns false to stop the walk
+    using RangeVisitor = std::function<bool(const Payload &, OFF_T)>;
+
+    // Visit in order every node that 'keyfinder' matches, which must
+    // be a contiguous run of them, such as all those overlapping an
+    // interval. They're all found in a single walk, rather than a
+    // separate search from the root for each one. Returns false if
+    // the visitor stopped the walk.
+    template <class PayloadComparable>
+    bool visit_range(OFF_T nodeoff, const PayloadComparable &keyfinder,
+                     const RangeVisitor &visitor) const
+    {
+        if (!nodeoff)
+            return true;
+
+        const node n = get(nodeoff);
+        int cmp = keyfinder.cmp(n.payload);
+        if (cmp <= 0 && !visit_range(n.lc, keyfinder, visitor))
+            return false;
+        if (cmp == 0 && !visitor(n.payload, nodeoff))
+            return false;
+        return cmp < 0 || visit_range(n.rc, keyfinder, visitor);
+    }
+
+    using NodeContentsVisitor =
+        std::function<void(const Payload &, const Annotation &)>;
+
+    // Reverse the byte order of every node reachable from 'nodeoff',
+    // to move an index between hosts of opposite endianness. If
+    // 'to_native' is true, the nodes are currently in the other byte
+    // order and end up in this host's; otherwise the reverse. Either
+    // way, 'visitor' sees each node's payload and annotation while
+    // they're in native order, so that it can convert any further
+    // data they point to.
+    //
+    // Persistent trees share subtrees, so nodes already listed in
+    // 'done' are skipped, and each converted node is added to it.
+    void byteswap(OFF_T nodeoff, bool to_native,
+                  std::unordered_set<OFF_T> &done,
+                  const NodeContentsVisitor &visitor)
+    {
+        assert(!refcounting);
+
+        std::vector<OFF_T> stack{nodeoff};
+        while (!stack.empty()) {
+            OFF_T off = stack.back();
+            stack.pop_back();
+            if (!off || !done.insert(off).second)
+                continue;
+
+            disknode &dn = *arena.getptr<disknode>(off);
+            if (to_native)
+                byteswap_disknode(dn);
+            visitor(dn.payload, dn.annotation);
+            stack.push_back(dn.lc);
+            stack.push_back(dn.rc);
+            if (!to_native)
+                byteswap_disknode(dn);
+        }
+    }
+
+    // Support for relayout_index. relayout_place assigns a location in
+    // 'relocation' to every node reachable from 'nodeoff' that doesn't
+    // already have one, and calls 'visitor' on each of them. The
+    // nodes are placed in blocks that fit in a page, each holding the
+    // top few levels of a subtree in breadth-first order, and each
+    // followed by the blocks for the subtrees below it, so that a
+    // search from the root touches as few pages as possible.
+    void relayout_place(OFF_T nodeoff, RelayoutMap &relocation,
+                        const NodeContentsVisitor &visitor) const
+    {
+        assert(!refcounting);
+
+        const size_t per_page = 4096 / sizeof(disknode);
+        unsigned depth = 1;
+        while (((size_t)2 << depth) - 1 <= per_page)
+            depth++;
+
+        std::vector<OFF_T> blocks{nodeoff};
+        while (!blocks.empty()) {
+            std::vector<OFF_T> level{blocks.back()};
+            blocks.pop_back();
+            for (unsigned d = 0; d < depth && !level.empty(); d++) {
+                std::vector<OFF_T> next;
+                for (OFF_T off : level) {
+                    if (!relocation.place(off, sizeof(disknode)))
+                        continue;
+                    const disknode &dn = *arena.getptr<disknode>(off);
+                    visitor(dn.payload, dn.annotation);
+                    next.push_back(dn.lc);
+                    next.push_back(dn.rc);
+                }
+                level.swap(next);
+            }
+            // What's left in 'level' are the roots of the subtrees
+            // hanging off the bottom of this block.
+            blocks.insert(blocks.end(), level.rbegin(), level.rend());
+        }
+    }
+
+    using NodeContentsTranslator = std::function<void(Payload &, Annotation &)>;
+
+    // Second half of relayout: write every node reachable from
+    // 'nodeoff' (and not listed in 'done') to the location it was
+    // given by relayout_place, translating its links, and calling
+    // 'translate' to translate any other offsets in its contents.
+    void relayout_copy(OFF_T nodeoff, const RelayoutMap &relocation,
+                       Arena &dest, std::unordered_set<OFF_T> &done,
+                       const NodeContentsTranslator &translate) const
+    {
+        std::vector<OFF_T> stack{nodeoff};
+        while (!stack.empty()) {
+            OFF_T off = stack.back();
+            stack.pop_back();
+            if (!off || !done.insert(off).second)
+                continue;
+
+            const disknode &src = *arena.getptr<disknode>(off);
+            disknode &dst = *dest.getptr<disknode>(relocation(off));
+            dst = src;
+            dst.lc = relocation(src.lc);
+            dst.rc = relocation(src.rc);
+            translate(dst.payload, dst.annotation);
+            stack.push_back(src.lc);
+            stack.push_back(src.rc);
+        }
+    }
 };
 
 // A class encapsulating information about the filename of a Tarmac
@@ -824,6 +1381,11 @@ struct TracePair {
     bool index_on_disk;
     std::string index_filename;             // if index_on_disk is true
     std::shared_ptr<MemArena> memory_index; // if index_on_disk is false
+
+    std::string cpu; // which CPU's view to read, in a per-CPU index
+
+    // If index_filename is in an index cache directory, the directory
+    std::string index_cache_dir;
 };
 
 #endif // LIBTARMAC_DISKTREE_HH
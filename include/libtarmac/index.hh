@@ -24,6 +24,7 @@
 // if they have been found by CMake.
 #include "libtarmac/platform.hh"
 
+#include "libtarmac/btree.hh"
 #include "libtarmac/disktree.hh"
 #include "libtarmac/image.hh"
 #include "libtarmac/index_ds.hh"
@@ -33,9 +34,14 @@
 
 #include <assert.h>
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 // Parameters that tell run_indexer which features it can leave out of
@@ -44,6 +50,72 @@ struct IndexerParams {
     bool record_memory = true;
     bool record_calls = true;
 
+    // Implementations to use for the index structures that can be
+    // either an AVL tree or a B+-tree
+    TreeType memsubtree_type = TreeType::AVL;
+    TreeType bypctree_type = TreeType::AVL;
+
+    // If this is TreeType::BTree, also store a B+-tree copy of seqtree
+    // for lookups by line and time (see FileHeader::seqtree_type)
+    TreeType seqtree_type = TreeType::AVL;
+
+    // Store a full memory tree only at every this many seqtree nodes,
+    // and a list of changes at the others (see FLAG_MEMORY_DELTAS).
+    // 1 means a full memory tree everywhere.
+    unsigned snapshot_interval = 1;
+
+    // Build only checkpoints of the memory state during indexing, and
+    // the rest on demand when the index is read (see FLAG_LAZY_MEMORY),
+    // with a checkpoint every lazy_memory_interval seqtree nodes.
+    bool lazy_memory = false;
+    unsigned lazy_memory_interval = 1024;
+
+    // Cut the trace into this many pieces, index them in parallel, and
+    // stitch the results together into one index (see FLAG_SHARDED).
+    unsigned shards = 1;
+
+    // Index each CPU of a multi-CPU trace separately, reading the
+    // trace only once (see FLAG_PER_CPU).
+    bool per_cpu = false;
+
+    // Ask the OS to discard each part of the trace file from its
+    // cache once it's been read, or not to cache it at all, so that
+    // indexing a trace much bigger than RAM doesn't push everything
+    // else out (see SequentialFileBuf).
+    bool trace_drop_behind = false;
+    bool trace_direct_io = false;
+
+    // Index only the lines of the trace from window_start_line to
+    // window_end_line, and only those with times from window_start_time
+    // to window_end_time (all inclusive), as if the rest of the trace
+    // wasn't there. Line numbers in the index still match the whole
+    // trace file.
+    LineNo window_start_line = 1;
+    LineNo window_end_line = std::numeric_limits<LineNo>::max();
+    Time window_start_time = 0;
+    Time window_end_time = std::numeric_limits<Time>::max();
+
+    bool has_window() const
+    {
+        return window_start_line > 1 ||
+               window_end_line != std::numeric_limits<LineNo>::max() ||
+               window_start_time > 0 ||
+               window_end_time != std::numeric_limits<Time>::max();
+    }
+
+    // Address ranges (inclusive at both ends) to leave out of the
+    // index. Each run of consecutive instructions whose PCs are in
+    // exclude_pcs is folded into a single seqtree node with no PC, and
+    // none of them is entered in the by-PC tree. Memory accesses that
+    // touch exclude_data are not recorded at all, so that memory is
+    // always unknown.
+    std::vector<std::pair<Addr, Addr>> exclude_pcs;
+    std::vector<std::pair<Addr, Addr>> exclude_data;
+
+    // Fold each run of repeated iterations of a loop that changes
+    // nothing into a single seqtree node (see FLAG_LOOP_RUNS).
+    bool compress_loops = false;
+
     bool can_store_on_disk() const {
         /*
          * At present, we only permit disk-based indexes if they
@@ -65,34 +137,226 @@ struct IndexerDiagnostics {
         return *diagnostics_stream;
     }
     bool debug_call_heuristics = false;
+    bool debug_space = false;
 };
 
 void run_indexer(const TracePair &trace, const IndexerParams &iparams,
                  const IndexerDiagnostics &idiags, const ParseParams &pparams);
 
-enum class IndexHeaderState { OK, WrongMagic, Incomplete };
-IndexHeaderState check_index_header(const std::string &index_filename);
+// Make a copy of an index file with the byte order of all its fields
+// reversed, for use on a host of the opposite endianness. The input
+// can be in either byte order.
+void convert_index_byte_order(const std::string &index_filename,
+                              const std::string &out_filename);
+
+// Make a copy of a complete index file containing only the data
+// reachable from its header, with each tree laid out so that a
+// lookup touches as few pages as possible. Queries on the copy give
+// the same results as on the original.
+void relayout_index(const std::string &index_filename,
+                    const std::string &out_filename);
+
+enum class IndexHeaderState {
+    OK,
+    WrongMagic,
+    WrongByteOrder,
+    Incomplete,
+    WrongParams, // made with indexing options other than 'iparams'
+};
+// If 'iparams' is given, also check that the index was made with the
+// same options among those that decide which parts of the trace it
+// describes, so that it would give the same answers.
+IndexHeaderState check_index_header(const std::string &index_filename,
+                                    const IndexerParams *iparams = nullptr);
+
+// One layer of a memory state: a memory tree root, together with the
+// trees and the arena that it has to be read through. Entries last
+// modified before line 'hide_before' are hidden, showing whatever is
+// in the layer below instead.
+struct MemoryLayer {
+    const AVLDisk<MemoryPayload, MemoryAnnotation> *memtree = nullptr;
+    const SelectableTree<MemorySubPayload> *memsubtree = nullptr;
+    const Arena *arena = nullptr;
+    OFF_T root = 0;
+    LineNo hide_before = 0;
+};
+
+// A region of registers or memory that has been modified since some
+// point in the trace, as found by IndexNavigator::changes_since.
+struct MemoryChange {
+    char type; // 'r' or 'm'
+    Addr lo, hi; // inclusive
+    LineNo line; // of the seqtree node that last modified it
+
+    // Its contents now, with 'def' flagging which bytes are known.
+    // (changes_since only lists known bytes, so they all are.)
+    std::vector<unsigned char> data, def;
+};
+
+// The memory state at some point in the trace. Usually that's a
+// single layer; in a sharded index it's the shard's own memory tree
+// on top of the base state it started from, and in an index of
+// snapshots and deltas it's the replayed deltas on top of a snapshot.
+// If the trees were built on demand, 'hold' keeps them alive for as
+// long as the MemoryState, whatever the reader does with them since.
+struct MemoryState {
+    MemoryLayer top, base;
+    std::shared_ptr<const void> hold;
+
+    bool layered() const { return base.memtree != nullptr; }
+};
 
+// Read access to a finished index, and the trace file it indexes.
+//
+// The const methods of IndexReader, and of IndexNavigator, are safe
+// to call from several threads at once, so one reader can serve all
+// the threads of a parallel analysis. The index file itself is only
+// ever read, so any number of readers in any number of processes can
+// share it.
 class IndexReader {
     const std::string index_filename;
     const std::string tarmac_filename;
+    const std::string cpu;
     std::shared_ptr<Arena> arena;
-    mutable std::ifstream tarmac;
-    bool bigend, thumbonly, aarch64_used;
+    PositionedFile tarmac;
+    bool bigend, thumbonly, aarch64_used, memory_deltas, lazy_memory;
     unsigned max_sve_bits;
 
+    // The LoopRun records of an index with folded loops
+    OFF_T loop_table;
+    unsigned nloop_runs;
+
+    // The table of sampled line positions (see FileHeader::line_offsets)
+    OFF_T line_table;
+    LineNo line_table_first, line_table_size;
+
+    bool loop_run_node(const SeqOrderPayload &run_node, const LoopRun &run,
+                       const std::string &text,
+                       const std::vector<size_t> &starts, LineNo offset,
+                       SeqOrderPayload *out) const;
+
+    // The shards of a sharded index, in trace order, each with trees
+    // that read its data through a view of the index file
+    struct Shard {
+        OFF_T base, base_memroot;
+        LineNo first_line;
+        ArenaView arena;
+        AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
+        SelectableTree<MemorySubPayload> memsubtree;
+
+        Shard(Arena &file, const IndexShard &rec, TreeType memsubtree_type);
+    };
+    std::vector<std::unique_ptr<Shard>> shards;
+
     std::string read_tarmac(OFF_T pos, OFF_T len) const;
 
+    // Up to 'len' bytes of the trace file from 'pos', straight from
+    // the mapping of it if possible, or else read into 'buf'. Only
+    // short at the end of the file.
+    StringRef trace_text(OFF_T pos, size_t len, std::string &buf) const;
+
+    // Advance 'pos' from the start of one line of the trace file to
+    // the start of the line 'n' lines later, which must begin before
+    // 'limit'. Returns false if there isn't one.
+    bool skip_trace_lines(OFF_T &pos, LineNo n, OFF_T limit) const;
+
+    // The line of the trace file starting at 'pos', without its line
+    // ending, and going no further than 'limit'
+    std::string trace_line_at(OFF_T pos, OFF_T limit) const;
+
+    // Memory states reconstructed from delta records, in a private
+    // arena in RAM. Each is a tree of just the memory written since
+    // its snapshot, read as a layer over the snapshot's own tree in
+    // the index, and they're indexed by the offset of their delta
+    // records.
+    //
+    // A cache is lent to one MemoryState at a time, through its
+    // 'hold', since the state is read after memory_state() returns.
+    // When the state is dropped, the cache goes back to a pool to be
+    // lent out again, and the pool only keeps a few of them, so there
+    // are never many more caches than states in use.
+    struct ReplayCache {
+        std::unique_ptr<MemArena> arena;
+        std::unique_ptr<AVLDisk<MemoryPayload, MemoryAnnotation>> memtree;
+        std::unordered_map<OFF_T, OFF_T> roots;
+    };
+    struct ReplayPool {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ReplayCache>> idle;
+    };
+    std::shared_ptr<ReplayPool> replay_pool;
+
+    std::shared_ptr<ReplayCache> lend_replay_cache() const;
+    OFF_T replay_memory_deltas(ReplayCache &cache, OFF_T record) const;
+
+    // The memory trees of the regions of a lazy index (see
+    // hasLazyMemory()) that have been rebuilt, each in a private arena
+    // on top of the index, indexed by the offset of the region record.
+    // A region is never changed once it's built, and the roots of its
+    // nodes' trees are indexed by the offsets of their slots.
+    struct LazyRegion {
+        std::shared_ptr<OverlayArena> arena;
+        std::unique_ptr<AVLDisk<MemoryPayload, MemoryAnnotation>> memtree;
+        std::unique_ptr<SelectableTree<MemorySubPayload>> memsubtree;
+        std::unordered_map<OFF_T, OFF_T> roots;
+    };
+    mutable std::mutex lazy_mutex;
+    mutable std::unordered_map<OFF_T, std::shared_ptr<const LazyRegion>>
+        lazy_regions;
+    mutable size_t lazy_regions_size = 0;
+
+    std::shared_ptr<const LazyRegion> lazy_memory_region(OFF_T region) const;
+    std::shared_ptr<const LazyRegion>
+    build_lazy_memory_region(OFF_T region) const;
+
   public:
     AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
-    AVLDisk<MemorySubPayload> memsubtree;
+    SelectableTree<MemorySubPayload> memsubtree;
     AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree;
-    AVLDisk<ByPCPayload> bypctree;
-    OFF_T seqroot, bypcroot;
-    unsigned lineno_offset;
+    BTreeDisk<SeqOrderPayload> seqbtree;
+    SelectableTree<ByPCPayload> bypctree;
+    OFF_T seqroot, seqbtreeroot, bypcroot;
+    LineNo lineno_offset;
 
     IndexReader(const TracePair &trace);
 
+    // Lookups in seqtree, behaving like the AVLDisk functions of the
+    // same names. If the index has a B+-tree copy of seqtree (see
+    // FileHeader::seqtree_type), they search that instead.
+    template <class PayloadComparable>
+    bool seq_find(const PayloadComparable &keyfinder,
+                  SeqOrderPayload *out) const
+    {
+        return seqbtreeroot
+                   ? seqbtree.find(seqbtreeroot, keyfinder, out, nullptr)
+                   : seqtree.find(seqroot, keyfinder, out, nullptr);
+    }
+    template <class PayloadComparable>
+    bool seq_find_rightmost(const PayloadComparable &keyfinder,
+                            SeqOrderPayload *out) const
+    {
+        return seqbtreeroot ? seqbtree.find_rightmost(seqbtreeroot, keyfinder,
+                                                      out, nullptr)
+                            : seqtree.find_rightmost(seqroot, keyfinder, out,
+                                                     nullptr);
+    }
+    template <class PayloadComparable>
+    bool seq_succ(const PayloadComparable &keyfinder,
+                  SeqOrderPayload *out) const
+    {
+        return seqbtreeroot
+                   ? seqbtree.succ(seqbtreeroot, keyfinder, out, nullptr)
+                   : seqtree.succ(seqroot, keyfinder, out, nullptr);
+    }
+    template <class PayloadComparable>
+    bool seq_pred(const PayloadComparable &keyfinder,
+                  SeqOrderPayload *out) const
+    {
+        return seqbtreeroot
+                   ? seqbtree.pred(seqbtreeroot, keyfinder, out, nullptr)
+                   : seqtree.pred(seqroot, keyfinder, out, nullptr);
+    }
+
     const void *index_offset(OFF_T pos) const
     {
         return arena->getptr<char>(pos);
@@ -100,18 +364,71 @@ class IndexReader {
 
     OFF_T index_subtree_root(OFF_T pos) const
     {
-        return *arena->getptr<diskint<OFF_T>>(pos);
+        return *arena->getptr<diskoff>(pos);
     }
 
+    // Translate the memory_root field of a seqtree node into the
+    // memory trees and roots that describe it. Usually that's just
+    // 'memtree' and the same offset, but if the index stores memory as
+    // deltas from periodic snapshots, the tree might have to be
+    // reconstructed, and in a sharded index it's in two layers.
+    MemoryState memory_state(OFF_T memory_root) const;
+
+    // The text of a folded loop run node, split into lines, kept by a
+    // caller that expands the same run repeatedly
+    struct LoopRunText {
+        LineNo first_line = 0; // of the run node, or 0 if none yet
+        std::string text;
+        std::vector<size_t> starts;
+    };
+
+    // If 'node' is a seqtree node standing for a folded run of loop
+    // iterations (see FLAG_LOOP_RUNS), replace it with the node it
+    // would have been without folding that contains 'line', or that
+    // is the last one at or before time 't'. Otherwise leave it alone
+    // and return false.
+    bool expand_loop_run(SeqOrderPayload &node, LineNo line,
+                         LoopRunText *cache = nullptr) const;
+    bool expand_loop_run_at_time(SeqOrderPayload &node, Time t) const;
+
+    // The LoopRun record for the seqtree node starting at the given
+    // line, or nullptr if it isn't a folded loop run
+    const LoopRun *find_loop_run(LineNo first_line) const;
+
     std::vector<std::string> get_trace_lines(const SeqOrderPayload &node) const;
+
+    // The same lines, without copying them: each one refers straight
+    // into the read-only mapping of the trace file, so it stays valid
+    // as long as the IndexReader. 'out' is cleared first, so reusing
+    // one vector for many nodes needs no allocation per line. If this
+    // node's part of the trace isn't mapped, it's read into 'buf'
+    // instead, and the lines only last until 'buf' is next changed.
+    void get_trace_line_refs(const SeqOrderPayload &node,
+                             std::vector<StringRef> &out,
+                             std::string &buf) const;
     std::string get_trace_line(const SeqOrderPayload &node, unsigned lineno) const;
 
+    // Position in the trace file of the start of a line, numbered like
+    // trace_file_firstline, found from the table of sampled line
+    // positions without a seqtree lookup. Returns false if the table
+    // doesn't cover that line.
+    bool line_position(LineNo line, OFF_T &pos) const;
+
+    // The text of a line found in the same way, or false if it can't be
+    bool get_line_text(LineNo line, std::string &out) const;
+
     const std::string &get_index_filename() const { return index_filename; }
     const std::string &get_tarmac_filename() const { return tarmac_filename; }
 
     bool isBigEndian() const { return bigend; }
     bool isAArch64() const { return aarch64_used; }
     bool isThumbOnly() const { return thumbonly; }
+    bool hasMemoryDeltas() const { return memory_deltas; }
+    bool hasLazyMemory() const { return lazy_memory; }
+    unsigned nLoopRuns() const { return nloop_runs; }
+    LineNo nLineOffsets() const { return line_table_size; }
+    unsigned nShards() const { return shards.size(); }
+    const std::string &cpuView() const { return cpu; }
     unsigned maxSVEBits() const { return max_sve_bits; }
     ParseParams parseParams() const;
 };
@@ -164,15 +481,36 @@ class IndexNavigator {
     // Read the system's raw memory representation at a given time.
     // Return value is the line number of the latest trace event that
     // wrote any part of that data.
-    unsigned getmem(OFF_T memroot, char type, Addr addr, size_t size,
-                    void *outdata, unsigned char *outdef) const;
+    LineNo getmem(OFF_T memroot, char type, Addr addr, size_t size,
+                  void *outdata, unsigned char *outdef) const;
 
     // Read the raw memory representation, and last-update indication,
     // of the first defined subregion of the specified region. Returns
     // false if no such subregion exists.
     bool getmem_next(OFF_T memroot, char type, Addr addr, size_t size,
                      const void **outdata, Addr *outaddr, size_t *outsize,
-                     unsigned *outline) const;
+                     LineNo *outline) const;
+
+    // Pass every defined subregion of the specified region, in
+    // order, to a visitor, with the same information getmem_next
+    // returns. This is quicker than calling getmem_next repeatedly,
+    // since the memory tree is walked only once.
+    using MemVisitor = std::function<void(const void *data, Addr addr,
+                                          size_t size, LineNo line)>;
+    void visit_mem(OFF_T memroot, char type, Addr addr, size_t size,
+                   const MemVisitor &visitor) const;
+
+    // Find every region of registers and memory in a memory state
+    // whose last modification was at or after 'minline', in order of
+    // type and address, with its contents. Memory last written with
+    // contents the trace didn't show is only listed where later reads
+    // have shown them. Pass 'type' as 'r' or 'm'
+    // to find only registers or only memory. This is one walk of the
+    // memory tree that skips every subtree with nothing so recent in
+    // it, so it's much quicker than calling find_next_mod over and
+    // over to find the same thing.
+    std::vector<MemoryChange> changes_since(OFF_T memroot, LineNo minline,
+                                            char type = 0) const;
 
     // Read the iflags at a given time.
     unsigned get_iflags(OFF_T memroot) const;
@@ -188,11 +526,17 @@ class IndexNavigator {
                                             const RegisterId &reg) const;
 
     bool node_at_time(Time t, SeqOrderPayload *node) const;
-    bool node_at_line(unsigned line, SeqOrderPayload *node) const;
+    bool node_at_line(LineNo line, SeqOrderPayload *node) const;
     bool get_previous_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool get_next_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool find_buffer_limit(bool end, SeqOrderPayload *node) const;
-    bool find_next_mod(OFF_T memroot, char type, Addr addr, unsigned minline,
+
+    // Find the first line after 'line' (if sign > 0), or the last line
+    // before it (if sign < 0), at which an instruction at 'pc' was
+    // executed, using the by-PC tree. Visits inside a folded loop run
+    // are found too, though the tree only records the first of them.
+    bool find_pc_visit(Addr pc, LineNo line, int sign, LineNo *out) const;
+    bool find_next_mod(OFF_T memroot, char type, Addr addr, LineNo minline,
                        int sign, Addr &lo, Addr &hi) const;
 
     // Do a raw lookup in the layered range tree that indexes
@@ -203,19 +547,19 @@ class IndexNavigator {
     // [mindepth_i,maxdepth_i), and return the number of lines
     // preceding that one whose call depth are in the range
     // [mindepth_o,maxdepth_o).
-    unsigned lrt_translate(unsigned line, unsigned mindepth_i,
-                           unsigned maxdepth_i, unsigned mindepth_o,
-                           unsigned maxdepth_o) const;
+    LineNo lrt_translate(LineNo line, unsigned mindepth_i,
+                         unsigned maxdepth_i, unsigned mindepth_o,
+                         unsigned maxdepth_o) const;
 
     // The above call assumes the search will succeed. If there's a
     // chance of it being out of range, use this call instead, which
     // returns <true, answer> on success, or <false, 0> if the search
     // fails.
-    std::pair<bool, unsigned> lrt_translate_may_fail(unsigned line,
-                                                     unsigned mindepth_i,
-                                                     unsigned maxdepth_i,
-                                                     unsigned mindepth_o,
-                                                     unsigned maxdepth_o) const;
+    std::pair<bool, LineNo> lrt_translate_may_fail(LineNo line,
+                                                   unsigned mindepth_i,
+                                                   unsigned maxdepth_i,
+                                                   unsigned mindepth_o,
+                                                   unsigned maxdepth_o) const;
 
     // Convenience wrapper to take the difference of two lrt_translate
     // calls.
@@ -224,9 +568,66 @@ class IndexNavigator {
     // range, and E be the (lineend)th one. Then the return value is
     // the number of lines in the range [S,E) whose call depth
     // is in the output range.
-    unsigned lrt_translate_range(unsigned linestart, unsigned lineend,
-                                 unsigned mindepth_i, unsigned maxdepth_i,
-                                 unsigned mindepth_o, unsigned maxdepth_o) const;
+    LineNo lrt_translate_range(LineNo linestart, LineNo lineend,
+                               unsigned mindepth_i, unsigned maxdepth_i,
+                               unsigned mindepth_o, unsigned maxdepth_o) const;
+
+    // Find the first node at or after a given line of the trace whose
+    // call depth is in the range [mindepth,maxdepth), using the
+    // layered range tree to skip over the nodes outside the range
+    // without visiting them.
+    bool next_node_at_depth(LineNo line, unsigned mindepth, unsigned maxdepth,
+                            SeqOrderPayload *node) const;
+};
+
+// A position in the trace, for stepping through it one seqtree node at
+// a time. It keeps its path down the seqtree, so each step takes
+// amortised constant time, instead of the fresh search from the root
+// done by get_next_node and get_previous_node. Folded loop runs are
+// expanded into the nodes they stand for, as IndexNavigator does.
+class SeqCursor {
+    const IndexNavigator &nav;
+    AVLDisk<SeqOrderPayload, SeqOrderAnnotation>::Cursor cursor;
+    SeqOrderPayload current;
+    IndexReader::LoopRunText run_text;
+
+    bool settle(LineNo line);
+
+  public:
+    SeqCursor(const IndexNavigator &nav);
+
+    // False if the last seek or step found nothing
+    bool valid() const { return cursor.valid(); }
+    const SeqOrderPayload &node() const { return current; }
+
+    // Move to the node containing a line, the node at a time (as
+    // IndexNavigator::node_at_time), or the first or last node
+    bool seek_line(LineNo line);
+    bool seek_time(Time t);
+    bool seek_limit(bool end);
+
+    bool next();
+    bool prev();
+};
+
+// Steps through the seqtree nodes whose call depth is in the range
+// [mindepth,maxdepth), using next_node_at_depth. Each step costs
+// O(log n) however many nodes it skips, so it can pass over a whole
+// call to a deeper function, or everything between two returns to a
+// shallower one, without reading any of it.
+class DepthScan {
+    const IndexNavigator &nav;
+    unsigned mindepth, maxdepth;
+    SeqOrderPayload current;
+    bool found;
+
+  public:
+    DepthScan(const IndexNavigator &nav, unsigned mindepth, unsigned maxdepth,
+              LineNo line = 1);
+
+    bool valid() const { return found; }
+    const SeqOrderPayload &node() const { return current; }
+    bool next();
 };
 
 #endif // LIBTARMAC_INDEX_HH
@@ -89,6 +89,22 @@ memory and registers at every point in the trace, for example: there's
 a tree root for every observable instant, and each one shares nearly
 all its nodes with its predecessor.
 
+Encoding
+~~~~~~~~
+
+Every integer field in the index is a ``diskint``, stored in the byte
+order of the host that generated the index (recorded in the file
+header, so that an index from a host of the other endianness is
+detected and regenerated, or converted by ``tarmac-indextool
+--convert-byte-order``), and in as few bytes as its range needs. In
+particular, file offsets (both links between tree nodes, and positions
+in the trace file) are stored in 48 bits as a ``diskoff``, and the
+tree node headers omit the reference count used by the copy-on-write
+mode of ``AVLDisk``, since the persistent trees that make up an index
+never use it. Changing any of these widths changes the index format,
+so it must be accompanied by a change to the version in the magic
+number.
+
 The sequential-order tree
 ~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -238,6 +254,110 @@ don't have to worry about the fact that it shares a lot of its nodes
 with the trees before and after it. That's just a space-saving
 optimisation.
 
+Alternatively, an index can be built (with ``--snapshot-interval``) so
+that only every Kth event has a full ``memtree`` of its own. In that
+case the ``memory_root`` field of every ``seqtree`` node points
+instead to a *memory delta record*, which gives the root of the most
+recent full tree (the 'snapshot'), a link to the previous event's
+record, and the list of ``memtree`` payloads that this event wrote,
+in order. Between snapshots the indexer modifies its ``memtree`` in
+place rather than copying the path to every changed node, which is
+where the space goes. The state at any event is recovered by starting
+from the snapshot and replaying the payloads of each record since
+then, each one overwriting whatever was previously stored in its
+address range. The header flag ``FLAG_MEMORY_DELTAS`` indicates this
+kind of index; ``IndexReader::memory_state`` hides the difference
+from everything that reads the index.
+
+A third option (``--lazy-memory``) puts off building most of the
+memory trees until they're needed. The indexer again keeps its
+``memtree`` up to date in place, committing a full copy only at
+periodic *checkpoints*, and each checkpoint starts a *lazy memory
+region* covering the ``seqtree`` nodes up to the next one. Each
+``seqtree`` node's ``memory_root`` points to a small *slot*, giving
+its region and the root of its own memory tree, which is 0 at first
+for everything except the checkpoint nodes. The index file itself is
+never changed once it's made: it stays mapped read-only, and the
+slots of the other nodes keep their 0. The first time a memory state
+inside a region is wanted, the reader re-parses the trace lines of the
+region starting from the checkpoint state, and builds a memory tree
+for every node of the region in a private ``OverlayArena`` layered on
+top of the index, remembering each node's root by the offset of its
+slot. Memory sub-trees made during indexing were filled in with
+hindsight by later memory reads, so the region records the ones its
+nodes made, in order; the rebuild links in those same sub-trees
+rather than making new empty ones, and ignores the memory reads it
+sees (``fill_memtree_from_read`` does nothing while replaying), since
+they're already accounted for. The reader keeps the rebuilt regions,
+up to a size limit. The header flag ``FLAG_LAZY_MEMORY`` indicates
+this kind of index.
+
+Finally, an index can be built in pieces in parallel (with
+``--index-shards``). The trace is cut at event boundaries into
+*shards*, and each one is indexed separately into a file of its own.
+The indexer for a shard starts reading a little before the shard's own
+first line, to learn the contents of registers and memory, but makes no
+``seqtree`` nodes for those warm-up lines; the memory state at the
+point it starts is unknown, represented (as at the start of a whole
+trace) by an empty memory sub-tree covering all of memory, last
+modified at line 0. Once a shard is finished, the memory trees of its
+own part of the trace are rebuilt on their own, without anything from
+the warm-up lines, and those are copied verbatim into the final index
+file, one shard after another, so that every file offset inside a
+shard is relative to the position the shard was copied to. The
+``seqtree`` and ``bypctree`` of the shards are merged into single trees
+in the usual form, with each ``memory_root`` converted to an absolute
+file offset. The memory state of a ``seqtree`` node in a sharded index
+is in two layers: the shard's own ``memtree`` root, and underneath it
+the *base* state left at the end of all the previous shards. Anything
+in the shard's own tree last modified before the shard's first line
+(including the placeholder for unknown memory) is hidden, and the base
+state shows through instead. The base states are ordinary ``memtree``
+roots outside all the shards, built while the shards are stitched
+together; the memory that a shard found out about by reading it is
+added to the base states' sub-trees at the same time. The header flag
+``FLAG_SHARDED`` indicates this kind of index, and the header points to
+an array of ``IndexShard`` records giving the location, first line and
+base state of each shard.
+
+A trace from several CPUs at once can be indexed with a separate view
+of each CPU (with ``--per-cpu``). Each view is a complete index of the
+whole trace in its own right, except that the instruction and register
+events of the other CPUs are ignored, so its registers, PC and call
+depth follow that one CPU. Memory is shared, so every view sees every
+CPU's memory accesses. A ``seqtree`` node never mixes lines of its own
+CPU with lines of the others, and the nodes made of other CPUs' lines
+have no PC. All the views are built in a single pass over the trace
+file, each by its own thread, into separate files, which are then
+copied into the final index file as they stand. The header flag
+``FLAG_PER_CPU`` indicates this kind of index: none of the usual trees
+are in the outer file at all, and the header points to an array of
+``IndexCPUView`` records giving the name and location of each view.
+
+An index can also fold up loops that spin without changing anything
+(with ``--compress-loops``), such as a firmware polling loop or an
+idle loop around ``WFI``. The indexer watches for a sequence of
+``seqtree`` nodes that repeats the one just before it, node for node,
+with the same PC and number of trace lines, and with no change to
+registers, memory or the call-matching state (writing the value that
+was already there doesn't count as a change). After one such
+repetition, later repetitions of the same sequence are not given
+nodes of their own: each run of them becomes a single ``seqtree`` node
+covering all their lines, with the PC, time and memory state of the
+first of them. The last repetition stored in full is the *body* of the
+loop. Since nothing changes, every node inside the run is given the
+same memory state, and the reader can reconstruct any of them on
+demand from the matching node of the body and the lines of the trace
+inside the run. (So writes of unchanged values inside the run aren't
+recorded; those made by the body, and by the nodes after the run,
+are.) The header flag ``FLAG_LOOP_RUNS`` indicates this kind of index,
+and the header points to an array of ``LoopRun`` records, in trace
+order, identifying the run nodes and their bodies. The ``bypctree``
+has an entry for the first visit inside each run to each PC of the
+body, but not for the rest: each of those is a whole number of
+iterations later, and ``IndexNavigator::find_pc_visit`` works them out
+from the entry and the ``LoopRun`` record.
+
 Registers and memory are stored in the same tree, by pretending that
 registers occupy a small address space of their own. So the sorting
 key for ``memtree`` is a tuple (address-space identifier, address),
@@ -389,22 +509,122 @@ struct MagicNumber {
     bool check();
 };
 
+/* ----------------------------------------------------------------------
+ * Width of a trace line number, or a count of lines, as stored inside
+ * the index. 40 bits allows traces of about 10^12 lines, at the cost
+ * of one byte more than an unsigned in each place it appears.
+ */
+using diskline = diskint<LineNo, 5>;
+
 /* ----------------------------------------------------------------------
  * File header that lives immediately after the magic number,
  * containing the roots of other trees.
  */
 
+#define BYTE_ORDER_BIG 'B'
+#define BYTE_ORDER_LITTLE 'L'
+#define BYTE_ORDER_HOST (HOST_BIG_ENDIAN ? BYTE_ORDER_BIG : BYTE_ORDER_LITTLE)
+
 struct FileHeader {
+    // Byte order of every diskint in the file: BYTE_ORDER_BIG or
+    // BYTE_ORDER_LITTLE. This is a single byte, so that it can be
+    // checked before reading anything else.
+    char byte_order;
+
+    // Implementation of the memory subtrees and the PC tree, as a
+    // TreeType value (see btree.hh). The memory trees are always AVL.
+    char memsubtree_type;
+    char bypctree_type;
+
+    // If this is TreeType::BTree, seqbtreeroot is the root of a
+    // B+-tree holding a copy of every seqtree payload, which lookups by
+    // line or time use instead of seqtree. seqtree itself is still an
+    // AVL tree, for the searches and walks that need its annotations.
+    char seqtree_type;
+
     diskint<unsigned> flags; // see flag definitions below
-    diskint<OFF_T> seqroot;  // root of the sequential order tree
-    diskint<OFF_T> bypcroot; // root of the PC tree
+    diskoff seqroot;         // root of the sequential order tree
+    diskoff bypcroot;        // root of the PC tree
+    diskoff seqbtreeroot;    // see seqtree_type
 
     // If the actual Tarmac data starts somewhere other than line 1 of
     // the file (e.g. because of an initial header line), this stores
     // the offset, for adjusting line numbers shown during browsing.
-    diskint<unsigned> lineno_offset;
+    diskline lineno_offset;
+
+    // With FLAG_SHARDED, an array of IndexShard records, one for each
+    // piece of the index that was built separately
+    diskoff shards;
+    diskint<unsigned> nshards;
+
+    // With FLAG_PER_CPU, an array of IndexCPUView records, one for
+    // each CPU in the trace
+    diskoff cpu_views;
+    diskint<unsigned> ncpu_views;
+
+    // With FLAG_LOOP_RUNS, an array of LoopRun records, in order of
+    // first line
+    diskoff loop_runs;
+    diskint<unsigned> nloop_runs;
+
+    // Table of nline_offsets diskoffs giving the position in the trace
+    // file of every LINE_OFFSET_INTERVAL'th line that was indexed.
+    // Entry i is the start of physical line (line_offsets_first + i) *
+    // LINE_OFFSET_INTERVAL + 1, counting the first line of the file as
+    // line 1 (that is, not adjusted by lineno_offset). The table is
+    // stored in chunks of LINE_OFFSET_CHUNK entries, written as the
+    // indexer reads the trace, so this field points to an array of
+    // diskoffs giving the position of each chunk; entry i is entry (i %
+    // LINE_OFFSET_CHUNK) of chunk (i / LINE_OFFSET_CHUNK).
+    diskoff line_offsets;
+    diskline line_offsets_first;
+    diskline nline_offsets;
+
+    // The part of the trace that was indexed, as given by
+    // IndexerParams::window_start_line and friends, so that an index
+    // of one part of a trace is never taken for an index of another
+    diskint<LineNo> window_start_line, window_end_line;
+    diskint<Time> window_start_time, window_end_time;
+
+    // Likewise, a hash of the address ranges that were left out (see
+    // IndexerParams::exclude_pcs and exclude_data)
+    diskint<uint64_t> exclusions_hash;
+
+    void byteswap()
+    {
+        byte_order = (byte_order == BYTE_ORDER_BIG ? BYTE_ORDER_LITTLE
+                                                   : BYTE_ORDER_BIG);
+        flags.byteswap();
+        seqroot.byteswap();
+        bypcroot.byteswap();
+        seqbtreeroot.byteswap();
+        lineno_offset.byteswap();
+        shards.byteswap();
+        nshards.byteswap();
+        cpu_views.byteswap();
+        ncpu_views.byteswap();
+        loop_runs.byteswap();
+        nloop_runs.byteswap();
+        line_offsets.byteswap();
+        line_offsets_first.byteswap();
+        nline_offsets.byteswap();
+        window_start_line.byteswap();
+        window_end_line.byteswap();
+        window_start_time.byteswap();
+        window_end_time.byteswap();
+        exclusions_hash.byteswap();
+    }
 };
 
+// Spacing between the lines whose positions are kept in the table at
+// FileHeader::line_offsets. Any other line is found by scanning forward
+// from the one before it in the table, so this bounds that scan.
+#define LINE_OFFSET_INTERVAL 64
+
+// Number of entries in each chunk of the table at
+// FileHeader::line_offsets. The last chunk may be partly unused.
+#define LINE_OFFSET_CHUNK 4096
+
 // Flag definitions for FileHeader::flags
 #define FLAG_BIGEND 0x00000001U // trace was believed big-endian at index time
 #define FLAG_AARCH64_USED 0x00000002U // trace includes AArch64 execution state
@@ -418,6 +638,17 @@ struct FileHeader {
 #define FLAG_SVELEN_MASK 0x000000F0U
 #define FLAG_SVELEN_UNIT 0x00000010U
 
+// seqtree nodes point to memory delta records, not memory tree roots
+#define FLAG_MEMORY_DELTAS 0x00000100U
+// seqtree nodes point to LazyMemorySlot records, not memory tree roots
+#define FLAG_LAZY_MEMORY 0x00000200U
+// seqtree memory roots lie inside shards, layered on a base state
+#define FLAG_SHARDED 0x00000400U
+// file contains a separate index of each CPU, and no trees of its own
+#define FLAG_PER_CPU 0x00000800U
+// some seqtree nodes stand for many iterations of a loop (see LoopRun)
+#define FLAG_LOOP_RUNS 0x00001000U
+
 /* ----------------------------------------------------------------------
  * Payload and annotation formats for the top-level sequential order tree
  */
@@ -426,16 +657,37 @@ struct SeqOrderPayload {
     diskint<Time> mod_time; // timestamp as given in the trace file
     diskint<Addr> pc;       // PC of this node
 
-    // Locations in the trace file, in both bytes and lines
-    diskint<OFF_T> trace_file_pos, trace_file_len;
-    diskint<unsigned> trace_file_firstline, trace_file_lines;
-
-    // Root of the memory tree representing the state just after this node
-    diskint<OFF_T> memory_root;
+    // Locations in the trace file, in both bytes and lines. A node
+    // usually covers only a few lines. Placeholders for instructions
+    // left out by an indexing filter, and folded runs of a loop (see
+    // LoopRun), can cover many more, but the indexer cuts those into
+    // several nodes well before they get near 4GiB or 2^32 lines, so
+    // the length in bytes is stored in 32 bits.
+    diskoff trace_file_pos;
+    diskint<OFF_T, 4> trace_file_len;
+    diskline trace_file_firstline;
+    diskint<unsigned> trace_file_lines;
+
+    // Root of the memory tree representing the state just after this
+    // node (or, with FLAG_MEMORY_DELTAS, a MemoryDeltaRecord, or with
+    // FLAG_LAZY_MEMORY, a LazyMemorySlot)
+    diskoff memory_root;
 
     // Current depth in the function call hierarchy
     diskint<unsigned> call_depth;
 
+    void byteswap()
+    {
+        mod_time.byteswap();
+        pc.byteswap();
+        trace_file_pos.byteswap();
+        trace_file_len.byteswap();
+        trace_file_firstline.byteswap();
+        trace_file_lines.byteswap();
+        memory_root.byteswap();
+        call_depth.byteswap();
+    }
+
     int cmp(const struct SeqOrderPayload &rhs) const
     {
         if (trace_file_firstline != rhs.trace_file_firstline)
@@ -458,7 +710,7 @@ struct SeqOrderAnnotation {
 
     // Points to an array of CallDepthArrayEntry structures, as
     // defined below
-    diskint<OFF_T> call_depth_array;
+    diskoff call_depth_array;
     diskint<unsigned> call_depth_arraylen;
 
     SeqOrderAnnotation() {}
@@ -466,13 +718,29 @@ struct SeqOrderAnnotation {
     SeqOrderAnnotation(const SeqOrderAnnotation &, const SeqOrderAnnotation &)
     {
     }
+
+    void byteswap()
+    {
+        call_depth_array.byteswap();
+        call_depth_arraylen.byteswap();
+    }
 };
 
 #define SENTINEL_DEPTH (UINT_MAX - 1)
 struct CallDepthArrayEntry {
     diskint<unsigned> call_depth;
-    diskint<unsigned> cumulative_lines, cumulative_insns;
-    diskint<OFF_T> leftlink, rightlink;
+    diskline cumulative_lines, cumulative_insns;
+    // Indices into the child nodes' arrays (not file offsets)
+    diskint<unsigned> leftlink, rightlink;
+
+    void byteswap()
+    {
+        call_depth.byteswap();
+        cumulative_lines.byteswap();
+        cumulative_insns.byteswap();
+        leftlink.byteswap();
+        rightlink.byteswap();
+    }
 };
 
 /* ----------------------------------------------------------------------
@@ -485,17 +753,25 @@ struct MemoryPayload {
     // If 'raw' is true, then 'contents' is the file offset of an
     // actual sequence of raw bytes representing the memory contents
     // described by this node. If 'raw' is false, then 'contents' is
-    // the file offset of a diskint<OFF_T> storing the root of a tree
-    // of MemorySubPayload.
+    // the file offset of a diskoff storing the root of a tree of
+    // MemorySubPayload.
     bool raw;
 
     diskint<Addr> lo, hi; // low and high bytes touched, i.e. inclusive
-    diskint<OFF_T> contents;
+    diskoff contents;
 
     // Identifies (by its trace_file_firstline field, i.e. primary
     // key) the seqtree node in which this piece of memory was last
     // touched
-    diskint<unsigned> trace_file_firstline;
+    diskline trace_file_firstline;
+
+    void byteswap()
+    {
+        lo.byteswap();
+        hi.byteswap();
+        contents.byteswap();
+        trace_file_firstline.byteswap();
+    }
 
     int cmp(const struct MemoryPayload &rhs) const
     {
@@ -513,7 +789,7 @@ struct MemoryAnnotation {
     // Identifies (by its trace_file_firstline field, i.e. primary
     // key) the seqtree node in which any piece of memory within this
     // node's subtree was last touched
-    diskint<unsigned> latest;
+    diskline latest;
 
     MemoryAnnotation() : latest(0) {}
     MemoryAnnotation(const MemoryPayload &p) : latest(p.trace_file_firstline) {}
@@ -521,6 +797,137 @@ struct MemoryAnnotation {
         : latest(std::max(lhs.latest + 1, rhs.latest + 1) - 1)
     {
     }
+
+    void byteswap() { latest.byteswap(); }
+};
+
+/* ----------------------------------------------------------------------
+ * Header of a memory delta record, used in place of a memory tree root
+ * by indexes with FLAG_MEMORY_DELTAS. It's followed in the file by
+ * 'count' MemoryPayload structures, which are the updates made to the
+ * memory tree by this seqtree node, in the order they were made.
+ */
+
+struct MemoryDeltaRecord {
+    diskoff snapshot_root; // last memory tree root stored in full
+    diskoff prev;          // previous node's record, or 0 at a snapshot
+    diskint<unsigned> count;
+
+    void byteswap()
+    {
+        snapshot_root.byteswap();
+        prev.byteswap();
+        count.byteswap();
+    }
+
+    size_t size() const
+    {
+        return sizeof(MemoryDeltaRecord) + count * sizeof(MemoryPayload);
+    }
+};
+
+/* ----------------------------------------------------------------------
+ * Records used by indexes with FLAG_LAZY_MEMORY. Every seqtree node
+ * has a LazyMemorySlot, and every run of nodes starting at a
+ * checkpoint has a LazyMemoryRegion.
+ */
+
+struct LazyMemoryRegion {
+    diskoff checkpoint_root;      // memory tree after the region's first node
+    diskline first_line;          // trace_file_firstline of that node
+    diskint<unsigned> nodes;      // number of seqtree nodes in the region
+
+    // Array of diskoff, giving the memory subtree root words made while
+    // indexing the region (after its first node), in order
+    diskoff subtree_words;
+    diskint<unsigned> nsubtrees;
+
+    void byteswap()
+    {
+        checkpoint_root.byteswap();
+        first_line.byteswap();
+        nodes.byteswap();
+        subtree_words.byteswap();
+        nsubtrees.byteswap();
+    }
+};
+
+struct LazyMemorySlot {
+    diskoff region; // LazyMemoryRegion containing this node
+    diskoff root;   // memory tree root for this node, or 0 if it has to be
+                    // rebuilt from the trace when it's needed
+
+    void byteswap()
+    {
+        region.byteswap();
+        root.byteswap();
+    }
+};
+
+/* ----------------------------------------------------------------------
+ * Record describing one shard of an index with FLAG_SHARDED. File
+ * offsets inside the shard's data (tree links, contents pointers and
+ * so on) are relative to 'base'.
+ */
+
+struct IndexShard {
+    diskoff base;         // file offset where the shard's data starts
+    diskoff size;         // size of the shard's data
+    diskoff base_memroot; // memory tree root for the state before it
+    diskline first_line;  // first line of the shard's own part of the trace
+
+    void byteswap()
+    {
+        base.byteswap();
+        size.byteswap();
+        base_memroot.byteswap();
+        first_line.byteswap();
+    }
+};
+
+/* ----------------------------------------------------------------------
+ * Record describing one CPU's view of an index with FLAG_PER_CPU. The
+ * view is a whole index file (magic number, header and all) copied
+ * into the outer file at 'base', so file offsets inside it are
+ * relative to 'base'.
+ */
+
+struct IndexCPUView {
+    diskoff name; // file offset of the CPU's name, NUL-terminated
+    diskoff base; // file offset where the view starts
+    diskoff size; // size of the view
+
+    void byteswap()
+    {
+        name.byteswap();
+        base.byteswap();
+        size.byteswap();
+    }
+};
+
+/* ----------------------------------------------------------------------
+ * Record describing one seqtree node of an index with FLAG_LOOP_RUNS
+ * that stands for a run of identical iterations of a loop. Each
+ * iteration covers 'period_lines' lines and would have been
+ * 'period_nodes' seqtree nodes, the same as the ordinary nodes starting
+ * at 'body_line'.
+ */
+
+struct LoopRun {
+    diskline first_line;            // trace_file_firstline of the run node
+    diskline body_line;             // first line of the body
+    diskint<unsigned> period_lines; // lines in each iteration
+    diskint<unsigned> period_nodes; // seqtree nodes in each iteration
+    diskint<unsigned> iterations;   // number of iterations in the run
+
+    void byteswap()
+    {
+        first_line.byteswap();
+        body_line.byteswap();
+        period_lines.byteswap();
+        period_nodes.byteswap();
+        iterations.byteswap();
+    }
 };
 
 /* ----------------------------------------------------------------------
@@ -531,7 +938,14 @@ struct MemorySubPayload {
     diskint<Addr> lo, hi; // low and high bytes touched, i.e. inclusive
 
     // This is always just a raw range of bytes in the file
-    diskint<OFF_T> contents;
+    diskoff contents;
+
+    void byteswap()
+    {
+        lo.byteswap();
+        hi.byteswap();
+        contents.byteswap();
+    }
 
     int cmp(const struct MemorySubPayload &rhs) const
     {
@@ -549,7 +963,13 @@ struct MemorySubPayload {
 
 struct ByPCPayload {
     diskint<Addr> pc;
-    diskint<unsigned> trace_file_firstline;
+    diskline trace_file_firstline;
+
+    void byteswap()
+    {
+        pc.byteswap();
+        trace_file_firstline.byteswap();
+    }
 
     int cmp(const struct ByPCPayload &rhs) const
     {
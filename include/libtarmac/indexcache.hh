@@ -0,0 +1,58 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * A shared cache directory of index files, in which each index is
+ * named after a fingerprint of the trace file's contents and the
+ * parameters it was made with, rather than the trace's own name. So
+ * a tool can find an index made from an identical trace anywhere
+ * else, or on another machine, and the trace's location and
+ * timestamps don't matter.
+ */
+
+#ifndef LIBTARMAC_INDEXCACHE_HH
+#define LIBTARMAC_INDEXCACHE_HH
+
+#include "libtarmac/index.hh"
+#include "libtarmac/parser.hh"
+
+#include <stdint.h>
+
+#include <string>
+
+// Default limit on the total size of the index files in a cache
+// directory, beyond which the least recently used are deleted
+constexpr uint64_t INDEX_CACHE_DEFAULT_SIZE = 10ULL << 30;
+
+// Return the name of the file in cache_dir where an index of
+// tarmac_filename with the given parameters is kept. The trace's
+// fingerprint is its size, and a hash of a sample of blocks spread
+// through it, so working it out doesn't mean reading the whole trace.
+std::string index_cache_filename(const std::string &cache_dir,
+                                 const std::string &tarmac_filename,
+                                 const IndexerParams &iparams,
+                                 const ParseParams &pparams);
+
+// Record that an index in the cache has just been used, and delete
+// the least recently used others until the cache is no bigger than
+// max_size bytes (or until only 'index_filename' is left).
+void index_cache_update(const std::string &cache_dir,
+                        const std::string &index_filename,
+                        uint64_t max_size);
+
+#endif // LIBTARMAC_INDEXCACHE_HH
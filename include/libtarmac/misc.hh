@@ -24,6 +24,7 @@
 #include <functional>
 #include <ostream>
 #include <stdio.h>
+#include <streambuf>
 #include <string>
 #include <time.h>
 #include <vector>
@@ -33,12 +34,34 @@ template <typename T, size_t n> static inline void enforce_array(T (&)[n]) {}
 
 typedef unsigned long long Time;
 typedef unsigned long long Addr;
+typedef unsigned long long LineNo; // line number in a trace file
 
 template <typename value> inline value absdiff(value a, value b)
 {
     return a < b ? b - a : a - b;
 }
 
+// 64-bit FNV-1a hash, for fingerprinting things without storing them
+struct FNVHash {
+    uint64_t value = 14695981039346656037ULL;
+
+    void add(const void *vdata, size_t size)
+    {
+        const unsigned char *data = (const unsigned char *)vdata;
+        for (size_t i = 0; i < size; i++)
+            value = (value ^ data[i]) * 1099511628211ULL;
+    }
+
+    // Add an integer, in the same byte order on every host
+    void add(uint64_t n)
+    {
+        for (unsigned i = 0; i < 8; i++) {
+            unsigned char byte = n >> (8 * i);
+            add(&byte, 1);
+        }
+    }
+};
+
 // Force a string to exactly the given length, padding it with
 // 'padvalue' if it's too short.
 std::string rpad(const std::string &s, size_t len, char padvalue = ' ');
@@ -85,6 +108,150 @@ template <class Payload> class Infinity {
 bool get_file_timestamp(const std::string &filename, uint64_t *out_timestamp);
 bool is_interactive();
 std::string get_error_message();
+// Ask the OS to discard any cached pages of a file, so that the next
+// access to it comes from disk. Returns false if this isn't supported.
+bool evict_file_from_cache(const std::string &filename);
+bool get_file_size(const std::string &filename, uint64_t *out_size);
+// Set a file's modification time to now
+bool touch_file(const std::string &filename);
+// Create a directory, succeeding if it already exists
+bool make_directory(const std::string &dirname);
+// List the names of the files in a directory, without the directory
+// name itself
+bool list_directory(const std::string &dirname,
+                    std::vector<std::string> &out);
+
+// Stream buffer for reading a large file once from start to end, such
+// as a trace file being indexed, without pushing everything else out
+// of the OS's page cache. The OS is told the file will be read
+// sequentially, so that it reads ahead. With 'drop_behind', it's also
+// told to discard each part of the file from its cache once that part
+// has been read, and with 'direct', the file is read bypassing the
+// cache altogether, where the platform and file system allow. Seeking
+// is supported, but only to support starting part way through.
+class SequentialFileBuf : public std::streambuf {
+    struct PlatformData;
+    PlatformData *pdata;
+
+    bool drop_behind, direct;
+    std::vector<char> storage;
+    char *buffer;         // aligned start of 'storage'
+    uint64_t buffer_pos;  // file offset of 'buffer'
+    uint64_t read_pos;    // file offset of the next read
+    uint64_t dropped_to;  // file offset up to which the cache is dropped
+
+    // Per-platform parts. read_at returns the number of bytes read
+    // into 'buffer', which can only be short at the end of the file.
+    bool open_file(const std::string &filename);
+    void close_file();
+    size_t read_at(uint64_t offset, size_t size);
+    uint64_t file_size();
+    void drop_cached(uint64_t from, uint64_t to);
+
+  protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+  public:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+    static constexpr size_t ALIGNMENT = 4096;
+
+    SequentialFileBuf(const std::string &filename, bool drop_behind = false,
+                      bool direct = false);
+    ~SequentialFileBuf();
+    SequentialFileBuf(const SequentialFileBuf &) = delete;
+    SequentialFileBuf &operator=(const SequentialFileBuf &) = delete;
+
+    bool is_open() const { return pdata != nullptr; }
+};
+
+// Non-owning reference to a run of characters stored elsewhere, in
+// the manner of C++17's std::string_view, so that pieces of a large
+// buffer can be handed around without copying them.
+class StringRef {
+    const char *ptr;
+    size_t len;
+
+  public:
+    StringRef() : ptr(nullptr), len(0) {}
+    StringRef(const char *ptr, size_t len) : ptr(ptr), len(len) {}
+    StringRef(const std::string &s) : ptr(s.data()), len(s.size()) {}
+
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const char *begin() const { return ptr; }
+    const char *end() const { return ptr + len; }
+    char operator[](size_t i) const { return ptr[i]; }
+
+    std::string str() const { return std::string(ptr, len); }
+};
+
+inline std::ostream &operator<<(std::ostream &os, StringRef s)
+{
+    return os.write(s.data(), s.size());
+}
+
+// Read-only file accessed by offset, with no current position to
+// seek, so that several threads can read from it at once. Where the
+// platform allows, the file as it was when opened is also mapped into
+// memory, so that its contents can be used in place by mapped().
+// read() always reads the file itself, so it sees a short read rather
+// than a fault if the file has been truncated since it was mapped.
+class PositionedFile {
+    struct PlatformData;
+    PlatformData *pdata;
+    const char *map_data;
+    uint64_t map_size;
+
+  public:
+    PositionedFile(const std::string &filename);
+    ~PositionedFile();
+    PositionedFile(const PositionedFile &) = delete;
+    PositionedFile &operator=(const PositionedFile &) = delete;
+
+    bool is_open() const { return pdata != nullptr; }
+
+    // Read up to 'size' bytes from 'offset' into 'buf', returning the
+    // number read, which is only short at the end of the file.
+    size_t read(uint64_t offset, void *buf, size_t size) const;
+
+    // Pointer to the 'size' bytes at 'offset' in the mapping of the
+    // file, or nullptr if they aren't all mapped.
+    const char *mapped(uint64_t offset, size_t size) const
+    {
+        if (!map_data || offset > map_size || size > map_size - offset)
+            return nullptr;
+        return map_data + offset;
+    }
+};
+
+// Listening end of a stream socket named by a path in the file system
+// (a Unix-domain socket), for serving requests from other processes on
+// the same machine. An existing socket at the path (say, left behind by
+// a server that was killed) is replaced, but any other kind of file
+// there is a fatal error. Not every platform supports these; where one
+// doesn't, constructing this is a fatal error. Writing to a client that
+// has gone away fails with an error rather than raising SIGPIPE.
+class LocalSocketServer {
+    struct PlatformData;
+    PlatformData *pdata;
+
+  public:
+    LocalSocketServer(const std::string &path);
+    ~LocalSocketServer();
+    LocalSocketServer(const LocalSocketServer &) = delete;
+    LocalSocketServer &operator=(const LocalSocketServer &) = delete;
+
+    // Wait for a client to connect, and return a stream reading from
+    // it and one writing to it, both of which the caller must fclose.
+    // Errors affecting only one connection, or that clear up once other
+    // clients disconnect (such as running out of file descriptors), are
+    // waited out. Returns false if the listening socket itself failed.
+    bool accept(FILE *&in, FILE *&out);
+};
 
 FILE *fopen_wrapper(const char *filename, const char *mode);
 struct tm localtime_wrapper(time_t t);
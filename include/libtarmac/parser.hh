@@ -24,10 +24,18 @@
 
 #include <cstdint>
 #include <exception>
+#include <string>
 #include <vector>
 
 struct TarmacEvent {
     Time time;
+
+    // Trace source identifier (e.g. "cpu0") named on the event's line,
+    // as a number the parser gives each source it sees, or 0 if the
+    // line named none. TarmacLineParser::source_name turns it back
+    // into the name.
+    unsigned source = 0;
+
     TarmacEvent(Time time) : time(time) {}
     TarmacEvent() = default;
     TarmacEvent(const TarmacEvent &) = default;
@@ -164,7 +172,8 @@ class TarmacLineParser {
   public:
     TarmacLineParser(const ParseParams &params, ParseReceiver &);
     ~TarmacLineParser();
-    void parse(const std::string &s) const;
+    void parse(StringRef s) const;
+    const std::string &source_name(unsigned source) const;
 };
 
 #endif // LIBTARMAC_PARSER_HH
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_QUERY_HH
+#define LIBTARMAC_QUERY_HH
+
+#include "libtarmac/calltree.hh"
+#include "libtarmac/index.hh"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Queries about a trace, for tools that answer many of them against
+ * one open index, such as tarmac-serve and tarmac-query. Each query is
+ * a line of JSON, holding a flat object such as
+ *
+ *   {"id": 1, "op": "reg", "line": 1234, "reg": "x0"}
+ *
+ * and is answered with another line of JSON, repeating the "id" of the
+ * query if it had one.
+ */
+
+// Largest memory read a single query can ask for
+static const uint64_t MAX_QUERY_MEM_SIZE = 65536;
+
+// Longest query line a server will read from a client, well beyond
+// anything a real query needs
+static const size_t MAX_QUERY_LENGTH = 4 * MAX_QUERY_MEM_SIZE;
+
+struct QueryError {
+    std::string msg;
+    QueryError(const std::string &msg) : msg(msg) {}
+};
+
+// A query parsed from its JSON. Only a flat object is accepted, whose
+// values are strings, numbers, booleans or null; each value is kept as
+// the contents of a string, or the text of anything else.
+class QueryRequest {
+    std::map<std::string, std::string> fields;
+    std::string id; // JSON text of the "id" field, if there was one
+
+  public:
+    // Throws QueryError if the JSON isn't of the accepted form
+    QueryRequest(const std::string &json);
+
+    const std::string &id_json() const { return id; }
+
+    bool has(const std::string &key) const { return fields.count(key); }
+
+    // Fetch a field, throwing QueryError if it's missing. A number can
+    // be given in decimal, or in hex with a leading 0x, and either as a
+    // JSON number or a string.
+    const std::string &get_string(const std::string &key) const;
+    uint64_t get_number(const std::string &key) const;
+    uint64_t get_number(const std::string &key, uint64_t dflt) const
+    {
+        return has(key) ? get_number(key) : dflt;
+    }
+};
+
+// Builder for a JSON object, used for the answers to queries and the
+// objects inside them.
+class QueryResponse {
+    std::ostringstream os;
+    bool empty = true;
+
+    void key(const std::string &k);
+
+  public:
+    QueryResponse &field(const std::string &k, const std::string &value);
+    QueryResponse &field(const std::string &k, const char *value)
+    {
+        return field(k, std::string(value));
+    }
+    QueryResponse &field(const std::string &k, unsigned long long value);
+    QueryResponse &field(const std::string &k, bool value);
+    QueryResponse &null_field(const std::string &k);
+
+    // Add a field whose value is already JSON, such as another object
+    QueryResponse &raw_field(const std::string &k, const std::string &json);
+    QueryResponse &array_field(const std::string &k,
+                               const std::vector<std::string> &jsons);
+
+    std::string str() const;
+};
+
+std::string json_quote(const std::string &s);
+
+// Answers queries about one trace. answer() can be called from several
+// threads at once.
+//
+// The operations are:
+//
+//  - "node", given a "line" or "time": the seqtree node there
+//  - "text", given a "line": that line of the trace file
+//  - "reg", given a "line" or "time" and a register "reg": its value
+//    after the instruction there
+//  - "mem", given a "line" or "time", an "addr" and a "size": the
+//    contents of memory after the instruction there
+//  - "callinfo", given a "function" name or address: every call to it
+//  - "calltree", given optional "from" and "to" lines and a maximum
+//    "depth": the function calls starting in that part of the trace
+//
+// Line numbers, in queries and answers, are those of the trace file.
+class QueryEngine {
+    const IndexNavigator &IN;
+    CallTreeOptions ctopts;
+
+    // The call tree is only worked out when a query first needs it
+    mutable std::mutex calltree_mutex;
+    mutable std::unique_ptr<CallTree> calltree;
+
+    SeqOrderPayload find_node(const QueryRequest &req) const;
+    void answer_node(const QueryRequest &req, QueryResponse &resp) const;
+    void answer_text(const QueryRequest &req, QueryResponse &resp) const;
+    void answer_reg(const QueryRequest &req, QueryResponse &resp) const;
+    void answer_mem(const QueryRequest &req, QueryResponse &resp) const;
+    void answer_callinfo(const QueryRequest &req, QueryResponse &resp) const;
+    void answer_calltree(const QueryRequest &req, QueryResponse &resp) const;
+
+  public:
+    QueryEngine(const IndexNavigator &IN,
+                const CallTreeOptions &ctopts = CallTreeOptions());
+
+    // Answer a query given as a line of JSON with another, without
+    // its newline. A bad query gets an answer with an "error" field.
+    std::string answer(const std::string &query) const;
+    std::string answer(const QueryRequest &req) const;
+
+    // An answer reporting an error, for a query that couldn't even be
+    // passed to answer(), such as one whose JSON wasn't understood
+    static std::string error_answer(const std::string &msg,
+                                    const std::string &id_json = "");
+};
+
+#endif // LIBTARMAC_QUERY_HH
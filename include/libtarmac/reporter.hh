@@ -19,6 +19,8 @@
 #ifndef LIBTARMAC_REPORTER_HH
 #define LIBTARMAC_REPORTER_HH
 
+#include "libtarmac/misc.hh"
+
 #include <memory>
 #include <ostream>
 #include <string>
@@ -29,7 +31,9 @@ enum class IndexUpdateCheck {
     Missing,        // rebuild needed: index not present
     TooOld,         // rebuild needed: index older than trace file
     WrongFormat,    // rebuild needed: index has wrong file format version
+    WrongByteOrder, // rebuild needed: index was made on other-endian host
     Incomplete,     // rebuild needed: previous generation did not finish
+    WrongParams,    // rebuild needed: index describes a different selection
     Forced,         // rebuild explicitly requested by user
     InMemory,       // index is not stored on disk at all, so must be built
 };
@@ -79,9 +83,9 @@ class Reporter {
     // Report a warning or fatal error during indexing, such as a
     // parsing problem. indexing_error does not return.
     virtual void indexing_warning(const std::string &trace_filename,
-                                  unsigned lineno, const std::string &msg) = 0;
+                                  LineNo lineno, const std::string &msg) = 0;
     virtual void indexing_error(const std::string &trace_filename,
-                                unsigned lineno, const std::string &msg) = 0;
+                                LineNo lineno, const std::string &msg) = 0;
 
     void set_indexing_progress(bool val) { progress = val; }
 
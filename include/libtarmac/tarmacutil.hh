@@ -21,6 +21,7 @@
 
 #include "libtarmac/argparse.hh"
 #include "libtarmac/index.hh"
+#include "libtarmac/indexcache.hh"
 #include "libtarmac/misc.hh"
 
 #include <string>
@@ -62,6 +63,10 @@ class TarmacUtilityBase {
         iparams = iparams_;
     }
 
+    // Prevent setup() from building or rebuilding the index, for a
+    // tool that wants to work on an existing index file as it stands.
+    void suppress_indexing() { indexing = Troolean::No; }
+
     std::string image_filename;
     uint64_t load_offset = 0;
 
@@ -76,6 +81,10 @@ class TarmacUtilityBase {
     bool bigend_explicit = false;
     bool bigend = false;
     bool thumbonly = false;
+    std::string cpu; // CPU to read the view of, in a per-CPU index
+    std::vector<std::string> exclude_symbols;
+    std::string index_cache_dir;
+    uint64_t index_cache_size = INDEX_CACHE_DEFAULT_SIZE;
     bool verbose;
     bool show_progress_meter;
 
@@ -84,6 +93,10 @@ class TarmacUtilityBase {
 
     void updateIndexIfNeeded(const TracePair &trace) const;
 
+    // If an index cache directory is in use, point a trace at its
+    // index in the cache.
+    void use_index_cache(TracePair &trace) const;
+
   private:
     // Subclass-dependent functionality.
     virtual bool does_indexing() { return true; };
@@ -125,7 +138,7 @@ struct TarmacUtilityMT : public TarmacUtilityBase {
     std::vector<TracePair> traces;
 
     virtual void add_options(Argparse &ap) override;
-    virtual void postProcessOptions() override {}
+    virtual void postProcessOptions() override;
     virtual void setupIndex() const override
     {
         for (const TracePair &trace : traces)
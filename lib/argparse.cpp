@@ -22,6 +22,7 @@
 #include "libtarmac/reporter.hh"
 
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
 #include <iostream>
 #include <queue>
@@ -39,6 +40,28 @@ using std::string;
 using std::unique_ptr;
 using std::vector;
 
+unsigned long long parse_uint(const string &s, unsigned long long max)
+{
+    // stoull would accept leading spaces and a minus sign
+    if (s.empty() || !isdigit((unsigned char)s[0]))
+        throw ArgparseError(
+            format(_("'{}': unable to parse numeric value"), s));
+    size_t pos;
+    unsigned long long val;
+    try {
+        val = stoull(s, &pos, 0);
+    } catch (std::exception &) {
+        throw ArgparseError(
+            format(_("'{}': unable to parse numeric value"), s));
+    }
+    if (pos < s.size())
+        throw ArgparseError(
+            format(_("'{}': unable to parse numeric value"), s));
+    if (val > max)
+        throw ArgparseError(format(_("'{}': numeric value out of range"), s));
+    return val;
+}
+
 Argparse::Opt::Opt(bool has_val, const vector<string> &optnames,
                    const string &help)
     : has_val(has_val), multiple(false), help(help)
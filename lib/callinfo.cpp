@@ -53,48 +53,33 @@ void CallInfo::run(const vector<string> &functions)
     }
 }
 
-void CallInfo::run(Addr symb_addr)
+vector<TarmacSite> find_calls(const IndexNavigator &IN, Addr addr)
 {
     vector<TarmacSite> Sites;
-    unsigned long long pc = symb_addr;
+    unsigned long long pc = addr;
     pc &= ~(unsigned long long)1;
 
     // Search first in the bypctree to get the times at which symbol is called.
-    {
-        ByPCPayload ByPCFinder, ByPCFound;
-        ByPCFinder.pc = pc;
-        ByPCFinder.trace_file_firstline = 0;
-
-        while (true) {
-            bool ret = index.bypctree.succ(index.bypcroot, ByPCFinder,
-                                           &ByPCFound, nullptr);
-
-            if (ret && ByPCFound.pc == pc &&
-                ByPCFound.trace_file_firstline >
-                    ByPCFinder.trace_file_firstline) {
-                Sites.push_back(
-                    TarmacSite(ByPCFound.pc, ByPCFound.trace_file_firstline));
-                ByPCFinder.trace_file_firstline =
-                    ByPCFound.trace_file_firstline + 1;
-            } else
-                break;
-        }
-    }
+    LineNo line = 0;
+    while (IN.find_pc_visit(pc, line, +1, &line))
+        Sites.push_back(TarmacSite(pc, line));
 
     // Search in seqtree, where we have much more details.
     for (auto &s : Sites) {
-        SeqOrderPayload SeqOrderFinder, SeqOrderFound;
-        SeqOrderFinder.pc = s.addr;
-        SeqOrderFinder.trace_file_firstline = s.tarmac_line;
+        SeqOrderPayload SeqOrderFound;
 
-        if (index.seqtree.find(index.seqroot, SeqOrderFinder, &SeqOrderFound,
-                               nullptr)) {
+        if (IN.node_at_line(s.tarmac_line, &SeqOrderFound)) {
             s.tarmac_pos = SeqOrderFound.trace_file_pos;
             s.time = SeqOrderFound.mod_time;
         }
     }
 
-    for (const auto &s : Sites)
+    return Sites;
+}
+
+void CallInfo::run(Addr symb_addr)
+{
+    for (const auto &s : find_calls(*this, symb_addr))
         cout << " - time: " << s.time
              << " (line:" << (s.tarmac_line + index.lineno_offset)
              << ", pos:" << s.tarmac_pos << ")\n";
@@ -201,31 +201,35 @@ CallTree::CallTree(const IndexNavigator &IN)
 {
     CallDepthTracker tracker(*this);
 
-    unsigned line = 0;
-    SeqOrderPayload node;
+    LineNo line = 0;
+    SeqCursor cursor(IN);
 
     // Skip first lines which have an invalid PC.
-    while (IN.node_at_line(line + 1, &node) && node.pc == KNOWN_INVALID_PC)
-        line++;
+    for (bool ok = cursor.seek_limit(false);
+         ok && cursor.node().pc == KNOWN_INVALID_PC; ok = cursor.next())
+        line = cursor.node().trace_file_firstline +
+               cursor.node().trace_file_lines - 1;
 
     bool initializeTracker = true;
-    while (IN.node_at_line(line + 1, &node)) {
+    while (cursor.seek_line(line + 1)) {
+        SeqOrderPayload node = cursor.node();
         if (initializeTracker) {
             tracker.start(node);
             initializeTracker = false;
         } else {
-            SeqOrderPayload prevNode;
-            bool success = IN.get_previous_node(node, &prevNode);
+            // The node before is one step back from here, without
+            // searching for it from the root
+            bool success = cursor.prev();
             (void)success; // squash compiler warning if asserts compiled out
             assert(success);
-            tracker.newDepth(node, prevNode);
+            tracker.newDepth(node, cursor.node());
         }
 
         unsigned depth = node.call_depth;
 
         bool found = false;
-        unsigned x, nextline = UINT_MAX;
-        pair<bool, unsigned> searchresult;
+        LineNo x, nextline = ULLONG_MAX;
+        pair<bool, LineNo> searchresult;
 
         // How many lines in the trace file are at a higher depth than
         // this one?
@@ -24,31 +24,46 @@
 #include "libtarmac/reporter.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <set>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using std::cout;
 using std::dec;
+using std::deque;
 using std::endl;
 using std::exception;
 using std::hex;
 using std::ifstream;
 using std::ios;
+using std::istream;
 using std::make_pair;
 using std::make_shared;
 using std::make_unique;
 using std::max;
 using std::min;
+using std::ofstream;
 using std::ostream;
 using std::ostringstream;
 using std::pair;
@@ -56,20 +71,37 @@ using std::ref;
 using std::set;
 using std::shared_ptr;
 using std::showbase;
+using std::streamoff;
 using std::streampos;
 using std::string;
 using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 
 // Smallest number of instructions that can elapse between setting LR and
 // branching for the branch to _not_ be considered a potential function call.
 static constexpr unsigned long long BRANCH_LR_WRITE_THRESHOLD = 8;
 
+// Longest loop body, in seqtree nodes, that --compress-loops looks for,
+// and the most trace file bytes it folds into a single seqtree node
+// (which has only 32 bits to record its length).
+static constexpr unsigned LOOP_MAX_PERIOD = 16;
+static constexpr OFF_T LOOP_RUN_MAX_BYTES = 1 << 16;
+static constexpr OFF_T SEQ_NODE_MAX_BYTES = 0xFFFFFFFF;
+
+// Size, in trace file bytes or lines, at which a run of instructions
+// excluded by an indexing filter is cut into another placeholder node.
+// This leaves plenty of room below the 32-bit limits for whatever the
+// last event added to the node turns out to cover.
+static constexpr OFF_T FILTERED_RUN_MAX_BYTES = 1 << 30;
+static constexpr LineNo FILTERED_RUN_MAX_LINES = 1 << 30;
+
 struct PendingCall {
     unsigned long long sp, pc;
-    unsigned call_line;
+    LineNo call_line;
     PendingCall(unsigned long long sp, unsigned long long pc,
-                unsigned call_line = 0)
+                LineNo call_line = 0)
         : sp(sp), pc(pc), call_line(call_line)
     {
     }
@@ -82,9 +114,9 @@ struct PendingCall {
 };
 
 struct CallReturn {
-    unsigned line;
+    LineNo line;
     int direction; // +1 = call, -1 = return
-    CallReturn(unsigned line, int direction) : line(line), direction(direction)
+    CallReturn(LineNo line, int direction) : line(line), direction(direction)
     {
     }
 
@@ -94,6 +126,253 @@ struct CallReturn {
     }
 };
 
+// Table of recently written small blocks of raw memory or register
+// contents, so that writing the same bytes again (a loop counter
+// cycling round, a stack slot refilled with the same spilled value)
+// can refer to the existing copy in the index instead of allocating
+// another. Raw contents are never modified once written, so sharing
+// them is safe.
+//
+// The table is direct-mapped by a hash of the contents, so it has a
+// fixed memory cost and forgets an old block when a new one hashes
+// to the same slot.
+class SharedContentsTable {
+    static constexpr size_t MAX_SIZE = 64; // larger blocks aren't shared
+    static constexpr unsigned BITS = 16;
+
+    struct Entry {
+        OFF_T offset = 0;
+        size_t size = 0;
+    };
+    vector<Entry> entries;
+
+  public:
+    struct Stats {
+        unsigned long long blocks = 0, shared_blocks = 0;
+        unsigned long long bytes = 0, shared_bytes = 0;
+    } stats;
+
+    SharedContentsTable() : entries(size_t(1) << BITS) {}
+
+    OFF_T store(Arena &arena, const unsigned char *data, size_t size)
+    {
+        stats.blocks++;
+        stats.bytes += size;
+
+        Entry *entry = nullptr;
+        if (size <= MAX_SIZE) {
+            // FNV-1a
+            uint32_t hash = 2166136261U ^ size;
+            for (size_t i = 0; i < size; i++)
+                hash = (hash ^ data[i]) * 16777619U;
+            entry = &entries[hash >> (32 - BITS)];
+
+            if (entry->offset && entry->size == size &&
+                !memcmp(arena.getptr<unsigned char>(entry->offset), data,
+                        size)) {
+                stats.shared_blocks++;
+                stats.shared_bytes += size;
+                return entry->offset;
+            }
+        }
+
+        OFF_T offset = arena.alloc(size);
+        memcpy(arena.getptr<unsigned char>(offset), data, size);
+        if (entry) {
+            entry->offset = offset;
+            entry->size = size;
+        }
+        return offset;
+    }
+};
+
+// Remove everything in the address range [lo,hi] of address space
+// 'type' from a memory tree, trimming any entries that extend outside
+// it. Returns the new root.
+static OFF_T memtree_delete_range(AVLDisk<MemoryPayload, MemoryAnnotation> &memtree,
+                                  OFF_T root, char type, Addr lo, Addr hi)
+{
+    MemoryPayload memp;
+    memp.type = type;
+    memp.lo = lo;
+    memp.hi = hi;
+    while (true) {
+        bool found;
+        MemoryPayload old_memp;
+        root = memtree.remove(root, memp, &found, &old_memp);
+        if (!found)
+            break;
+        if (old_memp.lo < memp.lo) {
+            MemoryPayload memp_below = old_memp;
+            memp_below.hi = memp.lo - 1;
+            root = memtree.insert(root, memp_below);
+        }
+        if (old_memp.hi > memp.hi) {
+            MemoryPayload memp_above = old_memp;
+            if (memp_above.raw)
+                memp_above.contents =
+                    memp_above.contents + (memp.hi + 1 - memp_above.lo);
+            memp_above.lo = memp.hi + 1;
+            root = memtree.insert(root, memp_above);
+        }
+    }
+    return root;
+}
+
+// Insert a payload into a memory tree, replacing whatever was there
+// before in its address range. Returns the new root.
+static OFF_T memtree_overwrite(AVLDisk<MemoryPayload, MemoryAnnotation> &memtree,
+                               OFF_T root, const MemoryPayload &memp)
+{
+    root = memtree_delete_range(memtree, root, memp.type, memp.lo, memp.hi);
+    return memtree.insert(root, memp);
+}
+
+// What an Index building part of an index on a worker thread hands
+// back to the main thread: its progress through the trace (if
+// anyone's counting), and the warnings and fatal parse error it came
+// across, to be reported in order once every worker has finished.
+struct IndexWork {
+    std::atomic<unsigned long long> *progress = nullptr;
+    bool keep_warnings = true;
+    vector<pair<LineNo, string>> warnings;
+    bool failed = false;
+    LineNo error_line = 0;
+    string error;
+};
+
+// The part of the trace file that one shard of a sharded index covers
+// (see FLAG_SHARDED), and what the Index building it hands back for
+// stitching the shards together.
+struct IndexShardWork : IndexWork {
+    // The shard's Index starts reading at start_pos, which is line
+    // start_lineno of the file, and stops at end_pos. Lines before
+    // first_line (numbered like Index::lineno) belong to the previous
+    // shard, and are only read to warm up the register, memory and
+    // call-tracking state.
+    streampos start_pos, end_pos;
+    LineNo start_lineno, first_line, lineno_offset;
+
+    // The memory tree root for the state just before first_line. Its
+    // memory subtrees go on being filled in by reads later in the
+    // shard, even once the final memory state no longer refers to them.
+    OFF_T start_memroot = 0;
+
+    // Transfers of control in the shard's own part of the trace whose
+    // handling could depend on calls made before it, which the shard
+    // doesn't reliably know about: those with sp at least as large as
+    // every stack pointer value seen before them in its own part
+    // (max_sp), since any earlier call with a smaller sp has been
+    // returned past by then. The calls and returns among these are
+    // left for stitch_shards to find, by replaying them in order with
+    // every call still pending at that point. Calls and returns at
+    // smaller stack pointers can only match each other, so the shard
+    // finds those itself.
+    //
+    // 'looks_like_call' says whether the transfer would be recorded
+    // as a call with return address 'lr', if it isn't a return. (That
+    // depends on lr having been written in the last few instructions,
+    // which the shard always sees, in its warm-up if nowhere else.) If
+    // the stack pointer wasn't known, sp_known is false, and sp_reg
+    // gives the offset of the stack pointer register to find it in the
+    // shard's starting state, since nothing since then has written it.
+    struct Transfer {
+        unsigned long long sp, pc, lr, max_sp;
+        LineNo line;
+        Addr sp_reg;
+        size_t sp_size;
+        bool sp_known, looks_like_call;
+    };
+    vector<Transfer> transfers;
+    unsigned long long max_sp = 0;
+
+    // The memory trees of the shard's own part of the trace, rebuilt
+    // by Index::compact_shard_memory in an arena of their own, without
+    // anything left over from its warm-up, so that stitch_shards can
+    // copy them in whole. 'own_roots' maps each memory tree root in
+    // the shard's seqtree, and its final one, to the same state in
+    // the rebuilt trees.
+    shared_ptr<Arena> own_arena;
+    unique_ptr<AVLDisk<MemoryPayload, MemoryAnnotation>> own_memtree;
+    unique_ptr<SelectableTree<MemorySubPayload>> own_memsubtree;
+    unordered_map<OFF_T, OFF_T> own_roots;
+
+    // The shard's seqtree nodes, with memory roots in the rebuilt
+    // trees, and its by-PC tree entries, each written out in order as
+    // an array in the shard's own file by Index::flatten_shard_trees,
+    // so that stitch_shards can build the merged trees in one go.
+    OFF_T seq_nodes = 0, bypc_nodes = 0;
+    size_t nseq = 0, nbypc = 0;
+};
+
+// Sort a list of inclusive address ranges, and merge any that overlap
+// or touch, so that they can be binary-searched.
+static void merge_ranges(vector<pair<Addr, Addr>> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+    size_t out = 0;
+    for (const auto &r : ranges) {
+        if (out > 0 && (r.first <= ranges[out - 1].second ||
+                        r.first - 1 == ranges[out - 1].second))
+            ranges[out - 1].second = max(ranges[out - 1].second, r.second);
+        else
+            ranges[out++] = r;
+    }
+    ranges.resize(out);
+}
+
+// The part of the trace file to index, if it's not the whole thing
+// (see IndexerParams::window_start_line and friends). The Index starts
+// reading at start_pos, which is line start_lineno of the file, and
+// stops at end_pos, behaving as if the file contained only that part
+// except that its line numbers still match the whole file.
+struct IndexWindow {
+    streampos start_pos = 0;
+    streampos end_pos = std::numeric_limits<streamoff>::max();
+    LineNo start_lineno = 1;
+};
+
+// Stream buffer that feeds the Index building one CPU's view of a
+// per-CPU index (see FLAG_PER_CPU). The main thread reads the trace
+// file once, and passes each block of it to every view in turn. A
+// view started part way through, because its CPU only just turned up
+// in the trace, reads the part of the file before that for itself.
+class TraceFeed : public std::streambuf {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<shared_ptr<const string>> queue;
+    bool closed = false, abandoned = false;
+
+    ifstream catchup;
+    streamoff catchup_end = 0;
+    string catchup_block;
+
+    shared_ptr<const string> block;
+    streamoff block_pos = 0, next_pos = 0;
+
+    static constexpr size_t MAX_QUEUED = 8;
+
+  protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode) override;
+
+  public:
+    void start(const string &filename, streamoff catchup_end);
+    void push(shared_ptr<const string> block);
+    void close();
+    void abandon();
+};
+
+// One CPU's view of a per-CPU index, and what the Index building it
+// hands back. The first view also reports every other trace source
+// it sees, so that the main thread can start views for them.
+struct IndexCPUWork : IndexWork {
+    string cpu;
+    TraceFeed feed;
+    std::function<void(const string &)> found_source;
+};
+
 class Index : ParseReceiver {
     TracePair trace;
     IndexerParams iparams;
@@ -104,7 +383,7 @@ class Index : ParseReceiver {
     unsigned long long expected_next_pc, expected_next_lr;
     shared_ptr<Arena> arena;
     AVLDisk<MemoryPayload, MemoryAnnotation> *memtree;
-    AVLDisk<MemorySubPayload> *memsubtree;
+    SelectableTree<MemorySubPayload> *memsubtree;
     AVLDisk<SeqOrderPayload, SeqOrderAnnotation> *seqtree;
     Time current_time;
     bool seen_instruction_at_current_time;
@@ -116,19 +395,152 @@ class Index : ParseReceiver {
     unsigned curr_iflags;
     size_t max_sve_bits;
 
-    void delete_from_memtree(char type, Addr addr, size_t size);
-
     // Used during parsing (shared between parse_tarmac_line and
     // got_event):
     TarmacLineParser parser;
-    unique_ptr<ifstream> ifs;
-    size_t lineno, true_lineno, lineno_offset, prev_lineno;
+    unique_ptr<SequentialFileBuf> tracebuf;
+    unique_ptr<istream> ifs;
+    LineNo lineno, true_lineno, lineno_offset, prev_lineno;
     bool seen_any_event;
     streampos linepos, oldpos;
-    AVLDisk<ByPCPayload> *bypctree;
+
+    // Positions of the sampled lines read so far, for the table at
+    // FileHeader::line_offsets, written straight into the arena a chunk
+    // at a time. The first one is that of physical line
+    // line_offsets_first * LINE_OFFSET_INTERVAL + 1.
+    LineNo line_offsets_first, nline_offsets;
+    vector<OFF_T> line_offset_chunks;
+    SelectableTree<ByPCPayload> *bypctree;
     OFF_T header_offset, bypcroot;
+    SharedContentsTable shared_contents;
+
+    // State for storing memory as snapshots plus deltas (see
+    // FLAG_MEMORY_DELTAS): the root of the last memory tree committed
+    // in full, the last delta record written, the number of seqtree
+    // nodes written since the snapshot, and the memory tree updates
+    // made since the last seqtree node.
+    OFF_T snapshot_root, prev_delta_record;
+    unsigned nodes_since_snapshot;
+    vector<MemoryPayload> pending_deltas;
+
+    // State for building memory trees lazily (see FLAG_LAZY_MEMORY):
+    // the current region record, and the memory subtree root words
+    // made since it started. When a region is being rebuilt,
+    // 'replaying' is set, and make_sub_memtree hands out the words
+    // recorded for the region in order, instead of making new ones.
+    OFF_T lazy_region;
+    vector<OFF_T> lazy_subtree_words;
+    bool replaying;
+    size_t replay_subtree_pos;
+
+    // Set if this Index is building one shard of a sharded index, and
+    // in the Index that the shards are stitched into, the table
+    // describing them
+    IndexShardWork *shard;
+    OFF_T shard_table;
+    unsigned nshards;
+
+    // Set if this Index is building one CPU's view of a per-CPU
+    // index. Lines from the other trace sources still make seqtree
+    // nodes of their own, so that the view covers the whole trace,
+    // but only their memory updates are applied. 'foreign_node' says
+    // whether the node being built is one of those.
+    IndexCPUWork *cpu_view;
+    bool foreign_node;
+    set<unsigned> sources_seen;
+
+    IndexWindow window;
+
+    // Set while building a node that stands in for a run of
+    // instructions excluded by IndexerParams::exclude_pcs
+    bool filtered_node;
+
+    static bool in_ranges(const vector<pair<Addr, Addr>> &ranges, Addr lo,
+                          Addr hi);
+    bool is_filtered(const TarmacEvent *event, bool is_instruction) const;
+
+    // State for folding repeated iterations of a loop that changes
+    // nothing into a single seqtree node (see FLAG_LOOP_RUNS).
+    // 'node_changed' says whether the node being built has changed
+    // any state. 'loop_history' describes the most recent nodes, and
+    // loop_streak[P] counts the nodes in a row that changed nothing
+    // and matched the node P before them. While a run is being
+    // folded, 'loop_run' is its node so far, 'loop_run_rec' its
+    // LoopRun record, and 'loop_pending' the nodes of the iteration in
+    // progress; 'loop_body_pcs' gives the PC and offset in lines of
+    // each node of the body. Nodes before 'loop_folded_to' may have
+    // been folded, so can't be the body of another run.
+    //
+    // A write of the value already there doesn't count as a change.
+    // It's stored like any other, except while a node that might be
+    // folded into a run is being built: then it's held back in
+    // 'loop_node_touches', and moved along with the node to
+    // 'loop_pending_touches'. Once an iteration is folded, only its own
+    // writes are kept, in 'loop_folded_touches', since every iteration
+    // makes the same ones. As soon as a node turns out not to fold,
+    // flush_loop_touches() stores all the held-back writes, in order,
+    // so that everything outside the folded iterations has exactly
+    // the memory state it would have without --compress-loops.
+    struct LoopNode {
+        Addr pc;
+        unsigned lines;
+        LineNo firstline;
+    };
+    struct LoopTouch {
+        char type;
+        Addr addr;
+        LineNo line;
+        vector<unsigned char> contents;
+    };
+    bool node_changed;
+    vector<LoopTouch> loop_node_touches, loop_folded_touches;
+    vector<vector<LoopTouch>> loop_pending_touches;
+    bool loop_touches_held;
+    deque<LoopNode> loop_history;
+    vector<unsigned> loop_streak;
+    SeqOrderPayload loop_run;
+    LoopRun loop_run_rec;
+    vector<SeqOrderPayload> loop_pending;
+    vector<pair<Addr, LineNo>> loop_body_pcs;
+    vector<LoopRun> loop_runs;
+    LineNo loop_folded_to;
+
+    bool in_loop_run() const { return loop_run_rec.period_nodes != 0; }
+    void add_seq_node(const SeqOrderPayload &seqp);
+    void insert_seq_node(const SeqOrderPayload &seqp);
+    void start_loop_run(unsigned period, LineNo body_line);
+    void end_loop_run();
+    void store_loop_touches(const vector<LoopTouch> &touches);
+    void flush_loop_touches();
+
+    // Whichever of the above is set, if this Index is running on a
+    // worker thread
+    IndexWork *work;
+
+    bool is_foreign(const TarmacEvent *event) const
+    {
+        return cpu_view && event && event->source &&
+               parser.source_name(event->source) != cpu_view->cpu;
+    }
 
-    unsigned char *make_memtree_update(char type, Addr addr, size_t size);
+    // True while reading the lines before a shard's own part of the
+    // trace, which make no seqtree nodes
+    bool warming_up() const { return shard && prev_lineno < shard->first_line; }
+
+    // True if the memory tree is modified in place between seqtree
+    // nodes, rather than committed after every one
+    bool memtree_in_place() const
+    {
+        return iparams.snapshot_interval > 1 || iparams.lazy_memory;
+    }
+
+    void add_to_memtree(const MemoryPayload &memp);
+    OFF_T write_memory_delta_record();
+    OFF_T write_lazy_memory_slot();
+    void close_lazy_memory_region();
+
+    void make_memtree_update(char type, Addr addr, size_t size,
+                             const unsigned char *contents);
 
     inline const RegisterId &REG_sp()
     {
@@ -141,13 +553,28 @@ class Index : ParseReceiver {
 
   public:
     Index(const TracePair &trace, const IndexerParams &iparams,
-          const IndexerDiagnostics &idiags, const ParseParams &pparams)
+          const IndexerDiagnostics &idiags, const ParseParams &pparams,
+          IndexShardWork *shard = nullptr, IndexCPUWork *cpu_view = nullptr)
         : trace(trace), iparams(iparams), idiags(idiags), pparams(pparams),
           expected_next_pc(KNOWN_INVALID_PC),
           expected_next_lr(KNOWN_INVALID_PC), arena(nullptr), memtree(nullptr),
           memsubtree(nullptr), seqtree(nullptr), aarch64_used(false),
-          last_iset(ARM), parser(pparams, *this)
+          last_iset(ARM), curr_iflags(0), parser(pparams, *this),
+          bypctree(nullptr), lazy_region(0), replaying(false), shard(shard),
+          shard_table(0), nshards(0), cpu_view(cpu_view), foreign_node(false),
+          filtered_node(false), node_changed(false), loop_touches_held(false),
+          loop_streak(LOOP_MAX_PERIOD + 1, 0), loop_folded_to(0)
     {
+        loop_run_rec.period_nodes = 0;
+        work = shard ? static_cast<IndexWork *>(shard) : cpu_view;
+        merge_ranges(this->iparams.exclude_pcs);
+        merge_ranges(this->iparams.exclude_data);
+
+        // Without memory events in the trees, the trees that a lazy
+        // index would rebuild on demand would come out differently,
+        // and there's nothing worth deferring anyway
+        if (!iparams.record_memory)
+            this->iparams.lazy_memory = false;
     }
 
     ~Index()
@@ -173,6 +600,10 @@ class Index : ParseReceiver {
                                      unsigned long long contents);
     void update_memtree_from_read(char type, Addr addr, size_t size,
                                   unsigned long long contents);
+    void fill_memtree_from_read(char type, Addr addr, size_t size,
+                                const unsigned char *data);
+    bool read_memtree_bytes(OFF_T root, char type, Addr addr, size_t size,
+                            unsigned char *data);
     bool read_memtree_value(char type, Addr addr, size_t size,
                             unsigned long long *output);
     bool read_memtree_reg(const RegisterId &reg, unsigned long long *output);
@@ -192,12 +623,30 @@ class Index : ParseReceiver {
     bool read_one_trace_line();
     void finish_reading_trace_file();
     void build_call_tree();
+    void add_line_offset(OFF_T pos);
+    OFF_T line_offset(LineNo i) const;
     void finalise_index();
+
+    void set_window(const IndexWindow &w) { window = w; }
+    void index_shard();
+    void compact_shard_memory();
+    void flatten_shard_trees();
+    void index_cpu_view();
+    OFF_T copy_shard_subtree(const Index &shard, OFF_T base, OFF_T word);
+    void stitch_shards(const vector<unique_ptr<Index>> &shards);
+
+    void rebuild_lazy_memory_region(shared_ptr<Arena> arena,
+                                    TreeType memsubtree_type, OFF_T region,
+                                    const vector<SeqOrderPayload> &nodes,
+                                    const vector<vector<string>> &lines,
+                                    unordered_map<OFF_T, OFF_T> &roots);
 };
 
 void Index::update_sp(unsigned long long sp)
 {
     curr_sp = sp;
+    if (shard && !warming_up())
+        shard->max_sp = max(shard->max_sp, sp);
 
     if (iparams.record_calls) {
         for (auto it = pending_calls.begin(); it != pending_calls.end();) {
@@ -207,6 +656,7 @@ void Index::update_sp(unsigned long long sp)
             auto to_erase = it;
             ++it;
             pending_calls.erase(to_erase);
+            node_changed = true;
         }
     }
 }
@@ -228,7 +678,8 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
         // might _be_ a return that we can match with a previous call.
 
         unsigned long long lr, sp;
-        if (!read_memtree_reg(REG_sp(), &sp))
+        bool sp_known = read_memtree_reg(REG_sp(), &sp);
+        if (!sp_known)
             sp = ULLONG_MAX;
 
         if (idiags.debug_call_heuristics)
@@ -236,8 +687,31 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
                 << "transfer of control @ " << prev_lineno << ", sp=" << hex
                 << sp << ", pc=" << pc << dec << endl;
 
+        auto looks_like_call = [&]() {
+            return expected_next_lr != KNOWN_INVALID_PC &&
+                   read_memtree_reg(REG_lr(), &lr) &&
+                   insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD &&
+                   absdiff(lr, expected_next_lr) < 64;
+        };
+
         auto it = pending_calls.find(PendingCall(sp, pc));
-        if (it != pending_calls.end()) {
+        if (warming_up()) {
+            // Calls and returns in a shard's warm-up lines are the
+            // previous shard's business, since it sees them in full
+        } else if (shard && sp >= shard->max_sp) {
+            // Leave this one for stitch_shards (see IndexShardWork)
+            IndexShardWork::Transfer t;
+            t.sp = sp;
+            t.pc = pc;
+            t.looks_like_call = looks_like_call();
+            t.lr = t.looks_like_call ? lr : 0;
+            t.max_sp = shard->max_sp;
+            t.line = prev_lineno;
+            t.sp_reg = reg_offset(REG_sp(), curr_iflags);
+            t.sp_size = reg_size(REG_sp());
+            t.sp_known = sp_known;
+            shard->transfers.push_back(t);
+        } else if (it != pending_calls.end()) {
 
             if (idiags.debug_call_heuristics)
                 idiags.diag() << "  looks like return for call @ "
@@ -257,16 +731,15 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
             found_callrets.insert(CallReturn(it->call_line, +1));
             found_callrets.insert(CallReturn(prev_lineno, -1));
             pending_calls.erase(it);
-        } else if (expected_next_lr != KNOWN_INVALID_PC &&
-                   read_memtree_reg(REG_lr(), &lr) &&
-                   insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD &&
-                   absdiff(lr, expected_next_lr) < 64) {
+            node_changed = true;
+        } else if (looks_like_call()) {
 
             if (idiags.debug_call_heuristics)
                 idiags.diag() << "  inserting as pending call with sp=" << hex
                               << sp << " lr=" << lr << dec << endl;
 
             pending_calls.insert(PendingCall(sp, lr, prev_lineno));
+            node_changed = true;
         }
 
         // After a transfer of control, reset insns_since_lr_update to
@@ -298,6 +771,8 @@ static inline bool reg_update_overwrites_reg(Addr offset, size_t size,
 void Index::got_event(RegisterEvent &ev)
 {
     got_event_common(&ev, false);
+    if (is_foreign(&ev))
+        return;
 
     RegisterId reg = ev.reg;
 
@@ -313,8 +788,7 @@ void Index::got_event(RegisterEvent &ev)
     }
     auto offset = reg_offset(reg, curr_iflags) + ev.offset;
     auto size = ev.bytes.size();
-    unsigned char *p = make_memtree_update('r', offset, size);
-    memcpy(p, ev.bytes.data(), size);
+    make_memtree_update('r', offset, size, ev.bytes.data());
 
     if (reg_update_overwrites_reg(offset, size, REG_sp(), curr_iflags)) {
         unsigned long long new_sp_value;
@@ -338,10 +812,36 @@ void Index::got_event(RegisterEvent &ev)
         insns_since_lr_update = 0;
 }
 
+bool Index::in_ranges(const vector<pair<Addr, Addr>> &ranges, Addr lo,
+                      Addr hi)
+{
+    // Find the last range starting at or before hi
+    auto it = std::upper_bound(
+        ranges.begin(), ranges.end(), hi,
+        [](Addr a, const pair<Addr, Addr> &r) { return a < r.first; });
+    return it != ranges.begin() && (it - 1)->second >= lo;
+}
+
+bool Index::is_filtered(const TarmacEvent *event, bool is_instruction) const
+{
+    if (iparams.exclude_pcs.empty() || !event)
+        return false;
+    // Anything other than an instruction belongs to whatever node it
+    // turns up in
+    if (!is_instruction)
+        return filtered_node;
+    Addr pc = static_cast<const InstructionEvent *>(event)->pc;
+    return in_ranges(iparams.exclude_pcs, pc, pc);
+}
+
 void Index::got_event(MemoryEvent &ev)
 {
     got_event_common(&ev, false);
 
+    if (!iparams.exclude_data.empty() &&
+        in_ranges(iparams.exclude_data, ev.addr, ev.addr + (ev.size - 1)))
+        return;
+
     if (!ev.read) {
         if (ev.known)
             update_memtree('m', ev.addr, ev.size, ev.contents);
@@ -357,6 +857,8 @@ void Index::got_event(MemoryEvent &ev)
 void Index::got_event(InstructionEvent &ev)
 {
     got_event_common(&ev, true);
+    if (is_foreign(&ev))
+        return;
 
     if (insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD)
         insns_since_lr_update++;
@@ -459,8 +961,11 @@ void Index::got_event(TextOnlyEvent &ev) { got_event_common(&ev, false); }
 void Index::got_event(ExceptionEvent &ev)
 {
     got_event_common(&ev, false);
+    if (is_foreign(&ev))
+        return;
 
-    if (!seen_cpu_exception_at_current_line) {
+    node_changed = true;
+    if (!replaying && !seen_cpu_exception_at_current_line && !warming_up()) {
         ByPCPayload bypcp;
         bypcp.trace_file_firstline = prev_lineno;
         bypcp.pc = CPU_EXCEPTION_PC;
@@ -469,51 +974,36 @@ void Index::got_event(ExceptionEvent &ev)
     }
 }
 
-void Index::delete_from_memtree(char type, Addr addr, size_t size)
+void Index::make_memtree_update(char type, Addr addr, size_t size,
+                                const unsigned char *contents)
 {
-    MemoryPayload memp;
-    memp.type = type;
-    memp.lo = addr;
-    memp.hi = addr + (size - 1);
-    memp.trace_file_firstline = prev_lineno;
-    while (true) {
-        bool found;
-        MemoryPayload old_memp;
-        memroot = memtree->remove(memroot, memp, &found, &old_memp);
-        if (!found)
-            break;
-        if (old_memp.lo < memp.lo) {
-            MemoryPayload memp_below = old_memp;
-            memp_below.hi = memp.lo - 1;
-            memroot = memtree->insert(memroot, memp_below);
-        }
-        if (old_memp.hi > memp.hi) {
-            MemoryPayload memp_above = old_memp;
-            if (memp_above.raw)
-                memp_above.contents =
-                    memp_above.contents + (memp.hi + 1 - memp_above.lo);
-            memp_above.lo = memp.hi + 1;
-            memroot = memtree->insert(memroot, memp_above);
+    // When folding loops, a write of what was there already isn't a
+    // change, and is held back if this node might be folded
+    bool changed = true;
+    if (iparams.compress_loops) {
+        vector<unsigned char> prev(size);
+        if (read_memtree_bytes(memroot, type, addr, size, prev.data()) &&
+            !memcmp(prev.data(), contents, size)) {
+            if (in_loop_run() && !node_changed) {
+                loop_node_touches.push_back(
+                    LoopTouch{type, addr, prev_lineno, std::move(prev)});
+                loop_touches_held = true;
+                return;
+            }
+            changed = false;
         }
     }
-}
-
-unsigned char *Index::make_memtree_update(char type, Addr addr, size_t size)
-{
-    OFF_T contents_offset = arena->alloc(size);
-
-    delete_from_memtree(type, addr, size);
+    if (changed)
+        node_changed = true;
 
     MemoryPayload memp;
     memp.type = type;
     memp.lo = addr;
     memp.hi = addr + (size - 1);
     memp.raw = true;
-    memp.contents = contents_offset;
+    memp.contents = shared_contents.store(*arena, contents, size);
     memp.trace_file_firstline = prev_lineno;
-    memroot = memtree->insert(memroot, memp);
-
-    return arena->getptr<unsigned char>(contents_offset);
+    add_to_memtree(memp);
 }
 
 void Index::update_memtree(char type, Addr addr, size_t size,
@@ -522,14 +1012,16 @@ void Index::update_memtree(char type, Addr addr, size_t size,
     if (type == 'm' && !iparams.record_memory)
         return;
 
-    unsigned char *contents_ptr = make_memtree_update(type, addr, size);
+    unsigned char bytes[sizeof(contents)];
+    assert(size <= sizeof(bytes));
     if (type == 'm' && pparams.bigend) {
         for (size_t i = 0; i < size; i++)
-            contents_ptr[i] = contents >> (8 * (size - 1 - i));
+            bytes[i] = contents >> (8 * (size - 1 - i));
     } else {
         for (size_t i = 0; i < size; i++)
-            contents_ptr[i] = contents >> (8 * i);
+            bytes[i] = contents >> (8 * i);
     }
+    make_memtree_update(type, addr, size, bytes);
 }
 
 void Index::update_memtree_if_necessary(char type, Addr addr, size_t size,
@@ -553,10 +1045,23 @@ void Index::update_memtree_if_necessary(char type, Addr addr, size_t size,
 
 OFF_T Index::make_sub_memtree(char type, Addr addr, size_t size)
 {
-    OFF_T newroot_offset = arena->alloc(sizeof(diskint<OFF_T>));
-    *arena->getptr<diskint<OFF_T>>(newroot_offset) = 0;
+    OFF_T newroot_offset;
+    if (replaying) {
+        // Reuse the subtree made at this point during indexing, which
+        // later memory reads will have filled in
+        if (replay_subtree_pos >= lazy_subtree_words.size())
+            reporter->errx(1, _("%s: lazy memory region does not match "
+                                "trace file"),
+                           trace.index_filename.c_str());
+        newroot_offset = lazy_subtree_words[replay_subtree_pos++];
+    } else {
+        newroot_offset = arena->alloc(sizeof(diskoff));
+        *arena->getptr<diskoff>(newroot_offset) = 0;
+        if (iparams.lazy_memory)
+            lazy_subtree_words.push_back(newroot_offset);
+    }
 
-    delete_from_memtree(type, addr, size);
+    node_changed = true;
 
     MemoryPayload memp;
     memp.type = type;
@@ -565,11 +1070,105 @@ OFF_T Index::make_sub_memtree(char type, Addr addr, size_t size)
     memp.raw = false;
     memp.contents = newroot_offset;
     memp.trace_file_firstline = prev_lineno;
-    memroot = memtree->insert(memroot, memp);
+    add_to_memtree(memp);
 
     return newroot_offset;
 }
 
+void Index::add_to_memtree(const MemoryPayload &memp)
+{
+    // Writes held back from a possible loop iteration come first
+    if (loop_touches_held)
+        flush_loop_touches();
+    memroot = memtree_overwrite(*memtree, memroot, memp);
+    if (iparams.snapshot_interval > 1)
+        pending_deltas.push_back(memp);
+}
+
+OFF_T Index::write_memory_delta_record()
+{
+    MemoryDeltaRecord rec;
+    if (nodes_since_snapshot == 0) {
+        // Time for a snapshot. Committing the memory tree makes the
+        // current state immutable, so it can be referred to for ever.
+        memtree->commit();
+        snapshot_root = memroot;
+        rec.prev = 0;
+        rec.count = 0;
+    } else {
+        rec.prev = prev_delta_record;
+        rec.count = pending_deltas.size();
+    }
+    rec.snapshot_root = snapshot_root;
+
+    OFF_T offset = arena->alloc(rec.size());
+    *arena->getptr<MemoryDeltaRecord>(offset) = rec;
+    for (unsigned i = 0; i < rec.count; i++)
+        *arena->getptr<MemoryPayload>(offset + sizeof(MemoryDeltaRecord) +
+                                      i * sizeof(MemoryPayload)) =
+            pending_deltas[i];
+
+    pending_deltas.clear();
+    prev_delta_record = offset;
+    if (++nodes_since_snapshot == iparams.snapshot_interval)
+        nodes_since_snapshot = 0;
+    return offset;
+}
+
+OFF_T Index::write_lazy_memory_slot()
+{
+    LazyMemorySlot slot;
+    if (nodes_since_snapshot == 0) {
+        // Time for a checkpoint, which starts a new region
+        close_lazy_memory_region();
+        memtree->commit();
+
+        LazyMemoryRegion reg;
+        reg.checkpoint_root = memroot;
+        reg.first_line = prev_lineno;
+        reg.nodes = 0;
+        reg.subtree_words = 0;
+        reg.nsubtrees = 0;
+        lazy_region = arena->alloc(sizeof(LazyMemoryRegion));
+        *arena->getptr<LazyMemoryRegion>(lazy_region) = reg;
+
+        slot.root = memroot;
+    } else {
+        slot.root = 0;
+    }
+    slot.region = lazy_region;
+
+    LazyMemoryRegion &reg = *arena->getptr<LazyMemoryRegion>(lazy_region);
+    reg.nodes = reg.nodes + 1;
+
+    OFF_T offset = arena->alloc(sizeof(LazyMemorySlot));
+    *arena->getptr<LazyMemorySlot>(offset) = slot;
+
+    if (++nodes_since_snapshot == iparams.lazy_memory_interval)
+        nodes_since_snapshot = 0;
+    return offset;
+}
+
+void Index::close_lazy_memory_region()
+{
+    // Record the memory subtrees made since the region's first node.
+    // Any made during its first node are already in the checkpoint,
+    // and any made since the last node are left over at the end of
+    // the list, where rebuilding the region won't look for them.
+    if (lazy_region) {
+        unsigned n = lazy_subtree_words.size();
+        OFF_T words = n ? arena->alloc(n * sizeof(diskoff)) : 0;
+        for (unsigned i = 0; i < n; i++)
+            *arena->getptr<diskoff>(words + i * sizeof(diskoff)) =
+                lazy_subtree_words[i];
+
+        LazyMemoryRegion &reg = *arena->getptr<LazyMemoryRegion>(lazy_region);
+        reg.subtree_words = words;
+        reg.nsubtrees = n;
+    }
+    lazy_subtree_words.clear();
+}
+
 void Index::update_memtree_from_read(char type, Addr addr, size_t size,
                                      unsigned long long contents)
 {
@@ -586,6 +1185,20 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
             data[i] = contents >> (8 * i);
     }
 
+    fill_memtree_from_read(type, addr, size, data);
+}
+
+// Fill in whatever a read of memory has told us about the contents of
+// memory subtrees covering it, which stand for memory whose contents
+// were unknown when it was last written.
+void Index::fill_memtree_from_read(char type, Addr addr, size_t size,
+                                   const unsigned char *data)
+{
+    // A lazy memory region's subtrees already hold everything that
+    // reads told us when the index was made
+    if (replaying)
+        return;
+
     MemoryPayload memp_search, memp;
     memp_search.type = type;
     memp_search.lo = addr;
@@ -608,8 +1221,8 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
              * changed in future, this would be where to add code.
              */
         } else {
-            diskint<OFF_T> *subroot =
-                arena->getptr<diskint<OFF_T>>(memp.contents);
+            diskoff *subroot =
+                arena->getptr<diskoff>(memp.contents);
 
             MemorySubPayload msp;
             msp.lo = memp_search.lo;
@@ -632,22 +1245,20 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
                     MemorySubPayload msp_insert;
                     msp_insert.lo = msp.lo;
                     msp_insert.hi = msp_found.lo - 1;
-                    OFF_T contents_offset =
-                        arena->alloc(msp_insert.hi - msp_insert.lo + 1);
-                    // Take account of alloc() perhaps having
+                    msp_insert.contents = shared_contents.store(
+                        *arena, data + (msp.lo - addr),
+                        msp_insert.hi - msp_insert.lo + 1);
+                    // Take account of store() perhaps having
                     // re-mmapped the file
-                    subroot = arena->getptr<diskint<OFF_T>>(memp.contents);
-                    memcpy(arena->getptr<unsigned char>(contents_offset),
-                           data + (msp.lo - addr),
-                           msp_insert.hi - msp_insert.lo + 1);
-                    msp_insert.contents = contents_offset;
+                    subroot = arena->getptr<diskoff>(memp.contents);
 
                     OFF_T new_subroot_value =
                         memsubtree->insert(*subroot, msp_insert);
                     // Take account of insert() perhaps having
                     // re-mmapped the file
-                    subroot = arena->getptr<diskint<OFF_T>>(memp.contents);
+                    subroot = arena->getptr<diskoff>(memp.contents);
                     *subroot = new_subroot_value;
+                    node_changed = true;
                 }
                 msp.lo = msp_found.hi + 1;
             }
@@ -658,26 +1269,23 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
     }
 }
 
-bool Index::read_memtree_value(char type, Addr addr, size_t size,
-                               unsigned long long *output)
+// Read 'size' bytes of registers or memory from the memory tree with
+// the given root into 'data', returning false if any of them is
+// unknown.
+bool Index::read_memtree_bytes(OFF_T root, char type, Addr addr, size_t size,
+                               unsigned char *data)
 {
-    unsigned char data[8], def[8];
-
     MemoryPayload memp_search;
     memp_search.type = type;
     memp_search.lo = addr;
     memp_search.hi = addr + (size - 1);
 
-    memset(def, 0, size);
-
-    while (memp_search.lo <= memp_search.hi) {
-        bool found;
-        MemoryPayload memp_got;
-        found = memtree->find_leftmost(last_memroot, memp_search, &memp_got,
-                                       nullptr);
-        if (!found)
-            break;
+    // The pieces found never overlap, so adding up their sizes says
+    // whether every byte was found
+    size_t found_bytes = 0;
 
+    memtree->visit_range(root, memp_search, [&](const MemoryPayload &memp_got,
+                                                OFF_T) {
         Addr addr_lo = max(memp_search.lo, memp_got.lo);
         Addr addr_hi = min(memp_search.hi, memp_got.hi);
 
@@ -686,34 +1294,45 @@ bool Index::read_memtree_value(char type, Addr addr, size_t size,
                 arena->getptr<unsigned char>(memp_got.contents);
             memcpy((char *)data + (addr_lo - addr),
                    treedata + (addr_lo - memp_got.lo), addr_hi - addr_lo + 1);
-            memset((char *)def + (addr_lo - addr), 1, addr_hi - addr_lo + 1);
+            found_bytes += addr_hi - addr_lo + 1;
         } else {
             OFF_T subroot =
-                *arena->getptr<diskint<OFF_T>>(memp_got.contents);
-            MemorySubPayload msp, msp_found;
+                *arena->getptr<diskoff>(memp_got.contents);
+            MemorySubPayload msp;
             msp.lo = addr_lo;
             msp.hi = addr_hi;
-            while (msp.lo <= msp.hi && memsubtree->find_leftmost(
-                                           subroot, msp, &msp_found, nullptr)) {
-                Addr subaddr_lo = max(msp.lo, msp_found.lo);
-                Addr subaddr_hi = min(msp.hi, msp_found.hi);
-                const unsigned char *treedata =
-                    arena->getptr<unsigned char>(msp_found.contents);
-                memcpy((char *)data + (subaddr_lo - addr),
-                       treedata + (subaddr_lo - msp_found.lo),
-                       subaddr_hi - subaddr_lo + 1);
-                memset((char *)def + (subaddr_lo - addr), 1,
-                       subaddr_hi - subaddr_lo + 1);
-                msp.lo = subaddr_hi + 1;
-            }
+            memsubtree->visit_range(
+                subroot, msp, [&](const MemorySubPayload &msp_found, OFF_T) {
+                    Addr subaddr_lo = max(msp.lo, msp_found.lo);
+                    Addr subaddr_hi = min(msp.hi, msp_found.hi);
+                    const unsigned char *treedata =
+                        arena->getptr<unsigned char>(msp_found.contents);
+                    memcpy((char *)data + (subaddr_lo - addr),
+                           treedata + (subaddr_lo - msp_found.lo),
+                           subaddr_hi - subaddr_lo + 1);
+                    found_bytes += subaddr_hi - subaddr_lo + 1;
+                    return true;
+                });
         }
+        return true;
+    });
 
-        memp_search.lo = memp_got.hi + 1;
-        if (memp_search.lo == 0) // special case: address space wraparound
-            break;
-    }
+    return found_bytes == size;
+}
+
+bool Index::read_memtree_value(char type, Addr addr, size_t size,
+                               unsigned long long *output)
+{
+    unsigned char data[8];
+    assert(size <= sizeof(data));
+
+    // When storing memory deltas or building memory trees lazily, the
+    // memory tree is modified in place between snapshots, so the state
+    // as of the last seqtree node isn't kept, and we read the current
+    // state instead.
+    OFF_T root = memtree_in_place() ? memroot : last_memroot;
 
-    if (memchr(def, '\0', size))
+    if (!read_memtree_bytes(root, type, addr, size, data))
         return false; // not every byte was available
 
     if (output) {
@@ -761,9 +1380,28 @@ class CallDepthCountingTreeWalker {
 
 class CallDepthArrayTreeWalker {
     Arena *arena;
+    const vector<LoopRun> &loop_runs;
+
+    // Number of seqtree nodes that a node stands for: more than one if
+    // it's a folded run of loop iterations
+    LineNo node_count(const SeqOrderPayload &node) const
+    {
+        auto it = std::lower_bound(
+            loop_runs.begin(), loop_runs.end(), node.trace_file_firstline,
+            [](const LoopRun &run, LineNo line) {
+                return run.first_line < line;
+            });
+        if (it != loop_runs.end() &&
+            it->first_line == node.trace_file_firstline)
+            return (LineNo)it->iterations * it->period_nodes;
+        return 1;
+    }
 
   public:
-    CallDepthArrayTreeWalker(Arena *arena) : arena(arena) {}
+    CallDepthArrayTreeWalker(Arena *arena, const vector<LoopRun> &loop_runs)
+        : arena(arena), loop_runs(loop_runs)
+    {
+    }
     CallDepthArrayTreeWalker(const CallDepthArrayTreeWalker &) = delete;
 
     void operator()(SeqOrderPayload &mainpayload, SeqOrderAnnotation &main,
@@ -783,7 +1421,7 @@ class CallDepthArrayTreeWalker {
         current_node_array[0].cumulative_insns = 0;
         current_node_array[1].call_depth = SENTINEL_DEPTH;
         current_node_array[1].cumulative_lines = mainpayload.trace_file_lines;
-        current_node_array[1].cumulative_insns = 1;
+        current_node_array[1].cumulative_insns = node_count(mainpayload);
         arrays[ROOT] = current_node_array;
         len[ROOT] = 2;
 
@@ -849,7 +1487,7 @@ class CallDepthArrayTreeWalker {
         // Now do a second merge pass over the same arrays actually
         // populating the new array.
         unsigned new_arraypos = 0;
-        unsigned clines = 0, cinsns = 0;
+        LineNo clines = 0, cinsns = 0;
         for (int i = 0; i < NARRAYS; i++)
             index[i] = 0;
         while (true) {
@@ -887,6 +1525,11 @@ class CallDepthArrayTreeWalker {
 
 void Index::got_event_common(TarmacEvent *event, bool is_instruction)
 {
+    // When rebuilding a lazy memory region, the caller already knows
+    // where each seqtree node starts and ends
+    if (replaying)
+        return;
+
     /*
      * Tarmac files have been known to include chronological disorder,
      * e.g. a Cortex-M3 Fast Model might output 'CADI
@@ -900,34 +1543,54 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
     if (event && (ev_time == -(Time)1 || event->time > ev_time))
         ev_time = event->time;
 
+    // In a per-CPU view, another trace source's instructions don't
+    // start nodes of their own, but a change between this CPU's lines
+    // and anyone else's always does
+    bool foreign = is_foreign(event);
+    bool filtered = !foreign && is_filtered(event, is_instruction);
+    if (foreign)
+        is_instruction = false;
+    if (cpu_view && cpu_view->found_source && event && event->source &&
+        sources_seen.insert(event->source).second)
+        cpu_view->found_source(parser.source_name(event->source));
+
     if (!seen_any_event)
         lineno_offset = true_lineno - lineno;
 
-    if (!event || ev_time != current_time ||
-        (seen_instruction_at_current_time && is_instruction)) {
-        if (seen_any_event && linepos != oldpos) {
+    // A run of excluded instructions makes just one node, however many
+    // times and instructions it covers, unless it gets too long for a
+    // node's 32-bit byte and line counts
+    bool filtered_run_full =
+        filtered && filtered_node &&
+        (linepos - oldpos >= FILTERED_RUN_MAX_BYTES ||
+         lineno - prev_lineno >= FILTERED_RUN_MAX_LINES);
+    if (!event || foreign != foreign_node || filtered != filtered_node ||
+        filtered_run_full ||
+        (!filtered && (ev_time != current_time ||
+                       (seen_instruction_at_current_time && is_instruction)))) {
+        if (seen_any_event && linepos != oldpos && !warming_up()) {
             SeqOrderPayload seqp;
             seqp.mod_time = current_time;
-            seqp.pc = curr_pc;
+            seqp.pc = filtered_node ? KNOWN_INVALID_PC : curr_pc;
             seqp.trace_file_pos = oldpos;
             seqp.trace_file_len = linepos - oldpos;
             seqp.trace_file_firstline = prev_lineno;
             seqp.trace_file_lines = lineno - prev_lineno;
-            seqp.memory_root = memroot;
+            seqp.memory_root = iparams.lazy_memory ? write_lazy_memory_slot()
+                               : iparams.snapshot_interval > 1
+                                   ? write_memory_delta_record()
+                                   : memroot;
             seqp.call_depth = 0; // fill this in later
-            seqroot = seqtree->insert(seqroot, seqp);
-
-            if (curr_pc != KNOWN_INVALID_PC) {
-                ByPCPayload bypcp;
-                bypcp.trace_file_firstline = prev_lineno;
-                bypcp.pc = curr_pc & ~(unsigned long long)1;
-                bypcroot = bypctree->insert(bypcroot, bypcp);
-            }
+            add_seq_node(seqp);
         }
+        node_changed = false;
 
+        if (shard && !shard->start_memroot && !warming_up())
+            shard->start_memroot = last_memroot;
         last_memroot = memroot;
         last_sp = curr_sp;
-        memtree->commit();
+        if (!memtree_in_place())
+            memtree->commit();
 
         if (!event)
             return;
@@ -942,21 +1605,274 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
         prev_lineno = lineno;
         seen_any_event = true;
         seen_cpu_exception_at_current_line = false;
+        foreign_node = foreign;
+        filtered_node = filtered;
     }
 
     if (is_instruction)
         seen_instruction_at_current_time = true;
 }
 
+void Index::add_seq_node(const SeqOrderPayload &seqp)
+{
+    if (!iparams.compress_loops) {
+        insert_seq_node(seqp);
+        return;
+    }
+
+    LoopNode ln{seqp.pc, seqp.trace_file_lines, seqp.trace_file_firstline};
+    auto matches = [&](unsigned period) {
+        if (node_changed || ln.pc == KNOWN_INVALID_PC ||
+            loop_history.size() < period)
+            return false;
+        const LoopNode &prev = loop_history[loop_history.size() - period];
+        return prev.pc == ln.pc && prev.lines == ln.lines;
+    };
+
+    for (unsigned period = 1; period <= LOOP_MAX_PERIOD; period++)
+        loop_streak[period] = matches(period) ? loop_streak[period] + 1 : 0;
+    bool continues_run = in_loop_run() && matches(loop_run_rec.period_nodes);
+    loop_history.push_back(ln);
+    if (loop_history.size() > LOOP_MAX_PERIOD)
+        loop_history.pop_front();
+
+    if (continues_run) {
+        loop_pending.push_back(seqp);
+        loop_pending_touches.push_back(std::move(loop_node_touches));
+        loop_node_touches.clear();
+        if (loop_pending.size() < loop_run_rec.period_nodes)
+            return;
+
+        // A whole iteration has gone by, so fold it into the run node
+        OFF_T len = loop_pending.back().trace_file_pos +
+                    loop_pending.back().trace_file_len -
+                    loop_pending.front().trace_file_pos;
+        LineNo lines = loop_pending.back().trace_file_firstline +
+                       loop_pending.back().trace_file_lines -
+                       loop_pending.front().trace_file_firstline;
+
+        // An iteration too long to be a node by itself isn't folded
+        if (len > SEQ_NODE_MAX_BYTES || lines > UINT_MAX) {
+            flush_loop_touches();
+            end_loop_run();
+            return;
+        }
+
+        // The writes this iteration held back are the ones to store
+        // if the run ends, since it makes the same ones as the last
+        loop_folded_touches.clear();
+        for (auto &touches : loop_pending_touches)
+            for (auto &touch : touches)
+                loop_folded_touches.push_back(std::move(touch));
+        loop_pending_touches.clear();
+
+        // Start a fresh run node, with the same body and this iteration
+        // first, once this one is as long as we allow, or if adding the
+        // iteration would overflow any of its counts
+        if (loop_run_rec.iterations &&
+            (loop_run.trace_file_len >= LOOP_RUN_MAX_BYTES ||
+             len > SEQ_NODE_MAX_BYTES - loop_run.trace_file_len ||
+             lines > UINT_MAX - loop_run.trace_file_lines ||
+             loop_run_rec.iterations == UINT_MAX)) {
+            vector<SeqOrderPayload> iteration;
+            iteration.swap(loop_pending);
+            unsigned period = loop_run_rec.period_nodes;
+            LineNo body_line = loop_run_rec.body_line;
+            end_loop_run();
+            start_loop_run(period, body_line);
+            loop_pending.swap(iteration);
+        }
+
+        const SeqOrderPayload &first = loop_pending.front();
+        if (!loop_run_rec.iterations) {
+            loop_run = first;
+            loop_run.trace_file_len = len;
+            loop_run.trace_file_lines = lines;
+            loop_run_rec.first_line = first.trace_file_firstline;
+            loop_run_rec.period_lines = lines;
+            loop_body_pcs.clear();
+            for (const auto &node : loop_pending)
+                loop_body_pcs.push_back(
+                    make_pair(node.pc, node.trace_file_firstline -
+                                           first.trace_file_firstline));
+        } else {
+            loop_run.trace_file_len = loop_run.trace_file_len + len;
+            loop_run.trace_file_lines = loop_run.trace_file_lines + lines;
+        }
+        loop_run_rec.iterations = loop_run_rec.iterations + 1;
+        loop_folded_to = first.trace_file_firstline + lines;
+        loop_pending.clear();
+        return;
+    }
+
+    if (in_loop_run()) {
+        // This node doesn't fold, so nor do the ones since the last
+        // iteration that did, and all of them need the writes they
+        // held back
+        SeqOrderPayload node = seqp;
+        if (loop_touches_held) {
+            flush_loop_touches();
+            node.memory_root = memroot;
+        }
+        end_loop_run();
+        insert_seq_node(node);
+    } else {
+        insert_seq_node(seqp);
+    }
+
+    // Once the nodes just made have repeated the ones before them, and
+    // changed nothing, start folding further repeats of them
+    for (unsigned period = 1; period <= LOOP_MAX_PERIOD; period++) {
+        if (loop_streak[period] < period)
+            continue;
+        LineNo body_line =
+            loop_history[loop_history.size() - period].firstline;
+        if (body_line >= loop_folded_to)
+            start_loop_run(period, body_line);
+        break;
+    }
+}
+
+void Index::insert_seq_node(const SeqOrderPayload &seqp)
+{
+    seqroot = seqtree->insert(seqroot, seqp);
+
+    if (seqp.pc != KNOWN_INVALID_PC) {
+        ByPCPayload bypcp;
+        bypcp.trace_file_firstline = seqp.trace_file_firstline;
+        bypcp.pc = seqp.pc & ~(unsigned long long)1;
+        bypcroot = bypctree->insert(bypcroot, bypcp);
+    }
+}
+
+void Index::start_loop_run(unsigned period, LineNo body_line)
+{
+    loop_run_rec.body_line = body_line;
+    loop_run_rec.period_nodes = period;
+    loop_run_rec.iterations = 0;
+    loop_pending.clear();
+    loop_pending_touches.clear();
+}
+
+void Index::end_loop_run()
+{
+    if (loop_run_rec.iterations) {
+        seqroot = seqtree->insert(seqroot, loop_run);
+        for (const auto &body_pc : loop_body_pcs) {
+            ByPCPayload bypcp;
+            bypcp.trace_file_firstline =
+                loop_run.trace_file_firstline + body_pc.second;
+            bypcp.pc = body_pc.first & ~(unsigned long long)1;
+            bypcroot = bypctree->insert(bypcroot, bypcp);
+        }
+        loop_runs.push_back(loop_run_rec);
+    }
+
+    // A partial iteration at the end of the run is left as it is
+    for (const auto &node : loop_pending)
+        insert_seq_node(node);
+
+    loop_pending.clear();
+    loop_pending_touches.clear();
+    loop_run_rec.period_nodes = 0;
+}
+
+void Index::store_loop_touches(const vector<LoopTouch> &touches)
+{
+    for (const auto &touch : touches) {
+        MemoryPayload memp;
+        memp.type = touch.type;
+        memp.lo = touch.addr;
+        memp.hi = touch.addr + (touch.contents.size() - 1);
+        memp.raw = true;
+        memp.contents = shared_contents.store(*arena, touch.contents.data(),
+                                              touch.contents.size());
+        memp.trace_file_firstline = touch.line;
+        memroot = memtree_overwrite(*memtree, memroot, memp);
+    }
+}
+
+// Store the writes held back by a loop run, now that it's known not to
+// be folded any further. The nodes still waiting to be folded get
+// memory states of their own, with their writes in.
+void Index::flush_loop_touches()
+{
+    loop_touches_held = false;
+    store_loop_touches(loop_folded_touches);
+    loop_folded_touches.clear();
+    for (size_t i = 0; i < loop_pending_touches.size(); i++) {
+        store_loop_touches(loop_pending_touches[i]);
+        memtree->commit();
+        loop_pending[i].memory_root = memroot;
+    }
+    loop_pending_touches.clear();
+    store_loop_touches(loop_node_touches);
+    loop_node_touches.clear();
+}
+
 bool Index::parse_warning(const string &msg)
 {
-    reporter->indexing_warning(trace.tarmac_filename, lineno + lineno_offset,
-                               msg);
+    // Warnings were already given when the index was first made, a
+    // shard leaves warnings about its warm-up lines to the previous
+    // shard, and only one CPU view reports them at all
+    if (work) {
+        if (work->keep_warnings && (!shard || lineno >= shard->first_line))
+            work->warnings.emplace_back(lineno + lineno_offset, msg);
+    } else if (!replaying) {
+        reporter->indexing_warning(trace.tarmac_filename,
+                                   lineno + lineno_offset, msg);
+    }
     return false;
 }
 
+static uint64_t exclusions_hash(const IndexerParams &iparams)
+{
+    FNVHash hash;
+    for (auto *ranges : {&iparams.exclude_pcs, &iparams.exclude_data}) {
+        hash.add(ranges->size());
+        for (auto &range : *ranges) {
+            hash.add(range.first);
+            hash.add(range.second);
+        }
+    }
+    return hash.value;
+}
+
+// Whether a mapped index file is at least long enough to hold its magic
+// number and header. Anything shorter was never completed.
+static bool index_header_present(const Arena &arena)
+{
+    return arena.curr_offset() >=
+           (OFF_T)(sizeof(MagicNumber) + sizeof(FileHeader));
+}
+
+// Record in a new index's header the options that check_index_header
+// compares, and compare them
+static void record_index_params(FileHeader &hdr, const IndexerParams &iparams)
+{
+    hdr.window_start_line = iparams.window_start_line;
+    hdr.window_end_line = iparams.window_end_line;
+    hdr.window_start_time = iparams.window_start_time;
+    hdr.window_end_time = iparams.window_end_time;
+    hdr.exclusions_hash = exclusions_hash(iparams);
+}
+
+static bool index_params_match(const FileHeader &hdr,
+                               const IndexerParams &iparams)
+{
+    return hdr.window_start_line == iparams.window_start_line &&
+           hdr.window_end_line == iparams.window_end_line &&
+           hdr.window_start_time == iparams.window_start_time &&
+           hdr.window_end_time == iparams.window_end_time &&
+           hdr.exclusions_hash == exclusions_hash(iparams);
+}
+
 void Index::open_index_file()
 {
+    if (iparams.lazy_memory && iparams.snapshot_interval > 1)
+        reporter->errx(1, _("lazy memory trees cannot be combined with a "
+                            "snapshot interval"));
+
     if (trace.index_on_disk) {
         remove(trace.index_filename.c_str());
         arena = make_shared<MMapFile>(trace.index_filename, true);
@@ -968,28 +1884,44 @@ void Index::open_index_file()
 
     header_offset = arena->alloc(sizeof(FileHeader));
     FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    hdr.byte_order = BYTE_ORDER_HOST;
+    hdr.memsubtree_type = (char)iparams.memsubtree_type;
+    hdr.bypctree_type = (char)iparams.bypctree_type;
+    hdr.seqtree_type = (char)TreeType::AVL; // until finalise_index
+    hdr.seqbtreeroot = 0;
+    record_index_params(hdr, iparams);
     hdr.flags = 0;        // ensure FLAG_COMPLETE is not initially set
 
     magic.setup();
 
     memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(*arena);
-    memsubtree = new AVLDisk<MemorySubPayload>(*arena);
+    memsubtree = new SelectableTree<MemorySubPayload>(
+        *arena, iparams.memsubtree_type);
     seqtree = new AVLDisk<SeqOrderPayload, SeqOrderAnnotation>(*arena);
-    bypctree = new AVLDisk<ByPCPayload>(*arena);
+    bypctree = new SelectableTree<ByPCPayload>(*arena, iparams.bypctree_type);
 }
 
 void Index::open_trace_file()
 {
     /*
-     * Read in the input.
+     * Read in the input. A CPU view gets it from the thread reading
+     * the file on behalf of all the views.
      */
-    ifs = make_unique<ifstream>(trace.tarmac_filename.c_str(),
-                                std::ios_base::in | std::ios_base::binary);
-    if (ifs->fail())
-        reporter->err(1, "%s: open", trace.tarmac_filename.c_str());
+    if (cpu_view) {
+        ifs = make_unique<istream>(&cpu_view->feed);
+    } else {
+        tracebuf = make_unique<SequentialFileBuf>(trace.tarmac_filename,
+                                                  iparams.trace_drop_behind,
+                                                  iparams.trace_direct_io);
+        if (!tracebuf->is_open())
+            reporter->err(1, "%s: open", trace.tarmac_filename.c_str());
+        ifs = make_unique<istream>(tracebuf.get());
+    }
 
     memroot = seqroot = 0;
     prev_lineno = 0; // used to fill in last-mod time in make_sub_memtree
+    snapshot_root = prev_delta_record = 0;
+    nodes_since_snapshot = 0;
 
     // Set the initial contents of memory to be a sub-memtree, so that
     // we can fill in anything we later find out about via MR events.
@@ -1006,17 +1938,47 @@ void Index::open_trace_file()
     bypcroot = 0;
     true_lineno = 0;
     lineno = 1;
-    oldpos = 0;
+    oldpos = linepos = 0;
+    line_offsets_first = nline_offsets = 0;
+    line_offset_chunks.clear();
     lineno_offset = 0;
     seen_any_event = false;
     prev_lineno = lineno;
     curr_pc = KNOWN_INVALID_PC;
+    curr_sp = 0;
+    insns_since_lr_update = BRANCH_LR_WRITE_THRESHOLD;
     max_sve_bits = 128;
 
-    ifs->seekg(0, ios::end);
-    reporter->indexing_start(ifs->tellg());
-    ifs->seekg(0);
-}
+    if (cpu_view)
+        return;
+
+    if (shard) {
+        if (shard->start_pos != 0) {
+            // Start part way through the file, as if the lines before
+            // had been read already, except that nothing is known
+            // about the registers and memory
+            seen_any_event = true;
+            lineno_offset = shard->lineno_offset;
+            true_lineno = shard->start_lineno - 1;
+            lineno = prev_lineno = true_lineno - lineno_offset;
+            oldpos = linepos = shard->start_pos;
+            ifs->seekg(shard->start_pos);
+        }
+        return;
+    }
+
+    ifs->seekg(0, ios::end);
+    streamoff end = min((streamoff)ifs->tellg(), (streamoff)window.end_pos);
+    reporter->indexing_start(max(end - (streamoff)window.start_pos,
+                                 (streamoff)0));
+    ifs->seekg(window.start_pos);
+
+    // A window starts reading part way through the file, but unlike a
+    // shard, nothing before it has been seen, so the numbering of the
+    // lines in the index starts again from its first event
+    true_lineno = window.start_lineno - 1;
+    oldpos = linepos = window.start_pos;
+}
 
 bool Index::read_one_trace_line()
 {
@@ -1024,6 +1986,11 @@ bool Index::read_one_trace_line()
     if (seen_any_event)
         lineno++;
 
+    if ((shard && linepos >= shard->end_pos) || linepos >= window.end_pos) {
+        finish_reading_trace_file();
+        return false;
+    }
+
     if (ifs->eof()) {
         // If getline() above returned a truncated line, then it
         // will have set the fail flag on the stream, which will
@@ -1042,6 +2009,12 @@ bool Index::read_one_trace_line()
         return false;
     }
 
+    if ((true_lineno - 1) % LINE_OFFSET_INTERVAL == 0) {
+        if (nline_offsets == 0)
+            line_offsets_first = (true_lineno - 1) / LINE_OFFSET_INTERVAL;
+        add_line_offset(linepos);
+    }
+
     try {
         parser.parse(line);
     } catch (TarmacParseError e) {
@@ -1050,10 +2023,20 @@ bool Index::read_one_trace_line()
             oss << e.msg << endl
                 << _("ignoring parse error on partial last line "
                      "(trace truncated?)");
-            reporter->indexing_warning(trace.tarmac_filename, lineno,
-                                       oss.str());
+            if (work) {
+                if (work->keep_warnings)
+                    work->warnings.emplace_back(lineno, oss.str());
+            } else
+                reporter->indexing_warning(trace.tarmac_filename, lineno,
+                                           oss.str());
             finish_reading_trace_file();
             return false;
+        } else if (work) {
+            // Leave it to the main thread to report, in order
+            work->failed = true;
+            work->error_line = lineno;
+            work->error = e.msg;
+            return false;
         } else {
             if (trace.index_on_disk)
                 remove(trace.index_filename.c_str());
@@ -1065,7 +2048,12 @@ bool Index::read_one_trace_line()
     // times. tellg() is a somehow slow function on some platforms, and this
     // alone allows a 2x speedup in parsing time.
     linepos += line.size() + 1;
-    reporter->indexing_progress(linepos);
+    if (work) {
+        if (work->progress)
+            *work->progress += line.size() + 1;
+    } else {
+        reporter->indexing_progress(linepos - window.start_pos);
+    }
 
     return true;
 }
@@ -1075,15 +2063,21 @@ void Index::finish_reading_trace_file()
     if (!ifs)
         return;
 
-    reporter->indexing_done();
+    if (!work)
+        reporter->indexing_done();
 
     // Call got_event with no actual event, signalling end-of-file, so
     // that the last record is output (the same flushing of
     // accumulated data we'd do on seeing the next instruction, except
     // that then we stop without processing an instruction).
     got_event_common(nullptr, false);
+    if (in_loop_run()) {
+        flush_loop_touches();
+        end_loop_run();
+    }
 
     ifs = nullptr;
+    tracebuf = nullptr;
 }
 
 void Index::build_call_tree()
@@ -1099,14 +2093,64 @@ void Index::build_call_tree()
             seqtree->walk(seqroot, WalkOrder::Inorder, ref(visitor));
         }
         {
-            CallDepthArrayTreeWalker visitor(arena.get());
+            CallDepthArrayTreeWalker visitor(arena.get(), loop_runs);
             seqtree->walk(seqroot, WalkOrder::Postorder, ref(visitor));
         }
     }
 }
 
+void Index::add_line_offset(OFF_T pos)
+{
+    size_t index = nline_offsets++ % LINE_OFFSET_CHUNK;
+    if (index == 0)
+        line_offset_chunks.push_back(
+            arena->alloc(LINE_OFFSET_CHUNK * sizeof(diskoff)));
+    arena->getptr<diskoff>(line_offset_chunks.back())[index] = pos;
+}
+
+OFF_T Index::line_offset(LineNo i) const
+{
+    return arena->getptr<diskoff>(
+        line_offset_chunks[i / LINE_OFFSET_CHUNK])[i % LINE_OFFSET_CHUNK];
+}
+
 void Index::finalise_index()
 {
+    OFF_T loop_table = 0;
+    if (!loop_runs.empty()) {
+        loop_table = arena->alloc(loop_runs.size() * sizeof(LoopRun));
+        for (size_t i = 0; i < loop_runs.size(); i++)
+            *arena->getptr<LoopRun>(loop_table + i * sizeof(LoopRun)) =
+                loop_runs[i];
+    }
+
+    OFF_T line_table = 0;
+    if (!line_offset_chunks.empty()) {
+        line_table =
+            arena->alloc(line_offset_chunks.size() * sizeof(diskoff));
+        diskoff *chunks = arena->getptr<diskoff>(line_table);
+        for (size_t i = 0; i < line_offset_chunks.size(); i++)
+            chunks[i] = line_offset_chunks[i];
+    }
+
+    // The B+-tree copy of seqtree is made in one go from the finished
+    // tree, since build_call_tree has only just filled in the call
+    // depths in its payloads.
+    OFF_T seqbtreeroot = 0;
+    if (iparams.seqtree_type == TreeType::BTree) {
+        auto cursor = seqtree->cursor(seqroot);
+        size_t count = 0;
+        for (bool ok = cursor.first(); ok; ok = cursor.next())
+            count++;
+        cursor.first();
+        BTreeDisk<SeqOrderPayload> seqbtree(*arena);
+        seqbtreeroot = seqbtree.build(count, [&]() {
+            SeqOrderPayload payload = cursor.payload();
+            cursor.next();
+            return payload;
+        });
+    }
+
     FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
 
     if (seqroot == 0)
@@ -1119,6 +2163,16 @@ void Index::finalise_index()
         flags |= FLAG_THUMB_ONLY;
     if (aarch64_used)
         flags |= FLAG_AARCH64_USED;
+    if (iparams.snapshot_interval > 1)
+        flags |= FLAG_MEMORY_DELTAS;
+    if (iparams.lazy_memory) {
+        close_lazy_memory_region();
+        flags |= FLAG_LAZY_MEMORY;
+    }
+    if (shard_table)
+        flags |= FLAG_SHARDED;
+    if (loop_table)
+        flags |= FLAG_LOOP_RUNS;
 
     unsigned svelen_flag = ((max_sve_bits + 127) / 128 - 1) * FLAG_SVELEN_UNIT;
     assert((svelen_flag & ~FLAG_SVELEN_MASK) == 0);
@@ -1129,7 +2183,27 @@ void Index::finalise_index()
 
     hdr.seqroot = seqroot;
     hdr.bypcroot = bypcroot;
+    hdr.seqtree_type =
+        (char)(seqbtreeroot ? TreeType::BTree : TreeType::AVL);
+    hdr.seqbtreeroot = seqbtreeroot;
     hdr.lineno_offset = lineno_offset;
+    hdr.shards = shard_table;
+    hdr.nshards = nshards;
+    hdr.loop_runs = loop_table;
+    hdr.nloop_runs = loop_runs.size();
+    hdr.line_offsets = line_table;
+    hdr.line_offsets_first = line_offsets_first;
+    hdr.nline_offsets = nline_offsets;
+
+    if (idiags.debug_space) {
+        const auto &st = shared_contents.stats;
+        idiags.diag() << "Index size: " << arena->curr_offset() << " bytes\n"
+                      << "Raw contents blocks written: " << st.blocks << " ("
+                      << st.bytes << " bytes)\n"
+                      << "Shared with an identical earlier block: "
+                      << st.shared_blocks << " (" << st.shared_bytes
+                      << " bytes saved)" << endl;
+    }
 }
 
 void Index::parse_tarmac_file()
@@ -1141,57 +2215,2154 @@ void Index::parse_tarmac_file()
     finalise_index();
 }
 
-IndexHeaderState check_index_header(const string &index_filename)
+void Index::index_shard()
+{
+    open_index_file();
+    open_trace_file();
+    while (read_one_trace_line());
+    if (!shard->failed) {
+        compact_shard_memory();
+        flatten_shard_trees();
+    }
+}
+
+// Copy a memory subtree, given the word holding its root, out of one
+// arena into another, returning the offset of the new root word.
+static OFF_T copy_memsubtree(const SelectableTree<MemorySubPayload> &from,
+                             const Arena &from_arena, OFF_T word,
+                             SelectableTree<MemorySubPayload> &to,
+                             Arena &to_arena, SharedContentsTable &contents)
+{
+    OFF_T root = 0;
+    from.visit(*from_arena.getptr<diskoff>(word),
+               [&](const MemorySubPayload &p, OFF_T) {
+                   MemorySubPayload msp = p;
+                   msp.contents = contents.store(
+                       to_arena, from_arena.getptr<unsigned char>(p.contents),
+                       p.hi - p.lo + 1);
+                   root = to.insert(root, msp);
+               });
+    OFF_T newword = to_arena.alloc(sizeof(diskoff));
+    *to_arena.getptr<diskoff>(newword) = root;
+    return newword;
+}
+
+// Rebuild the memory trees of a shard's own part of the trace (see
+// IndexShardWork::own_arena). The state at each seqtree node differs
+// from the one before by the entries modified since, which the memory
+// tree annotations find without visiting the rest, so applying just
+// those in turn gives the same states without any of the warm-up.
+void Index::compact_shard_memory()
+{
+    if (trace.index_on_disk) {
+        string filename = trace.index_filename + ".mem";
+        remove(filename.c_str());
+        shard->own_arena = make_shared<MMapFile>(filename, true);
+    } else {
+        shard->own_arena = make_shared<MemArena>();
+    }
+    Arena &own = *shard->own_arena;
+    own.alloc(sizeof(diskoff)); // so that no tree node is at offset 0
+    shard->own_memtree =
+        make_unique<AVLDisk<MemoryPayload, MemoryAnnotation>>(own);
+    shard->own_memsubtree = make_unique<SelectableTree<MemorySubPayload>>(
+        own, iparams.memsubtree_type);
+
+    SharedContentsTable contents;
+    unordered_map<OFF_T, OFF_T> copied_subtrees;
+    OFF_T root = 0;
+    LineNo since = shard->first_line;
+    auto rebuild = [&](OFF_T oldroot) {
+        if (shard->own_roots.count(oldroot))
+            return;
+        LineNo latest = since;
+        memtree->visit_where(
+            oldroot,
+            [&](const MemoryAnnotation &annot) {
+                return annot.latest >= since;
+            },
+            [&](const MemoryPayload &p, OFF_T) {
+                MemoryPayload memp = p;
+                if (memp.raw) {
+                    memp.contents = contents.store(
+                        own, arena->getptr<unsigned char>(p.contents),
+                        p.hi - p.lo + 1);
+                } else {
+                    auto it = copied_subtrees.find(p.contents);
+                    if (it == copied_subtrees.end())
+                        it = copied_subtrees
+                                 .emplace(p.contents,
+                                          copy_memsubtree(
+                                              *memsubtree, *arena, p.contents,
+                                              *shard->own_memsubtree, own,
+                                              contents))
+                                 .first;
+                    memp.contents = it->second;
+                }
+                root = memtree_overwrite(*shard->own_memtree, root, memp);
+                latest = max(latest, (LineNo)p.trace_file_firstline);
+            });
+        shard->own_memtree->commit();
+        shard->own_roots[oldroot] = root;
+        since = latest + 1;
+    };
+
+    seqtree->visit(seqroot, [&](const SeqOrderPayload &p, OFF_T) {
+        rebuild(p.memory_root);
+    });
+    rebuild(memroot);
+}
+
+// Write out a shard's seqtree and by-PC tree as arrays (see
+// IndexShardWork::seq_nodes).
+void Index::flatten_shard_trees()
+{
+    seqtree->visit(seqroot,
+                   [&](const SeqOrderPayload &, OFF_T) { shard->nseq++; });
+    shard->seq_nodes = arena->alloc(shard->nseq * sizeof(SeqOrderPayload));
+    size_t i = 0;
+    seqtree->visit(seqroot, [&](const SeqOrderPayload &p, OFF_T) {
+        SeqOrderPayload seqp = p;
+        seqp.memory_root = shard->own_roots.at(p.memory_root);
+        *arena->getptr<SeqOrderPayload>(shard->seq_nodes +
+                                        i++ * sizeof(SeqOrderPayload)) = seqp;
+    });
+
+    bypctree->visit(bypcroot,
+                    [&](const ByPCPayload &, OFF_T) { shard->nbypc++; });
+    shard->bypc_nodes = arena->alloc(shard->nbypc * sizeof(ByPCPayload));
+    i = 0;
+    bypctree->visit(bypcroot, [&](const ByPCPayload &p, OFF_T) {
+        *arena->getptr<ByPCPayload>(shard->bypc_nodes +
+                                    i++ * sizeof(ByPCPayload)) = p;
+    });
+}
+
+void Index::index_cpu_view()
+{
+    open_index_file();
+    open_trace_file();
+    while (read_one_trace_line());
+    if (!cpu_view->failed) {
+        build_call_tree();
+        finalise_index();
+    }
+}
+
+// Copy a memory subtree out of a shard's own memory trees, into the
+// Index's own part of the file, returning the offset of the new
+// subtree's root word.
+OFF_T Index::copy_shard_subtree(const Index &sh, OFF_T base, OFF_T word)
+{
+    OFF_T root = 0;
+    sh.shard->own_memsubtree->visit(
+        *sh.shard->own_arena->getptr<diskoff>(word),
+        [&](const MemorySubPayload &p, OFF_T) {
+            MemorySubPayload msp = p;
+            msp.contents = msp.contents + base;
+            root = memsubtree->insert(root, msp);
+        });
+    OFF_T newword = arena->alloc(sizeof(diskoff));
+    *arena->getptr<diskoff>(newword) = root;
+    return newword;
+}
+
+void Index::stitch_shards(const vector<unique_ptr<Index>> &shards)
+{
+    open_index_file();
+    seqroot = bypcroot = 0;
+    lineno_offset = shards[0]->lineno_offset;
+
+    // Copy each shard's own memory trees into the file unchanged. The
+    // rest of what it made is either merged below or only of use to
+    // the shard itself.
+    vector<IndexShard> records;
+    for (auto &sh : shards) {
+        const Arena &own = *sh->shard->own_arena;
+        IndexShard rec;
+        OFF_T size = own.curr_offset();
+        rec.base = arena->alloc(size);
+        rec.size = size;
+        memcpy(arena->getptr<char>(rec.base), own.getptr<char>(0), size);
+        records.push_back(rec);
+    }
+
+    max_sve_bits = 128;
+
+    // Merge the shards' seqtrees and by-PC trees, building each one in
+    // a single pass from the shards' flattened copies of them. The
+    // seqtree nodes are in order already, one shard after another,
+    // and just have their memory roots made into offsets in the whole
+    // file, so that IndexReader can tell which shard they're in. The
+    // by-PC entries of all the shards are merged into order.
+    size_t nseq = 0, nbypc = 0;
+    for (auto &sh : shards) {
+        nseq += sh->shard->nseq;
+        nbypc += sh->shard->nbypc;
+        aarch64_used = aarch64_used || sh->aarch64_used;
+        max_sve_bits = max(max_sve_bits, sh->max_sve_bits);
+    }
+
+    size_t seq_shard = 0, seq_pos = 0;
+    seqroot = seqtree->build(nseq, [&]() {
+        while (seq_pos == shards[seq_shard]->shard->nseq) {
+            seq_shard++;
+            seq_pos = 0;
+        }
+        const Index &sh = *shards[seq_shard];
+        SeqOrderPayload seqp = *sh.arena->getptr<SeqOrderPayload>(
+            sh.shard->seq_nodes + seq_pos++ * sizeof(SeqOrderPayload));
+        seqp.memory_root = seqp.memory_root + records[seq_shard].base;
+        return seqp;
+    });
+
+    vector<size_t> bypc_pos(shards.size(), 0);
+    auto bypc_next = [&](size_t k) -> const ByPCPayload & {
+        return *shards[k]->arena->getptr<ByPCPayload>(
+            shards[k]->shard->bypc_nodes + bypc_pos[k] * sizeof(ByPCPayload));
+    };
+    auto later = [&](size_t a, size_t b) {
+        return bypc_next(a).cmp(bypc_next(b)) > 0;
+    };
+    std::priority_queue<size_t, vector<size_t>, decltype(later)> bypc_heads(
+        later);
+    for (size_t k = 0; k < shards.size(); k++)
+        if (shards[k]->shard->nbypc)
+            bypc_heads.push(k);
+    bypcroot = bypctree->build(nbypc, [&]() {
+        size_t k = bypc_heads.top();
+        bypc_heads.pop();
+        ByPCPayload p = bypc_next(k);
+        if (++bypc_pos[k] < shards[k]->shard->nbypc)
+            bypc_heads.push(k);
+        return p;
+    });
+
+    // Each shard sampled the line positions in its own part of the
+    // file, including the lines it read to warm up, which the previous
+    // shard has already provided
+    line_offsets_first = shards[0]->line_offsets_first;
+    nline_offsets = 0;
+    line_offset_chunks.clear();
+    for (auto &sh : shards) {
+        LineNo have = line_offsets_first + nline_offsets;
+        for (LineNo i = 0; i < sh->nline_offsets; i++)
+            if (sh->line_offsets_first + i >= have)
+                add_line_offset(sh->line_offset(i));
+    }
+
+    // Make the memory state each shard started from: nothing at all
+    // for the first, and for each other, its predecessor's starting
+    // state overlaid with everything the predecessor changed. Those
+    // base states live in our own part of the file.
+    memroot = 0;
+    prev_lineno = 0;
+    make_sub_memtree('m', 0, 0);
+    memtree->commit();
+    for (size_t k = 0; k < shards.size(); k++) {
+        const Index &sh = *shards[k];
+        OFF_T base = records[k].base;
+
+        LineNo first_line = sh.shard->first_line;
+
+        // Whatever the shard's warm-up left it knowing about memory is
+        // hidden by the base state. But anything it learned by reading
+        // memory whose contents were unknown when it started its own
+        // part of the trace was already true then, so fill that in to
+        // the base state too.
+        sh.memtree->visit(sh.shard->start_memroot, [&](const MemoryPayload &p,
+                                                       OFF_T) {
+            if (p.raw)
+                return;
+            sh.memsubtree->visit(
+                *sh.arena->getptr<diskoff>(p.contents),
+                [&](const MemorySubPayload &msp, OFF_T) {
+                    Addr lo = max((Addr)msp.lo, (Addr)p.lo);
+                    Addr hi = min((Addr)msp.hi, (Addr)p.hi);
+                    if (lo <= hi)
+                        fill_memtree_from_read(
+                            p.type, lo, hi - lo + 1,
+                            sh.arena->getptr<unsigned char>(msp.contents) +
+                                (lo - msp.lo));
+                });
+        });
+
+        records[k].base_memroot = memroot;
+        records[k].first_line = first_line;
+
+        // Then the shard's own changes go on top
+        unordered_map<OFF_T, OFF_T> copied_subtrees;
+        sh.shard->own_memtree->visit(sh.shard->own_roots.at(sh.memroot),
+                                     [&](const MemoryPayload &p, OFF_T) {
+            MemoryPayload memp = p;
+            if (memp.raw) {
+                memp.contents = memp.contents + base;
+            } else {
+                auto it = copied_subtrees.find(memp.contents);
+                if (it == copied_subtrees.end())
+                    it = copied_subtrees
+                             .emplace(memp.contents,
+                                      copy_shard_subtree(sh, base,
+                                                         memp.contents))
+                             .first;
+                memp.contents = it->second;
+            }
+            memroot = memtree_overwrite(*memtree, memroot, memp);
+        });
+        memtree->commit();
+    }
+
+    nshards = records.size();
+    shard_table = arena->alloc(nshards * sizeof(IndexShard));
+    for (unsigned k = 0; k < nshards; k++)
+        *arena->getptr<IndexShard>(shard_table + k * sizeof(IndexShard)) =
+            records[k];
+
+    // Find the calls and returns the shards left to us (see
+    // IndexShardWork), by replaying their transfers of control in
+    // order in the same way update_sp and update_pc would have, along
+    // with the calls each shard still had pending at the end. Those
+    // are all at stack pointers below the largest the shard saw, so
+    // adding them after its transfers doesn't change the outcome.
+    set<PendingCall> pending;
+    for (size_t k = 0; k < shards.size(); k++) {
+        const Index &sh = *shards[k];
+        found_callrets.insert(sh.found_callrets.begin(),
+                              sh.found_callrets.end());
+        for (auto &t : sh.shard->transfers) {
+            pending.erase(pending.begin(),
+                          pending.lower_bound(PendingCall(t.max_sp, 0)));
+
+            unsigned long long sp = t.sp;
+            if (!t.sp_known) {
+                // Nothing in the shard wrote the stack pointer, so if
+                // it's known at all, it's known in the state the
+                // shard started from
+                unsigned char data[8];
+                assert(t.sp_size <= sizeof(data));
+                sp = ULLONG_MAX;
+                if (read_memtree_bytes(records[k].base_memroot, 'r',
+                                       t.sp_reg, t.sp_size, data)) {
+                    sp = 0;
+                    for (size_t i = t.sp_size; i-- > 0;)
+                        sp = (sp << 8) | data[i];
+                }
+            }
+
+            auto it = pending.find(PendingCall(sp, t.pc));
+            if (it != pending.end()) {
+                found_callrets.insert(CallReturn(it->call_line, +1));
+                found_callrets.insert(CallReturn(t.line, -1));
+                pending.erase(it);
+            } else if (t.looks_like_call) {
+                pending.insert(PendingCall(sp, t.lr, t.line));
+            }
+        }
+        pending.erase(pending.begin(), pending.lower_bound(PendingCall(
+                                           sh.shard->max_sp, 0)));
+    pending.insert(sh.pending_calls.begin(), sh.pending_calls.end());
+    }
+
+    build_call_tree();
+    finalise_index();
+}
+
+// Follows the same rule as Index::got_event_common for where one
+// seqtree node ends and the next begins, without indexing anything,
+// so that a trace can be cut into shards at node boundaries.
+class NodeBoundaryFinder : ParseReceiver {
+    TarmacLineParser parser;
+    Time current_time;
+    bool seen_instruction_at_current_time, boundary;
+
+    void got_event_common(TarmacEvent &event, bool is_instruction)
+    {
+        Time ev_time = current_time;
+        if (ev_time == -(Time)1 || event.time > ev_time)
+            ev_time = event.time;
+
+        if (ev_time != current_time ||
+            (seen_instruction_at_current_time && is_instruction)) {
+            boundary = true;
+            if (current_time != ev_time) {
+                current_time = ev_time;
+                seen_instruction_at_current_time = false;
+            }
+        }
+
+        if (is_instruction)
+            seen_instruction_at_current_time = true;
+    }
+
+  public:
+    NodeBoundaryFinder(const ParseParams &pparams)
+        : parser(pparams, *this), current_time(-(Time)1),
+          seen_instruction_at_current_time(false)
+    {
+    }
+
+    void got_event(RegisterEvent &ev) { got_event_common(ev, false); }
+    void got_event(MemoryEvent &ev) { got_event_common(ev, false); }
+    void got_event(InstructionEvent &ev) { got_event_common(ev, true); }
+    void got_event(TextOnlyEvent &ev) { got_event_common(ev, false); }
+    void got_event(ExceptionEvent &ev) { got_event_common(ev, false); }
+
+    // Read the trace from 'pos', which must be the start of a line,
+    // and return the position of the first line at or after 'target'
+    // that starts a new seqtree node, or -1 if there isn't one.
+    streamoff find(const string &filename, streamoff pos, streamoff target)
+    {
+        ifstream ifs(filename, ios::in | ios::binary);
+        ifs.seekg(pos);
+        string line;
+        while (getline(ifs, line)) {
+            boundary = false;
+            try {
+                parser.parse(line);
+            } catch (TarmacParseError) {
+                // The shard that reaches this line will report it
+                return -1;
+            }
+            if (boundary && pos >= target)
+                return pos;
+            pos += line.size() + 1;
+        }
+        return -1;
+    }
+};
+
+// Count the lines in the part [from,to) of a file.
+static LineNo count_lines(const string &filename, streamoff from,
+                          streamoff to)
+{
+    ifstream ifs(filename, ios::in | ios::binary);
+    ifs.seekg(from);
+    vector<char> buf(1 << 20);
+    LineNo count = 0;
+    for (streamoff left = to - from; left > 0;) {
+        ifs.read(buf.data(), min(left, (streamoff)buf.size()));
+        streamoff got = ifs.gcount();
+        if (!got)
+            break;
+        count += std::count(buf.begin(), buf.begin() + got, '\n');
+        left -= got;
+    }
+    return count;
+}
+
+static void run_sharded_indexer(const TracePair &trace,
+                                const IndexerParams &iparams,
+                                const IndexerDiagnostics &idiags,
+                                const ParseParams &pparams)
+{
+    // How much of the trace before its own part each shard reads, to
+    // learn the register and memory contents it starts with
+    static constexpr streamoff WARMUP_BYTES = 1 << 20;
+
+    const string &filename = trace.tarmac_filename;
+    streamoff filesize;
+    {
+        ifstream ifs(filename, ios::in | ios::binary);
+        if (ifs.fail())
+            reporter->err(1, "%s: open", filename.c_str());
+        ifs.seekg(0, ios::end);
+        filesize = ifs.tellg();
+    }
+
+    // Find the first line of the trace with an event in it, which is
+    // where line numbering in the index starts. Then decide where each
+    // shard after the first should start, by finding the first node
+    // boundary after an evenly spaced cut point, and where its
+    // warm-up should start, a bit before that.
+    unsigned n = iparams.shards;
+    vector<streamoff> starts(n, -1), warm_starts(n, 0);
+    starts[0] = NodeBoundaryFinder(pparams).find(filename, 0, 0);
+    if (starts[0] != -1) {
+        vector<std::thread> probes;
+        for (unsigned k = 1; k < n; k++)
+            probes.emplace_back([&, k]() {
+                streamoff cut = filesize * k / n;
+                streamoff warm = max(cut - WARMUP_BYTES, starts[0]);
+                if (warm > starts[0]) {
+                    // Move forward to the start of a line
+                    ifstream ifs(filename, ios::in | ios::binary);
+                    ifs.seekg(warm - 1);
+                    string line;
+                    getline(ifs, line);
+                    warm += line.size();
+                }
+                warm_starts[k] = warm;
+                starts[k] = NodeBoundaryFinder(pparams).find(filename, warm,
+                                                             cut);
+            });
+        for (auto &t : probes)
+            t.join();
+    }
+
+    // Drop any shards that turned out empty, for instance because a
+    // cut point was in the middle of one huge node
+    vector<unsigned> used;
+    for (unsigned k = 0; k < n; k++)
+        if (starts[k] != -1 &&
+            (used.empty() || starts[k] > starts[used.back()]))
+            used.push_back(k);
+    if (used.size() < 2) {
+        IndexerParams single = iparams;
+        single.shards = 1;
+        Index index(trace, single, idiags, pparams);
+        index.parse_tarmac_file();
+        return;
+    }
+
+    // Count the lines before each of the positions we need to know
+    // the line numbers of, counting the pieces in between in parallel
+    vector<streamoff> positions;
+    for (unsigned k : used) {
+        positions.push_back(starts[k]);
+        positions.push_back(warm_starts[k]);
+    }
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()),
+                    positions.end());
+    vector<LineNo> counts(positions.size());
+    {
+        vector<std::thread> counters;
+        for (size_t i = 0; i < positions.size(); i++)
+            counters.emplace_back([&, i]() {
+                counts[i] = count_lines(filename, i ? positions[i - 1] : 0,
+                                        positions[i]);
+            });
+        for (auto &t : counters)
+            t.join();
+    }
+    std::map<streamoff, LineNo> line_at;
+    LineNo total = 0;
+    for (size_t i = 0; i < positions.size(); i++)
+        line_at[positions[i]] = (total += counts[i]) + 1;
+
+    // Index every shard at once, each in its own file
+    std::atomic<unsigned long long> progress(0);
+    std::atomic<unsigned> finished(0);
+    unsigned long long to_read = 0;
+    vector<IndexShardWork> work(used.size());
+    vector<unique_ptr<Index>> shards;
+    for (size_t i = 0; i < used.size(); i++) {
+        IndexShardWork &w = work[i];
+        unsigned k = used[i];
+        w.start_pos = i ? warm_starts[k] : 0;
+        w.end_pos = i + 1 < used.size()
+                        ? starts[used[i + 1]]
+                        : std::numeric_limits<streamoff>::max();
+        w.lineno_offset = line_at[starts[0]] - 1;
+        w.start_lineno = line_at[w.start_pos];
+        w.first_line = i ? line_at[starts[k]] - w.lineno_offset : 1;
+        w.progress = &progress;
+        to_read += min((streamoff)w.end_pos, filesize) - (streamoff)w.start_pos;
+
+        TracePair shard_trace = trace;
+        if (trace.index_on_disk)
+            shard_trace.index_filename += ".shard" + std::to_string(i);
+        else
+            shard_trace.memory_index = make_shared<MemArena>();
+        shards.push_back(make_unique<Index>(shard_trace, iparams, idiags,
+                                            pparams, &w));
+    }
+
+    reporter->indexing_start(to_read);
+    vector<std::thread> workers;
+    for (auto &sh : shards)
+        workers.emplace_back([&, index = sh.get()]() {
+            index->index_shard();
+            finished++;
+        });
+    while (finished < workers.size()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        reporter->indexing_progress((streamoff)progress);
+    }
+    for (auto &t : workers)
+        t.join();
+    reporter->indexing_done();
+
+    auto remove_shard_files = [&]() {
+        if (!trace.index_on_disk)
+            return;
+        shards.clear();
+        for (size_t i = 0; i < used.size(); i++) {
+            work[i].own_memtree.reset();
+            work[i].own_memsubtree.reset();
+            work[i].own_arena.reset();
+            string name = trace.index_filename + ".shard" + std::to_string(i);
+            remove(name.c_str());
+            remove((name + ".mem").c_str());
+        }
+    };
+
+    for (auto &w : work) {
+        for (auto &warning : w.warnings)
+            reporter->indexing_warning(filename, warning.first,
+                                       warning.second);
+        if (w.failed) {
+            remove_shard_files();
+            if (trace.index_on_disk)
+                remove(trace.index_filename.c_str());
+            reporter->indexing_error(filename, w.error_line, w.error);
+        }
+    }
+
+    Index index(trace, iparams, idiags, pparams);
+    index.stitch_shards(shards);
+    remove_shard_files();
+}
+
+// Size of the blocks that the trace is read in, for a per-CPU index
+static const size_t TRACE_FEED_BLOCK = 1 << 20;
+
+void TraceFeed::start(const string &filename, streamoff catchup_end_)
+{
+    catchup_end = catchup_end_;
+    if (catchup_end)
+        catchup.open(filename, ios::in | ios::binary);
+}
+
+TraceFeed::int_type TraceFeed::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+
+    block_pos = next_pos;
+    if (next_pos < catchup_end) {
+        catchup_block.resize(
+            min(catchup_end - next_pos, (streamoff)TRACE_FEED_BLOCK));
+        catchup.read(&catchup_block[0], catchup_block.size());
+        size_t got = catchup.gcount();
+        if (got) {
+            char *data = &catchup_block[0];
+            setg(data, data, data + got);
+            next_pos += got;
+            return traits_type::to_int_type(*gptr());
+        }
+        // The file must have shrunk since it was read. Carry on with
+        // whatever the main thread has for us.
+        catchup_end = next_pos;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]() { return !queue.empty() || closed; });
+    if (queue.empty())
+        return traits_type::eof();
+    block = queue.front();
+    queue.pop_front();
+    cond.notify_all();
+
+    char *data = const_cast<char *>(block->data());
+    setg(data, data, data + block->size());
+    next_pos += block->size();
+    return traits_type::to_int_type(*gptr());
+}
+
+TraceFeed::pos_type TraceFeed::seekoff(off_type off, std::ios_base::seekdir dir,
+                                       std::ios_base::openmode)
+{
+    // Only telling the current position is supported
+    if (off != 0 || dir != std::ios_base::cur)
+        return pos_type(off_type(-1));
+    return pos_type(block_pos + (gptr() - eback()));
+}
+
+void TraceFeed::push(shared_ptr<const string> newblock)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock,
+              [this]() { return queue.size() < MAX_QUEUED || abandoned; });
+    if (!abandoned)
+        queue.push_back(std::move(newblock));
+    cond.notify_all();
+}
+
+void TraceFeed::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    cond.notify_all();
+}
+
+void TraceFeed::abandon()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    abandoned = true;
+    queue.clear();
+    cond.notify_all();
+}
+
+// Finds the first trace source (such as a CPU) that a trace names.
+class SourceFinder : ParseReceiver {
+    TarmacLineParser parser;
+    string source;
+
+    void got_source(const TarmacEvent &ev)
+    {
+        if (source.empty())
+            source = parser.source_name(ev.source);
+    }
+
+  public:
+    SourceFinder(const ParseParams &pparams) : parser(pparams, *this) {}
+
+    void got_event(RegisterEvent &ev) { got_source(ev); }
+    void got_event(MemoryEvent &ev) { got_source(ev); }
+    void got_event(InstructionEvent &ev) { got_source(ev); }
+    void got_event(TextOnlyEvent &ev) { got_source(ev); }
+    void got_event(ExceptionEvent &ev) { got_source(ev); }
+
+    // Only the start of the trace is searched, since a trace that
+    // names its sources at all will name one there.
+    string find(const string &filename)
+    {
+        ifstream ifs(filename, ios::in | ios::binary);
+        string line;
+        for (unsigned n = 0; n < 65536 && source.empty() && getline(ifs, line);
+             n++) {
+            try {
+                parser.parse(line);
+            } catch (TarmacParseError) {
+                // Indexing will report it
+                break;
+            }
+        }
+        return source;
+    }
+};
+
+// Write the index file for a per-CPU index, containing the complete
+// index of each CPU's view copied from 'images'.
+static void write_per_cpu_index(const TracePair &trace,
+                                const IndexerParams &iparams,
+                                const vector<string> &cpus,
+                                const vector<shared_ptr<Arena>> &images)
+{
+    shared_ptr<Arena> arena;
+    if (trace.index_on_disk) {
+        remove(trace.index_filename.c_str());
+        arena = make_shared<MMapFile>(trace.index_filename, true);
+    } else {
+        arena = trace.memory_index;
+    }
+
+    OFF_T magic_offset = arena->alloc(sizeof(MagicNumber));
+    OFF_T header_offset = arena->alloc(sizeof(FileHeader));
+    {
+        FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+        hdr.byte_order = BYTE_ORDER_HOST;
+        record_index_params(hdr, iparams);
+        hdr.flags = 0; // ensure FLAG_COMPLETE is not initially set
+    }
+    arena->getptr<MagicNumber>(magic_offset)->setup();
+
+    vector<IndexCPUView> records(cpus.size());
+    for (size_t i = 0; i < cpus.size(); i++) {
+        records[i].name = arena->alloc(cpus[i].size() + 1);
+        memcpy(arena->getptr<char>(records[i].name), cpus[i].c_str(),
+               cpus[i].size() + 1);
+    }
+    OFF_T table = arena->alloc(cpus.size() * sizeof(IndexCPUView));
+    for (size_t i = 0; i < cpus.size(); i++) {
+        OFF_T size = images[i]->curr_offset();
+        records[i].base = arena->alloc(size);
+        records[i].size = size;
+        memcpy(arena->getptr<char>(records[i].base),
+               images[i]->getptr<char>(0), size);
+        *arena->getptr<IndexCPUView>(table + i * sizeof(IndexCPUView)) =
+            records[i];
+    }
+
+    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    hdr.memsubtree_type = (char)iparams.memsubtree_type;
+    hdr.bypctree_type = (char)iparams.bypctree_type;
+    hdr.seqtree_type = (char)iparams.seqtree_type;
+    hdr.seqroot = 0;
+    hdr.bypcroot = 0;
+    hdr.seqbtreeroot = 0;
+    hdr.lineno_offset = 0;
+    hdr.shards = 0;
+    hdr.nshards = 0;
+    hdr.loop_runs = 0;
+    hdr.nloop_runs = 0;
+    hdr.line_offsets = 0;
+    hdr.line_offsets_first = 0;
+    hdr.nline_offsets = 0;
+    hdr.cpu_views = table;
+    hdr.ncpu_views = cpus.size();
+    hdr.flags = FLAG_PER_CPU | FLAG_COMPLETE;
+}
+
+static void run_per_cpu_indexer(const TracePair &trace,
+                                const IndexerParams &iparams,
+                                const IndexerDiagnostics &idiags,
+                                const ParseParams &pparams)
+{
+    const string &filename = trace.tarmac_filename;
+
+    string first = SourceFinder(pparams).find(filename);
+    if (first.empty()) {
+        reporter->warnx(_("%s: trace does not say which CPU each line comes "
+                          "from; making an ordinary index"),
+                        filename.c_str());
+        Index index(trace, iparams, idiags, pparams);
+        index.parse_tarmac_file();
+        return;
+    }
+
+    SequentialFileBuf tracebuf(filename, iparams.trace_drop_behind,
+                               iparams.trace_direct_io);
+    if (!tracebuf.is_open())
+        reporter->err(1, "%s: open", filename.c_str());
+    istream ifs(&tracebuf);
+    ifs.seekg(0, ios::end);
+    reporter->indexing_start(ifs.tellg());
+    ifs.seekg(0);
+
+    // Each CPU's view is indexed on its own thread. The first view
+    // reports every trace source it sees, and a view is started for
+    // each new one, reading the part of the file it missed for itself.
+    struct View {
+        IndexCPUWork work;
+        TracePair trace;
+        unique_ptr<Index> index;
+        std::thread thread;
+    };
+    vector<unique_ptr<View>> views;
+    std::mutex found_mutex;
+    vector<string> found;
+    set<string> known;
+
+    auto start_view = [&](const string &cpu, streamoff catchup_end) {
+        size_t i = views.size();
+        views.push_back(make_unique<View>());
+        View &v = *views.back();
+        v.work.cpu = cpu;
+        if (i == 0)
+            v.work.found_source = [&](const string &source) {
+                std::lock_guard<std::mutex> lock(found_mutex);
+                found.push_back(source);
+            };
+        else
+            v.work.keep_warnings = false;
+        v.work.feed.start(filename, catchup_end);
+        v.trace = trace;
+        if (trace.index_on_disk)
+            v.trace.index_filename += ".cpu" + std::to_string(i);
+        else
+            v.trace.memory_index = make_shared<MemArena>();
+        v.index = make_unique<Index>(v.trace, iparams, idiags, pparams,
+                                     nullptr, &v.work);
+        v.thread = std::thread([&v]() {
+            v.index->index_cpu_view();
+            v.work.feed.abandon();
+        });
+        known.insert(cpu);
+    };
+    auto start_found_views = [&](streamoff pos) {
+        vector<string> names;
+        {
+            std::lock_guard<std::mutex> lock(found_mutex);
+            names.swap(found);
+        }
+        for (auto &name : names)
+            if (!known.count(name))
+                start_view(name, pos);
+    };
+
+    // Read the file once, handing each block to every view
+    start_view(first, 0);
+    streamoff pos = 0;
+    while (true) {
+        start_found_views(pos);
+        auto block = make_shared<string>(TRACE_FEED_BLOCK, '\0');
+        ifs.read(&(*block)[0], block->size());
+        size_t got = ifs.gcount();
+        if (!got)
+            break;
+        block->resize(got);
+        for (auto &v : views)
+            v->work.feed.push(block);
+        pos += got;
+        reporter->indexing_progress(pos);
+    }
+    for (auto &v : views)
+        v->work.feed.close();
+
+    // Once the first view has finished, no more sources can turn up
+    views[0]->thread.join();
+    start_found_views(pos);
+    for (size_t i = 1; i < views.size(); i++) {
+        views[i]->work.feed.close();
+        views[i]->thread.join();
+    }
+    reporter->indexing_done();
+
+    auto remove_view_files = [&]() {
+        for (auto &v : views) {
+            v->index = nullptr;
+            if (trace.index_on_disk)
+                remove(v->trace.index_filename.c_str());
+        }
+    };
+
+    // Every view reads the same lines, so any parse error will have
+    // stopped each of them in the same place, apart from views that
+    // started too late to reach it
+    const IndexCPUWork *failed = nullptr;
+    for (auto &v : views)
+        if (v->work.failed &&
+            (!failed || v->work.error_line < failed->error_line))
+            failed = &v->work;
+    for (auto &warning : views[0]->work.warnings) {
+        if (failed && warning.first > failed->error_line)
+            break;
+        reporter->indexing_warning(filename, warning.first, warning.second);
+    }
+    if (failed) {
+        remove_view_files();
+        if (trace.index_on_disk)
+            remove(trace.index_filename.c_str());
+        reporter->indexing_error(filename, failed->error_line, failed->error);
+    }
+
+    // Write the views out in order of their names, so that the index
+    // doesn't depend on which CPU happened to come first
+    std::sort(views.begin(), views.end(),
+              [](const unique_ptr<View> &a, const unique_ptr<View> &b) {
+                  return a->work.cpu < b->work.cpu;
+              });
+    vector<string> cpus;
+    vector<shared_ptr<Arena>> images;
+    for (auto &v : views) {
+        v->index = nullptr;
+        cpus.push_back(v->work.cpu);
+        if (trace.index_on_disk)
+            images.push_back(
+                make_shared<MMapFile>(v->trace.index_filename, false));
+        else
+            images.push_back(v->trace.memory_index);
+    }
+    write_per_cpu_index(trace, iparams, cpus, images);
+    images.clear();
+    remove_view_files();
+}
+
+void Index::rebuild_lazy_memory_region(shared_ptr<Arena> arena_,
+                                       TreeType memsubtree_type, OFF_T region,
+                                       const vector<SeqOrderPayload> &nodes,
+                                       const vector<vector<string>> &lines,
+                                       unordered_map<OFF_T, OFF_T> &roots)
+{
+    arena = arena_;
+    memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(*arena);
+    memsubtree = new SelectableTree<MemorySubPayload>(*arena, memsubtree_type);
+
+    LazyMemoryRegion reg = *arena->getptr<LazyMemoryRegion>(region);
+    for (unsigned i = 0; i < reg.nsubtrees; i++)
+        lazy_subtree_words.push_back(*arena->getptr<diskoff>(
+            reg.subtree_words + i * sizeof(diskoff)));
+    replaying = true;
+    replay_subtree_pos = 0;
+    max_sve_bits = 128;
+
+    // Start from the state after the region's first node, which is
+    // kept in full
+    memroot = last_memroot = reg.checkpoint_root;
+    unsigned long long iflags;
+    if (read_memtree_value('r', reg_offset(REG_iflags), reg_size(REG_iflags),
+                           &iflags))
+        curr_iflags = iflags;
+
+    // Re-parse each following node's lines, and commit the memory tree
+    // afterwards so that the node's state stays as it is for ever
+    for (size_t i = 1; i < nodes.size(); i++) {
+        prev_lineno = lineno = nodes[i].trace_file_firstline;
+        for (const string &line : lines[i]) {
+            try {
+                parser.parse(line);
+            } catch (TarmacParseError) {
+                // Only possible on a truncated last line, which
+                // indexing will already have warned about
+            }
+            lineno++;
+        }
+        memtree->commit();
+        roots[nodes[i].memory_root] = memroot;
+    }
+}
+
+IndexHeaderState check_index_header(const string &index_filename,
+                                    const IndexerParams *iparams)
 {
     MMapFile arena(index_filename, false);
+    if (!index_header_present(arena))
+        return IndexHeaderState::Incomplete;
 
     MagicNumber &magic = *arena.getptr<MagicNumber>(0);
     if (!magic.check())
         return IndexHeaderState::WrongMagic;
 
     FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
+    if (hdr.byte_order != BYTE_ORDER_HOST)
+        return IndexHeaderState::WrongByteOrder;
     if (!(hdr.flags & FLAG_COMPLETE))
         return IndexHeaderState::Incomplete;
+    if (iparams && !index_params_match(hdr, *iparams))
+        return IndexHeaderState::WrongParams;
 
     return IndexHeaderState::OK;
 }
 
+// Parses the trace from a given position to find the time of the
+// first event there, for finding the ends of a time window by binary
+// search.
+class TimeFinder : ParseReceiver {
+    TarmacLineParser parser;
+    bool found;
+    Time time;
+
+    void got_event_common(TarmacEvent &event)
+    {
+        if (!found) {
+            found = true;
+            time = event.time;
+        }
+    }
+
+  public:
+    TimeFinder(const ParseParams &pparams) : parser(pparams, *this) {}
+
+    // Find the time of the event on a single line, if it has one
+    bool line_time(const string &line, Time *t)
+    {
+        found = false;
+        try {
+            parser.parse(line);
+        } catch (TarmacParseError) {
+            // Leave it to the indexer to report, if it's in the window
+        }
+        if (found)
+            *t = time;
+        return found;
+    }
+
+    void got_event(RegisterEvent &ev) { got_event_common(ev); }
+    void got_event(MemoryEvent &ev) { got_event_common(ev); }
+    void got_event(InstructionEvent &ev) { got_event_common(ev); }
+    void got_event(TextOnlyEvent &ev) { got_event_common(ev); }
+    void got_event(ExceptionEvent &ev) { got_event_common(ev); }
+
+    // Read the trace from 'pos', which must be the start of a line, up
+    // to 'limit'. Return the position of the first line with an event
+    // at 'target' or later, or 'limit' if there isn't one. If
+    // 'first_only', give up after the first line with an event, and
+    // return -1 if it was before 'target'.
+    streamoff find(ifstream &ifs, streamoff pos, streamoff limit, Time target,
+                   bool first_only)
+    {
+        ifs.clear();
+        ifs.seekg(pos);
+        string line;
+        while (pos < limit && getline(ifs, line)) {
+            Time t;
+            bool got = line_time(line, &t);
+            if (got && t >= target)
+                return pos;
+            if (got && first_only)
+                return -1;
+            pos += line.size() + 1;
+        }
+        return limit;
+    }
+};
+
+// Find the position of the first line of the trace with an event at
+// 'target' or later, assuming the times in the trace never decrease.
+static streamoff find_time_pos(const string &filename,
+                               const ParseParams &pparams, Time target)
+{
+    // Once the range is this small, just read through it
+    static constexpr streamoff LINEAR_SEARCH_BYTES = 1 << 16;
+
+    ifstream ifs(filename, ios::in | ios::binary);
+    if (ifs.fail())
+        reporter->err(1, "%s: open", filename.c_str());
+    ifs.seekg(0, ios::end);
+    streamoff lo = 0, hi = ifs.tellg();
+    TimeFinder finder(pparams);
+
+    // The answer is always in [lo,hi], and lo is always a line start
+    while (hi - lo > LINEAR_SEARCH_BYTES) {
+        streamoff mid = lo + (hi - lo) / 2;
+        ifs.clear();
+        ifs.seekg(mid - 1);
+        string line;
+        getline(ifs, line);
+        mid += line.size();
+        if (mid >= hi)
+            break;
+        if (finder.find(ifs, mid, hi, target, true) == -1)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return finder.find(ifs, lo, hi, target, false);
+}
+
+// Find the position of the start of a given line of the trace, or the
+// end of the file if it doesn't have that many lines.
+static streamoff find_line_pos(const string &filename, LineNo lineno)
+{
+    ifstream ifs(filename, ios::in | ios::binary);
+    if (ifs.fail())
+        reporter->err(1, "%s: open", filename.c_str());
+    vector<char> buf(1 << 20);
+    streamoff pos = 0;
+    LineNo left = lineno - 1;
+    while (left > 0) {
+        ifs.read(buf.data(), buf.size());
+        streamoff got = ifs.gcount();
+        if (!got)
+            break;
+        for (char *p = buf.data(), *end = p + got;
+             (p = (char *)memchr(p, '\n', end - p)) != nullptr;) {
+            p++;
+            if (--left == 0)
+                return pos + (p - buf.data());
+        }
+        pos += got;
+    }
+    return pos;
+}
+
+static void run_windowed_indexer(const TracePair &trace,
+                                 const IndexerParams &iparams,
+                                 const IndexerDiagnostics &idiags,
+                                 const ParseParams &pparams)
+{
+    const string &filename = trace.tarmac_filename;
+    IndexWindow window;
+
+    if (iparams.window_start_line > 1) {
+        window.start_lineno = iparams.window_start_line;
+        window.start_pos = find_line_pos(filename, window.start_lineno);
+    }
+    if (iparams.window_start_time > 0) {
+        streamoff pos =
+            find_time_pos(filename, pparams, iparams.window_start_time);
+        if (pos > window.start_pos) {
+            window.start_pos = pos;
+            window.start_lineno = count_lines(filename, 0, pos) + 1;
+        }
+    }
+
+    if (iparams.window_end_line != std::numeric_limits<LineNo>::max())
+        window.end_pos = find_line_pos(filename, iparams.window_end_line + 1);
+    if (iparams.window_end_time != std::numeric_limits<Time>::max())
+        window.end_pos =
+            min((streamoff)window.end_pos,
+                find_time_pos(filename, pparams, iparams.window_end_time + 1));
+
+    Index index(trace, iparams, idiags, pparams);
+    index.set_window(window);
+    index.parse_tarmac_file();
+}
+
 void run_indexer(const TracePair &trace, const IndexerParams &iparams,
                  const IndexerDiagnostics &idiags, const ParseParams &pparams)
 {
+    // The memory trees rebuilt on demand in a lazy index are made
+    // without knowing what was excluded from the original ones
+    if (iparams.lazy_memory && !iparams.exclude_data.empty())
+        reporter->errx(1, _("excluded data addresses cannot be combined "
+                            "with lazy memory trees"));
+
+    // Folded loop runs rely on the memory tree being committed after
+    // every node, and on seeing the whole trace in order
+    if (iparams.compress_loops &&
+        (iparams.per_cpu || iparams.shards > 1 || iparams.lazy_memory ||
+         iparams.snapshot_interval > 1))
+        reporter->errx(1, _("folding loops cannot be combined with a "
+                            "per-CPU index, index shards, a snapshot "
+                            "interval or lazy memory trees"));
+
+    if (iparams.has_window()) {
+        if (iparams.per_cpu || iparams.shards > 1)
+            reporter->errx(1, _("indexing part of a trace cannot be combined "
+                                "with a per-CPU index or index shards"));
+        run_windowed_indexer(trace, iparams, idiags, pparams);
+        return;
+    }
+
+    if (iparams.per_cpu) {
+        if (iparams.shards > 1 || iparams.lazy_memory)
+            reporter->errx(1, _("a per-CPU index cannot be combined with "
+                                "index shards or lazy memory trees"));
+        run_per_cpu_indexer(trace, iparams, idiags, pparams);
+        return;
+    }
+
+    // Call-matching diagnostics from several threads at once would be
+    // unreadable, so indexing with them is never sharded
+    if (iparams.shards > 1 && !idiags.debug_call_heuristics) {
+        if (iparams.snapshot_interval > 1 || iparams.lazy_memory)
+            reporter->errx(1, _("a sharded index cannot be combined with a "
+                                "snapshot interval or lazy memory trees"));
+        run_sharded_indexer(trace, iparams, idiags, pparams);
+        return;
+    }
+
     Index index(trace, iparams, idiags, pparams);
     index.parse_tarmac_file();
 }
 
+// Convert the byte order of the index image in 'arena', which is the
+// whole of a copy of index_filename, or one CPU's view within it.
+static void convert_arena_byte_order(Arena &arena,
+                                     const string &index_filename);
+
+void convert_index_byte_order(const string &index_filename,
+                              const string &out_filename)
+{
+    {
+        ifstream in(index_filename, ios::in | ios::binary);
+        if (!in)
+            reporter->err(1, "%s: open", index_filename.c_str());
+        ofstream out(out_filename, ios::out | ios::binary | ios::trunc);
+        if (!out)
+            reporter->err(1, "%s: open", out_filename.c_str());
+        // Copying an empty file would count as a failure to write, so
+        // leave that to be reported as an incomplete index below
+        if (in.peek() != ifstream::traits_type::eof())
+            out << in.rdbuf();
+        if (!out)
+            reporter->err(1, "%s: write", out_filename.c_str());
+    }
+
+    MMapFile arena(out_filename, true);
+    convert_arena_byte_order(arena, index_filename);
+}
+
+static void convert_arena_byte_order(Arena &arena,
+                                     const string &index_filename)
+{
+    if (!index_header_present(arena))
+        reporter->errx(1, _("%s: index file is incomplete"),
+                       index_filename.c_str());
+    MagicNumber &magic = *arena.getptr<MagicNumber>(0);
+    if (!magic.check())
+        reporter->errx(1, _("%s: magic number did not match"),
+                       index_filename.c_str());
+    FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
+    if (hdr.byte_order != BYTE_ORDER_BIG && hdr.byte_order != BYTE_ORDER_LITTLE)
+        reporter->errx(1, _("%s: unrecognised byte order in index header"),
+                       index_filename.c_str());
+
+    // Convert the header first if it's in the foreign byte order, so
+    // that we can read the tree roots out of it; otherwise last.
+    bool to_native = (hdr.byte_order != BYTE_ORDER_HOST);
+    if (to_native)
+        hdr.byteswap();
+    if (!(hdr.flags & FLAG_COMPLETE))
+        reporter->errx(1, _("%s: index file is incomplete"),
+                       index_filename.c_str());
+    OFF_T seqroot = hdr.seqroot, bypcroot = hdr.bypcroot;
+    TreeType memsubtree_type = (TreeType)hdr.memsubtree_type;
+    TreeType bypctree_type = (TreeType)hdr.bypctree_type;
+    OFF_T seqbtreeroot = hdr.seqbtreeroot;
+    bool memory_deltas = (hdr.flags & FLAG_MEMORY_DELTAS);
+    bool lazy_memory = (hdr.flags & FLAG_LAZY_MEMORY);
+    bool sharded = (hdr.flags & FLAG_SHARDED);
+    OFF_T shard_table = hdr.shards;
+    unsigned nshards = hdr.nshards;
+    bool per_cpu = (hdr.flags & FLAG_PER_CPU);
+    OFF_T cpu_views = hdr.cpu_views;
+    unsigned ncpu_views = hdr.ncpu_views;
+    bool loop_runs = (hdr.flags & FLAG_LOOP_RUNS);
+    OFF_T loop_table = hdr.loop_runs;
+    unsigned nloop_runs = hdr.nloop_runs;
+    OFF_T line_table = hdr.line_offsets;
+    LineNo nline_offsets = hdr.nline_offsets;
+    if (!to_native)
+        hdr.byteswap();
+
+    // Each view of a per-CPU index is a complete index in its own right
+    if (per_cpu) {
+        for (unsigned i = 0; i < ncpu_views; i++) {
+            IndexCPUView &rec = *arena.getptr<IndexCPUView>(
+                cpu_views + i * sizeof(IndexCPUView));
+            if (to_native)
+                rec.byteswap();
+            ArenaView view(arena, rec.base, rec.size);
+            if (!to_native)
+                rec.byteswap();
+            convert_arena_byte_order(view, index_filename);
+        }
+        return;
+    }
+
+    AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree(arena);
+    BTreeDisk<SeqOrderPayload> seqbtree(arena);
+    SelectableTree<ByPCPayload> bypctree(arena, bypctree_type);
+
+    // Every separately allocated piece of the file that has been
+    // converted so far, whether tree node or otherwise. Memory trees
+    // share almost all their nodes between seqtree nodes, so this is
+    // what stops us converting anything twice.
+    unordered_set<OFF_T> done;
+
+    // The memory trees of the file as a whole, and of each shard of a
+    // sharded index, read through a view of the shard. Offsets in
+    // different shards can coincide, so each shard has its own record
+    // of what's been converted.
+    struct MemoryTrees {
+        Arena &arena;
+        AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
+        SelectableTree<MemorySubPayload> memsubtree;
+        unordered_set<OFF_T> &done;
+
+        MemoryTrees(Arena &arena, TreeType memsubtree_type,
+                    unordered_set<OFF_T> &done)
+            : arena(arena), memtree(arena),
+              memsubtree(arena, memsubtree_type), done(done)
+        {
+        }
+    };
+    MemoryTrees main_trees(arena, memsubtree_type, done);
+
+    auto swap_memsubtree_root = [&](MemoryTrees &t, OFF_T offset) {
+        if (!t.done.insert(offset).second)
+            return;
+        diskoff &root = *t.arena.getptr<diskoff>(offset);
+        if (to_native)
+            root.byteswap();
+        t.memsubtree.byteswap(
+            root, to_native, t.done,
+            [](const MemorySubPayload &,
+               const EmptyAnnotation<MemorySubPayload> &) {});
+        if (!to_native)
+            root.byteswap();
+    };
+
+    auto swap_memtree_in = [&](MemoryTrees &t, OFF_T root) {
+        t.memtree.byteswap(
+            root, to_native, t.done,
+            [&](const MemoryPayload &memp, const MemoryAnnotation &) {
+                if (!memp.raw)
+                    swap_memsubtree_root(t, memp.contents);
+            });
+    };
+    auto swap_memtree = [&](OFF_T root) { swap_memtree_in(main_trees, root); };
+
+    vector<OFF_T> shard_bases;
+    vector<unique_ptr<ArenaView>> shard_views;
+    vector<unique_ptr<unordered_set<OFF_T>>> shard_done;
+    vector<unique_ptr<MemoryTrees>> shard_trees;
+    if (sharded) {
+        for (unsigned k = 0; k < nshards; k++) {
+            IndexShard &rec = *arena.getptr<IndexShard>(
+                shard_table + k * sizeof(IndexShard));
+            if (to_native)
+                rec.byteswap();
+            OFF_T base = rec.base, size = rec.size;
+            OFF_T base_memroot = rec.base_memroot;
+            if (!to_native)
+                rec.byteswap();
+
+            shard_bases.push_back(base);
+            shard_views.push_back(make_unique<ArenaView>(arena, base, size));
+            shard_done.push_back(make_unique<unordered_set<OFF_T>>());
+            shard_trees.push_back(make_unique<MemoryTrees>(
+                *shard_views.back(), memsubtree_type, *shard_done.back()));
+            swap_memtree(base_memroot);
+        }
+    }
+
+    auto swap_delta_record = [&](OFF_T offset) {
+        if (!done.insert(offset).second)
+            return;
+        MemoryDeltaRecord &rec = *arena.getptr<MemoryDeltaRecord>(offset);
+        if (to_native)
+            rec.byteswap();
+        OFF_T snapshot = rec.snapshot_root;
+        unsigned count = rec.count;
+        if (!to_native)
+            rec.byteswap();
+
+        swap_memtree(snapshot);
+        for (unsigned i = 0; i < count; i++) {
+            MemoryPayload &memp = *arena.getptr<MemoryPayload>(
+                offset + sizeof(MemoryDeltaRecord) + i * sizeof(MemoryPayload));
+            if (to_native)
+                memp.byteswap();
+            bool raw = memp.raw;
+            OFF_T contents = memp.contents;
+            if (!to_native)
+                memp.byteswap();
+            if (!raw)
+                swap_memsubtree_root(main_trees, contents);
+        }
+    };
+
+    auto swap_lazy_region = [&](OFF_T offset) {
+        if (!done.insert(offset).second)
+            return;
+        LazyMemoryRegion &reg = *arena.getptr<LazyMemoryRegion>(offset);
+        if (to_native)
+            reg.byteswap();
+        OFF_T checkpoint = reg.checkpoint_root, words = reg.subtree_words;
+        unsigned nsubtrees = reg.nsubtrees;
+        if (!to_native)
+            reg.byteswap();
+
+        swap_memtree(checkpoint);
+        if (words && done.insert(words).second) {
+            for (unsigned i = 0; i < nsubtrees; i++) {
+                diskoff &word =
+                    *arena.getptr<diskoff>(words + i * sizeof(diskoff));
+                if (to_native)
+                    word.byteswap();
+                OFF_T word_offset = word;
+                if (!to_native)
+                    word.byteswap();
+                swap_memsubtree_root(main_trees, word_offset);
+            }
+        }
+    };
+
+    auto swap_lazy_slot = [&](OFF_T offset) {
+        if (!done.insert(offset).second)
+            return;
+        LazyMemorySlot &slot = *arena.getptr<LazyMemorySlot>(offset);
+        if (to_native)
+            slot.byteswap();
+        OFF_T region = slot.region, root = slot.root;
+        if (!to_native)
+            slot.byteswap();
+
+        swap_lazy_region(region);
+        if (root)
+            swap_memtree(root);
+    };
+
+    seqtree.byteswap(
+        seqroot, to_native, done,
+        [&](const SeqOrderPayload &seqp, const SeqOrderAnnotation &seqa) {
+            if (sharded) {
+                OFF_T root = seqp.memory_root;
+                size_t k = std::upper_bound(shard_bases.begin(),
+                                            shard_bases.end(), root) -
+                           shard_bases.begin() - 1;
+                swap_memtree_in(*shard_trees[k], root - shard_bases[k]);
+            } else if (lazy_memory)
+                swap_lazy_slot(seqp.memory_root);
+            else if (memory_deltas)
+                swap_delta_record(seqp.memory_root);
+            else
+                swap_memtree(seqp.memory_root);
+            OFF_T array = seqa.call_depth_array;
+            if (array && done.insert(array).second) {
+                CallDepthArrayEntry *entries =
+                    arena.getptr<CallDepthArrayEntry>(array);
+                for (unsigned i = 0, n = seqa.call_depth_arraylen; i < n; i++)
+                    entries[i].byteswap();
+            }
+        });
+
+    // The copies of seqtree's payloads refer to the same memory trees,
+    // which have all been converted already.
+    seqbtree.byteswap(seqbtreeroot, to_native, done,
+                      [](const SeqOrderPayload &,
+                         const EmptyAnnotation<SeqOrderPayload> &) {});
+
+    bypctree.byteswap(bypcroot, to_native, done,
+                      [](const ByPCPayload &,
+                         const EmptyAnnotation<ByPCPayload> &) {});
+
+    if (loop_runs) {
+        for (unsigned i = 0; i < nloop_runs; i++)
+            arena.getptr<LoopRun>(loop_table + i * sizeof(LoopRun))
+                ->byteswap();
+    }
+
+    if (line_table) {
+        for (LineNo c = 0; c * LINE_OFFSET_CHUNK < nline_offsets; c++) {
+            // Read each chunk's position while it's in native order
+            diskoff &chunkpos = arena.getptr<diskoff>(line_table)[c];
+            if (to_native)
+                chunkpos.byteswap();
+            diskoff *entries = arena.getptr<diskoff>(chunkpos);
+            if (!to_native)
+                chunkpos.byteswap();
+            LineNo n = min<LineNo>(LINE_OFFSET_CHUNK,
+                                   nline_offsets - c * LINE_OFFSET_CHUNK);
+            for (LineNo i = 0; i < n; i++)
+                entries[i].byteswap();
+        }
+    }
+}
+
+void relayout_index(const string &index_filename, const string &out_filename)
+{
+    switch (check_index_header(index_filename)) {
+    case IndexHeaderState::OK:
+    case IndexHeaderState::WrongParams: // not checked without iparams
+        break;
+    case IndexHeaderState::WrongMagic:
+        reporter->errx(1, _("%s: magic number did not match"),
+                       index_filename.c_str());
+        break;
+    case IndexHeaderState::WrongByteOrder:
+        reporter->errx(1, _("%s: index file was generated on a host of the "
+                            "opposite endianness"),
+                       index_filename.c_str());
+        break;
+    case IndexHeaderState::Incomplete:
+        reporter->errx(1, _("%s: index file is incomplete"),
+                       index_filename.c_str());
+        break;
+    }
+
+    // Check everything that can go wrong before touching the output
+    // file, so that a failure doesn't leave an empty one behind
+    MMapFile in(index_filename, false);
+    const FileHeader &hdr = *in.getptr<FileHeader>(sizeof(MagicNumber));
+    if (hdr.flags & FLAG_SHARDED)
+        reporter->errx(1, _("%s: a sharded index cannot be relaid out"),
+                       index_filename.c_str());
+    if (hdr.flags & FLAG_PER_CPU)
+        reporter->errx(1, _("%s: a per-CPU index cannot be relaid out"),
+                       index_filename.c_str());
+    if (hdr.flags & FLAG_LOOP_RUNS)
+        reporter->errx(1, _("%s: an index with folded loops cannot be "
+                            "relaid out"),
+                       index_filename.c_str());
+
+    remove(out_filename.c_str());
+    MMapFile out(out_filename, true);
+
+    TreeType memsubtree_type = (TreeType)hdr.memsubtree_type;
+    TreeType bypctree_type = (TreeType)hdr.bypctree_type;
+    OFF_T seqroot = hdr.seqroot, bypcroot = hdr.bypcroot;
+    OFF_T seqbtreeroot = hdr.seqbtreeroot;
+    bool memory_deltas = (hdr.flags & FLAG_MEMORY_DELTAS);
+    bool lazy_memory = (hdr.flags & FLAG_LAZY_MEMORY);
+
+    AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree(in);
+    BTreeDisk<SeqOrderPayload> seqbtree(in);
+    AVLDisk<MemoryPayload, MemoryAnnotation> memtree(in);
+    SelectableTree<MemorySubPayload> memsubtree(in, memsubtree_type);
+    SelectableTree<ByPCPayload> bypctree(in, bypctree_type);
+
+    // The header goes at the start of the new file just as in the old.
+    OFF_T header_offset = out.alloc(sizeof(MagicNumber) + sizeof(FileHeader));
+    assert(header_offset == 0);
+    (void)header_offset;
+
+    // First pass: decide where everything reachable will go. Anything
+    // we don't reach (such as tree nodes left over from rebalancing
+    // during indexing) isn't copied at all. Each tree is placed as a
+    // unit, so that a search through it stays within as few pages as
+    // possible, and the memory trees are placed in the order the
+    // seqtree refers to them, so that neighbouring trace positions
+    // have their memory state nearby.
+    RelayoutMap relocation(out);
+
+    vector<pair<OFF_T, size_t>> call_depth_arrays;
+    vector<OFF_T> memtree_roots, memsubtree_roots, delta_records;
+    vector<OFF_T> subtree_root_words, lazy_slots, lazy_regions;
+
+    // Raw data blocks are referred to by start offset and length, but
+    // after a memory tree node has been split, its halves refer to
+    // different parts of the same block. So we collect the ranges
+    // that are in use, and merge overlapping ones afterwards.
+    vector<pair<OFF_T, OFF_T>> raw_ranges;
+
+    seqtree.relayout_place(
+        seqroot, relocation,
+        [&](const SeqOrderPayload &seqp, const SeqOrderAnnotation &seqa) {
+            if (lazy_memory)
+                lazy_slots.push_back(seqp.memory_root);
+            else if (memory_deltas)
+                delta_records.push_back(seqp.memory_root);
+            else if (seqp.memory_root)
+                memtree_roots.push_back(seqp.memory_root);
+            if (seqa.call_depth_array)
+                call_depth_arrays.emplace_back(
+                    seqa.call_depth_array,
+                    seqa.call_depth_arraylen * sizeof(CallDepthArrayEntry));
+        });
+
+    // Its B+-tree copy, if any, refers to the same memory states, so
+    // it has nothing to add to the lists.
+    seqbtree.relayout_place(seqbtreeroot, relocation,
+                            [](const SeqOrderPayload &,
+                               const EmptyAnnotation<SeqOrderPayload> &) {});
+
+    // Delta records are read in sequence when reconstructing a memory
+    // state, so they go together in trace order.
+    for (OFF_T record : delta_records) {
+        const MemoryDeltaRecord &rec = *in.getptr<MemoryDeltaRecord>(record);
+        relocation.place(record, rec.size());
+        memtree_roots.push_back(rec.snapshot_root);
+    }
+
+    // Likewise the slots of a lazy index, which are looked at on the
+    // way to every memory tree.
+    for (OFF_T offset : lazy_slots) {
+        const LazyMemorySlot &slot = *in.getptr<LazyMemorySlot>(offset);
+        relocation.place(offset, sizeof(LazyMemorySlot));
+        if (relocation.place(slot.region, sizeof(LazyMemoryRegion))) {
+            lazy_regions.push_back(slot.region);
+            memtree_roots.push_back(
+                in.getptr<LazyMemoryRegion>(slot.region)->checkpoint_root);
+        }
+        if (slot.root)
+            memtree_roots.push_back(slot.root);
+    }
+
+    bypctree.relayout_place(
+        bypcroot, relocation,
+        [](const ByPCPayload &, const EmptyAnnotation<ByPCPayload> &) {});
+
+    auto place_subtree_root_word = [&](OFF_T word) {
+        if (relocation.place(word, sizeof(diskoff))) {
+            subtree_root_words.push_back(word);
+            OFF_T subroot = *in.getptr<diskoff>(word);
+            if (subroot)
+                memsubtree_roots.push_back(subroot);
+        }
+    };
+
+    auto place_memory_contents = [&](const MemoryPayload &memp) {
+        if (memp.raw)
+            raw_ranges.emplace_back(memp.contents,
+                                    memp.contents + (memp.hi - memp.lo + 1));
+        else
+            place_subtree_root_word(memp.contents);
+    };
+
+    for (OFF_T root : memtree_roots)
+        memtree.relayout_place(
+            root, relocation,
+            [&](const MemoryPayload &memp, const MemoryAnnotation &) {
+                place_memory_contents(memp);
+            });
+    for (OFF_T record : delta_records) {
+        unsigned count = in.getptr<MemoryDeltaRecord>(record)->count;
+        for (unsigned i = 0; i < count; i++)
+            place_memory_contents(*in.getptr<MemoryPayload>(
+                record + sizeof(MemoryDeltaRecord) + i * sizeof(MemoryPayload)));
+    }
+
+    // A lazy region's list of memory subtrees includes ones that no
+    // memory tree built so far refers to.
+    for (OFF_T region : lazy_regions) {
+        const LazyMemoryRegion &reg = *in.getptr<LazyMemoryRegion>(region);
+        OFF_T words = reg.subtree_words;
+        unsigned nsubtrees = reg.nsubtrees;
+        if (!words)
+            continue;
+        relocation.place(words, nsubtrees * sizeof(diskoff));
+        for (unsigned i = 0; i < nsubtrees; i++)
+            place_subtree_root_word(
+                *in.getptr<diskoff>(words + i * sizeof(diskoff)));
+    }
+
+    for (OFF_T root : memsubtree_roots)
+        memsubtree.relayout_place(
+            root, relocation,
+            [&](const MemorySubPayload &msp,
+                const EmptyAnnotation<MemorySubPayload> &) {
+                raw_ranges.emplace_back(msp.contents,
+                                        msp.contents + (msp.hi - msp.lo + 1));
+            });
+
+    for (auto &array : call_depth_arrays)
+        relocation.place(array.first, array.second);
+
+    OFF_T line_table = hdr.line_offsets;
+    vector<OFF_T> line_chunks;
+    if (line_table) {
+        for (LineNo i = 0; i < hdr.nline_offsets; i += LINE_OFFSET_CHUNK)
+            line_chunks.push_back(
+                in.getptr<diskoff>(line_table)[i / LINE_OFFSET_CHUNK]);
+        relocation.place(line_table, line_chunks.size() * sizeof(diskoff));
+        for (OFF_T chunk : line_chunks)
+            relocation.place(chunk, LINE_OFFSET_CHUNK * sizeof(diskoff));
+    }
+
+    // Merge the raw data ranges into maximal disjoint blocks, each
+    // keyed by its end offset so that upper_bound finds the block
+    // containing a given offset.
+    std::sort(raw_ranges.begin(), raw_ranges.end());
+    std::map<OFF_T, pair<OFF_T, OFF_T>> raw_blocks; // end -> (start, new)
+    for (size_t i = 0; i < raw_ranges.size();) {
+        OFF_T start = raw_ranges[i].first, end = raw_ranges[i].second;
+        for (i++; i < raw_ranges.size() && raw_ranges[i].first <= end; i++)
+            end = max(end, raw_ranges[i].second);
+        raw_blocks[end] = make_pair(start, out.alloc(end - start));
+    }
+    auto translate_raw = [&](OFF_T offset) {
+        auto it = raw_blocks.upper_bound(offset);
+        assert(it != raw_blocks.end() && it->second.first <= offset);
+        return it->second.second + (offset - it->second.first);
+    };
+
+    // Second pass: now that the output file has reached its final
+    // size, copy everything into it, translating all the offsets.
+    std::unordered_set<OFF_T> done;
+
+    memcpy(out.getptr<MagicNumber>(0), in.getptr<MagicNumber>(0),
+           sizeof(MagicNumber));
+    FileHeader &outhdr = *out.getptr<FileHeader>(sizeof(MagicNumber));
+    outhdr = hdr;
+    outhdr.seqroot = relocation(seqroot);
+    outhdr.bypcroot = relocation(bypcroot);
+    outhdr.seqbtreeroot = relocation(seqbtreeroot);
+    outhdr.line_offsets = relocation(line_table);
+
+    seqtree.relayout_copy(
+        seqroot, relocation, out, done,
+        [&](SeqOrderPayload &seqp, SeqOrderAnnotation &seqa) {
+            seqp.memory_root = relocation(seqp.memory_root);
+            seqa.call_depth_array = relocation(seqa.call_depth_array);
+        });
+
+    seqbtree.relayout_copy(
+        seqbtreeroot, relocation, out, done,
+        [&](SeqOrderPayload &seqp, EmptyAnnotation<SeqOrderPayload> &) {
+            seqp.memory_root = relocation(seqp.memory_root);
+        });
+
+    bypctree.relayout_copy(
+        bypcroot, relocation, out, done,
+        [](ByPCPayload &, EmptyAnnotation<ByPCPayload> &) {});
+
+    auto translate_memory_contents = [&](MemoryPayload &memp) {
+        if (memp.raw)
+            memp.contents = translate_raw(memp.contents);
+        else
+            memp.contents = relocation(memp.contents);
+    };
+
+    for (OFF_T root : memtree_roots)
+        memtree.relayout_copy(
+            root, relocation, out, done,
+            [&](MemoryPayload &memp, MemoryAnnotation &) {
+                translate_memory_contents(memp);
+            });
+
+    for (OFF_T record : delta_records) {
+        const MemoryDeltaRecord &rec = *in.getptr<MemoryDeltaRecord>(record);
+        OFF_T newrecord = relocation(record);
+        memcpy(out.getptr<char>(newrecord), &rec, rec.size());
+        MemoryDeltaRecord &outrec = *out.getptr<MemoryDeltaRecord>(newrecord);
+        outrec.snapshot_root = relocation(rec.snapshot_root);
+        outrec.prev = relocation(rec.prev);
+        for (unsigned i = 0, n = rec.count; i < n; i++)
+            translate_memory_contents(*out.getptr<MemoryPayload>(
+                newrecord + sizeof(MemoryDeltaRecord) +
+                i * sizeof(MemoryPayload)));
+    }
+
+    for (OFF_T offset : lazy_slots) {
+        const LazyMemorySlot &slot = *in.getptr<LazyMemorySlot>(offset);
+        LazyMemorySlot &outslot =
+            *out.getptr<LazyMemorySlot>(relocation(offset));
+        outslot.region = relocation(slot.region);
+        outslot.root = relocation(slot.root);
+    }
+
+    for (OFF_T region : lazy_regions) {
+        const LazyMemoryRegion &reg = *in.getptr<LazyMemoryRegion>(region);
+        LazyMemoryRegion &outreg =
+            *out.getptr<LazyMemoryRegion>(relocation(region));
+        outreg = reg;
+        outreg.checkpoint_root = relocation(reg.checkpoint_root);
+        outreg.subtree_words = relocation(reg.subtree_words);
+        for (unsigned i = 0, n = reg.nsubtrees; i < n; i++)
+            *out.getptr<diskoff>(outreg.subtree_words + i * sizeof(diskoff)) =
+                relocation(*in.getptr<diskoff>(reg.subtree_words +
+                                               i * sizeof(diskoff)));
+    }
+
+    for (OFF_T root : memsubtree_roots)
+        memsubtree.relayout_copy(
+            root, relocation, out, done,
+            [&](MemorySubPayload &msp, EmptyAnnotation<MemorySubPayload> &) {
+                msp.contents = translate_raw(msp.contents);
+            });
+
+    for (OFF_T word : subtree_root_words)
+        *out.getptr<diskoff>(relocation(word)) =
+            relocation(*in.getptr<diskoff>(word));
+
+    for (auto &array : call_depth_arrays)
+        if (array.second)
+            memcpy(out.getptr<char>(relocation(array.first)),
+                   in.getptr<char>(array.first), array.second);
+
+    for (size_t i = 0; i < line_chunks.size(); i++) {
+        out.getptr<diskoff>(relocation(line_table))[i] =
+            relocation(line_chunks[i]);
+        memcpy(out.getptr<char>(relocation(line_chunks[i])),
+               in.getptr<char>(line_chunks[i]),
+               LINE_OFFSET_CHUNK * sizeof(diskoff));
+    }
+
+    for (auto &block : raw_blocks) {
+        OFF_T start = block.second.first, size = block.first - start;
+        memcpy(out.getptr<char>(block.second.second), in.getptr<char>(start),
+               size);
+    }
+}
+
+// In a per-CPU index, pick out the view of the CPU that 'trace' asks
+// for, or complain if it doesn't ask for one that's there.
+static shared_ptr<Arena> get_cpu_view(const TracePair &trace,
+                                      shared_ptr<Arena> arena)
+{
+    const string &index_filename = trace.index_filename;
+    bool per_cpu = false;
+    if (index_header_present(*arena) &&
+        arena->getptr<MagicNumber>(0)->check()) {
+        const FileHeader &hdr =
+            *arena->getptr<FileHeader>(sizeof(MagicNumber));
+        per_cpu = (hdr.byte_order == BYTE_ORDER_HOST &&
+                   (hdr.flags & FLAG_PER_CPU));
+    }
+
+    if (!per_cpu) {
+        if (!trace.cpu.empty())
+            reporter->errx(1, _("%s: index does not have a view of each CPU "
+                                "(re-index with --per-cpu)"),
+                           index_filename.c_str());
+        return arena;
+    }
+
+    const FileHeader &hdr = *arena->getptr<FileHeader>(sizeof(MagicNumber));
+    string available;
+    const IndexCPUView *found = nullptr;
+    for (unsigned i = 0; i < hdr.ncpu_views; i++) {
+        const IndexCPUView &rec = *arena->getptr<IndexCPUView>(
+            hdr.cpu_views + i * sizeof(IndexCPUView));
+        string name = arena->getptr<char>(rec.name);
+        if (name == trace.cpu)
+            found = &rec;
+        available += (available.empty() ? "" : ", ") + name;
+    }
+
+    if (trace.cpu.empty())
+        reporter->errx(1, _("%s: index has a view of each CPU; choose one "
+                            "with --cpu (available: %s)"),
+                       index_filename.c_str(), available.c_str());
+    if (!found)
+        reporter->errx(1, _("%s: index has no view of CPU '%s' (available: "
+                            "%s)"),
+                       index_filename.c_str(), trace.cpu.c_str(),
+                       available.c_str());
+    return make_shared<ArenaView>(arena, found->base, found->size);
+}
+
 static shared_ptr<Arena> get_index_mapping(const TracePair &trace)
 {
-    if (trace.index_on_disk)
-        return make_shared<MMapFile>(trace.index_filename, false);
-    else
-        return trace.memory_index;
+    if (!trace.index_on_disk)
+        return get_cpu_view(trace, trace.memory_index);
+
+    return get_cpu_view(trace, make_shared<MMapFile>(trace.index_filename,
+                                                     false));
 }
 
 IndexReader::IndexReader(const TracePair &trace)
     : index_filename(trace.index_filename),
-      tarmac_filename(trace.tarmac_filename),
+      tarmac_filename(trace.tarmac_filename), cpu(trace.cpu),
       arena(get_index_mapping(trace)),
-      tarmac(tarmac_filename, std::ios_base::in | std::ios_base::binary),
-      bigend(), aarch64_used(), memtree(*arena), memsubtree(*arena),
-      seqtree(*arena), bypctree(*arena)
+      tarmac(tarmac_filename),
+      bigend(), aarch64_used(), loop_table(0), nloop_runs(0),
+      line_table(0), line_table_first(0), line_table_size(0),
+      replay_pool(make_shared<ReplayPool>()),
+      memtree(*arena), memsubtree(*arena), seqtree(*arena), seqbtree(*arena),
+      bypctree(*arena)
 {
+    if (!index_header_present(*arena))
+        reporter->errx(1, _("%s: index file is incomplete"),
+                       index_filename.c_str());
     MagicNumber &magic = *arena->getptr<MagicNumber>(0);
     if (!magic.check())
         reporter->errx(1, _("%s: magic number did not match"),
                        index_filename.c_str());
     FileHeader &hdr = *arena->getptr<FileHeader>(sizeof(MagicNumber));
+    if (hdr.byte_order != BYTE_ORDER_HOST)
+        reporter->errx(1, _("%s: index file was generated on a host of the "
+                            "opposite endianness"),
+                       index_filename.c_str());
     seqroot = hdr.seqroot;
+    seqbtreeroot = hdr.seqbtreeroot;
     bypcroot = hdr.bypcroot;
+    memsubtree.set_tree_type((TreeType)hdr.memsubtree_type);
+    bypctree.set_tree_type((TreeType)hdr.bypctree_type);
     bigend = (hdr.flags & FLAG_BIGEND);
     aarch64_used = (hdr.flags & FLAG_AARCH64_USED);
     thumbonly = (hdr.flags & FLAG_THUMB_ONLY);
+    memory_deltas = (hdr.flags & FLAG_MEMORY_DELTAS);
+    lazy_memory = (hdr.flags & FLAG_LAZY_MEMORY);
     max_sve_bits =
         128 * (((hdr.flags & FLAG_SVELEN_MASK) / FLAG_SVELEN_UNIT) + 1);
     lineno_offset = hdr.lineno_offset;
+    line_table = hdr.line_offsets;
+    line_table_first = hdr.line_offsets_first;
+    line_table_size = hdr.nline_offsets;
+    if (hdr.flags & FLAG_LOOP_RUNS) {
+        loop_table = hdr.loop_runs;
+        nloop_runs = hdr.nloop_runs;
+    }
+
+    if (hdr.flags & FLAG_SHARDED) {
+        for (unsigned k = 0; k < hdr.nshards; k++)
+            shards.push_back(make_unique<Shard>(
+                *arena,
+                *arena->getptr<IndexShard>(hdr.shards +
+                                           k * sizeof(IndexShard)),
+                memsubtree.tree_type()));
+    }
+
+    // Everything in a finished index is below the trees' high-water
+    // marks, so all of it is eligible for the decoded-node cache. The
+    // top levels of seqtree and the memtrees are the parts that are
+    // revisited most, by every node_at_line, getmem and lrt_translate.
+    seqtree.enable_cache(12);
+    memtree.enable_cache(14);
+    memsubtree.enable_cache(12);
+    bypctree.enable_cache(10);
+}
+
+IndexReader::Shard::Shard(Arena &file, const IndexShard &rec,
+                          TreeType memsubtree_type)
+    : base(rec.base), base_memroot(rec.base_memroot),
+      first_line(rec.first_line), arena(file, rec.base, rec.size),
+      memtree(arena),
+      memsubtree(arena, memsubtree_type)
+{
+    memtree.enable_cache(12);
+    memsubtree.enable_cache(10);
+}
+
+MemoryState IndexReader::memory_state(OFF_T memory_root) const
+{
+    MemoryState state;
+    state.top.memtree = &memtree;
+    state.top.memsubtree = &memsubtree;
+    state.top.arena = arena.get();
+    state.top.root = memory_root;
+
+    if (!shards.empty()) {
+        // Find the shard the root is in, and read its tree over the
+        // state it started from
+        auto it = std::upper_bound(
+            shards.begin(), shards.end(), memory_root,
+            [](OFF_T off, const unique_ptr<Shard> &sh) {
+                return off < sh->base;
+            });
+        assert(it != shards.begin());
+        const Shard &sh = **--it;
+        state.base = state.top;
+        state.base.root = sh.base_memroot;
+        state.top.memtree = &sh.memtree;
+        state.top.memsubtree = &sh.memsubtree;
+        state.top.arena = &sh.arena;
+        state.top.root = memory_root - sh.base;
+        state.top.hide_before = sh.first_line;
+    } else if (lazy_memory) {
+        const LazyMemorySlot &slot =
+            *arena->getptr<LazyMemorySlot>(memory_root);
+        if (slot.root) {
+            state.top.root = slot.root;
+        } else {
+            auto reg = lazy_memory_region(slot.region);
+            state.top.memtree = reg->memtree.get();
+            state.top.memsubtree = reg->memsubtree.get();
+            state.top.arena = reg->arena.get();
+            state.top.root = reg->roots.at(memory_root);
+            state.hold = reg;
+        }
+    } else if (memory_deltas) {
+        const MemoryDeltaRecord &rec =
+            *arena->getptr<MemoryDeltaRecord>(memory_root);
+        if (!rec.prev) {
+            state.top.root = rec.snapshot_root;
+        } else {
+            auto cache = lend_replay_cache();
+            // The deltas since the snapshot are a layer over it
+            state.base = state.top;
+            state.base.root = rec.snapshot_root;
+            state.top.root = replay_memory_deltas(*cache, memory_root);
+            state.top.memtree = cache->memtree.get();
+            state.hold = cache;
+        }
+    }
+    return state;
+}
+
+shared_ptr<IndexReader::ReplayCache> IndexReader::lend_replay_cache() const
+{
+    // Number of idle caches the pool keeps for reuse
+    static constexpr size_t MAX_IDLE_REPLAY_CACHES = 4;
+
+    // The cache returned most recently is the likeliest to have the
+    // states near this one already
+    unique_ptr<ReplayCache> cache;
+    {
+        std::lock_guard<std::mutex> lock(replay_pool->mutex);
+        if (!replay_pool->idle.empty()) {
+            cache = std::move(replay_pool->idle.back());
+            replay_pool->idle.pop_back();
+        }
+    }
+    if (!cache)
+        cache = make_unique<ReplayCache>();
+
+    // Give it back when the last user is finished with it, unless the
+    // IndexReader has gone away meanwhile
+    std::weak_ptr<ReplayPool> pool = replay_pool;
+    return shared_ptr<ReplayCache>(cache.release(), [pool](ReplayCache *c) {
+        unique_ptr<ReplayCache> owned(c);
+        if (auto p = pool.lock()) {
+            std::lock_guard<std::mutex> lock(p->mutex);
+            if (p->idle.size() < MAX_IDLE_REPLAY_CACHES)
+                p->idle.push_back(std::move(owned));
+        }
+    });
+}
+
+OFF_T IndexReader::replay_memory_deltas(ReplayCache &cache,
+                                        OFF_T record) const
+{
+    // Limit on the size of the replay arena, beyond which we start
+    // again from scratch rather than keep every state we've made
+    static constexpr OFF_T REPLAY_ARENA_LIMIT = 64 << 20;
+
+    if (!cache.arena || cache.arena->curr_offset() > REPLAY_ARENA_LIMIT) {
+        cache.roots.clear();
+        cache.memtree = nullptr;
+        cache.arena = make_unique<MemArena>();
+        cache.arena->alloc(16); // so that no node pointer ends up at 0
+        cache.memtree =
+            make_unique<AVLDisk<MemoryPayload, MemoryAnnotation>>(
+                *cache.arena);
+    }
+
+    // Find the latest state we already have on the way back to the
+    // snapshot, and replay every record after it. The tree we build
+    // holds only what the records have written since the snapshot, so
+    // it starts out empty.
+    vector<OFF_T> chain;
+    OFF_T root = 0;
+    for (OFF_T r = record;;) {
+        auto it = cache.roots.find(r);
+        if (it != cache.roots.end()) {
+            root = it->second;
+            break;
+        }
+        const MemoryDeltaRecord &rec = *arena->getptr<MemoryDeltaRecord>(r);
+        if (!rec.prev)
+            break;
+        chain.push_back(r);
+        r = rec.prev;
+    }
+
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        OFF_T r = *it;
+        unsigned count = arena->getptr<MemoryDeltaRecord>(r)->count;
+        for (unsigned i = 0; i < count; i++) {
+            MemoryPayload memp = *arena->getptr<MemoryPayload>(
+                r + sizeof(MemoryDeltaRecord) + i * sizeof(MemoryPayload));
+            root = memtree_overwrite(*cache.memtree, root, memp);
+        }
+        // Commit, so that replaying further records starting from
+        // this state can't disturb it
+        cache.memtree->commit();
+        cache.roots[r] = root;
+    }
+
+    return root;
+}
+
+shared_ptr<const IndexReader::LazyRegion>
+IndexReader::lazy_memory_region(OFF_T region) const
+{
+    // Limit on the total size of the regions we keep, beyond which we
+    // start again from scratch
+    static constexpr size_t LAZY_REGIONS_LIMIT = 64 << 20;
+
+    {
+        std::lock_guard<std::mutex> lock(lazy_mutex);
+        auto it = lazy_regions.find(region);
+        if (it != lazy_regions.end())
+            return it->second;
+    }
+
+    // Build it without holding the lock, so that other threads can use
+    // the regions already built meanwhile. If two threads build the
+    // same one at once, the second one's copy is simply dropped.
+    auto reg = build_lazy_memory_region(region);
+
+    std::lock_guard<std::mutex> lock(lazy_mutex);
+    auto it = lazy_regions.find(region);
+    if (it != lazy_regions.end())
+        return it->second;
+    if (lazy_regions_size > LAZY_REGIONS_LIMIT) {
+        lazy_regions.clear();
+        lazy_regions_size = 0;
+    }
+    lazy_regions_size += reg->arena->upper_size();
+    lazy_regions[region] = reg;
+    return reg;
+}
+
+shared_ptr<const IndexReader::LazyRegion>
+IndexReader::build_lazy_memory_region(OFF_T region) const
+{
+    // Find all the seqtree nodes in the region, and their trace lines
+    LazyMemoryRegion reg = *arena->getptr<LazyMemoryRegion>(region);
+    vector<SeqOrderPayload> nodes;
+    vector<vector<string>> lines;
+    SeqOrderPayload node;
+    node.trace_file_firstline = reg.first_line;
+    bool found = seq_find(node, &node);
+    while (found && nodes.size() < reg.nodes) {
+        nodes.push_back(node);
+        lines.push_back(get_trace_lines(node));
+        found = seq_succ(node, &node);
+    }
+    if (nodes.size() != reg.nodes)
+        reporter->errx(1, _("%s: lazy memory region at line %llu is corrupt"),
+                       index_filename.c_str(),
+                       (unsigned long long)reg.first_line);
+
+    TracePair trace;
+    trace.tarmac_filename = tarmac_filename;
+    trace.index_filename = index_filename;
+    IndexerParams iparams;
+    iparams.record_calls = false;
+    iparams.lazy_memory = true;
+    // The trees are built in an arena of their own, on top of the
+    // index, which is only ever read
+    auto built = make_shared<LazyRegion>();
+    built->arena = make_shared<OverlayArena>(arena);
+    {
+        Index index(trace, iparams, IndexerDiagnostics(), parseParams());
+        index.rebuild_lazy_memory_region(built->arena, memsubtree.tree_type(),
+                                         region, nodes, lines, built->roots);
+    }
+    built->memtree = make_unique<AVLDisk<MemoryPayload, MemoryAnnotation>>(
+        *built->arena);
+    built->memsubtree = make_unique<SelectableTree<MemorySubPayload>>(
+        *built->arena, memsubtree.tree_type());
+    return built;
 }
 
 ParseParams IndexReader::parseParams() const
@@ -1202,52 +4373,160 @@ ParseParams IndexReader::parseParams() const
         params.iset_specified = true;
         params.iset = THUMB;
     }
-    return params;
+    return params;
+}
+
+string IndexReader::read_tarmac(OFF_T pos, OFF_T len) const
+{
+    string sbuf(len, '\0');
+    tarmac.read(pos, &sbuf[0], len);
+    return sbuf;
+}
+
+StringRef IndexReader::trace_text(OFF_T pos, size_t len, string &buf) const
+{
+    if (const char *text = tarmac.mapped(pos, len))
+        return StringRef(text, len);
+    buf.resize(len);
+    buf.resize(tarmac.read(pos, &buf[0], len));
+    return StringRef(buf);
+}
+
+bool IndexReader::skip_trace_lines(OFF_T &pos, LineNo n, OFF_T limit) const
+{
+    string buf;
+    while (n > 0) {
+        if (pos >= limit)
+            return false;
+        StringRef chunk = trace_text(pos, min((OFF_T)65536, limit - pos), buf);
+        if (chunk.empty())
+            return false;
+        const char *p = chunk.begin();
+        while (n > 0) {
+            const char *nl =
+                (const char *)memchr(p, '\n', chunk.end() - p);
+            if (!nl)
+                break;
+            p = nl + 1;
+            n--;
+        }
+        pos += (n > 0 ? chunk.size() : p - chunk.begin());
+    }
+    return pos < limit;
 }
 
-string IndexReader::read_tarmac(OFF_T pos, OFF_T len) const
+string IndexReader::trace_line_at(OFF_T pos, OFF_T limit) const
 {
-    vector<char> vbuf(len);
-    tarmac.seekg(pos);
-    tarmac.read(&vbuf[0], len);
-    return string(&vbuf[0], len);
+    string line, buf;
+    while (pos < limit) {
+        StringRef chunk = trace_text(pos, min((OFF_T)4096, limit - pos), buf);
+        if (chunk.empty())
+            break;
+        const char *nl =
+            (const char *)memchr(chunk.data(), '\n', chunk.size());
+        line.append(chunk.data(), nl ? nl - chunk.data() : chunk.size());
+        if (nl)
+            break;
+        pos += chunk.size();
+    }
+    if (line.size() > 0 && line[line.size() - 1] == '\r')
+        line.resize(line.size() - 1);
+    return line;
 }
 
-vector<string> IndexReader::get_trace_lines(const SeqOrderPayload &node) const
+void IndexReader::get_trace_line_refs(const SeqOrderPayload &node,
+                                      vector<StringRef> &out,
+                                      string &buf) const
 {
-    string sbuf = read_tarmac(node.trace_file_pos, node.trace_file_len);
-    vector<string> lines;
+    out.clear();
 
-    for (size_t pos = 0, size = sbuf.size(); pos < size;) {
-        size_t nl = sbuf.find('\n', pos);
-        if (nl == string::npos) {
-            /*
-             * If this is the end of a trace file with a truncated
-             * final line, pretend there's a \n at the end of sbuf.
-             * Then the next time we come round this loop we'll exit
-             * because pos will exceed sbuf's length.
-             */
-            nl = sbuf.size();
-        }
+    StringRef text =
+        trace_text(node.trace_file_pos, node.trace_file_len, buf);
+
+    for (size_t pos = 0, size = text.size(); pos < size;) {
+        const char *nl =
+            (const char *)memchr(text.data() + pos, '\n', size - pos);
 
-        string line = sbuf.substr(pos, nl - pos);
-        if (line.size() > 0 && line[line.size() - 1] == '\r')
-            line.resize(line.size() - 1);
-        lines.push_back(line);
+        /*
+         * If this is the end of a trace file with a truncated final
+         * line, pretend there's a \n at the end of the text. Then the
+         * next time we come round this loop we'll exit because pos
+         * will exceed its length.
+         */
+        size_t end = nl ? nl - text.data() : size;
 
-        pos = nl + 1;
+        size_t len = end - pos;
+        if (len > 0 && text[pos + len - 1] == '\r')
+            len--;
+        out.emplace_back(text.data() + pos, len);
+
+        pos = end + 1;
     }
+}
 
+vector<string> IndexReader::get_trace_lines(const SeqOrderPayload &node) const
+{
+    vector<StringRef> refs;
+    string buf;
+    get_trace_line_refs(node, refs, buf);
+
+    vector<string> lines;
+    lines.reserve(refs.size());
+    for (StringRef ref : refs)
+        lines.push_back(ref.str());
     return lines;
 }
 
 string IndexReader::get_trace_line(const SeqOrderPayload &node,
                                    unsigned lineno) const
 {
-    vector<string> lines = get_trace_lines(node);
-    if (lineno >= lines.size())
+    // Lines near the start of the node are quickest found by counting
+    // from there, but for a node covering many lines, such as a long
+    // register dump, the table of line positions gets nearer
+    OFF_T start = node.trace_file_pos;
+    OFF_T limit = start + node.trace_file_len;
+    OFF_T pos;
+    if (lineno >= LINE_OFFSET_INTERVAL &&
+        line_position(node.trace_file_firstline + lineno, pos) &&
+        pos >= start && pos < limit)
+        return trace_line_at(pos, limit);
+
+    pos = start;
+    if (!skip_trace_lines(pos, lineno, limit))
         return "";
-    return lines[lineno];
+    return trace_line_at(pos, limit);
+}
+
+bool IndexReader::line_position(LineNo line, OFF_T &pos) const
+{
+    LineNo physline = line + lineno_offset;
+    if (physline < 1)
+        return false;
+    LineNo entry = (physline - 1) / LINE_OFFSET_INTERVAL;
+    if (entry < line_table_first || entry - line_table_first >= line_table_size)
+        return false;
+
+    entry -= line_table_first;
+    OFF_T chunk =
+        arena->getptr<diskoff>(line_table)[entry / LINE_OFFSET_CHUNK];
+    pos = arena->getptr<diskoff>(chunk)[entry % LINE_OFFSET_CHUNK];
+    if (!skip_trace_lines(pos, (physline - 1) % LINE_OFFSET_INTERVAL,
+                          std::numeric_limits<OFF_T>::max()))
+        return false;
+
+    // Make sure the line isn't just the empty space after the end of
+    // the file
+    string buf;
+    return !trace_text(pos, 1, buf).empty();
+}
+
+bool IndexReader::get_line_text(LineNo line, string &out) const
+{
+    OFF_T pos;
+    if (!line_position(line, pos))
+        return false;
+    out = trace_line_at(pos, std::numeric_limits<OFF_T>::max());
+    return true;
 }
 
 bool IndexNavigator::lookup_symbol(const string &name, uint64_t &addr,
@@ -1298,7 +4577,7 @@ string IndexNavigator::get_symbolic_address(Addr addr, bool fallback) const
 
 struct IndexLRTSearcher {
     const IndexReader &index;
-    unsigned target;
+    LineNo target;
     unsigned mindepth_i, maxdepth_i;
     unsigned mindepth_o, maxdepth_o;
 
@@ -1308,12 +4587,12 @@ struct IndexLRTSearcher {
     // and maxindex apply to.
     OFF_T curr;
 
-    unsigned output_lines;
+    LineNo output_lines;
 
     class OutOfRangeException : exception {
     };
 
-    IndexLRTSearcher(const IndexReader &index, unsigned target, unsigned mindepth_i,
+    IndexLRTSearcher(const IndexReader &index, LineNo target, unsigned mindepth_i,
                      unsigned maxdepth_i, unsigned mindepth_o,
                      unsigned maxdepth_o)
         : index(index), target(target), mindepth_i(mindepth_i),
@@ -1379,7 +4658,7 @@ struct IndexLRTSearcher {
                 lookup_array(&here_a, minindex_o)->leftlink;
             unsigned maxindex_o_lhs =
                 lookup_array(&here_a, maxindex_o)->leftlink;
-            unsigned lines_i =
+            LineNo lines_i =
                 (lookup_array(lhs, maxindex_i_lhs)->cumulative_lines -
                  lookup_array(lhs, minindex_i_lhs)->cumulative_lines);
             if (target < lines_i) {
@@ -1420,7 +4699,7 @@ struct IndexLRTSearcher {
                 lookup_array(&here_a, minindex_o)->rightlink;
             unsigned maxindex_o_rhs =
                 lookup_array(&here_a, maxindex_o)->rightlink;
-            unsigned lines =
+            LineNo lines =
                 (lookup_array(rhs, maxindex_i_rhs)->cumulative_lines -
                  lookup_array(rhs, minindex_i_rhs)->cumulative_lines);
             if (target <= lines) {
@@ -1443,143 +4722,257 @@ struct IndexLRTSearcher {
     }
 };
 
-bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
-                                 size_t size, const void **outdata,
-                                 Addr *outaddr, size_t *outsize,
-                                 unsigned *outline) const
+namespace {
+// A piece of memory contents found in a single layer of a memory state
+struct MemoryChunk {
+    Addr lo, hi;
+    const char *data;
+    LineNo line;
+};
+} // namespace
+
+// Find the leftmost visible entry of one layer of a memory state
+// overlapping the range [lo,hi] of address space 'type'.
+static bool layer_next_entry(const MemoryLayer &layer, char type, Addr lo,
+                             Addr hi, MemoryPayload *memp_got)
 {
     MemoryPayload memp_search;
     memp_search.type = type;
-    memp_search.lo = addr;
-    memp_search.hi = addr + (size - 1);
-
-    while (memp_search.lo <= memp_search.hi) {
-        bool found;
-        MemoryPayload memp_got;
-        found = index.memtree.find_leftmost(memroot, memp_search, &memp_got,
-                                            nullptr);
-        if (!found)
+    memp_search.lo = lo;
+    memp_search.hi = hi;
+    return !layer.memtree->visit_range(
+        layer.root, memp_search, [&](const MemoryPayload &memp, OFF_T) {
+            if (memp.trace_file_firstline < layer.hide_before)
+                return true;
+            *memp_got = memp;
             return false;
+        });
+}
 
-        Addr addr_lo = max(memp_search.lo, memp_got.lo);
-        Addr addr_hi = min(memp_search.hi, memp_got.hi);
-        assert(addr_lo <= addr_hi);
-
-        if (memp_got.raw) {
-            size_t size = addr_hi - addr_lo + 1;
-            const char *treedata =
-                (const char *)index.index_offset(memp_got.contents);
-            if (outdata)
-                *outdata = treedata + (addr_lo - memp_got.lo);
-            if (outaddr)
-                *outaddr = addr_lo;
-            if (outsize)
-                *outsize = size;
-            if (outline)
-                *outline = memp_got.trace_file_firstline;
-            return true;
-        } else {
-            OFF_T subroot = index.index_subtree_root(memp_got.contents);
-            MemorySubPayload msp, msp_found;
-            msp.lo = addr_lo;
-            msp.hi = addr_hi;
-            if (!index.memsubtree.find_leftmost(subroot, msp, &msp_found,
-                                                nullptr)) {
-                // Nothing in this subtree covers the range in
-                // question, so it was a dead end. Go back to the main
-                // memory tree and try the next thing in it.
-                memp_search.lo = memp_got.hi + 1;
-                if (memp_search.lo == 0)
-                    return false; // address space wrapped round
-                continue;
+// Visit, in address order, every defined piece of memory in [lo,hi]
+// in one layer of a memory state, walking the memory tree and each
+// memory subtree just once. Returns false if the visitor stopped the
+// walk by returning false.
+static bool layer_visit_chunks(const MemoryLayer &layer, char type, Addr lo,
+                               Addr hi,
+                               const std::function<bool(const MemoryChunk &)>
+                                   &visitor)
+{
+    MemoryPayload memp_search;
+    memp_search.type = type;
+    memp_search.lo = lo;
+    memp_search.hi = hi;
+    return layer.memtree->visit_range(
+        layer.root, memp_search, [&](const MemoryPayload &memp, OFF_T) {
+            if (memp.trace_file_firstline < layer.hide_before)
+                return true;
+
+            MemoryChunk chunk;
+            chunk.lo = max(lo, (Addr)memp.lo);
+            chunk.hi = min(hi, (Addr)memp.hi);
+            chunk.line = memp.trace_file_firstline;
+
+            if (memp.raw) {
+                chunk.data = layer.arena->getptr<char>(memp.contents) +
+                             (chunk.lo - memp.lo);
+                return visitor(chunk);
             }
 
-            Addr subaddr_lo = max(msp.lo, msp_found.lo);
-            Addr subaddr_hi = min(msp.hi, msp_found.hi);
-            const char *treedata =
-                (const char *)index.index_offset(msp_found.contents);
-            size_t size = subaddr_hi - subaddr_lo + 1;
+            OFF_T subroot = *layer.arena->getptr<diskoff>(memp.contents);
+            MemorySubPayload msp;
+            msp.lo = chunk.lo;
+            msp.hi = chunk.hi;
+            return layer.memsubtree->visit_range(
+                subroot, msp, [&](const MemorySubPayload &msp_found, OFF_T) {
+                    MemoryChunk subchunk = chunk;
+                    subchunk.lo = max(msp.lo, msp_found.lo);
+                    subchunk.hi = min(msp.hi, msp_found.hi);
+                    subchunk.data =
+                        layer.arena->getptr<char>(msp_found.contents) +
+                        (subchunk.lo - msp_found.lo);
+                    return visitor(subchunk);
+                });
+        });
+}
 
-            if (outdata)
-                *outdata = treedata + (subaddr_lo - msp_found.lo);
-            if (outaddr)
-                *outaddr = subaddr_lo;
-            if (outsize)
-                *outsize = size;
-            if (outline)
-                *outline = memp_got.trace_file_firstline;
-            return true;
+// Find the first defined piece of memory in [lo,hi] in one layer of a
+// memory state.
+static bool layer_next_chunk(const MemoryLayer &layer, char type, Addr lo,
+                             Addr hi, MemoryChunk *chunk)
+{
+    return !layer_visit_chunks(layer, type, lo, hi,
+                               [&](const MemoryChunk &found) {
+                                   *chunk = found;
+                                   return false;
+                               });
+}
+
+bool IndexNavigator::getmem_next(OFF_T memroot, char type, Addr addr,
+                                 size_t size, const void **outdata,
+                                 Addr *outaddr, size_t *outsize,
+                                 LineNo *outline) const
+{
+    Addr lo = addr, hi = addr + (size - 1);
+    auto state = index.memory_state(memroot);
+
+    MemoryChunk chunk;
+    bool found = layer_next_chunk(state.top, type, lo, hi, &chunk);
+
+    if (state.layered() && !(found && chunk.lo == lo)) {
+        // Something in the base state might come first, if the top
+        // layer doesn't cover it
+        Addr limit = found ? chunk.lo - 1 : hi;
+        MemoryChunk base_chunk;
+        while (lo <= limit &&
+               layer_next_chunk(state.base, type, lo, limit, &base_chunk)) {
+            MemoryPayload cover;
+            bool covered = layer_next_entry(state.top, type, base_chunk.lo,
+                                            base_chunk.hi, &cover);
+            if (!covered || cover.lo > base_chunk.lo) {
+                if (covered)
+                    base_chunk.hi = cover.lo - 1;
+                chunk = base_chunk;
+                found = true;
+                break;
+            }
+            lo = cover.hi + 1;
+            if (lo == 0)
+                break; // address space wrapped round
         }
     }
 
-    return false;
+    if (!found)
+        return false;
+    if (outdata)
+        *outdata = chunk.data;
+    if (outaddr)
+        *outaddr = chunk.lo;
+    if (outsize)
+        *outsize = chunk.hi - chunk.lo + 1;
+    if (outline)
+        *outline = chunk.line;
+    return true;
 }
 
-unsigned IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
-                                size_t size, void *outdata,
-                                unsigned char *outdef) const
+void IndexNavigator::visit_mem(OFF_T memroot, char type, Addr addr,
+                               size_t size, const MemVisitor &visitor) const
 {
-    unsigned retline = 0;
-    MemoryPayload memp_search;
-    memp_search.type = type;
-    memp_search.lo = addr;
-    memp_search.hi = addr + (size - 1);
-    if (outdef)
-        memset(outdef, 0, size);
-    while (memp_search.lo <= memp_search.hi) {
-        bool found;
-        MemoryPayload memp_got;
-        found = index.memtree.find_leftmost(memroot, memp_search, &memp_got,
-                                            nullptr);
-        if (!found)
-            break;
+    auto state = index.memory_state(memroot);
+    if (!state.layered()) {
+        layer_visit_chunks(state.top, type, addr, addr + (size - 1),
+                           [&](const MemoryChunk &chunk) {
+                               visitor(chunk.data, chunk.lo,
+                                       chunk.hi - chunk.lo + 1, chunk.line);
+                               return true;
+                           });
+        return;
+    }
 
-        Addr addr_lo = max(memp_search.lo, memp_got.lo);
-        Addr addr_hi = min(memp_search.hi, memp_got.hi);
+    // Two layers have to be merged, which getmem_next already does
+    const void *outdata;
+    Addr outaddr;
+    size_t outsize;
+    LineNo outline;
+    while (getmem_next(memroot, type, addr, size, &outdata, &outaddr, &outsize,
+                       &outline)) {
+        visitor(outdata, outaddr, outsize, outline);
+        size -= outaddr + outsize - addr;
+        addr = outaddr + outsize;
+        if (!size || !addr)
+            break;
+    }
+}
 
-        if (memp_got.raw) {
-            const char *treedata =
-                (const char *)index.index_offset(memp_got.contents);
+// Read memory from one layer of a memory state, for getmem. If 'mark'
+// is not null, flag in it every byte the layer has an entry for;
+// bytes flagged in 'mask' are left alone, and an entry that only
+// covers flagged bytes doesn't count towards the returned line.
+static LineNo layer_getmem(const MemoryLayer &layer, char type, Addr addr,
+                           size_t size, void *outdata, unsigned char *outdef,
+                           unsigned char *mark, const unsigned char *mask)
+{
+    auto put = [&](Addr lo, Addr hi, const char *src) {
+        size_t start = lo - addr, len = hi - lo + 1;
+        for (size_t i = 0; i < len; i++) {
+            if (mask && mask[start + i])
+                continue;
             if (outdata)
-                memcpy((char *)outdata + (addr_lo - addr),
-                       treedata + (addr_lo - memp_got.lo),
-                       addr_hi - addr_lo + 1);
+                ((char *)outdata)[start + i] = src[i];
             if (outdef)
-                memset((char *)outdef + (addr_lo - addr), 1,
-                       addr_hi - addr_lo + 1);
-        } else {
-            OFF_T subroot = index.index_subtree_root(memp_got.contents);
-            MemorySubPayload msp, msp_found;
-            msp.lo = addr_lo;
-            msp.hi = addr_hi;
-            while (msp.lo <= msp.hi && index.memsubtree.find_leftmost(
-                                           subroot, msp, &msp_found, nullptr)) {
-                Addr subaddr_lo = max(msp.lo, msp_found.lo);
-                Addr subaddr_hi = min(msp.hi, msp_found.hi);
-                const char *treedata =
-                    (const char *)index.index_offset(msp_found.contents);
-                if (outdata)
-                    memcpy((char *)outdata + (subaddr_lo - addr),
-                           treedata + (subaddr_lo - msp_found.lo),
-                           subaddr_hi - subaddr_lo + 1);
-                if (outdef)
-                    memset((char *)outdef + (subaddr_lo - addr), 1,
-                           subaddr_hi - subaddr_lo + 1);
-                msp.lo = subaddr_hi + 1;
-            }
+                outdef[start + i] = 1;
         }
+    };
 
-        if (retline < memp_got.trace_file_firstline)
-            retline = memp_got.trace_file_firstline;
+    LineNo retline = 0;
+    Addr lo = addr, hi = addr + (size - 1);
+    MemoryPayload memp_search;
+    memp_search.type = type;
+    memp_search.lo = lo;
+    memp_search.hi = hi;
+    layer.memtree->visit_range(
+        layer.root, memp_search, [&](const MemoryPayload &memp_got, OFF_T) {
+            if (memp_got.trace_file_firstline < layer.hide_before)
+                return true;
+            Addr addr_lo = max(lo, (Addr)memp_got.lo);
+            Addr addr_hi = min(hi, (Addr)memp_got.hi);
+
+            // Skip anything not visible through the layer above
+            bool visible = !mask || memchr(mask + (addr_lo - addr), 0,
+                                           addr_hi - addr_lo + 1);
+            if (!visible) {
+                // nothing to do
+            } else if (memp_got.raw) {
+                put(addr_lo, addr_hi,
+                    layer.arena->getptr<char>(memp_got.contents) +
+                        (addr_lo - memp_got.lo));
+            } else {
+                OFF_T subroot =
+                    *layer.arena->getptr<diskoff>(memp_got.contents);
+                MemorySubPayload msp;
+                msp.lo = addr_lo;
+                msp.hi = addr_hi;
+                layer.memsubtree->visit_range(
+                    subroot, msp,
+                    [&](const MemorySubPayload &msp_found, OFF_T) {
+                        Addr subaddr_lo = max(msp.lo, msp_found.lo);
+                        Addr subaddr_hi = min(msp.hi, msp_found.hi);
+                        put(subaddr_lo, subaddr_hi,
+                            layer.arena->getptr<char>(msp_found.contents) +
+                                (subaddr_lo - msp_found.lo));
+                        return true;
+                    });
+            }
 
-        memp_search.lo = memp_got.hi + 1;
-        if (memp_search.lo == 0) // special case: address space wraparound
-            break;
-    }
+            if (mark)
+                memset(mark + (addr_lo - addr), 1, addr_hi - addr_lo + 1);
+            if (visible && retline < memp_got.trace_file_firstline)
+                retline = memp_got.trace_file_firstline;
+            return true;
+        });
 
     return retline;
 }
 
+LineNo IndexNavigator::getmem(OFF_T memroot, char type, Addr addr,
+                              size_t size, void *outdata,
+                              unsigned char *outdef) const
+{
+    if (outdef)
+        memset(outdef, 0, size);
+    auto state = index.memory_state(memroot);
+    if (!state.layered())
+        return layer_getmem(state.top, type, addr, size, outdata, outdef,
+                            nullptr, nullptr);
+
+    // Read the top layer first, then fill in whatever it didn't cover
+    // from the base state
+    vector<unsigned char> covered(size);
+    LineNo line = layer_getmem(state.top, type, addr, size, outdata, outdef,
+                               covered.data(), nullptr);
+    return max(line, layer_getmem(state.base, type, addr, size, outdata,
+                                  outdef, nullptr, covered.data()));
+}
+
 bool IndexNavigator::get_reg_bytes(OFF_T memroot, const RegisterId &reg,
                                    vector<unsigned char> &val) const
 {
@@ -1648,16 +5041,25 @@ class SeqTimeFinder {
 
 bool IndexNavigator::node_at_time(Time t, SeqOrderPayload *node) const
 {
-    return index.seqtree.find_rightmost(index.seqroot, SeqTimeFinder(t), node,
-                                        nullptr);
+    if (index.seq_find_rightmost(SeqTimeFinder(t), node)) {
+        index.expand_loop_run_at_time(*node, t);
+        return true;
+    }
+
+    // The node we want might be folded into a loop run that starts
+    // earlier
+    if (!index.nLoopRuns() ||
+        !index.seq_pred(SeqTimeFinder(t), node))
+        return false;
+    return index.expand_loop_run_at_time(*node, t) && node->mod_time == t;
 }
 
 namespace {
 class SeqLineFinder {
-    unsigned line;
+    LineNo line;
 
   public:
-    SeqLineFinder(unsigned line) : line(line) {}
+    SeqLineFinder(LineNo line) : line(line) {}
     int cmp(const SeqOrderPayload &rhs) const
     {
         return (line < rhs.trace_file_firstline
@@ -1669,43 +5071,326 @@ class SeqLineFinder {
 };
 } // namespace
 
-bool IndexNavigator::node_at_line(unsigned line, SeqOrderPayload *node) const
+const LoopRun *IndexReader::find_loop_run(LineNo first_line) const
+{
+    if (!nloop_runs)
+        return nullptr;
+    const LoopRun *runs = arena->getptr<LoopRun>(loop_table);
+    const LoopRun *it = std::lower_bound(
+        runs, runs + nloop_runs, first_line,
+        [](const LoopRun &run, LineNo line) { return run.first_line < line; });
+    if (it == runs + nloop_runs || it->first_line != first_line)
+        return nullptr;
+    return it;
+}
+
+// Offsets in 'text' of the start of each of its lines, followed by its
+// length
+static vector<size_t> line_starts(const string &text)
+{
+    vector<size_t> starts{0};
+    for (size_t pos = 0; (pos = text.find('\n', pos)) != string::npos &&
+                         ++pos < text.size();)
+        starts.push_back(pos);
+    starts.push_back(text.size());
+    return starts;
+}
+
+// Make the node that a folded loop run would have had at 'offset' lines
+// into it, given the text of the run and its line_starts. It's a copy
+// of the matching node of the body, moved to the right part of the
+// trace, with the memory state and call depth of the run.
+bool IndexReader::loop_run_node(const SeqOrderPayload &run_node,
+                                const LoopRun &run, const string &text,
+                                const vector<size_t> &starts, LineNo offset,
+                                SeqOrderPayload *out) const
+{
+    LineNo phase = offset % run.period_lines;
+    SeqOrderPayload body;
+    if (!seq_find(SeqLineFinder(run.body_line + phase), &body))
+        return false;
+
+    LineNo nlines = starts.size() - 1;
+    LineNo first = min(offset - phase + (body.trace_file_firstline -
+                                         run.body_line),
+                       nlines);
+    LineNo last = min(first + body.trace_file_lines, nlines);
+
+    // The time of a node is the time of its first event, but never
+    // earlier than the run's
+    Time time = run_node.mod_time;
+    TimeFinder finder(parseParams());
+    for (LineNo i = first; i < last; i++) {
+        string line = text.substr(starts[i], starts[i + 1] - starts[i]);
+        if (!line.empty() && line.back() == '\n')
+            line.pop_back();
+        Time t;
+        if (finder.line_time(line, &t)) {
+            time = max(time, t);
+            break;
+        }
+    }
+
+    *out = body;
+    out->mod_time = time;
+    out->trace_file_pos = run_node.trace_file_pos + starts[first];
+    out->trace_file_len = starts[last] - starts[first];
+    out->trace_file_firstline = run_node.trace_file_firstline + first;
+    out->memory_root = run_node.memory_root;
+    out->call_depth = run_node.call_depth;
+    return true;
+}
+
+bool IndexReader::expand_loop_run(SeqOrderPayload &node, LineNo line,
+                                  LoopRunText *cache) const
+{
+    const LoopRun *run = find_loop_run(node.trace_file_firstline);
+    if (!run)
+        return false;
+
+    LoopRunText local;
+    if (!cache)
+        cache = &local;
+    if (cache->first_line != node.trace_file_firstline) {
+        cache->first_line = node.trace_file_firstline;
+        cache->text = read_tarmac(node.trace_file_pos, node.trace_file_len);
+        cache->starts = line_starts(cache->text);
+    }
+
+    SeqOrderPayload run_node = node;
+    return loop_run_node(run_node, *run, cache->text, cache->starts,
+                         line - run_node.trace_file_firstline, &node);
+}
+
+bool IndexReader::expand_loop_run_at_time(SeqOrderPayload &node, Time t) const
+{
+    const LoopRun *run = find_loop_run(node.trace_file_firstline);
+    if (!run)
+        return false;
+
+    SeqOrderPayload run_node = node, found;
+    string text = read_tarmac(run_node.trace_file_pos, run_node.trace_file_len);
+    vector<size_t> starts = line_starts(text);
+
+    // Find the last iteration starting no later than t. The first one
+    // starts at the run's own time, which is no later than t.
+    unsigned lo = 0, hi = run->iterations;
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (!loop_run_node(run_node, *run, text, starts,
+                           (LineNo)mid * run->period_lines, &found))
+            return false;
+        if (found.mod_time <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // Then the last node of that iteration no later than t
+    LineNo offset = (LineNo)lo * run->period_lines;
+    LineNo end = offset + run->period_lines;
+    if (!loop_run_node(run_node, *run, text, starts, offset, &node))
+        return false;
+    while (true) {
+        offset = node.trace_file_firstline + node.trace_file_lines -
+                 run_node.trace_file_firstline;
+        if (offset >= end ||
+            !loop_run_node(run_node, *run, text, starts, offset, &found) ||
+            found.mod_time > t)
+            break;
+        node = found;
+    }
+    return true;
+}
+
+bool IndexNavigator::node_at_line(LineNo line, SeqOrderPayload *node) const
 {
-    return index.seqtree.find(index.seqroot, SeqLineFinder(line), node,
-                              nullptr);
+    if (!index.seq_find(SeqLineFinder(line), node))
+        return false;
+    index.expand_loop_run(*node, line);
+    return true;
 }
 
 bool IndexNavigator::get_previous_node(SeqOrderPayload &in,
                                        SeqOrderPayload *out) const
 {
-    return index.seqtree.find(index.seqroot,
-                              SeqLineFinder(in.trace_file_firstline - 1), out,
-                              nullptr);
+    LineNo line = in.trace_file_firstline - 1;
+    if (!index.seq_find(SeqLineFinder(line), out))
+        return false;
+    index.expand_loop_run(*out, line);
+    return true;
 }
 
 bool IndexNavigator::get_next_node(SeqOrderPayload &in,
                                    SeqOrderPayload *out) const
 {
-    return index.seqtree.find(
-        index.seqroot,
-        SeqLineFinder(in.trace_file_firstline + in.trace_file_lines), out,
-        nullptr);
+    LineNo line = in.trace_file_firstline + in.trace_file_lines;
+    if (!index.seq_find(SeqLineFinder(line), out))
+        return false;
+    index.expand_loop_run(*out, line);
+    return true;
+}
+
+bool IndexNavigator::find_pc_visit(Addr pc, LineNo line, int sign,
+                                   LineNo *out) const
+{
+    ByPCPayload finder, found;
+    finder.pc = pc & ~(Addr)1;
+    finder.trace_file_firstline = line;
+    bool ok = (sign > 0 ? index.bypctree.succ(index.bypcroot, finder, &found,
+                                              nullptr)
+                        : index.bypctree.pred(index.bypcroot, finder, &found,
+                                              nullptr)) &&
+              found.pc == finder.pc;
+    LineNo best = ok ? (LineNo)found.trace_file_firstline : 0;
+
+    // In a folded loop run, the by-PC tree only has an entry for the
+    // first visit to each node of the body, and the rest follow it at
+    // intervals of a whole iteration. So any entry in a run before
+    // 'line' (or, searching backwards, before the visit just found)
+    // might stand for a visit nearer to it. A run has at most one such
+    // entry per node of its body.
+    if (index.nLoopRuns()) {
+        ByPCPayload entry = found;
+        bool got = ok;
+        if (sign > 0) {
+            finder.trace_file_firstline = line + 1;
+            got = index.bypctree.pred(index.bypcroot, finder, &entry,
+                                      nullptr) &&
+                  entry.pc == finder.pc;
+        }
+
+        SeqOrderPayload run_node;
+        const LoopRun *run = nullptr;
+        if (got && index.seq_find(SeqLineFinder(entry.trace_file_firstline),
+                                  &run_node))
+            run = index.find_loop_run(run_node.trace_file_firstline);
+
+        for (unsigned i = 0; run && got && i < run->period_nodes &&
+                             entry.trace_file_firstline >=
+                                 run_node.trace_file_firstline;
+             i++) {
+            LineNo first = entry.trace_file_firstline;
+            LineNo period = run->period_lines;
+            LineNo iterations = run->iterations;
+            if (sign > 0) {
+                LineNo next = (line - first) / period + 1;
+                if (next < iterations &&
+                    (!ok || first + next * period < best)) {
+                    best = first + next * period;
+                    ok = true;
+                }
+            } else {
+                LineNo prev = min((line - 1 - first) / period, iterations - 1);
+                best = max(best, first + prev * period);
+            }
+
+            finder.trace_file_firstline = first;
+            got = index.bypctree.pred(index.bypcroot, finder, &entry,
+                                      nullptr) &&
+                  entry.pc == finder.pc;
+        }
+    }
+
+    if (ok)
+        *out = best;
+    return ok;
+}
+
+SeqCursor::SeqCursor(const IndexNavigator &nav)
+    : nav(nav), cursor(nav.index.seqtree.cursor(nav.index.seqroot))
+{
+}
+
+// Set 'current' from the seqtree node the cursor is on, or the node
+// containing 'line' if that's a folded loop run
+bool SeqCursor::settle(LineNo line)
+{
+    if (!cursor.valid())
+        return false;
+    current = cursor.payload();
+    nav.index.expand_loop_run(current, line, &run_text);
+    return true;
+}
+
+bool SeqCursor::seek_line(LineNo line)
+{
+    cursor.seek(SeqLineFinder(line));
+    return settle(line);
+}
+
+bool SeqCursor::seek_time(Time t)
+{
+    SeqOrderPayload found;
+    if (!nav.node_at_time(t, &found)) {
+        cursor.clear();
+        return false;
+    }
+    return seek_line(found.trace_file_firstline);
+}
+
+bool SeqCursor::seek_limit(bool end)
+{
+    if (end) {
+        cursor.last();
+        return valid() &&
+               settle(cursor.payload().trace_file_firstline +
+                      cursor.payload().trace_file_lines - 1);
+    }
+    cursor.first();
+    return valid() && settle(cursor.payload().trace_file_firstline);
+}
+
+bool SeqCursor::next()
+{
+    if (!cursor.valid())
+        return false;
+
+    // Stay in the same seqtree node if it's a folded loop run and
+    // there's more of it to go
+    LineNo line = current.trace_file_firstline + current.trace_file_lines;
+    const SeqOrderPayload &here = cursor.payload();
+    if (line < here.trace_file_firstline + here.trace_file_lines)
+        return settle(line);
+
+    cursor.next();
+    return valid() && settle(cursor.payload().trace_file_firstline);
+}
+
+bool SeqCursor::prev()
+{
+    if (!cursor.valid())
+        return false;
+
+    LineNo first = current.trace_file_firstline;
+    if (first > cursor.payload().trace_file_firstline)
+        return settle(first - 1);
+
+    cursor.prev();
+    return valid() &&
+           settle(cursor.payload().trace_file_firstline +
+                  cursor.payload().trace_file_lines - 1);
 }
 
 bool IndexNavigator::find_buffer_limit(bool end, SeqOrderPayload *node) const
 {
-    if (end)
-        return index.seqtree.pred(index.seqroot, Infinity<SeqOrderPayload>(+1),
-                                  node, nullptr);
-    else
-        return index.seqtree.succ(index.seqroot, Infinity<SeqOrderPayload>(-1),
-                                  node, nullptr);
+    if (end) {
+        if (!index.seq_pred(Infinity<SeqOrderPayload>(+1), node))
+            return false;
+        index.expand_loop_run(*node, node->trace_file_firstline +
+                                         node->trace_file_lines - 1);
+    } else {
+        if (!index.seq_succ(Infinity<SeqOrderPayload>(-1), node))
+            return false;
+        index.expand_loop_run(*node, node->trace_file_firstline);
+    }
+    return true;
 }
 
 namespace {
 struct RegMemChangesSearcher {
     // Input parameters for search
-    unsigned minline;
+    LineNo minline;
     char type;
     Addr addr;
     int sign;
@@ -1720,7 +5405,7 @@ struct RegMemChangesSearcher {
     Addr lo, hi;
     bool got_something, got_a_subtree;
 
-    RegMemChangesSearcher(unsigned minline, char type, Addr addr, int sign)
+    RegMemChangesSearcher(LineNo minline, char type, Addr addr, int sign)
         : minline(minline), type(type), addr(addr), sign(sign), pass(1),
           got_something(false)
     {
@@ -1847,19 +5532,149 @@ struct RegMemChangesSearcher {
 } // namespace
 
 bool IndexNavigator::find_next_mod(OFF_T memroot, char type, Addr addr,
-                                   unsigned minline, int sign, Addr &lo,
+                                   LineNo minline, int sign, Addr &lo,
                                    Addr &hi) const
 {
-    RegMemChangesSearcher rmcs(minline, type, addr, sign);
-    index.memtree.search(memroot, ref(rmcs), nullptr);
-    if (rmcs.need_second_pass())
-        index.memtree.search(memroot, ref(rmcs), nullptr);
-    return rmcs.get_result(lo, hi);
+    auto search = [&](const MemoryLayer &layer, Addr &lo, Addr &hi) {
+        RegMemChangesSearcher rmcs(max(minline, layer.hide_before), type,
+                                   addr, sign);
+        layer.memtree->search(layer.root, ref(rmcs), nullptr);
+        if (rmcs.need_second_pass())
+            layer.memtree->search(layer.root, ref(rmcs), nullptr);
+        return rmcs.get_result(lo, hi);
+    };
+
+    auto state = index.memory_state(memroot);
+    bool found = search(state.top, lo, hi);
+    if (state.layered()) {
+        // Changes in the base state can't be covered by anything in
+        // the top layer that wouldn't also be found, so the nearer of
+        // the two results is the right one
+        Addr base_lo, base_hi;
+        if (search(state.base, base_lo, base_hi) &&
+            (!found || (sign > 0 ? base_lo < lo : base_hi > hi))) {
+            lo = base_lo;
+            hi = base_hi;
+            found = true;
+        }
+    }
+    return found;
 }
 
-unsigned IndexNavigator::lrt_translate(unsigned line, unsigned mindepth_i,
-                                       unsigned maxdepth_i, unsigned mindepth_o,
-                                       unsigned maxdepth_o) const
+// Collect the changes since 'minline' in one layer of a memory state
+static void layer_changes_since(const MemoryLayer &layer, LineNo minline,
+                                char type, vector<MemoryChange> &out)
+{
+    minline = max(minline, layer.hide_before);
+    layer.memtree->visit_where(
+        layer.root,
+        [&](const MemoryAnnotation &annot) { return annot.latest >= minline; },
+        [&](const MemoryPayload &memp, OFF_T) {
+            if (type && memp.type != type)
+                return;
+
+            auto add = [&](Addr lo, Addr hi, const char *src) {
+                MemoryChange change;
+                change.type = memp.type;
+                change.lo = lo;
+                change.hi = hi;
+                change.line = memp.trace_file_firstline;
+                change.data.assign(src, src + (hi - lo + 1));
+                change.def.assign(hi - lo + 1, 1);
+                out.push_back(std::move(change));
+            };
+
+            if (memp.raw) {
+                add(memp.lo, memp.hi, layer.arena->getptr<char>(memp.contents));
+                return;
+            }
+
+            // Memory written with unknown contents can cover any amount
+            // of the address space (the whole of it, at the start of the
+            // trace), so only the parts that reads have filled in are
+            // listed, each as a change of its own
+            OFF_T subroot = *layer.arena->getptr<diskoff>(memp.contents);
+            MemorySubPayload msp;
+            msp.lo = memp.lo;
+            msp.hi = memp.hi;
+            layer.memsubtree->visit_range(
+                subroot, msp, [&](const MemorySubPayload &msp_found, OFF_T) {
+                    Addr lo = max(msp.lo, msp_found.lo);
+                    Addr hi = min(msp.hi, msp_found.hi);
+                    add(lo, hi,
+                        layer.arena->getptr<char>(msp_found.contents) +
+                            (lo - msp_found.lo));
+                    return true;
+                });
+        });
+}
+
+// The part of a change covering [lo,hi], which must be inside it
+static MemoryChange clip_change(const MemoryChange &change, Addr lo, Addr hi)
+{
+    MemoryChange clipped;
+    clipped.type = change.type;
+    clipped.lo = lo;
+    clipped.hi = hi;
+    clipped.line = change.line;
+    clipped.data.assign(change.data.begin() + (lo - change.lo),
+                        change.data.begin() + (hi - change.lo + 1));
+    clipped.def.assign(change.def.begin() + (lo - change.lo),
+                       change.def.begin() + (hi - change.lo + 1));
+    return clipped;
+}
+
+vector<MemoryChange> IndexNavigator::changes_since(OFF_T memroot,
+                                                   LineNo minline,
+                                                   char type) const
+{
+    auto state = index.memory_state(memroot);
+    vector<MemoryChange> top;
+    layer_changes_since(state.top, minline, type, top);
+    if (!state.layered())
+        return top;
+
+    // A change in the base state is hidden wherever the top layer has
+    // anything visible, and anything visible there is later than the
+    // base state, so it will have been found as a change too. So the
+    // base changes just need the top ones cutting out of them.
+    vector<MemoryChange> base, pieces;
+    layer_changes_since(state.base, minline, type, base);
+
+    // Order for disjoint changes, comparing the whole of each
+    auto before = [](const MemoryChange &a, const MemoryChange &b) {
+        return a.type != b.type ? a.type < b.type : a.hi < b.lo;
+    };
+
+    for (const MemoryChange &change : base) {
+        Addr lo = change.lo;
+        bool covered = false;
+        for (auto it = lower_bound(top.begin(), top.end(), change, before);
+             it != top.end() && !before(change, *it); ++it) {
+            if (it->lo > lo)
+                pieces.push_back(clip_change(change, lo, it->lo - 1));
+            if (it->hi >= change.hi) {
+                covered = true;
+                break;
+            }
+            lo = it->hi + 1;
+        }
+        if (!covered)
+            pieces.push_back(clip_change(change, lo, change.hi));
+    }
+
+    top.insert(top.end(), std::make_move_iterator(pieces.begin()),
+               std::make_move_iterator(pieces.end()));
+    sort(top.begin(), top.end(),
+         [](const MemoryChange &a, const MemoryChange &b) {
+             return a.type != b.type ? a.type < b.type : a.lo < b.lo;
+         });
+    return top;
+}
+
+LineNo IndexNavigator::lrt_translate(LineNo line, unsigned mindepth_i,
+                                     unsigned maxdepth_i, unsigned mindepth_o,
+                                     unsigned maxdepth_o) const
 {
     auto pair = lrt_translate_may_fail(line, mindepth_i, maxdepth_i, mindepth_o,
                                        maxdepth_o);
@@ -1867,8 +5682,8 @@ unsigned IndexNavigator::lrt_translate(unsigned line, unsigned mindepth_i,
     return pair.second;
 }
 
-std::pair<bool, unsigned>
-IndexNavigator::lrt_translate_may_fail(unsigned line, unsigned mindepth_i,
+std::pair<bool, LineNo>
+IndexNavigator::lrt_translate_may_fail(LineNo line, unsigned mindepth_i,
                                        unsigned maxdepth_i, unsigned mindepth_o,
                                        unsigned maxdepth_o) const
 {
@@ -1880,12 +5695,53 @@ IndexNavigator::lrt_translate_may_fail(unsigned line, unsigned mindepth_i,
     } catch (IndexLRTSearcher::OutOfRangeException) {
         success = false;
     }
-    unsigned output = success ? searcher.output_lines : 0;
+    LineNo output = success ? searcher.output_lines : 0;
     return std::make_pair(success, output);
 }
 
-unsigned IndexNavigator::lrt_translate_range(
-    unsigned linestart, unsigned lineend, unsigned mindepth_i,
+bool IndexNavigator::next_node_at_depth(LineNo line, unsigned mindepth,
+                                        unsigned maxdepth,
+                                        SeqOrderPayload *node) const
+{
+    while (true) {
+        // Count the lines in the depth range that come before this
+        // one, and then find the line just after all of those.
+        auto before = lrt_translate_may_fail(line - 1, 0, UINT_MAX, mindepth,
+                                             maxdepth);
+        if (!before.first)
+            return false;
+        auto next = lrt_translate_may_fail(before.second, mindepth, maxdepth,
+                                           0, UINT_MAX);
+        if (!next.first || !node_at_line(next.second + 1, node))
+            return false;
+
+        // The layered range tree counts a folded loop run as a whole
+        // at the depth it starts at, so a node expanded out of one
+        // might still be outside the range.
+        if (node->call_depth >= mindepth && node->call_depth < maxdepth)
+            return true;
+        line = node->trace_file_firstline + node->trace_file_lines;
+    }
+}
+
+DepthScan::DepthScan(const IndexNavigator &nav, unsigned mindepth,
+                     unsigned maxdepth, LineNo line)
+    : nav(nav), mindepth(mindepth), maxdepth(maxdepth)
+{
+    found = nav.next_node_at_depth(line, mindepth, maxdepth, &current);
+}
+
+bool DepthScan::next()
+{
+    if (found)
+        found = nav.next_node_at_depth(
+            current.trace_file_firstline + current.trace_file_lines, mindepth,
+            maxdepth, &current);
+    return found;
+}
+
+LineNo IndexNavigator::lrt_translate_range(
+    LineNo linestart, LineNo lineend, unsigned mindepth_i,
     unsigned maxdepth_i, unsigned mindepth_o, unsigned maxdepth_o) const
 {
     return (
@@ -1893,3 +5749,4 @@ unsigned IndexNavigator::lrt_translate_range(
         lrt_translate(linestart, mindepth_i, maxdepth_i, mindepth_o,
                       maxdepth_o));
 }
+
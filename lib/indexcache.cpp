@@ -0,0 +1,153 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/indexcache.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::ifstream;
+using std::ios;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+// How much of a trace is hashed to fingerprint it
+static const unsigned SAMPLE_BLOCKS = 64;
+static const size_t SAMPLE_BLOCK_SIZE = 4096;
+
+string index_cache_filename(const string &cache_dir,
+                            const string &tarmac_filename,
+                            const IndexerParams &iparams,
+                            const ParseParams &pparams)
+{
+    ifstream ifs(tarmac_filename, ios::in | ios::binary);
+    if (ifs.fail())
+        reporter->err(1, "%s: open", tarmac_filename.c_str());
+    ifs.seekg(0, ios::end);
+    uint64_t size = ifs.tellg();
+
+    // A small trace is hashed in full. Otherwise the samples include
+    // the first and last blocks, and the rest are spread evenly
+    // between.
+    FNVHash content;
+    content.add(size);
+    vector<char> buf(SAMPLE_BLOCK_SIZE);
+    if (size <= SAMPLE_BLOCKS * SAMPLE_BLOCK_SIZE) {
+        ifs.seekg(0);
+        buf.resize(size);
+        ifs.read(buf.data(), size);
+        content.add(buf.data(), ifs.gcount());
+    } else {
+        for (unsigned i = 0; i < SAMPLE_BLOCKS; i++) {
+            ifs.seekg((size - SAMPLE_BLOCK_SIZE) * i / (SAMPLE_BLOCKS - 1));
+            ifs.read(buf.data(), SAMPLE_BLOCK_SIZE);
+            content.add(buf.data(), ifs.gcount());
+        }
+    }
+
+    // Everything that changes what goes in the index file
+    ostringstream oss;
+    oss << "memsubtree=" << (int)iparams.memsubtree_type
+        << " bypctree=" << (int)iparams.bypctree_type
+        << " snapshots=" << iparams.snapshot_interval
+        << " lazy=" << (iparams.lazy_memory ? iparams.lazy_memory_interval : 0)
+        << " percpu=" << iparams.per_cpu << " bigend=" << pparams.bigend
+        << " iset=" << (pparams.iset_specified ? (int)pparams.iset : -1);
+    if (iparams.compress_loops)
+        oss << " loops=1";
+    if (iparams.seqtree_type != TreeType::AVL)
+        oss << " seqtree=" << (int)iparams.seqtree_type;
+    for (auto &r : iparams.exclude_pcs)
+        oss << " xpc=" << r.first << "-" << r.second;
+    for (auto &r : iparams.exclude_data)
+        oss << " xdata=" << r.first << "-" << r.second;
+    if (iparams.has_window())
+        oss << " window=" << iparams.window_start_line << ","
+            << iparams.window_end_line << "," << iparams.window_start_time
+            << "," << iparams.window_end_time;
+    string desc = oss.str();
+    FNVHash params;
+    params.add(desc.data(), desc.size());
+
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%08x.index",
+             (unsigned long long)content.value,
+             (unsigned)(params.value ^ (params.value >> 32)));
+    return cache_dir + "/" + name;
+}
+
+// Check that a file name is one that index_cache_filename makes, so
+// that nothing else in the directory is ever deleted.
+static bool is_cache_filename(const string &name)
+{
+    if (name.size() != 16 + 1 + 8 + 6 || name.compare(25, 6, ".index"))
+        return false;
+    for (size_t i = 0; i < 25; i++)
+        if (i == 16 ? name[i] != '-' : !isxdigit((unsigned char)name[i]))
+            return false;
+    return true;
+}
+
+void index_cache_update(const string &cache_dir, const string &index_filename,
+                        uint64_t max_size)
+{
+    touch_file(index_filename);
+
+    vector<string> names;
+    if (!list_directory(cache_dir, names))
+        return;
+
+    struct Entry {
+        string filename;
+        uint64_t size, timestamp;
+    };
+    vector<Entry> entries;
+    uint64_t total = 0;
+    for (const string &name : names) {
+        if (!is_cache_filename(name))
+            continue;
+        Entry e;
+        e.filename = cache_dir + "/" + name;
+        if (!get_file_size(e.filename, &e.size) ||
+            !get_file_timestamp(e.filename, &e.timestamp))
+            continue;
+        total += e.size;
+        if (e.filename != index_filename)
+            entries.push_back(e);
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                  return a.timestamp < b.timestamp;
+              });
+    for (const Entry &e : entries) {
+        if (total <= max_size)
+            break;
+        if (remove(e.filename.c_str()) == 0)
+            total -= e.size;
+    }
+}
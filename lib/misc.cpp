@@ -59,9 +59,9 @@ class CommandLineReporter : public Reporter {
     void indexing_status(const TracePair &pair,
                          IndexUpdateCheck status) override;
     void indexing_warning(const string &trace_filename,
-                          unsigned lineno, const string &msg) override;
+                          LineNo lineno, const string &msg) override;
     void indexing_error(const string &trace_filename,
-                        unsigned lineno, const string &msg) override;
+                        LineNo lineno, const string &msg) override;
     void indexing_start(streampos total) override;
     void indexing_progress(streampos pos) override;
     void indexing_done() override;
@@ -145,12 +145,24 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
                          pair.index_filename)
                << endl;
           break;
+      case IndexUpdateCheck::WrongByteOrder:
+          clog << format(_("index file {} was generated on a host of the "
+                           "opposite endianness; rebuilding it"),
+                         pair.index_filename)
+               << endl;
+          break;
       case IndexUpdateCheck::Incomplete:
           clog << format(_("previous generation of index file {} was not "
                            "completed; rebuilding it"),
                          pair.index_filename)
                << endl;
           break;
+      case IndexUpdateCheck::WrongParams:
+          clog << format(_("index file {} was generated with different "
+                           "options selecting what to index; rebuilding it"),
+                         pair.index_filename)
+               << endl;
+          break;
       case IndexUpdateCheck::OK:
           clog << format(_("index file {} looks ok; not rebuilding it"),
                          pair.index_filename)
@@ -164,13 +176,13 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
 }
 
 void CommandLineReporter::indexing_warning(const string &trace_filename,
-                                           unsigned lineno, const string &msg)
+                                           LineNo lineno, const string &msg)
 {
     clog << trace_filename << ":" << lineno << ": " << msg << endl;
 }
 
 void CommandLineReporter::indexing_error(const string &trace_filename,
-                                         unsigned lineno, const string &msg)
+                                         LineNo lineno, const string &msg)
 {
     clog << trace_filename << ":" << lineno << ": " << msg << endl;
     exit(1);
@@ -206,6 +218,8 @@ void CommandLineReporter::indexing_done()
 OFF_T Arena::alloc(size_t size)
 {
     if ((size_t)(curr_size - next_offset) < size) {
+        if (next_offset + (OFF_T)size > MAX_DISK_OFFSET)
+            reporter->errx(1, _("Index file would exceed maximum size"));
         OFF_T new_curr_size = (next_offset + size) * 5 / 4 + 65536;
         assert(new_curr_size >= next_offset);
         resize(new_curr_size);
@@ -228,6 +242,42 @@ void MemArena::resize(size_t newsize)
     curr_size = newsize;
 }
 
+ArenaView::ArenaView(Arena &parent, OFF_T base, OFF_T size)
+{
+    mapping = size ? parent.getptr<char>(base) : nullptr;
+    curr_size = next_offset = size;
+}
+
+ArenaView::ArenaView(std::shared_ptr<Arena> parent_, OFF_T base, OFF_T size)
+    : ArenaView(*parent_, base, size)
+{
+    parent = parent_;
+}
+
+void ArenaView::resize(size_t)
+{
+    reporter->errx(1, _("Attempted to extend a read-only view of an index"));
+}
+
+OverlayArena::OverlayArena(std::shared_ptr<Arena> lower_) : lower(lower_)
+{
+    split = curr_size = next_offset = lower->curr_offset();
+    mapping = split ? lower->getptr<char>(0) : nullptr;
+}
+
+OverlayArena::~OverlayArena()
+{
+    free(upper);
+}
+
+void OverlayArena::resize(size_t newsize)
+{
+    upper = realloc(upper, newsize - split);
+    if (!upper)
+        reporter->errx(1, _("Out of memory"));
+    curr_size = newsize;
+}
+
 static std::wstring string_to_wstring(const std::string &str)
 {
     std::wostringstream woss;
@@ -252,3 +302,102 @@ size_t terminal_width(const std::string &str)
     return wstr.size();
 #endif
 }
+
+constexpr size_t SequentialFileBuf::BUFFER_SIZE;
+constexpr size_t SequentialFileBuf::ALIGNMENT;
+
+SequentialFileBuf::SequentialFileBuf(const std::string &filename,
+                                     bool drop_behind, bool direct)
+    : pdata(nullptr), drop_behind(drop_behind), direct(direct),
+      storage(BUFFER_SIZE + ALIGNMENT), buffer_pos(0), read_pos(0),
+      dropped_to(0)
+{
+    // Direct I/O needs the buffer aligned as well as the file offsets
+    uintptr_t addr = (uintptr_t)storage.data();
+    buffer = storage.data() + (-addr & (ALIGNMENT - 1));
+    setg(buffer, buffer, buffer);
+
+    if (!open_file(filename))
+        pdata = nullptr;
+}
+
+SequentialFileBuf::~SequentialFileBuf()
+{
+    if (pdata)
+        close_file();
+}
+
+SequentialFileBuf::int_type SequentialFileBuf::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (!pdata)
+        return traits_type::eof();
+
+    buffer_pos = read_pos;
+    size_t got = read_at(read_pos, BUFFER_SIZE);
+    read_pos += got;
+    setg(buffer, buffer, buffer + got);
+
+    // Everything before this buffer has been consumed, so the OS
+    // needn't keep it
+    if (drop_behind && buffer_pos > dropped_to) {
+        drop_cached(dropped_to, buffer_pos);
+        dropped_to = buffer_pos;
+    }
+
+    if (!got)
+        return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+}
+
+SequentialFileBuf::pos_type
+SequentialFileBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which)
+{
+    if (!pdata)
+        return pos_type(off_type(-1));
+
+    off_type base;
+    if (dir == std::ios_base::beg)
+        base = 0;
+    else if (dir == std::ios_base::end)
+        base = file_size();
+    else
+        base = buffer_pos + (gptr() - eback());
+
+    // Just asking where we are shouldn't disturb the buffer
+    if (dir == std::ios_base::cur && off == 0)
+        return pos_type(base);
+    return seekpos(pos_type(base + off), which);
+}
+
+SequentialFileBuf::pos_type
+SequentialFileBuf::seekpos(pos_type pos, std::ios_base::openmode)
+{
+    off_type target = pos;
+    if (!pdata || target < 0)
+        return pos_type(off_type(-1));
+
+    if ((uint64_t)target >= buffer_pos &&
+        (uint64_t)target <= buffer_pos + (egptr() - eback())) {
+        setg(buffer, buffer + (target - buffer_pos), egptr());
+        return pos;
+    }
+
+    // Start the next read at the aligned position at or before the
+    // target, and skip the difference once it's been read. Nothing
+    // before here has been read by us, so don't drop any of it from
+    // the cache: someone else might be reading it.
+    read_pos = dropped_to = target & ~(off_type)(ALIGNMENT - 1);
+    buffer_pos = read_pos;
+    setg(buffer, buffer, buffer);
+    size_t skip = target - read_pos;
+    if (skip) {
+        if (underflow() == traits_type::eof() ||
+            skip > (size_t)(egptr() - eback()))
+            return pos_type(off_type(-1));
+        setg(buffer, buffer + skip, egptr());
+    }
+    return pos;
+}
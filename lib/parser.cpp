@@ -30,6 +30,7 @@
 #include <cstring>
 #include <iostream>
 #include <cmath>
+#include <map>
 #include <set>
 #include <sstream>
 #include <string>
@@ -44,6 +45,7 @@ using std::endl;
 using std::max;
 using std::ostringstream;
 using std::pair;
+using std::map;
 using std::set;
 using std::string;
 using std::vector;
@@ -209,6 +211,11 @@ class TarmacLineParserImpl {
         // this variable stores the starting position of the token
         // after the LD or ST, i.e. the address.
         size_t post_event_type_start = 0;
+
+        // Trace source (such as "cpu0") from the previous line, as an
+        // index into source_names. A line that doesn't name its
+        // source is taken to come from the same one.
+        unsigned source = 0;
     };
 
     string line;
@@ -219,6 +226,13 @@ class TarmacLineParserImpl {
     set<string> unrecognised_tarmac_events_reported;
     ParseReceiver *receiver;
     InterLineState next_line;
+    unsigned source = 0;
+
+    // Every trace source named so far, so that each event only needs
+    // to carry a number identifying its source. source_names[i] is
+    // the name of source i+1.
+    vector<string> source_names;
+    map<string, unsigned> source_ids;
 
     static set<string> known_timestamp_units;
 
@@ -237,6 +251,30 @@ class TarmacLineParserImpl {
     {
         receiver->highlight(start, end, cl);
     }
+
+    unsigned intern_source(const string &name)
+    {
+        auto it = source_ids.find(name);
+        if (it != source_ids.end())
+            return it->second;
+        source_names.push_back(name);
+        return source_ids[name] = source_names.size();
+    }
+
+    const string &source_name(unsigned id) const
+    {
+        static const string none;
+        return id ? source_names[id - 1] : none;
+    }
+
+    // Pass an event to the receiver, labelled with the current line's
+    // trace source
+    template <class Event> void send(Event &ev)
+    {
+        ev.source = source;
+        receiver->got_event(ev);
+    }
+
     void highlight(const Token &tok, HighlightClass cl)
     {
         highlight(tok.startpos, tok.endpos, cl);
@@ -326,7 +364,7 @@ class TarmacLineParserImpl {
         return true;
     }
 
-    void parse(const string &line_)
+    void parse(StringRef line_)
     {
         // Get the inter-line state referring to the previous line,
         // and replace it with a default-constructed InterLineState
@@ -340,7 +378,7 @@ class TarmacLineParserImpl {
         constexpr uint16_t UNUSED = 0x100, UNKNOWN = 0x101;
 
         // Set up the lexer.
-        line = line_;
+        line.assign(line_.data(), line_.size());
         pos = 0;
         size = line.find_last_not_of("\r\n");
         if (size != string::npos)
@@ -410,11 +448,13 @@ class TarmacLineParserImpl {
         next_line.timestamp = time;
 
         // Now we can have a trace source identifier (cpu or other component)
-        // If we want multiple streams recongized, this is it.
-        // But for now, we just drop the cpu* identifiers.
+        source = prev_line.source;
         if (tok.starts_with("cpu")) {
+            if (!source || tok.s != source_names[source - 1])
+                source = intern_source(tok.s);
             tok = lex();
         }
+        next_line.source = source;
 
         // Now we definitely expect an event type, and we diverge
         // based on what it is.
@@ -446,7 +486,7 @@ class TarmacLineParserImpl {
                 tok = lex(); // now tok.startpos begins unparsed text
                 highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
                 ExceptionEvent ev(time);
-                receiver->got_event(ev);
+                send(ev);
                 return;
             }
 
@@ -683,7 +723,7 @@ class TarmacLineParserImpl {
                 highlight(disass_end, line.size(), HL_SPACE);
             InstructionEvent ev(time, effect, address, iset, width,
                                 bitpattern, line.substr(tok.startpos));
-            receiver->got_event(ev);
+            send(ev);
         } else if (tok == "R") {
             // Register update.
             tok = lex();
@@ -989,7 +1029,7 @@ class TarmacLineParserImpl {
                     while (offset < bytes.size() && bytes[offset] != UNKNOWN)
                         realbytes.push_back(bytes[offset++]);
                     RegisterEvent ev(time, reg, start, realbytes);
-                    receiver->got_event(ev);
+                    send(ev);
                 }
             }
         } else if ((tok.isword() && tok.s.substr(0, 1) == "M") ||
@@ -1027,7 +1067,7 @@ class TarmacLineParserImpl {
                     highlight(firsttok.startpos, line.size(), HL_TEXT_EVENT);
                     TextOnlyEvent ev(time, tok.s,
                                      line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    send(ev);
                     return;
                 } else if (pos == 8 && end == 8 && (c == 'D')) {
                     // This is a data-bus access in the Cortex-M4 RTL style.
@@ -1125,7 +1165,7 @@ class TarmacLineParserImpl {
                     highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
                     TextOnlyEvent ev(time, tok.s,
                                      line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    send(ev);
                     return;
                 } else {
                     parse_error(tok, _("unrecognised parenthesised keyword"));
@@ -1165,7 +1205,7 @@ class TarmacLineParserImpl {
                 }
 
                 MemoryEvent ev(time, read, size, addr, known, contents);
-                receiver->got_event(ev);
+                send(ev);
             };
 
             if (size <= 8) {
@@ -1261,7 +1301,7 @@ class TarmacLineParserImpl {
 
                     MemoryEvent ev(time, read, j - i, baseaddr + 16 - j, false,
                                    0);
-                    receiver->got_event(ev);
+                    send(ev);
 
                     i = j;
                 } else {
@@ -1284,7 +1324,7 @@ class TarmacLineParserImpl {
 
                     MemoryEvent ev(time, read, j - i, baseaddr + 16 - j, true,
                                    value);
-                    receiver->got_event(ev);
+                    send(ev);
 
                     i = j;
                 }
@@ -1294,7 +1334,7 @@ class TarmacLineParserImpl {
             // ES-style format. Sometimes there's an ES token before
             // it, which we handle above.
             ExceptionEvent ev(time);
-            receiver->got_event(ev);
+            send(ev);
         } else if (tok == "E") {
             // Trace event type that reports (among other things) CPU
             // exceptions in the IT-style format.
@@ -1316,10 +1356,10 @@ class TarmacLineParserImpl {
             if (tok.starts_with("DebugEvent_")) {
                 // Not interesting enough to make an ExceptionEvent
                 TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-                receiver->got_event(ev);
+                send(ev);
             } else {
                 ExceptionEvent ev(time);
-                receiver->got_event(ev);
+                send(ev);
             }
         } else if (tok == "Tarmac") {
             // Header line seen at the start of some trace files. Typically
@@ -1361,7 +1401,7 @@ class TarmacLineParserImpl {
             highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
 
             TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-            receiver->got_event(ev);
+            send(ev);
         }
     }
 };
@@ -1374,7 +1414,12 @@ TarmacLineParser::TarmacLineParser(const ParseParams &params,
 
 TarmacLineParser::~TarmacLineParser() { delete pImpl; }
 
-void TarmacLineParser::parse(const string &s) const { pImpl->parse(s); }
+void TarmacLineParser::parse(StringRef s) const { pImpl->parse(s); }
+
+const string &TarmacLineParser::source_name(unsigned source) const
+{
+    return pImpl->source_name(source);
+}
 
 set<string> TarmacLineParserImpl::known_timestamp_units = {
     "clk", "ns", "cs", "cyc", "tic", "ps", "us",
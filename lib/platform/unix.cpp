@@ -22,18 +22,24 @@
 #include "libtarmac/intl.hh"
 
 #include <errno.h>
+#include <signal.h>
 #include <string.h>
 
 #include <sstream>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <utime.h>
 
 using std::ostringstream;
 using std::string;
+using std::vector;
 
 bool get_file_timestamp(const string &filename, uint64_t *out_timestamp)
 {
@@ -44,10 +50,59 @@ bool get_file_timestamp(const string &filename, uint64_t *out_timestamp)
     return true;
 }
 
+bool get_file_size(const string &filename, uint64_t *out_size)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return false;
+    *out_size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+bool touch_file(const string &filename)
+{
+    return utime(filename.c_str(), nullptr) == 0;
+}
+
+bool make_directory(const string &dirname)
+{
+    return mkdir(dirname.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+bool list_directory(const string &dirname, vector<string> &out)
+{
+    DIR *dir = opendir(dirname.c_str());
+    if (!dir)
+        return false;
+    while (struct dirent *de = readdir(dir)) {
+        string name = de->d_name;
+        if (name != "." && name != "..")
+            out.push_back(name);
+    }
+    closedir(dir);
+    return true;
+}
+
 bool is_interactive() { return isatty(1); }
 
 string get_error_message() { return strerror(errno); }
 
+bool evict_file_from_cache(const string &filename)
+{
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    // Dirty pages can't be discarded, so write them back first
+    bool ok = fsync(fd) == 0 &&
+              posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return ok;
+#else
+    return false;
+#endif
+}
+
 struct MMapFile::PlatformData {
     int fd;
 };
@@ -113,6 +168,251 @@ void MMapFile::resize(size_t newsize)
     map();
 }
 
+struct SequentialFileBuf::PlatformData {
+    int fd;
+    string filename;
+};
+
+bool SequentialFileBuf::open_file(const string &filename)
+{
+    int fd = -1;
+    if (direct) {
+#if defined O_DIRECT
+        fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+#elif defined F_NOCACHE
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd >= 0)
+            fcntl(fd, F_NOCACHE, 1);
+#endif
+        if (fd < 0) {
+            // Not every file system supports direct I/O (tmpfs
+            // doesn't, for example), so fall back to the next best
+            // thing
+            direct = false;
+            drop_behind = true;
+        }
+    }
+    if (fd < 0)
+        fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    pdata = new PlatformData;
+    pdata->fd = fd;
+    pdata->filename = filename;
+    return true;
+}
+
+void SequentialFileBuf::close_file()
+{
+    close(pdata->fd);
+    delete pdata;
+    pdata = nullptr;
+}
+
+size_t SequentialFileBuf::read_at(uint64_t offset, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(pdata->fd, buffer + done, size - done,
+                            offset + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            reporter->err(1, "%s: pread", pdata->filename.c_str());
+        if (got == 0)
+            break;
+        done += got;
+        // A short read with O_DIRECT leaves us misaligned, which can
+        // only happen at the end of the file anyway
+        if (direct && (done & (ALIGNMENT - 1)))
+            break;
+    }
+    return done;
+}
+
+uint64_t SequentialFileBuf::file_size()
+{
+    struct stat st;
+    if (fstat(pdata->fd, &st) < 0)
+        reporter->err(1, "%s: fstat", pdata->filename.c_str());
+    return st.st_size;
+}
+
+void SequentialFileBuf::drop_cached(uint64_t from, uint64_t to)
+{
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(pdata->fd, from, to - from, POSIX_FADV_DONTNEED);
+#endif
+}
+
+struct PositionedFile::PlatformData {
+    int fd;
+    string filename;
+};
+
+PositionedFile::PositionedFile(const string &filename)
+    : pdata(nullptr), map_data(nullptr), map_size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    pdata = new PlatformData;
+    pdata->fd = fd;
+    pdata->filename = filename;
+
+    // Failing to map the file (say, if it's too big for the address
+    // space) isn't an error: read() still works without the mapping.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+        (uint64_t)st.st_size <= SIZE_MAX) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            map_data = (const char *)p;
+            map_size = st.st_size;
+        }
+    }
+}
+
+PositionedFile::~PositionedFile()
+{
+    if (map_data)
+        munmap((void *)map_data, map_size);
+    if (pdata) {
+        close(pdata->fd);
+        delete pdata;
+    }
+}
+
+size_t PositionedFile::read(uint64_t offset, void *buf, size_t size) const
+{
+    if (!pdata)
+        return 0;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(pdata->fd, (char *)buf + done, size - done,
+                            offset + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            reporter->err(1, "%s: pread", pdata->filename.c_str());
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+struct LocalSocketServer::PlatformData {
+    int fd;
+    string path;
+};
+
+LocalSocketServer::LocalSocketServer(const string &path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        reporter->errx(1, _("%s: socket path is too long"), path.c_str());
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    // Only replace a socket left behind by an earlier server, never a
+    // file that's anything else, in case the path was mistyped
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            reporter->errx(1, _("%s: file exists and is not a socket"),
+                           path.c_str());
+        if (unlink(path.c_str()) < 0)
+            reporter->err(1, "%s: unlink", path.c_str());
+    } else if (errno != ENOENT) {
+        reporter->err(1, "%s: lstat", path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        reporter->err(1, "%s: socket", path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        reporter->err(1, "%s: bind", path.c_str());
+    if (listen(fd, SOMAXCONN) < 0)
+        reporter->err(1, "%s: listen", path.c_str());
+
+    // A client that hangs up before reading all its answers must only
+    // make writing to it fail, not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    pdata = new PlatformData;
+    pdata->fd = fd;
+    pdata->path = path;
+}
+
+LocalSocketServer::~LocalSocketServer()
+{
+    close(pdata->fd);
+    unlink(pdata->path.c_str());
+    delete pdata;
+}
+
+// Errors from accept() that only affect one connection, or go away
+// once some clients have finished, rather than meaning the listening
+// socket itself is broken
+static bool accept_error_is_transient(int err)
+{
+    switch (err) {
+    case EINTR:
+    case EAGAIN:
+    case ECONNABORTED:
+    case EPROTO:
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool LocalSocketServer::accept(FILE *&in, FILE *&out)
+{
+    while (true) {
+        int fd = ::accept(pdata->fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (!accept_error_is_transient(errno))
+                return false;
+            // Out of file descriptors or memory: wait a little for
+            // other clients to finish, rather than spinning
+            if (errno != EINTR && errno != ECONNABORTED)
+                usleep(100000);
+            continue;
+        }
+
+        // Failing to set up the streams for one client (typically for
+        // lack of file descriptors) just drops that client
+        int fd2 = dup(fd);
+        if (fd2 < 0) {
+            close(fd);
+            continue;
+        }
+        if (!(in = fdopen(fd, "r"))) {
+            close(fd);
+            close(fd2);
+            continue;
+        }
+        if (!(out = fdopen(fd2, "w"))) {
+            fclose(in);
+            close(fd2);
+            continue;
+        }
+        return true;
+    }
+}
+
 static bool try_make_conf_path(const char *env_var, const char *suffix,
                                const string &filename, string &out)
 {
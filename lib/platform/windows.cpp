@@ -26,14 +26,17 @@
 #include <windows.h>
 #include <shlobj.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
 #include <map>
 #include <string>
 #include <sstream>
+#include <vector>
 
 using std::ostringstream;
 using std::string;
+using std::vector;
 
 bool get_file_timestamp(const string &filename, uint64_t *out_timestamp)
 {
@@ -45,6 +48,50 @@ bool get_file_timestamp(const string &filename, uint64_t *out_timestamp)
     return true;
 }
 
+bool get_file_size(const string &filename, uint64_t *out_size)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(filename.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    *out_size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    return true;
+}
+
+bool touch_file(const string &filename)
+{
+    HANDLE fh = CreateFile(filename.c_str(), FILE_WRITE_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, 0, NULL);
+    if (fh == INVALID_HANDLE_VALUE)
+        return false;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    bool ok = SetFileTime(fh, NULL, NULL, &now);
+    CloseHandle(fh);
+    return ok;
+}
+
+bool make_directory(const string &dirname)
+{
+    return CreateDirectory(dirname.c_str(), NULL) ||
+           GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+bool list_directory(const string &dirname, vector<string> &out)
+{
+    WIN32_FIND_DATA data;
+    HANDLE fh = FindFirstFile((dirname + "\\*").c_str(), &data);
+    if (fh == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        string name = data.cFileName;
+        if (name != "." && name != "..")
+            out.push_back(name);
+    } while (FindNextFile(fh, &data));
+    FindClose(fh);
+    return true;
+}
+
 bool is_interactive()
 {
     DWORD ignored_output;
@@ -76,6 +123,165 @@ string get_error_message()
     return msg;
 }
 
+bool evict_file_from_cache(const string &)
+{
+    // Windows has no direct equivalent of POSIX_FADV_DONTNEED.
+    return false;
+}
+
+struct SequentialFileBuf::PlatformData {
+    HANDLE fh;
+    string filename;
+};
+
+bool SequentialFileBuf::open_file(const string &filename)
+{
+    // FILE_FLAG_NO_BUFFERING is the equivalent of O_DIRECT. There's no
+    // way to drop pages we've finished with from the cache, but
+    // FILE_FLAG_SEQUENTIAL_SCAN makes the cache manager reuse them
+    // sooner anyway.
+    DWORD flags = FILE_FLAG_SEQUENTIAL_SCAN;
+    if (direct)
+        flags |= FILE_FLAG_NO_BUFFERING;
+    HANDLE fh = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                           NULL, OPEN_EXISTING, flags, NULL);
+    if (fh == INVALID_HANDLE_VALUE && direct) {
+        direct = false;
+        fh = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+    if (fh == INVALID_HANDLE_VALUE)
+        return false;
+
+    pdata = new PlatformData;
+    pdata->fh = fh;
+    pdata->filename = filename;
+    return true;
+}
+
+void SequentialFileBuf::close_file()
+{
+    CloseHandle(pdata->fh);
+    delete pdata;
+    pdata = nullptr;
+}
+
+size_t SequentialFileBuf::read_at(uint64_t offset, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        OVERLAPPED ov = {0};
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD got;
+        if (!ReadFile(pdata->fh, buffer + done, (DWORD)(size - done), &got,
+                      &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            reporter->err(1, "%s: ReadFile", pdata->filename.c_str());
+        }
+        if (got == 0)
+            break;
+        done += got;
+        if (direct && (done & (ALIGNMENT - 1)))
+            break;
+    }
+    return done;
+}
+
+uint64_t SequentialFileBuf::file_size()
+{
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(pdata->fh, &size))
+        reporter->err(1, "%s: GetFileSizeEx", pdata->filename.c_str());
+    return size.QuadPart;
+}
+
+void SequentialFileBuf::drop_cached(uint64_t, uint64_t) {}
+
+struct PositionedFile::PlatformData {
+    HANDLE fh;
+    HANDLE mh;
+    string filename;
+};
+
+PositionedFile::PositionedFile(const string &filename)
+    : pdata(nullptr), map_data(nullptr), map_size(0)
+{
+    HANDLE fh = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                           NULL, OPEN_EXISTING, 0, NULL);
+    if (fh == INVALID_HANDLE_VALUE)
+        return;
+    pdata = new PlatformData;
+    pdata->fh = fh;
+    pdata->mh = NULL;
+    pdata->filename = filename;
+
+    // Failing to map the file (say, if it's too big for the address
+    // space) isn't an error: read() still works without the mapping.
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(fh, &size) && size.QuadPart > 0 &&
+        (uint64_t)size.QuadPart <= SIZE_MAX) {
+        pdata->mh = CreateFileMapping(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (pdata->mh) {
+            void *p = MapViewOfFile(pdata->mh, FILE_MAP_READ, 0, 0, 0);
+            if (p) {
+                map_data = (const char *)p;
+                map_size = size.QuadPart;
+            }
+        }
+    }
+}
+
+PositionedFile::~PositionedFile()
+{
+    if (map_data)
+        UnmapViewOfFile(map_data);
+    if (pdata) {
+        if (pdata->mh)
+            CloseHandle(pdata->mh);
+        CloseHandle(pdata->fh);
+        delete pdata;
+    }
+}
+
+size_t PositionedFile::read(uint64_t offset, void *buf, size_t size) const
+{
+    if (!pdata)
+        return 0;
+    size_t done = 0;
+    while (done < size) {
+        // Giving the offset in an OVERLAPPED makes the read independent
+        // of the handle's file pointer, so concurrent reads are safe
+        OVERLAPPED ov = {0};
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD got;
+        if (!ReadFile(pdata->fh, (char *)buf + done, (DWORD)(size - done),
+                      &got, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            reporter->err(1, "%s: ReadFile", pdata->filename.c_str());
+        }
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+struct LocalSocketServer::PlatformData {};
+
+LocalSocketServer::LocalSocketServer(const string &path) : pdata(nullptr)
+{
+    reporter->errx(1, _("%s: local sockets are not supported on Windows"),
+                   path.c_str());
+}
+
+LocalSocketServer::~LocalSocketServer() {}
+
+bool LocalSocketServer::accept(FILE *&, FILE *&) { return false; }
+
 struct MMapFile::PlatformData {
     HANDLE fh;
     HANDLE mh;
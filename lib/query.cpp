@@ -0,0 +1,594 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/query.hh"
+#include "libtarmac/callinfo.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/registers.hh"
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using std::lock_guard;
+using std::make_unique;
+using std::mutex;
+using std::string;
+using std::vector;
+
+/* ----------------------------------------------------------------------
+ * Parsing queries
+ */
+
+namespace {
+class JSONScanner {
+    const string &text;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const string &what) const
+    {
+        throw QueryError(format(_("bad JSON at offset {}: {}"), pos, what));
+    }
+
+  public:
+    JSONScanner(const string &text) : text(text) {}
+
+    void skip_space()
+    {
+        while (pos < text.size() && strchr(" \t\r\n", text[pos]))
+            pos++;
+    }
+
+    bool at_end()
+    {
+        skip_space();
+        return pos >= text.size();
+    }
+
+    char peek()
+    {
+        skip_space();
+        return pos < text.size() ? text[pos] : '\0';
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c)
+            fail(format(_("expected '{}'"), string(1, c)));
+        pos++;
+    }
+
+    static void put_utf8(string &out, unsigned long c)
+    {
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        } else {
+            out += (char)(0xF0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3F));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    // The four hex digits of a \u escape, which must be exactly that
+    unsigned long hex4()
+    {
+        if (pos + 4 > text.size())
+            fail(_("truncated \\u escape"));
+        for (size_t i = pos; i < pos + 4; i++)
+            if (!isxdigit((unsigned char)text[i]))
+                fail(_("bad \\u escape"));
+        unsigned long c = strtoul(text.substr(pos, 4).c_str(), nullptr, 16);
+        pos += 4;
+        return c;
+    }
+
+    string string_value()
+    {
+        expect('"');
+        string out;
+        while (true) {
+            if (pos >= text.size())
+                fail(_("unterminated string"));
+            char c = text[pos++];
+            if (c == '"')
+                return out;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+                fail(_("unterminated string"));
+            switch (c = text[pos++]) {
+            case '"':
+            case '\\':
+            case '/':
+                out += c;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u': {
+                // A character outside the BMP is written as a UTF-16
+                // surrogate pair, and neither half is allowed alone
+                unsigned long u = hex4();
+                if (u >= 0xDC00 && u < 0xE000)
+                    fail(_("unpaired surrogate in \\u escape"));
+                if (u >= 0xD800 && u < 0xDC00) {
+                    if (pos + 2 > text.size() || text[pos] != '\\' ||
+                        text[pos + 1] != 'u')
+                        fail(_("unpaired surrogate in \\u escape"));
+                    pos += 2;
+                    unsigned long lo = hex4();
+                    if (lo < 0xDC00 || lo >= 0xE000)
+                        fail(_("unpaired surrogate in \\u escape"));
+                    u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                put_utf8(out, u);
+                break;
+            }
+            default:
+                fail(_("bad escape in string"));
+            }
+        }
+    }
+
+    // Any value other than a string, returned as its JSON text
+    string literal_value()
+    {
+        skip_space();
+        size_t start = pos;
+        while (pos < text.size() && !strchr(" \t\r\n,}", text[pos]))
+            pos++;
+        string lit = text.substr(start, pos - start);
+        if (lit == "true" || lit == "false" || lit == "null")
+            return lit;
+        if (!lit.empty() && strchr("-0123456789", lit[0]) &&
+            lit.find_first_not_of("-+.eE0123456789") == string::npos)
+            return lit;
+        pos = start;
+        if (pos < text.size() && (text[pos] == '{' || text[pos] == '['))
+            fail(_("nested objects and arrays are not supported"));
+        fail(_("expected a value"));
+    }
+};
+} // namespace
+
+QueryRequest::QueryRequest(const string &json)
+{
+    JSONScanner js(json);
+    js.expect('{');
+    if (js.peek() == '}') {
+        js.expect('}');
+    } else {
+        while (true) {
+            string key = js.string_value();
+            js.expect(':');
+            if (js.peek() == '"') {
+                string value = js.string_value();
+                if (key == "id")
+                    id = json_quote(value);
+                fields[key] = value;
+            } else {
+                string value = js.literal_value();
+                if (key == "id")
+                    id = value;
+                fields[key] = value;
+            }
+            if (js.peek() == '}') {
+                js.expect('}');
+                break;
+            }
+            js.expect(',');
+        }
+    }
+    if (!js.at_end())
+        throw QueryError(_("unexpected text after the end of the query"));
+}
+
+const string &QueryRequest::get_string(const string &key) const
+{
+    auto it = fields.find(key);
+    if (it == fields.end())
+        throw QueryError(format(_("query needs a \"{}\" field"), key));
+    return it->second;
+}
+
+uint64_t QueryRequest::get_number(const string &key) const
+{
+    const string &s = get_string(key);
+    uint64_t value;
+    char *end;
+    errno = 0;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+        value = strtoull(s.c_str() + 2, &end, 16);
+    else
+        value = strtoull(s.c_str(), &end, 10);
+    if (s.empty() || *end || errno || s[0] == '-')
+        throw QueryError(
+            format(_("field \"{}\" should be a non-negative integer"), key));
+    return value;
+}
+
+/* ----------------------------------------------------------------------
+ * Writing answers
+ */
+
+string json_quote(const string &s)
+{
+    string out = "\"";
+    for (unsigned char c : s) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+                out += buf;
+            } else {
+                out += (char)c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+void QueryResponse::key(const string &k)
+{
+    os << (empty ? "{" : ", ") << json_quote(k) << ": ";
+    empty = false;
+}
+
+QueryResponse &QueryResponse::field(const string &k, const string &value)
+{
+    key(k);
+    os << json_quote(value);
+    return *this;
+}
+
+QueryResponse &QueryResponse::field(const string &k, unsigned long long value)
+{
+    key(k);
+    os << value;
+    return *this;
+}
+
+QueryResponse &QueryResponse::field(const string &k, bool value)
+{
+    key(k);
+    os << (value ? "true" : "false");
+    return *this;
+}
+
+QueryResponse &QueryResponse::null_field(const string &k)
+{
+    key(k);
+    os << "null";
+    return *this;
+}
+
+QueryResponse &QueryResponse::raw_field(const string &k, const string &json)
+{
+    key(k);
+    os << json;
+    return *this;
+}
+
+QueryResponse &QueryResponse::array_field(const string &k,
+                                          const vector<string> &jsons)
+{
+    key(k);
+    os << "[";
+    for (size_t i = 0; i < jsons.size(); i++)
+        os << (i ? ", " : "") << jsons[i];
+    os << "]";
+    return *this;
+}
+
+string QueryResponse::str() const
+{
+    return empty ? "{}" : os.str() + "}";
+}
+
+static string hex(uint64_t value) { return format("{:#x}", value); }
+
+static string hex_byte(unsigned char c)
+{
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", (unsigned)c);
+    return buf;
+}
+
+/* ----------------------------------------------------------------------
+ * Answering queries
+ */
+
+QueryEngine::QueryEngine(const IndexNavigator &IN,
+                         const CallTreeOptions &ctopts)
+    : IN(IN), ctopts(ctopts)
+{
+}
+
+SeqOrderPayload QueryEngine::find_node(const QueryRequest &req) const
+{
+    SeqOrderPayload node;
+    if (req.has("line")) {
+        uint64_t line = req.get_number("line");
+        if (line <= IN.index.lineno_offset ||
+            !IN.node_at_line(line - IN.index.lineno_offset, &node))
+            throw QueryError(format(_("no trace event at line {}"), line));
+    } else if (req.has("time")) {
+        uint64_t time = req.get_number("time");
+        if (!IN.node_at_time(time, &node))
+            throw QueryError(format(_("no trace event at time {}"), time));
+    } else {
+        throw QueryError(_("query needs a \"line\" or \"time\" field"));
+    }
+    return node;
+}
+
+void QueryEngine::answer_node(const QueryRequest &req,
+                              QueryResponse &resp) const
+{
+    SeqOrderPayload node = find_node(req);
+    resp.field("line", (unsigned long long)(node.trace_file_firstline +
+                                            IN.index.lineno_offset))
+        .field("lines", (unsigned long long)node.trace_file_lines)
+        .field("time", (unsigned long long)node.mod_time)
+        .field("pc", hex(node.pc))
+        .field("depth", (unsigned long long)node.call_depth);
+}
+
+void QueryEngine::answer_text(const QueryRequest &req,
+                              QueryResponse &resp) const
+{
+    uint64_t line = req.get_number("line");
+    string text;
+    if (line <= IN.index.lineno_offset ||
+        !IN.index.get_line_text(line - IN.index.lineno_offset, text))
+        throw QueryError(format(_("no line {} in the trace file"), line));
+    resp.field("text", text);
+}
+
+void QueryEngine::answer_reg(const QueryRequest &req,
+                             QueryResponse &resp) const
+{
+    RegisterId reg;
+    const string &name = req.get_string("reg");
+    if (!lookup_reg_name(reg, name))
+        throw QueryError(format(_("unknown register '{}'"), name));
+    SeqOrderPayload node = find_node(req);
+
+    resp.field("reg", reg_name(reg));
+    auto value = IN.get_reg_value(node.memory_root, reg);
+    vector<unsigned char> bytes(reg_size(reg));
+    if (value.first) {
+        resp.field("value", hex(value.second));
+    } else if (IN.get_reg_bytes(node.memory_root, reg, bytes)) {
+        // Too big for an integer, so give the bytes as stored
+        string s;
+        for (unsigned char c : bytes)
+            s += hex_byte(c);
+        resp.field("bytes", s);
+    } else {
+        resp.null_field("value");
+    }
+}
+
+void QueryEngine::answer_mem(const QueryRequest &req,
+                             QueryResponse &resp) const
+{
+    Addr addr = req.get_number("addr");
+    uint64_t size = req.get_number("size");
+    if (size == 0 || size > MAX_QUERY_MEM_SIZE)
+        throw QueryError(format(_("memory size must be from 1 to {} bytes"),
+                                MAX_QUERY_MEM_SIZE));
+    SeqOrderPayload node = find_node(req);
+
+    vector<unsigned char> data(size), def(size);
+    LineNo line =
+        IN.getmem(node.memory_root, 'm', addr, size, &data[0], &def[0]);
+
+    // Bytes whose contents aren't known are shown as ".."
+    string s;
+    for (size_t i = 0; i < size; i++)
+        s += def[i] ? hex_byte(data[i]) : string("..");
+    resp.field("addr", hex(addr)).field("data", s);
+    if (line)
+        resp.field("written",
+                   (unsigned long long)(line + IN.index.lineno_offset));
+    else
+        resp.null_field("written");
+}
+
+void QueryEngine::answer_callinfo(const QueryRequest &req,
+                                  QueryResponse &resp) const
+{
+    const string &function = req.get_string("function");
+    uint64_t addr;
+    size_t size;
+    if (function.size() > 2 && function[0] == '0' &&
+        (function[1] == 'x' || function[1] == 'X')) {
+        addr = req.get_number("function");
+    } else if (!IN.has_image()) {
+        throw QueryError(_("no image, so symbols cannot be looked up"));
+    } else if (IN.lookup_symbol(function, addr, size)) {
+        resp.field("size", (unsigned long long)size);
+    } else {
+        throw QueryError(format(_("symbol '{}' not found"), function));
+    }
+    resp.field("addr", hex(addr));
+
+    vector<string> calls;
+    for (const TarmacSite &s : find_calls(IN, addr))
+        calls.push_back(
+            QueryResponse()
+                .field("time", (unsigned long long)s.time)
+                .field("line", (unsigned long long)(s.tarmac_line +
+                                                    IN.index.lineno_offset))
+                .str());
+    resp.array_field("calls", calls);
+}
+
+namespace {
+// Collects the function calls in part of a CallTree
+struct CallSliceVisitor : CallTreeVisitor {
+    const IndexNavigator &IN;
+    LineNo from, to;
+    unsigned maxdepth, depth = 0;
+    vector<string> calls;
+
+    CallSliceVisitor(const CallTree &CT, const IndexNavigator &IN,
+                     LineNo from, LineNo to, unsigned maxdepth)
+        : CallTreeVisitor(CT), IN(IN), from(from), to(to), maxdepth(maxdepth)
+    {
+    }
+
+    unsigned long long line(const TarmacSite &site) const
+    {
+        return site.tarmac_line + IN.index.lineno_offset;
+    }
+
+    void onFunctionEntry(const TarmacSite &entry, const TarmacSite &exit)
+    {
+        if (depth <= maxdepth && line(entry) >= from && line(entry) <= to) {
+            QueryResponse call;
+            string name = CT.getFunctionName(entry);
+            if (!name.empty())
+                call.field("function", name);
+            calls.push_back(call.field("addr", hex(entry.addr))
+                                .field("depth", (unsigned long long)depth)
+                                .field("entry_line", line(entry))
+                                .field("entry_time",
+                                       (unsigned long long)entry.time)
+                                .field("exit_line", line(exit))
+                                .field("exit_time",
+                                       (unsigned long long)exit.time)
+                                .str());
+        }
+        depth++;
+    }
+    void onFunctionExit(const TarmacSite &, const TarmacSite &) { depth--; }
+};
+} // namespace
+
+void QueryEngine::answer_calltree(const QueryRequest &req,
+                                  QueryResponse &resp) const
+{
+    LineNo from = req.get_number("from", 0);
+    LineNo to = req.get_number("to", ~(LineNo)0);
+    unsigned maxdepth = req.get_number("depth", UINT_MAX);
+
+    const CallTree *CT;
+    {
+        lock_guard<mutex> lock(calltree_mutex);
+        if (!calltree) {
+            calltree = make_unique<CallTree>(IN);
+            calltree->setOptions(ctopts);
+        }
+        CT = calltree.get();
+    }
+
+    CallSliceVisitor visitor(*CT, IN, from, to, maxdepth);
+    CT->visit(visitor);
+    resp.array_field("calls", visitor.calls);
+}
+
+string QueryEngine::answer(const string &query) const
+{
+    try {
+        return answer(QueryRequest(query));
+    } catch (QueryError &e) {
+        return error_answer(e.msg);
+    }
+}
+
+string QueryEngine::answer(const QueryRequest &req) const
+{
+    QueryResponse resp;
+    if (!req.id_json().empty())
+        resp.raw_field("id", req.id_json());
+
+    try {
+        QueryResponse result;
+        const string &op = req.get_string("op");
+        if (op == "node")
+            answer_node(req, result);
+        else if (op == "text")
+            answer_text(req, result);
+        else if (op == "reg")
+            answer_reg(req, result);
+        else if (op == "mem")
+            answer_mem(req, result);
+        else if (op == "callinfo")
+            answer_callinfo(req, result);
+        else if (op == "calltree")
+            answer_calltree(req, result);
+        else
+            throw QueryError(format(_("unknown operation '{}'"), op));
+        resp.raw_field("result", result.str());
+    } catch (QueryError &e) {
+        resp.field("error", e.msg);
+    }
+    return resp.str();
+}
+
+string QueryEngine::error_answer(const string &msg, const string &id_json)
+{
+    QueryResponse resp;
+    if (!id_json.empty())
+        resp.raw_field("id", id_json);
+    return resp.field("error", msg).str();
+}
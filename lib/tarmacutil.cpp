@@ -19,13 +19,19 @@
 #include "libtarmac/disktree.hh"
 #include "libtarmac/tarmacutil.hh"
 #include "libtarmac/index.hh"
+#include "libtarmac/indexcache.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <climits>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 using std::cout;
 using std::make_shared;
@@ -38,6 +44,45 @@ TarmacUtilityBase::TarmacUtilityBase()
     idiags.diagnostics_stream = &cout;
 }
 
+// Parse a size in bytes, optionally followed by K, M, G or T.
+static uint64_t parse_size(const string &s)
+{
+    size_t pos;
+    uint64_t size;
+    try {
+        size = stoull(s, &pos, 0);
+    } catch (std::exception &) {
+        throw ArgparseError(format(_("unable to parse size '{}'"), s));
+    }
+    if (pos < s.size()) {
+        const char *suffixes = "KMGT";
+        const char *p = pos + 1 == s.size()
+                            ? strchr(suffixes, toupper((unsigned char)s[pos]))
+                            : nullptr;
+        if (!p || !*p)
+            throw ArgparseError(format(_("unable to parse size '{}'"), s));
+        size <<= 10 * (p - suffixes + 1);
+    }
+    return size;
+}
+
+// Parse an address range LO-HI, including both ends.
+static std::pair<Addr, Addr> parse_addr_range(const string &s)
+{
+    size_t dash = s.find('-');
+    try {
+        if (dash != string::npos) {
+            size_t pos1, pos2;
+            Addr lo = stoull(s.substr(0, dash), &pos1, 0);
+            Addr hi = stoull(s.substr(dash + 1), &pos2, 0);
+            if (pos1 == dash && pos2 == s.size() - dash - 1 && lo <= hi)
+                return {lo, hi};
+        }
+    } catch (std::exception &) {
+    }
+    throw ArgparseError(format(_("unable to parse address range '{}'"), s));
+}
+
 void TarmacUtilityBase::add_options(Argparse &ap)
 {
     if (!iparams.can_store_on_disk())
@@ -65,6 +110,118 @@ void TarmacUtilityBase::add_options(Argparse &ap)
         ap.optnoval({"--memory-index"},
                     _("keep index in memory instead of on disk"),
                     [this]() { index_on_disk = false; });
+        ap.optval({"--btree"}, _("TREE"),
+                  _("when indexing, store index structure TREE (memsubtree, "
+                    "bypctree or seqtree) as a B+-tree"),
+                  [this](const string &s) {
+                      if (s == "memsubtree")
+                          iparams.memsubtree_type = TreeType::BTree;
+                      else if (s == "bypctree")
+                          iparams.bypctree_type = TreeType::BTree;
+                      else if (s == "seqtree")
+                          iparams.seqtree_type = TreeType::BTree;
+                      else
+                          throw ArgparseError(
+                              format(_("unknown index structure '{}'"), s));
+                  });
+        ap.optval({"--snapshot-interval"}, _("N"),
+                  _("when indexing, store the full memory state only at every "
+                    "Nth trace event, making a smaller index but slower "
+                    "memory queries"),
+                  [this](const string &s) {
+                      iparams.snapshot_interval = parse_uint(s, UINT_MAX);
+                      if (iparams.snapshot_interval == 0)
+                          throw ArgparseError(
+                              _("snapshot interval must be at least 1"));
+                  });
+        ap.optnoval({"--lazy-memory"},
+                    _("when indexing, store the full memory state only at "
+                      "checkpoints, and fill in the rest when it is first "
+                      "needed"),
+                    [this]() { iparams.lazy_memory = true; });
+        ap.optval({"--index-shards"}, _("N"),
+                  _("when indexing, cut the trace into N pieces and index "
+                    "them in parallel"),
+                  [this](const string &s) {
+                      iparams.shards = parse_uint(s, UINT_MAX);
+                      if (iparams.shards == 0)
+                          throw ArgparseError(
+                              _("number of index shards must be at least 1"));
+                  });
+        ap.optnoval({"--per-cpu"},
+                    _("when indexing, make a separate view of the trace for "
+                      "each CPU in it"),
+                    [this]() { iparams.per_cpu = true; });
+        ap.optval({"--start-line"}, _("LINE"),
+                  _("when indexing, ignore the trace before line LINE"),
+                  [this](const string &s) {
+                      iparams.window_start_line = parse_uint(s);
+                  });
+        ap.optval({"--end-line"}, _("LINE"),
+                  _("when indexing, ignore the trace after line LINE"),
+                  [this](const string &s) {
+                      iparams.window_end_line = parse_uint(s);
+                  });
+        ap.optval({"--start-time"}, _("TIME"),
+                  _("when indexing, ignore the trace before time TIME"),
+                  [this](const string &s) {
+                      iparams.window_start_time = parse_uint(s);
+                  });
+        ap.optval({"--end-time"}, _("TIME"),
+                  _("when indexing, ignore the trace after time TIME"),
+                  [this](const string &s) {
+                      iparams.window_end_time = parse_uint(s);
+                  });
+        ap.optval({"--exclude-pc"}, _("LO-HI"),
+                  _("when indexing, fold instructions with PCs from LO to HI "
+                    "into placeholder nodes"),
+                  [this](const string &s) {
+                      iparams.exclude_pcs.push_back(parse_addr_range(s));
+                  });
+        if (can_use_image)
+            ap.optval({"--exclude-symbol"}, _("SYMBOL"),
+                      _("when indexing, fold instructions in SYMBOL in the "
+                        "image file into placeholder nodes"),
+                      [this](const string &s) {
+                          exclude_symbols.push_back(s);
+                      });
+        ap.optval({"--exclude-data"}, _("LO-HI"),
+                  _("when indexing, do not record memory accesses to "
+                    "addresses from LO to HI"),
+                  [this](const string &s) {
+                      iparams.exclude_data.push_back(parse_addr_range(s));
+                  });
+        ap.optnoval({"--compress-loops"},
+                    _("when indexing, fold repeated iterations of a loop that "
+                      "changes nothing into a single trace event"),
+                    [this]() { iparams.compress_loops = true; });
+        ap.optnoval({"--drop-trace-cache"},
+                    _("when indexing, tell the OS not to keep the parts of "
+                      "the trace file already read in its cache"),
+                    [this]() { iparams.trace_drop_behind = true; });
+        ap.optnoval({"--direct-io"},
+                    _("when indexing, read the trace file bypassing the OS's "
+                      "cache, if possible"),
+                    [this]() { iparams.trace_direct_io = true; });
+        ap.optval({"--index-cache"}, _("DIR"),
+                  _("keep index files in DIR, named after the contents of "
+                    "their trace files, so that any copy of a trace can "
+                    "use the same index"),
+                  [this](const string &s) { index_cache_dir = s; });
+        ap.optval({"--index-cache-size"}, _("SIZE"),
+                  _("delete the least recently used index files in the "
+                    "index cache when they total more than SIZE bytes "
+                    "(default 10G)"),
+                  [this](const string &s) { index_cache_size = parse_size(s); });
+    }
+    if (does_indexing()) {
+        ap.optval({"--cpu"}, _("CPU"),
+                  _("read the view of CPU in a per-CPU index (implies "
+                    "--per-cpu when indexing)"),
+                  [this](const string &s) {
+                      cpu = s;
+                      iparams.per_cpu = true;
+                  });
     }
     ap.optnoval({"--li"}, _("assume trace is from a little-endian platform"),
                 [this]() {
@@ -93,9 +250,14 @@ void TarmacUtilityBase::add_options(Argparse &ap)
                       if (s == "list") {
                           cout << _("List of diagnostic types:") << "\n"
                                << "--debug=call_heuristics: "
-                               << _("debug call and return analysis") << "\n";
+                               << _("debug call and return analysis") << "\n"
+                               << "--debug=space: "
+                               << _("report how the index file space is used")
+                               << "\n";
                       } else if (s == "call_heuristics") {
                           idiags.debug_call_heuristics = true;
+                      } else if (s == "space") {
+                          idiags.debug_space = true;
                       } else {
                           throw ArgparseError(
                               format(_("unknown diagnostic type '{}'"), s));
@@ -129,10 +291,27 @@ static string defaultIndexFilename(string tarmac_filename)
     return tarmac_filename + ".index";
 }
 
+void TarmacUtilityBase::use_index_cache(TracePair &trace) const
+{
+    string dir = index_cache_dir;
+    if (dir.empty() && !get_environment_variable("TARMAC_INDEX_CACHE", dir))
+        return;
+    if (dir.empty() || trace.tarmac_filename.empty())
+        return;
+    if (!make_directory(dir))
+        reporter->err(1, "%s: mkdir", dir.c_str());
+    trace.index_filename = index_cache_filename(dir, trace.tarmac_filename,
+                                                iparams, get_parse_params());
+    trace.index_cache_dir = dir;
+}
+
 void TarmacUtility::postProcessOptions()
 {
     trace.index_on_disk = index_on_disk;
+    trace.cpu = cpu;
     if (index_on_disk) {
+        if (trace.index_filename.empty())
+            use_index_cache(trace);
         if (trace.index_filename.empty())
             trace.index_filename = defaultIndexFilename(trace.tarmac_filename);
     } else {
@@ -153,15 +332,35 @@ void TarmacUtilityMT::add_options(Argparse &ap)
     auto add_pair = [this](const string &s) {
         TracePair pair;
         pair.tarmac_filename = s;
-        pair.index_on_disk = index_on_disk;
-        if (index_on_disk)
-            pair.index_filename = defaultIndexFilename(s);
         traces.push_back(pair);
     };
     ap.positional_multiple(_("TRACEFILE"), _("Tarmac trace files to read"),
                            add_pair);
 }
 
+void TarmacUtilityMT::postProcessOptions()
+{
+    if (!index_on_disk) {
+        if (indexing == Troolean::No)
+            reporter->warnx(_("Ignoring --no-index since index is in memory"));
+        indexing = Troolean::Yes;
+    }
+
+    // Options can come after the trace file names, so nothing about
+    // the traces is filled in until they've all been seen
+    for (TracePair &pair : traces) {
+        pair.index_on_disk = index_on_disk;
+        pair.cpu = cpu;
+        if (index_on_disk) {
+            use_index_cache(pair);
+            if (pair.index_filename.empty())
+                pair.index_filename = defaultIndexFilename(pair.tarmac_filename);
+        } else {
+            pair.memory_index = make_shared<MemArena>();
+        }
+    }
+}
+
 void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
 {
     Troolean doIndexing = indexing; // so we can translate Auto into Yes or No
@@ -180,18 +379,27 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
         if (!get_file_timestamp(trace.tarmac_filename, &trace_timestamp))
             reporter->err(1, "%s: stat", trace.tarmac_filename.c_str());
 
+        // An index in the cache is named after the contents of the
+        // trace, so the trace being newer doesn't make it out of date
         if (!get_file_timestamp(trace.index_filename, &index_timestamp)) {
             status = IndexUpdateCheck::Missing;
-        } else if (index_timestamp < trace_timestamp) {
+        } else if (index_timestamp < trace_timestamp &&
+                   trace.index_cache_dir.empty()) {
             status = IndexUpdateCheck::TooOld;
         } else {
-            switch (check_index_header(trace.index_filename)) {
+            switch (check_index_header(trace.index_filename, &iparams)) {
             case IndexHeaderState::WrongMagic:
                 status = IndexUpdateCheck::WrongFormat;
                 break;
+            case IndexHeaderState::WrongByteOrder:
+                status = IndexUpdateCheck::WrongByteOrder;
+                break;
             case IndexHeaderState::Incomplete:
                 status = IndexUpdateCheck::Incomplete;
                 break;
+            case IndexHeaderState::WrongParams:
+                status = IndexUpdateCheck::WrongParams;
+                break;
             default:
                 status = IndexUpdateCheck::OK;
                 break;
@@ -205,8 +413,29 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
         reporter->indexing_status(trace, IndexUpdateCheck::Forced);
     }
 
-    if (doIndexing == Troolean::Yes)
-        run_indexer(trace, iparams, idiags, get_parse_params());
+    if (trace.index_cache_dir.empty()) {
+        if (doIndexing == Troolean::Yes)
+            run_indexer(trace, iparams, idiags, get_parse_params());
+        return;
+    }
+
+    // Build an index for the cache under a temporary name, so that
+    // another tool looking for it never finds it half written
+    if (doIndexing == Troolean::Yes) {
+        TracePair tmp = trace;
+        tmp.index_filename += format(".part{:x}", std::random_device()());
+        run_indexer(tmp, iparams, idiags, get_parse_params());
+#ifdef _WIN32
+        // Windows rename() won't replace an existing file. Elsewhere
+        // it replaces it atomically, so that another tool never sees
+        // no index at all.
+        remove(trace.index_filename.c_str());
+#endif
+        if (rename(tmp.index_filename.c_str(), trace.index_filename.c_str()))
+            reporter->err(1, "%s: rename", tmp.index_filename.c_str());
+    }
+    index_cache_update(trace.index_cache_dir, trace.index_filename,
+                       index_cache_size);
 }
 
 ParseParams TarmacUtilityBase::get_parse_params() const
@@ -254,6 +483,21 @@ void TarmacUtilityBase::load_image()
             bigend = image->is_big_endian();
         }
     }
+
+    for (const string &name : exclude_symbols) {
+        if (!image)
+            reporter->errx(1, _("--exclude-symbol requires an image file"));
+        auto syms = image->find_all_symbols(name);
+        if (!syms)
+            reporter->errx(1, _("symbol '%s' not found in image"),
+                           name.c_str());
+        for (const Symbol *sym : *syms) {
+            // Ignore the low bit that marks a Thumb function
+            Addr lo = (sym->addr & ~(Addr)1) + load_offset;
+            Addr size = std::max(sym->size, (size_t)1);
+            iparams.exclude_pcs.emplace_back(lo, lo + (size - 1));
+        }
+    }
 }
 
 TarmacUtilityNoIndex::TarmacUtilityNoIndex()
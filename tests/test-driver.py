@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 
-# Copyright 2016-2021 Arm Limited. All rights reserved.
+# Copyright 2016-2021,2026 Arm Limited. All rights reserved.
 #
 # Licensed under the Apache License, Version 2.0 (the "License");
 # you may not use this file except in compliance with the License.
@@ -23,6 +23,7 @@ import argparse
 import itertools
 import subprocess
 import shlex
+import shutil
 import difflib
 
 class TestFailure(Exception):
@@ -72,6 +73,26 @@ class OutFile(RefFile):
     def name(self):
         return "output file '{}'".format(self.filename)
 
+class TempDir(ComparableStream):
+    def __init__(self, dirname):
+        self.dirname = dirname
+    def cleanup(self):
+        shutil.rmtree(self.dirname, ignore_errors=True)
+
+class DirListing(ComparableStream):
+    def __init__(self, dirname):
+        self.dirname = dirname
+    def text(self, out, err):
+        try:
+            return "".join(name + "\n"
+                           for name in sorted(os.listdir(self.dirname)))
+        except FileNotFoundError:
+            raise TestFailure(
+                "Expected directory '{}' to exist, but it did not"
+                .format(self.dirname))
+    def name(self):
+        return "listing of directory '{}'".format(self.dirname)
+
 class String(ComparableStream):
     def __init__(self, string):
         self.string = string
@@ -93,6 +114,8 @@ def parse_stream(name):
             return OutFile(words[1])
         if words[0] == "reffile":
             return RefFile(words[1])
+        if words[0] == "dirlist":
+            return DirListing(words[1])
         if words[0] == "string":
             return String(words[1])
         raise ValueError("unrecognised prefix in stream name '{}'".format(name))
@@ -126,17 +149,26 @@ def main():
     parser.add_argument("--tempfile", action="append",
                         help="Name a file expected to be generated as a side "
                         "effect of running this test")
+    parser.add_argument("--tempdir", action="append",
+                        help="Name a directory expected to be generated, "
+                        "with its contents, as a side effect of running "
+                        "this test")
+    parser.add_argument("--stdin", metavar="FILE",
+                        help="Feed the contents of a file to the command's "
+                        "standard input")
     parser.add_argument("--cleanup-always", action="store_true",
                         help="Clean up output files after the test runs")
     parser.add_argument("--cleanup-on-pass", action="store_true",
                         help="Clean up output files if the test passes")
-    parser.set_defaults(tempfile=[], compare=[], match=[])
+    parser.set_defaults(tempfile=[], tempdir=[], compare=[], match=[])
     args = parser.parse_args()
 
     # Add any temp files to the list of things we'll clean up before
     # and after the test
     for name in args.tempfile:
         all_streams.append(OutFile(name))
+    for name in args.tempdir:
+        all_streams.append(TempDir(name))
 
     def cleanup():
         for stream in all_streams:
@@ -147,11 +179,16 @@ def main():
     # one failed to write anything at all.
     cleanup()
 
+    stdin_data = b''
+    if args.stdin is not None:
+        with open(args.stdin, "rb") as fh:
+            stdin_data = fh.read()
+
     # Run the command.
     p = subprocess.Popen(args.command, stdin=subprocess.PIPE,
                          stdout=subprocess.PIPE,
                          stderr=subprocess.PIPE)
-    out, err = p.communicate(b'')
+    out, err = p.communicate(stdin_data)
     p.wait()
     status = p.returncode
 
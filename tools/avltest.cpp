@@ -18,6 +18,7 @@
 
 #include "libtarmac/argparse.hh"
 #include "libtarmac/disktree.hh"
+#include "libtarmac/index.hh"
 #include "libtarmac/reporter.hh"
 
 #include <functional>
@@ -51,10 +52,18 @@ struct TestPayload {
 enum class Test {
     Single,
     Clone,
+    Cache,
+    Build,
+    Cursor,
+    SeqCursor,
 };
 map<string, Test> testnames = {
     {"single", Test::Single},
     {"clone", Test::Clone},
+    {"cache", Test::Cache},
+    {"build", Test::Build},
+    {"cursor", Test::Cursor},
+    {"seqcursor", Test::SeqCursor},
 };
 
 class AVLTest {
@@ -70,6 +79,10 @@ class AVLTest {
     AVLTest(bool verbose);
     void test_single();
     void test_clone();
+    void test_cache();
+    void test_build();
+    void test_cursor();
+    void test_seq_cursor(const string &trace_filename);
 };
 
 AVLTest::AVLTest(bool verbose) : arena(), tree(arena, true), verbose(verbose)
@@ -153,6 +166,214 @@ void AVLTest::test_clone()
     }
 }
 
+void AVLTest::test_cache()
+{
+    // A persistent (non-refcounting) tree, as used in an index, with
+    // the decoded-node cache enabled. Its cache is deliberately tiny,
+    // so that slots are frequently reused by different nodes.
+    Tree ptree(arena);
+    ptree.enable_cache(4);
+
+    vector<OFF_T> roots;
+    vector<set<int>> expected;
+    OFF_T root = 0;
+    set<int> contents;
+
+    int p = 211;
+    for (int i = 1; i < p; i++) {
+        int j = (i * 123) % p;
+        root = ptree.insert(root, j);
+        ptree.commit();
+        contents.insert(j);
+        roots.push_back(root);
+        expected.push_back(contents);
+    }
+
+    // Read back every version of the tree twice, so that the second
+    // pass has a chance of finding nodes in the cache.
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t r = 0; r < roots.size(); r++) {
+            vector<int> got;
+            ptree.visit(roots[r], [&](const TestPayload &payload, OFF_T) {
+                got.push_back(payload.value);
+            });
+            if (got != vector<int>(expected[r].begin(), expected[r].end())) {
+                cout << "test_cache: tree root " << r << " has wrong contents"
+                     << endl;
+                exit(1);
+            }
+        }
+    }
+
+    auto stats = ptree.cache_stats();
+    if (verbose)
+        cout << "cache hits=" << stats.hits << " misses=" << stats.misses
+             << endl;
+    if (stats.hits == 0) {
+        cout << "test_cache: no cache hits at all" << endl;
+        exit(1);
+    }
+}
+
+void AVLTest::test_build()
+{
+    // Build trees of many sizes in one go, and check that they have
+    // the right contents, are balanced, and can be modified afterwards
+    function<int(OFF_T)> height;
+    height = [&, this](OFF_T offset) {
+        if (!offset)
+            return 0;
+        Tree::disknode &dn = *tree.arena.getptr<Tree::disknode>(offset);
+        int hl = height(dn.lc), hr = height(dn.rc);
+        if (hl - hr > 1 || hr - hl > 1 || dn.height != std::max(hl, hr) + 1) {
+            cout << "test_build: node at " << offset << " unbalanced" << endl;
+            exit(1);
+        }
+        return (int)dn.height;
+    };
+
+    for (int n = 0; n <= 100; n++) {
+        if (verbose)
+            cout << "building " << n << endl;
+        int next = 0;
+        OFF_T root = tree.build(n, [&]() { return TestPayload(2 * next++); });
+        dump(root);
+        check({root});
+        height(root);
+
+        vector<int> got, want;
+        tree.visit(root, [&](const TestPayload &payload, OFF_T) {
+            got.push_back(payload.value);
+        });
+        for (int i = 0; i < n; i++)
+            want.push_back(2 * i);
+        if (got != want) {
+            cout << "test_build: tree of " << n << " has wrong contents"
+                 << endl;
+            exit(1);
+        }
+
+        for (int i = 0; i <= n; i += 3)
+            root = tree.insert(root, 2 * i - 1);
+        check({root});
+        height(root);
+        tree.free_tree(root);
+    }
+}
+
+void AVLTest::test_cursor()
+{
+    // Seek a cursor to every payload of a persistent tree in turn, and
+    // walk forwards and backwards from there to the end, checking
+    // every step against succ() and pred()
+    Tree ptree(arena);
+    OFF_T root = 0;
+    int p = 211;
+    for (int i = 1; i < p; i++)
+        root = ptree.insert(root, 3 * ((i * 123) % p));
+    ptree.commit();
+
+    for (int key = -1; key <= 3 * p; key++) {
+        Tree::Cursor cursor = ptree.cursor(root);
+        bool present = key % 3 == 0 && key > 0 && key < 3 * p;
+        if (cursor.seek(TestPayload(key)) != present ||
+            (present && cursor.payload().value != key)) {
+            cout << "test_cursor: seek(" << key << ") wrong" << endl;
+            exit(1);
+        }
+        if (!present)
+            continue;
+
+        for (bool forwards : {true, false}) {
+            Tree::Cursor walker = cursor;
+            TestPayload here(key), expected;
+            while (true) {
+                bool more = forwards
+                                ? ptree.succ(root, here, &expected, nullptr)
+                                : ptree.pred(root, here, &expected, nullptr);
+                bool moved = forwards ? walker.next() : walker.prev();
+                if (moved != more ||
+                    (moved && walker.payload().value != expected.value)) {
+                    cout << "test_cursor: step " << (forwards ? "after " : "before ")
+                         << here.value << " from " << key << " wrong" << endl;
+                    exit(1);
+                }
+                if (!moved)
+                    break;
+                here = expected;
+            }
+        }
+    }
+
+    Tree::Cursor cursor = ptree.cursor(root);
+    if (!cursor.first() || cursor.payload().value != 3 || cursor.prev() ||
+        !cursor.last() || cursor.payload().value != 3 * (p - 1) ||
+        cursor.next()) {
+        cout << "test_cursor: first() or last() wrong" << endl;
+        exit(1);
+    }
+}
+
+void AVLTest::test_seq_cursor(const string &trace_filename)
+{
+    // Index a trace with its loops folded, so that some steps are
+    // between the nodes of a folded loop run, and walk it with a
+    // SeqCursor forwards and backwards from every line, checking each
+    // step against get_next_node and get_previous_node
+    TracePair trace;
+    trace.tarmac_filename = trace_filename;
+    trace.index_on_disk = false;
+    trace.memory_index = std::make_shared<MemArena>();
+    IndexerParams iparams;
+    iparams.compress_loops = true;
+    run_indexer(trace, iparams, IndexerDiagnostics(), ParseParams(false));
+    IndexNavigator IN(trace);
+
+    auto same = [](const SeqOrderPayload &a, const SeqOrderPayload &b) {
+        return a.trace_file_firstline == b.trace_file_firstline &&
+               a.trace_file_lines == b.trace_file_lines && a.pc == b.pc &&
+               a.mod_time == b.mod_time;
+    };
+
+    SeqOrderPayload last;
+    if (!IN.find_buffer_limit(true, &last)) {
+        cout << "test_seq_cursor: trace is empty" << endl;
+        exit(1);
+    }
+    LineNo end = last.trace_file_firstline + last.trace_file_lines;
+
+    for (LineNo line = 1; line < end; line++) {
+        SeqCursor cursor(IN);
+        SeqOrderPayload node;
+        if (!IN.node_at_line(line, &node) || !cursor.seek_line(line) ||
+            !same(cursor.node(), node)) {
+            cout << "test_seq_cursor: seek_line(" << line << ") wrong"
+                 << endl;
+            exit(1);
+        }
+
+        for (bool forwards : {true, false}) {
+            SeqCursor walker = cursor;
+            SeqOrderPayload here = node, expected;
+            while (true) {
+                bool more = forwards ? IN.get_next_node(here, &expected)
+                                     : IN.get_previous_node(here, &expected);
+                bool moved = forwards ? walker.next() : walker.prev();
+                if (moved != more || (moved && !same(walker.node(), expected))) {
+                    cout << "test_seq_cursor: step "
+                         << (forwards ? "after " : "before ") << "line "
+                         << here.trace_file_firstline << " from line " << line
+                         << " wrong" << endl;
+                    exit(1);
+                }
+                if (!moved)
+                    break;
+                here = expected;
+            }
+        }
+    }
+}
+
 void AVLTest::dump(OFF_T root)
 {
     if (!verbose)
@@ -166,7 +387,7 @@ void AVLTest::dump(OFF_T root)
             dump_node(dn.lc, prefix_before + "  ", prefix_before + "┌╴",
                       prefix_before + "│ ");
         cout << prefix_at << dn.payload.value << " offset=" << offset
-             << " rc=" << dn.refcount << endl;
+             << " rc=" << tree.refcount(offset) << endl;
         if (dn.rc)
             dump_node(dn.rc, prefix_after + "│ ", prefix_after + "└╴",
                       prefix_after + "  ");
@@ -198,8 +419,7 @@ void AVLTest::check(vector<OFF_T> roots)
         visit_node(root);
 
     for (auto kv: expected_refcounts) {
-        Tree::disknode &dn = *tree.arena.getptr<Tree::disknode>(kv.first);
-        int expected = kv.second, actual = dn.refcount;
+        int expected = kv.second, actual = tree.refcount(kv.first);
         if (expected != actual) {
             cout << "check({";
             const char *sep = "";
@@ -218,11 +438,15 @@ void AVLTest::check(vector<OFF_T> roots)
 int main(int argc, char **argv)
 {
     bool verbose = false;
+    string trace_filename;
     set<Test> tests_to_run;
 
     Argparse ap("avltest", argc, argv);
     ap.optnoval({"-v", "--verbose"}, "print verbose diagnostics during tests",
                 [&]() { verbose = true; });
+    ap.optval({"--trace"}, "TRACEFILE",
+              "trace file to walk in the seqcursor test",
+              [&](const string &arg) { trace_filename = arg; });
     ap.positional("testname", "name of sub-test to run",
                   [&](const std::string &arg) {
                       auto it = testnames.find(arg);
@@ -233,15 +457,29 @@ int main(int argc, char **argv)
                   }, false);
     ap.parse();
 
-    if (tests_to_run.empty())
+    if (tests_to_run.empty()) {
         for (auto kv: testnames)
             tests_to_run.insert(kv.second);
+        if (trace_filename.empty())
+            tests_to_run.erase(Test::SeqCursor);
+    } else if (tests_to_run.count(Test::SeqCursor) && trace_filename.empty()) {
+        cout << "seqcursor test needs a trace file (--trace)" << endl;
+        exit(1);
+    }
 
     AVLTest t(verbose);
     if (tests_to_run.count(Test::Single))
         t.test_single();
     if (tests_to_run.count(Test::Clone))
         t.test_clone();
+    if (tests_to_run.count(Test::Cache))
+        t.test_cache();
+    if (tests_to_run.count(Test::Build))
+        t.test_build();
+    if (tests_to_run.count(Test::Cursor))
+        t.test_cursor();
+    if (tests_to_run.count(Test::SeqCursor))
+        t.test_seq_cursor(trace_filename);
 
     return 0;
 }
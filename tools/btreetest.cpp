@@ -0,0 +1,268 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/btree.hh"
+#include "libtarmac/reporter.hh"
+
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::set;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct TestPayload {
+    int value;
+    TestPayload() = default;
+    TestPayload(int value) : value(value) {}
+    int cmp(const TestPayload &rhs) const {
+        if (value < rhs.value) return -1;
+        if (value > rhs.value) return +1;
+        return 0;
+    }
+};
+
+// Finder that compares equal to any payload in the range [lo,hi].
+struct RangeFinder {
+    int lo, hi;
+    int cmp(const TestPayload &rhs) const {
+        if (hi < rhs.value) return -1;
+        if (lo > rhs.value) return +1;
+        return 0;
+    }
+};
+
+// Annotation counting the payloads in a subtree, so that we can
+// check the internal nodes are keeping their annotations up to date.
+struct CountAnnotation {
+    int count;
+    CountAnnotation() : count(0) {}
+    CountAnnotation(const TestPayload &) : count(1) {}
+    CountAnnotation(const CountAnnotation &lhs, const CountAnnotation &rhs)
+        : count(lhs.count + rhs.count)
+    {
+    }
+};
+
+class BTreeTest {
+    MemArena arena;
+    // Very small nodes, so that a few hundred payloads make a tree
+    // several levels deep
+    using Tree = BTreeDisk<TestPayload, CountAnnotation, 96>;
+    Tree tree;
+    bool verbose;
+
+    void fail(const string &msg);
+    int check_node(OFF_T offset, vector<int> &contents);
+    void check(OFF_T root, const set<int> &expected);
+
+  public:
+    BTreeTest(bool verbose);
+    void run();
+};
+
+BTreeTest::BTreeTest(bool verbose) : arena(), tree(arena), verbose(verbose)
+{
+    arena.alloc(16);           // so that no node pointer ends up at 0
+}
+
+void BTreeTest::fail(const string &msg)
+{
+    cout << msg << endl;
+    exit(1);
+}
+
+// Check the annotations in a subtree by recounting it, and collect
+// its contents in order.
+int BTreeTest::check_node(OFF_T offset, vector<int> &contents)
+{
+    const Tree::diskheader &h = tree.header(offset);
+    unsigned count = h.count;
+    if (h.leaf) {
+        for (unsigned i = 0; i < count; i++)
+            contents.push_back(tree.entry(offset, i).value);
+        return count;
+    }
+
+    int total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        const Tree::diskchild &dc = tree.child(offset, i);
+        size_t start = contents.size();
+        int subcount = check_node(dc.offset, contents);
+        if (subcount != dc.annotation.count)
+            fail("annotation count wrong in node at " +
+                 std::to_string(offset));
+        if (start == contents.size() || contents.back() != dc.max.value)
+            fail("max payload wrong in node at " + std::to_string(offset));
+        total += subcount;
+    }
+    return total;
+}
+
+void BTreeTest::check(OFF_T root, const set<int> &expected)
+{
+    vector<int> contents;
+    if (root)
+        check_node(root, contents);
+    if (contents != vector<int>(expected.begin(), expected.end()))
+        fail("tree contents wrong at root " + std::to_string(root));
+
+    vector<int> visited;
+    tree.visit(root, [&](const TestPayload &p, OFF_T) {
+        visited.push_back(p.value);
+    });
+    if (visited != contents)
+        fail("visit() order wrong at root " + std::to_string(root));
+
+    // Try every kind of lookup for a spread of keys, including some
+    // outside the range of the contents.
+    for (int key = -2; key < 2 + 3 * (int)expected.size(); key++) {
+        TestPayload found;
+        bool ret;
+
+        auto it = expected.find(key);
+        ret = tree.find(root, TestPayload(key), &found, nullptr);
+        if (ret != (it != expected.end()) || (ret && found.value != key))
+            fail("find(" + std::to_string(key) + ") wrong");
+
+        auto lo = expected.lower_bound(key), hi = expected.upper_bound(key + 5);
+        ret = tree.find_leftmost(root, RangeFinder{key, key + 5}, &found,
+                                 nullptr);
+        if (ret != (lo != hi) || (ret && found.value != *lo))
+            fail("find_leftmost(" + std::to_string(key) + ") wrong");
+        ret = tree.find_rightmost(root, RangeFinder{key, key + 5}, &found,
+                                  nullptr);
+        if (ret != (lo != hi) || (ret && found.value != *std::prev(hi)))
+            fail("find_rightmost(" + std::to_string(key) + ") wrong");
+
+        // visit_range over a span wide enough to cross several
+        // leaves, and again stopping after the first two it finds
+        for (int span : {5, 100}) {
+            vector<int> want(expected.lower_bound(key),
+                             expected.upper_bound(key + span));
+            vector<int> got, firsttwo;
+            tree.visit_range(root, RangeFinder{key, key + span},
+                             [&](const TestPayload &p, OFF_T) {
+                                 got.push_back(p.value);
+                                 return true;
+                             });
+            bool stopped = !tree.visit_range(
+                root, RangeFinder{key, key + span},
+                [&](const TestPayload &p, OFF_T) {
+                    firsttwo.push_back(p.value);
+                    return firsttwo.size() < 2;
+                });
+            if (got != want)
+                fail("visit_range(" + std::to_string(key) + ") wrong");
+            if (want.size() > 2)
+                want.resize(2);
+            if (firsttwo != want || stopped != (want.size() == 2))
+                fail("visit_range(" + std::to_string(key) + ") wrong");
+        }
+
+        auto succ = expected.upper_bound(key);
+        ret = tree.succ(root, TestPayload(key), &found, nullptr);
+        if (ret != (succ != expected.end()) || (ret && found.value != *succ))
+            fail("succ(" + std::to_string(key) + ") wrong");
+
+        auto pred = expected.lower_bound(key);
+        ret = tree.pred(root, TestPayload(key), &found, nullptr);
+        if (ret != (pred != expected.begin()) ||
+            (ret && found.value != *std::prev(pred)))
+            fail("pred(" + std::to_string(key) + ") wrong");
+    }
+}
+
+void BTreeTest::run()
+{
+    // Insert the multiples of 3 below 3p, in a scrambled order,
+    // committing after every insertion so that all the old roots must
+    // stay valid. Then check every one of them.
+    int p = 211;
+    vector<OFF_T> roots;
+    vector<set<int>> expected;
+    set<int> contents;
+    OFF_T root = 0;
+
+    for (int i = 1; i < p; i++) {
+        int j = 3 * ((i * 123) % p);
+        if (verbose)
+            cout << "inserting " << j << endl;
+        root = tree.insert(root, j);
+        tree.commit();
+        contents.insert(j);
+        roots.push_back(root);
+        expected.push_back(contents);
+        check(root, contents);
+    }
+
+    for (size_t r = 0; r < roots.size(); r++)
+        check(roots[r], expected[r]);
+
+    // Now insert some more without committing, so that nodes are
+    // modified in place.
+    for (int i = 1; i < p; i++) {
+        int j = 3 * ((i * 45) % p) + 1;
+        root = tree.insert(root, j);
+        contents.insert(j);
+    }
+    check(root, contents);
+    for (size_t r = 0; r < roots.size(); r++)
+        check(roots[r], expected[r]);
+
+    // Build trees of every size up to a few levels deep in one go, and
+    // check that they still take insertions afterwards.
+    for (int n = 0; n < 300; n++) {
+        if (verbose)
+            cout << "building " << n << endl;
+        int next = 0;
+        root = tree.build(n, [&]() { return TestPayload(2 * next++); });
+        contents.clear();
+        for (int i = 0; i < n; i++)
+            contents.insert(2 * i);
+        check(root, contents);
+        for (int i = 0; i <= n; i += 7) {
+            root = tree.insert(root, 2 * i - 1);
+            contents.insert(2 * i - 1);
+        }
+        check(root, contents);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+
+    Argparse ap("btreetest", argc, argv);
+    ap.optnoval({"-v", "--verbose"}, "print verbose diagnostics during tests",
+                [&]() { verbose = true; });
+    ap.parse();
+
+    BTreeTest t(verbose);
+    t.run();
+
+    return 0;
+}
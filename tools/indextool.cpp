@@ -45,7 +45,29 @@ using std::vector;
 
 static bool omit_index_offsets;
 
-static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
+template <typename Tree>
+static void require_avl(const Tree &tree, const char *option)
+{
+    if (tree.tree_type() != TreeType::AVL)
+        reporter->errx(1, _("%s only supports trees indexed as AVL trees"),
+                       option);
+}
+
+static const char *tree_type_name(TreeType type)
+{
+    return type == TreeType::AVL ? "AVL" : "B+-tree";
+}
+
+template <typename Tree>
+static void dump_cache_stats(const char *name, const Tree &tree)
+{
+    auto stats = tree.cache_stats();
+    cout << format(_("{}: {} node cache hits, {} misses"), name, stats.hits,
+                   stats.misses)
+         << endl;
+}
+
+static void dump_memory_at_line(const IndexNavigator &IN, LineNo trace_line,
                                 const std::string &prefix);
 
 template <typename Payload, typename Annotation> class TreeDumper {
@@ -64,10 +86,12 @@ template <typename Payload, typename Annotation> class TreeDumper {
     {
     }
 
+    // An offset of 0 means the node wasn't read from a particular
+    // place in the file, e.g. it was expanded out of a folded loop run
     virtual void node_header(OFF_T offset)
     {
         cout << prefix;
-        if (!omit_index_offsets)
+        if (!omit_index_offsets && offset)
             cout << format(_("Node at file offset {}"), offset);
         else
             cout << _("Node");
@@ -207,6 +231,15 @@ class SeqTreeDumper : public TreeDumper<SeqOrderPayload, SeqOrderAnnotation> {
                  << node.memory_root << dec << endl;
         }
         cout << prefix << _("Call depth: ") << node.call_depth << endl;
+        if (const LoopRun *run =
+                IN.index.find_loop_run(node.trace_file_firstline)) {
+            cout << prefix
+                 << format(_("Folded loop: {} iterations of {} lines in {} "
+                             "nodes, body at line {}"),
+                           run->iterations, run->period_lines,
+                           run->period_nodes, run->body_line)
+                 << endl;
+        }
         if (dump_memory) {
             dump_memory_at_line(IN, node.trace_file_firstline, prefix + "  ");
         }
@@ -423,7 +456,7 @@ static void regdump(const std::vector<unsigned char> &val,
     }
 }
 
-static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
+static void dump_memory_at_line(const IndexNavigator &IN, LineNo trace_line,
                                 const std::string &prefix)
 {
     SeqOrderPayload node;
@@ -434,23 +467,14 @@ static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
     OFF_T memroot = node.memory_root;
     unsigned iflags = IN.get_iflags(memroot);
 
-    const void *outdata;
-    Addr outaddr;
-    size_t outsize;
-    unsigned outline;
-
-    Addr readaddr = 0;
-    size_t readsize = 0;
-    while (IN.getmem_next(memroot, 'm', readaddr, readsize, &outdata, &outaddr,
-                          &outsize, &outline)) {
-        cout << prefix << format(_("Memory last modified at line {}:"), outline)
-             << endl;
-        hexdump(outdata, outsize, outaddr, prefix);
-        readsize -= outaddr + outsize - readaddr;
-        readaddr = outaddr + outsize;
-        if (!readaddr)
-            break;
-    }
+    IN.visit_mem(memroot, 'm', 0, 0,
+                 [&](const void *data, Addr addr, size_t size, LineNo line) {
+                     cout << prefix
+                          << format(_("Memory last modified at line {}:"),
+                                    line)
+                          << endl;
+                     hexdump(data, size, addr, prefix);
+                 });
 
     for (const auto &regfam : reg_families) {
         for (unsigned i = 0; i < regfam.nregs; i++) {
@@ -460,8 +484,8 @@ static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
                 continue;              // it's a dummy register
             vector<unsigned char> val(size), def(size);
 
-            unsigned mod_line = IN.getmem(memroot, 'r', reg_offset(reg, iflags),
-                                          size, &val[0], &def[0]);
+            LineNo mod_line = IN.getmem(memroot, 'r', reg_offset(reg, iflags),
+                                        size, &val[0], &def[0]);
 
             bool print = false;
             for (auto c : def) {
@@ -501,11 +525,18 @@ int main(int argc, char **argv)
         ByPCWalk,
         RegMap,
         FullMemByLine,
+        ChangesByLine,
+        TextByLine,
+        ConvertByteOrder,
+        Relayout,
     } mode = Mode::None;
     OFF_T root;
-    unsigned trace_line;
+    string outfile;
+    LineNo trace_line;
     unsigned iflags = 0;
     bool got_iflags = false;
+    bool cache_stats = false;
+    unsigned max_depth = UINT_MAX;
 
     Argparse ap("tarmac-indextool", argc, argv);
     TarmacUtility tu;
@@ -566,6 +597,10 @@ int main(int argc, char **argv)
                 _("do not dump offsets in index file (so that output is more "
                   "stable when index format changes)"),
                 [&]() { omit_index_offsets = true; });
+    ap.optval({"--max-depth"}, _("DEPTH"),
+              _("(for --seq, --seq-with-mem) only dump nodes at call depth "
+                "DEPTH or shallower"),
+              [&](const string &s) { max_depth = parseint(s); });
     ap.optval({"--full-mem-at-line"}, _("OFFSET"),
               _("dump full content of memory tree corresponding to a "
                 "particular line of the trace file"),
@@ -574,6 +609,42 @@ int main(int argc, char **argv)
                   trace_line = parseint(s);
               });
 
+    ap.optval({"--changes-at-line"}, _("OFFSET"),
+              _("dump the registers and memory modified by the node at a "
+                "particular line of the trace file"),
+              [&](const string &s) {
+                  mode = Mode::ChangesByLine;
+                  trace_line = parseint(s);
+              });
+
+    ap.optval({"--text-at-line"}, _("OFFSET"),
+              _("print a particular line of the trace file, found through "
+                "the index's table of line positions"),
+              [&](const string &s) {
+                  mode = Mode::TextByLine;
+                  trace_line = parseint(s);
+              });
+
+    ap.optnoval({"--cache-stats"},
+                _("after the query, report how well the cache of decoded "
+                  "index nodes performed"),
+                [&]() { cache_stats = true; });
+    ap.optval({"--convert-byte-order"}, _("OUTFILE"),
+              _("write a copy of the index file to OUTFILE with its byte "
+                "order reversed, for use on a host of the other endianness"),
+              [&](const string &s) {
+                  mode = Mode::ConvertByteOrder;
+                  outfile = s;
+              });
+    ap.optval({"--relayout"}, _("OUTFILE"),
+              _("write a compacted copy of the index file to OUTFILE, "
+                "omitting unused data and laying out each tree for faster "
+                "lookups"),
+              [&](const string &s) {
+                  mode = Mode::Relayout;
+                  outfile = s;
+              });
+
     ap.parse([&]() {
         if (mode == Mode::None && !tu.only_index())
             throw ArgparseError(_("expected an option describing a query"));
@@ -595,12 +666,34 @@ int main(int argc, char **argv)
         break;
     }
 
+    if (mode == Mode::ConvertByteOrder) {
+        // The index is very likely not in this host's byte order, and
+        // we want to convert it rather than have setup() rebuild it.
+        tu.suppress_indexing();
+        tu.setup();
+        if (!tu.trace.index_on_disk)
+            reporter->errx(1, _("--convert-byte-order needs an index file "
+                                "on disk"));
+        convert_index_byte_order(tu.trace.index_filename, outfile);
+        return 0;
+    }
+
     tu.setup();
+
+    if (mode == Mode::Relayout) {
+        if (!tu.trace.index_on_disk)
+            reporter->errx(1, _("--relayout needs an index file on disk"));
+        relayout_index(tu.trace.index_filename, outfile);
+        return 0;
+    }
+
     const IndexNavigator IN(tu.trace);
 
     switch (mode) {
     case Mode::None:
     case Mode::RegMap:
+    case Mode::ConvertByteOrder:
+    case Mode::Relayout:
         assert(false && "This should have been ruled out above");
 
     case Mode::Header: {
@@ -610,11 +703,30 @@ int main(int argc, char **argv)
              << (IN.index.isAArch64() ? "AArch64" : "AArch32") << endl;
         cout << _("Thumb only: ")
              << (IN.index.isThumbOnly() ? "yes" : "no") << endl;
+        cout << _("Memory stored as snapshots and deltas: ")
+             << (IN.index.hasMemoryDeltas() ? "yes" : "no") << endl;
+        cout << _("Memory trees built on demand: ")
+             << (IN.index.hasLazyMemory() ? "yes" : "no") << endl;
+        cout << _("Shards built in parallel: ") << IN.index.nShards() << endl;
+        cout << _("Folded loop runs: ") << IN.index.nLoopRuns() << endl;
+        cout << _("Sampled line positions: ") << IN.index.nLineOffsets()
+             << endl;
+        cout << _("CPU view: ")
+             << (IN.index.cpuView().empty() ? _("(whole trace)")
+                                            : IN.index.cpuView())
+             << endl;
         cout << _("Largest SVE vector register access: ")
              << IN.index.maxSVEBits() << " bits" << endl;
         cout << _("Root of sequential order tree: ") << IN.index.seqroot
              << endl;
         cout << _("Root of by-PC tree: ") << IN.index.bypcroot << endl;
+        if (IN.index.seqbtreeroot)
+            cout << _("Root of B+-tree copy of sequential order tree: ")
+                 << IN.index.seqbtreeroot << endl;
+        cout << _("Type of memory subtrees: ")
+             << tree_type_name(IN.index.memsubtree.tree_type()) << endl;
+        cout << _("Type of by-PC tree: ")
+             << tree_type_name(IN.index.bypctree.tree_type()) << endl;
         cout << _("Line number adjustment for file header: ")
              << IN.index.lineno_offset << endl;
         break;
@@ -624,7 +736,13 @@ int main(int argc, char **argv)
     case Mode::SeqVisitWithMem: {
         SeqTreeDumper d(IN);
         d.dump_memory = (mode == Mode::SeqVisitWithMem);
-        IN.index.seqtree.visit(IN.index.seqroot, d.visitor);
+        if (max_depth == UINT_MAX) {
+            IN.index.seqtree.visit(IN.index.seqroot, d.visitor);
+        } else {
+            for (DepthScan scan(IN, 0, max_depth + 1); scan.valid();
+                 scan.next())
+                d.visitor(scan.node(), 0);
+        }
         break;
     }
 
@@ -654,7 +772,9 @@ int main(int argc, char **argv)
 
     case Mode::MemSubWalk: {
         MemSubtreeDumper d(IN);
-        IN.index.memsubtree.walk(root, WalkOrder::Preorder, d.walker);
+        require_avl(IN.index.memsubtree, "--memsubtree");
+        IN.index.memsubtree.as_avl().walk(root, WalkOrder::Preorder,
+                                          d.walker);
         break;
     }
 
@@ -666,8 +786,9 @@ int main(int argc, char **argv)
 
     case Mode::ByPCWalk: {
         ByPCTreeDumper d(IN);
-        IN.index.bypctree.walk(IN.index.bypcroot, WalkOrder::Preorder,
-                               d.walker);
+        require_avl(IN.index.bypctree, "--bypctree");
+        IN.index.bypctree.as_avl().walk(IN.index.bypcroot,
+                                        WalkOrder::Preorder, d.walker);
         break;
     }
 
@@ -675,6 +796,42 @@ int main(int argc, char **argv)
         dump_memory_at_line(IN, trace_line, "");
         break;
     }
+
+    case Mode::ChangesByLine: {
+        SeqOrderPayload node;
+        if (!IN.node_at_line(trace_line, &node)) {
+            cerr << format(_("Unable to find a node at line {}\n"),
+                           trace_line);
+            exit(1);
+        }
+        for (const MemoryChange &change :
+             IN.changes_since(node.memory_root, node.trace_file_firstline)) {
+            cout << format(change.type == 'r'
+                               ? _("Register space {:#x}-{:#x}: ")
+                               : _("Memory {:#x}-{:#x}: "),
+                           change.lo, change.hi);
+            regdump(change.data, change.def);
+            cout << endl;
+        }
+        break;
+    }
+
+    case Mode::TextByLine: {
+        string text;
+        if (!IN.index.get_line_text(trace_line, text)) {
+            cerr << format(_("Unable to find line {}\n"), trace_line);
+            exit(1);
+        }
+        cout << text << endl;
+        break;
+    }
+    }
+
+    if (cache_stats) {
+        dump_cache_stats("seqtree", IN.index.seqtree);
+        dump_cache_stats("memtree", IN.index.memtree);
+        dump_cache_stats("memsubtree", IN.index.memsubtree);
+        dump_cache_stats("bypctree", IN.index.bypctree);
     }
 
     return 0;
@@ -44,6 +44,7 @@ using std::unique_ptr;
 using std::vector;
 
 static ParseParams parse_params;
+static bool show_sources = false;
 
 class TestReceiver : public ParseReceiver {
     ostream &os;
@@ -57,13 +58,22 @@ class TestReceiver : public ParseReceiver {
         }
     }
 
+    string source(const TarmacEvent &ev)
+    {
+        if (!show_sources || !ev.source)
+            return "";
+        return " source=" + parser->source_name(ev.source);
+    }
+
   public:
+    const TarmacLineParser *parser = nullptr;
+
     TestReceiver(ostream &os) : os(os) {}
 
     void got_event(RegisterEvent &ev)
     {
         os << "* RegisterEvent"
-           << " time=" << ev.time << " reg=" << ev.reg << hex
+           << " time=" << ev.time << source(ev) << " reg=" << ev.reg << hex
            << " offset=" << ev.offset << " bytes=";
         char buf[3];
         const char *sep = "";
@@ -79,7 +89,8 @@ class TestReceiver : public ParseReceiver {
     void got_event(MemoryEvent &ev)
     {
         os << "* MemoryEvent"
-           << " time=" << ev.time << " read=" << (ev.read ? "true" : "false")
+           << " time=" << ev.time << source(ev)
+           << " read=" << (ev.read ? "true" : "false")
            << " known=" << (ev.known ? "true" : "false") << " addr=" << hex
            << ev.addr << dec << " size=" << ev.size << " contents=" << hex
            << ev.contents << dec << endl;
@@ -88,7 +99,7 @@ class TestReceiver : public ParseReceiver {
     void got_event(InstructionEvent &ev)
     {
         os << "* InstructionEvent"
-           << " time=" << ev.time
+           << " time=" << ev.time << source(ev)
            << " effect=" << tostr(ev.effect)
            << " pc=" << hex << ev.pc << dec
            << " iset="
@@ -101,13 +112,13 @@ class TestReceiver : public ParseReceiver {
 
     void got_event(ExceptionEvent &ev)
     {
-        os << "* ExceptionEvent" << " time=" << ev.time << endl;
+        os << "* ExceptionEvent" << " time=" << ev.time << source(ev) << endl;
     }
 
     void got_event(TextOnlyEvent &ev)
     {
         os << "* TextOnlyEvent"
-           << " time=" << ev.time << " type=\"" << ev.type << "\""
+           << " time=" << ev.time << source(ev) << " type=\"" << ev.type << "\""
            << " text=\"" << ev.msg << "\"" << endl;
     }
 
@@ -123,6 +134,7 @@ void run_tests(istream &is, ostream &os)
     string line;
     TestReceiver testrecv(os);
     TarmacLineParser parser(parse_params, testrecv);
+    testrecv.parser = &parser;
 
     while (getline(is, line)) {
         if (line.size() == 0 || line[0] == '#')
@@ -249,6 +261,8 @@ int main(int argc, char **argv)
                     parse_params.iset_specified = true;
                     parse_params.iset = THUMB;
                 });
+    ap.optnoval({"--sources"}, "show the trace source each event came from",
+                []() { show_sources = true; });
     ap.positional("INFILE", "input file to parse (default: standard input)",
                   [&](const string &s) { infile = make_unique<string>(s); },
                   false /* not required */);
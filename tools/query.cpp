@@ -0,0 +1,119 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Tool that answers a batch of queries about one trace (see
+ * libtarmac/query.hh), sharing them out between several threads all
+ * reading the same index, and writes the answers in the order the
+ * queries were given.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/query.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <atomic>
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cin;
+using std::cout;
+using std::ifstream;
+using std::istream;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string query_filename;
+    unsigned nthreads = std::thread::hardware_concurrency();
+    if (nthreads == 0)
+        nthreads = 1;
+    CallTreeOptions ctopts;
+
+    Argparse ap("tarmac-query", argc, argv);
+    TarmacUtility tu;
+    tu.add_options(ap);
+    ctopts.add_options(ap);
+    ap.optval({"--threads"}, _("N"),
+              _("answer queries on N threads at once (default: one for "
+                "each CPU)"),
+              [&](const string &s) {
+                  nthreads = parse_uint(s, UINT_MAX);
+                  if (nthreads == 0)
+                      throw ArgparseError(
+                          _("number of threads must be at least 1"));
+              });
+    ap.positional(_("QUERYFILE"),
+                  _("file of queries, one per line (default: standard "
+                    "input)"),
+                  [&](const string &s) { query_filename = s; }, false);
+    ap.parse();
+    tu.setup();
+
+    vector<string> queries;
+    {
+        ifstream file;
+        istream *is = &cin;
+        if (!query_filename.empty()) {
+            file.open(query_filename);
+            if (!file)
+                reporter->err(1, "%s: open", query_filename.c_str());
+            is = &file;
+        }
+        string line;
+        while (getline(*is, line))
+            if (line.find_first_not_of(" \t\r") != string::npos)
+                queries.push_back(line);
+    }
+
+    IndexNavigator IN(tu.trace, tu.image_filename, tu.load_offset);
+    QueryEngine engine(IN, ctopts);
+
+    // Each thread takes the next unanswered query until there are none
+    // left, so that a few slow queries don't leave the others idle
+    vector<string> answers(queries.size());
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i; (i = next++) < queries.size();)
+            answers[i] = engine.answer(queries[i]);
+    };
+
+    vector<std::thread> workers;
+    for (unsigned i = 1; i < nthreads && i < queries.size(); i++)
+        workers.emplace_back(work);
+    work();
+    for (auto &t : workers)
+        t.join();
+
+    for (const string &answer : answers)
+        cout << answer << "\n";
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Server that keeps the indexes of one or more traces open, with
+ * their ELF image loaded, and answers queries about them (see
+ * libtarmac/query.hh) for as long as it runs. Queries come either on
+ * standard input, or from any number of clients at once through a
+ * Unix-domain socket.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/query.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::make_shared;
+using std::make_unique;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+unique_ptr<Reporter> reporter = make_cli_reporter();
+
+class Server {
+    vector<unique_ptr<IndexNavigator>> navs;
+    vector<unique_ptr<QueryEngine>> engines;
+
+  public:
+    Server(const vector<TracePair> &traces, shared_ptr<Image> image,
+           uint64_t load_offset, const CallTreeOptions &ctopts)
+    {
+        for (const TracePair &trace : traces) {
+            navs.push_back(
+                make_unique<IndexNavigator>(trace, image, load_offset));
+            engines.push_back(make_unique<QueryEngine>(*navs.back(), ctopts));
+        }
+    }
+
+    // With more than one trace, a query can say which it's about with
+    // a "trace" field giving its file name or its position in the list
+    // of traces, counting from 0. Otherwise it's about the first.
+    string answer(const string &line) const
+    {
+        try {
+            QueryRequest req(line);
+            size_t i = 0;
+            if (req.has("trace")) {
+                const string &name = req.get_string("trace");
+                for (i = 0; i < navs.size(); i++)
+                    if (navs[i]->get_tarmac_filename() == name)
+                        break;
+                if (i == navs.size()) {
+                    char *end;
+                    i = strtoul(name.c_str(), &end, 10);
+                    if (name.empty() || *end || i >= navs.size())
+                        return QueryEngine::error_answer(
+                            format(_("no trace '{}'"), name), req.id_json());
+                }
+            }
+            return engines[i]->answer(req);
+        } catch (QueryError &e) {
+            return QueryEngine::error_answer(e.msg);
+        }
+    }
+
+    // Answer queries from one client until it stops sending them,
+    // stops being able to receive the answers, or sends a line too
+    // long to be a query
+    void serve(FILE *in, FILE *out) const
+    {
+        string line;
+        char buf[4096];
+        while (fgets(buf, sizeof(buf), in)) {
+            line += buf;
+            if (line.size() > MAX_QUERY_LENGTH) {
+                string ans = QueryEngine::error_answer(
+                    format(_("query longer than {} bytes"), MAX_QUERY_LENGTH));
+                fputs(ans.c_str(), out);
+                fputc('\n', out);
+                fflush(out);
+                return;
+            }
+            if (line.back() != '\n' && !feof(in))
+                continue;
+            if (line.find_first_not_of(" \t\r\n") != string::npos) {
+                string ans = answer(line);
+                if (fputs(ans.c_str(), out) == EOF ||
+                    fputc('\n', out) == EOF || fflush(out) == EOF)
+                    return;
+            }
+            line.clear();
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string socket_path;
+    CallTreeOptions ctopts;
+
+    Argparse ap("tarmac-serve", argc, argv);
+    TarmacUtilityMT tu;
+    tu.add_options(ap);
+    ctopts.add_options(ap);
+    ap.optval({"--socket"}, _("PATH"),
+              _("listen for clients on a Unix-domain socket at PATH, "
+                "instead of reading queries from standard input"),
+              [&](const string &s) { socket_path = s; });
+    ap.parse();
+    tu.setup();
+
+    shared_ptr<Image> image;
+    if (!tu.image_filename.empty())
+        image = make_shared<Image>(tu.image_filename);
+    Server server(tu.traces, image, tu.load_offset, ctopts);
+
+    if (socket_path.empty()) {
+        server.serve(stdin, stdout);
+        return 0;
+    }
+
+    // Each client gets a thread of its own, so that a slow query from
+    // one doesn't hold up the others. Beyond MAX_CLIENTS at once, we
+    // stop accepting connections until one of them goes away, leaving
+    // any more waiting in the socket's backlog.
+    static const unsigned MAX_CLIENTS = 64;
+    std::mutex clients_mutex;
+    std::condition_variable client_gone;
+    unsigned clients = 0;
+
+    LocalSocketServer listener(socket_path);
+    FILE *in, *out;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(clients_mutex);
+            client_gone.wait(lock, [&] { return clients < MAX_CLIENTS; });
+        }
+        if (!listener.accept(in, out))
+            break;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients++;
+        }
+        std::thread([&, in, out]() {
+            server.serve(in, out);
+            fclose(in);
+            fclose(out);
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients--;
+            client_gone.notify_one();
+        }).detach();
+    }
+    reporter->err(1, "%s: accept", socket_path.c_str());
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2026 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Benchmark comparing the AVL and B+-tree implementations of the index
+ * structures that can be either. Each of a by-PC tree of random PCs,
+ * and a seqtree of consecutive trace events, is built in both forms
+ * with the same contents, and the benchmark reports the size of the
+ * file and the time taken by lookups, both on a freshly opened file
+ * with its pages evicted from the OS cache (where supported) and
+ * again once it's warm.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/btree.hh"
+#include "libtarmac/index_ds.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
+
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using std::cout;
+using std::endl;
+using std::stoul;
+using std::string;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct PCFinder {
+    Addr pc;
+    int cmp(const ByPCPayload &rhs) const
+    {
+        if (pc != rhs.pc)
+            return pc < rhs.pc ? -1 : +1;
+        return 0;
+    }
+};
+
+struct LineFinder {
+    LineNo line;
+    int cmp(const SeqOrderPayload &rhs) const
+    {
+        if (line < rhs.trace_file_firstline)
+            return -1;
+        if (line >= rhs.trace_file_firstline + rhs.trace_file_lines)
+            return +1;
+        return 0;
+    }
+};
+
+// Simple deterministic pseudo-random sequence, so that both trees
+// get the same contents and the same queries.
+struct Random {
+    uint64_t state;
+    Random(uint64_t seed) : state(seed) {}
+    Addr next()
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 16) & ~(Addr)3;
+    }
+};
+
+// A function to do one random lookup in a tree, made by a
+// LookupMaker for a given mapping of the file the tree is in
+using Lookup = std::function<void(Random &)>;
+using LookupMaker = std::function<Lookup(Arena &)>;
+
+// Mean time in microseconds of 'count' random lookups, on a newly
+// opened mapping of the file.
+static double lookups(const string &filename, unsigned count,
+                      const LookupMaker &make_lookup)
+{
+    MMapFile arena(filename, false);
+    Lookup lookup = make_lookup(arena);
+    Random rng(2);
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < count; i++)
+        lookup(rng);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() /
+           count;
+}
+
+static void report(const string &filename, TreeType type, OFF_T size,
+                   unsigned queries, const LookupMaker &make_lookup)
+{
+    bool evicted = evict_file_from_cache(filename);
+    double cold = lookups(filename, queries, make_lookup);
+    double warm = lookups(filename, queries, make_lookup);
+
+    cout << "  " << (type == TreeType::AVL ? "AVL    " : "B+-tree") << "  size "
+         << size << " bytes, lookup " << cold << "us cold"
+         << (evicted ? "" : " (not evicted from OS cache)") << ", " << warm
+         << "us warm" << endl;
+
+    remove(filename.c_str());
+}
+
+// A by-PC tree, built by inserting entries in trace order, as the
+// indexer does, and searched for random PCs.
+static void bench_bypc(const string &filename, TreeType type,
+                       unsigned entries, unsigned queries)
+{
+    OFF_T root = 0;
+    OFF_T size;
+    {
+        MMapFile arena(filename, true);
+        arena.alloc(16); // so that no node pointer ends up at 0
+        SelectableTree<ByPCPayload> tree(arena, type);
+        Random rng(1);
+        for (unsigned i = 0; i < entries; i++) {
+            ByPCPayload payload;
+            payload.pc = rng.next();
+            payload.trace_file_firstline = i + 1;
+            root = tree.insert(root, payload);
+        }
+        size = arena.curr_offset();
+    }
+
+    report(filename, type, size, queries, [&](Arena &arena) -> Lookup {
+        auto tree = std::make_shared<SelectableTree<ByPCPayload>>(arena, type);
+        return [tree, root](Random &rng) {
+            ByPCPayload found;
+            tree->succ(root, PCFinder{rng.next()}, &found, nullptr);
+        };
+    });
+}
+
+// A seqtree, built as an AVL tree one event at a time as the indexer
+// does, and for the B+-tree, copied into one in a single pass as the
+// indexer does for '--btree=seqtree'. It's searched for random lines,
+// as by IndexNavigator::node_at_line. The size of the B+-tree is only
+// that of the copy, which an index holds as well as the AVL tree.
+static void bench_seq(const string &filename, TreeType type,
+                      unsigned entries, unsigned queries)
+{
+    const unsigned lines_per_node = 3;
+    auto make_payload = [](unsigned i) {
+        SeqOrderPayload payload;
+        payload.mod_time = i;
+        payload.pc = 0x8000 + 4 * (i % 1024);
+        payload.trace_file_pos = (OFF_T)i * 100;
+        payload.trace_file_len = 100;
+        payload.trace_file_firstline = (LineNo)i * lines_per_node + 1;
+        payload.trace_file_lines = lines_per_node;
+        payload.memory_root = 0;
+        payload.call_depth = 0;
+        return payload;
+    };
+
+    OFF_T root = 0;
+    OFF_T size;
+    {
+        MMapFile arena(filename, true);
+        arena.alloc(16); // so that no node pointer ends up at 0
+        if (type == TreeType::AVL) {
+            AVLDisk<SeqOrderPayload, SeqOrderAnnotation> tree(arena);
+            for (unsigned i = 0; i < entries; i++)
+                root = tree.insert(root, make_payload(i));
+        } else {
+            BTreeDisk<SeqOrderPayload> tree(arena);
+            unsigned i = 0;
+            root = tree.build(entries, [&]() { return make_payload(i++); });
+        }
+        size = arena.curr_offset();
+    }
+
+    LineNo lines = (LineNo)entries * lines_per_node;
+    report(filename, type, size, queries, [&](Arena &arena) -> Lookup {
+        if (type == TreeType::AVL) {
+            auto tree = std::make_shared<
+                AVLDisk<SeqOrderPayload, SeqOrderAnnotation>>(arena);
+            return [tree, root, lines](Random &rng) {
+                SeqOrderPayload found;
+                LineFinder finder{(rng.next() >> 2) % lines + 1};
+                tree->find(root, finder, &found, nullptr);
+            };
+        }
+        auto tree = std::make_shared<BTreeDisk<SeqOrderPayload>>(arena);
+        return [tree, root, lines](Random &rng) {
+            SeqOrderPayload found;
+            LineFinder finder{(rng.next() >> 2) % lines + 1};
+            tree->find(root, finder, &found, nullptr);
+        };
+    });
+}
+
+int main(int argc, char **argv)
+{
+    unsigned entries = 1000000, queries = 10000;
+    string dir = ".";
+
+    Argparse ap("treebench", argc, argv);
+    ap.optval({"--entries"}, "N", "number of entries to put in each tree",
+              [&](const string &s) { entries = stoul(s); });
+    ap.optval({"--queries"}, "N", "number of lookups to time",
+              [&](const string &s) { queries = stoul(s); });
+    ap.optval({"--dir"}, "DIR", "directory to write temporary files in",
+              [&](const string &s) { dir = s; });
+    ap.parse();
+
+    cout << "by-PC tree:" << endl;
+    bench_bypc(dir + "/treebench-avl.tmp", TreeType::AVL, entries, queries);
+    bench_bypc(dir + "/treebench-btree.tmp", TreeType::BTree, entries,
+               queries);
+    cout << "seqtree:" << endl;
+    bench_seq(dir + "/treebench-avl.tmp", TreeType::AVL, entries, queries);
+    bench_seq(dir + "/treebench-btree.tmp", TreeType::BTree, entries,
+              queries);
+
+    return 0;
+}
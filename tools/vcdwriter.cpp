@@ -25,10 +25,10 @@
 #include "vcd.hh"
 #include "vcdwriter.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <functional>
 
-using std::ref;
 using std::string;
 using std::vector;
 
@@ -242,10 +242,10 @@ class VCDVisitor : public ParseReceiver {
 
         // Output current simulation cycle.
         VCD.writeValueChange<long unsigned int>(Cycle, sop.mod_time);
-        vector<std::string> lines = IN.index.get_trace_lines(sop);
-        for (const string &line : lines) {
+        IN.index.get_trace_line_refs(sop, LineRefs, LineBuf);
+        for (StringRef ref : LineRefs) {
             try {
-                TLP.parse(line);
+                TLP.parse(ref);
             } catch (TarmacParseError err) {
                 // Ignore parse failures; we just leave the output event
                 // fields set to null.
@@ -259,9 +259,11 @@ class VCDVisitor : public ParseReceiver {
 
         // Let's find the updated registers.
         unsigned iflags = IN.get_iflags(sop.memory_root);
-        findRegisterChanges(CPU.CoreRegs, iflags, sop);
-        findRegisterChanges(CPU.SingleRegs, iflags, sop);
-        findRegisterChanges(CPU.DoubleRegs, iflags, sop);
+        vector<MemoryChange> changes =
+            IN.changes_since(sop.memory_root, sop.trace_file_firstline, 'r');
+        findRegisterChanges(CPU.CoreRegs, iflags, sop, changes);
+        findRegisterChanges(CPU.SingleRegs, iflags, sop, changes);
+        findRegisterChanges(CPU.DoubleRegs, iflags, sop, changes);
 
         // And the memory accesses...
         if (hadMemoryAccesses && MemoryAccesses.empty()) {
@@ -362,6 +364,10 @@ class VCDVisitor : public ParseReceiver {
     unsigned PrevInst;
     bool hadMemoryAccesses;
 
+    // Reused for each node's trace lines, to avoid allocating per line
+    vector<StringRef> LineRefs;
+    string LineBuf;
+
     void tick()
     {
         Tick += 1;
@@ -395,15 +401,15 @@ class VCDVisitor : public ParseReceiver {
 
     void
     findRegisterChanges(const vector<CPUDescription::RegisterDesc> &RegBank,
-                        unsigned iflags, const SeqOrderPayload &sop)
+                        unsigned iflags, const SeqOrderPayload &sop,
+                        const vector<MemoryChange> &changes)
     {
         for (const auto &R : RegBank) {
             Addr roffset = reg_offset(R.RegId, iflags);
-            Addr diff_lo, diff_hi;
-            if (IN.find_next_mod(sop.memory_root, 'r', roffset,
-                                 sop.trace_file_firstline, +1, diff_lo,
-                                 diff_hi) &&
-                diff_lo < roffset + R.Size) {
+            auto changed = [&](const MemoryChange &change) {
+                return change.lo < roffset + R.Size && change.hi >= roffset;
+            };
+            if (std::any_of(changes.begin(), changes.end(), changed)) {
                 vector<unsigned char> val(R.Size);
                 if (IN.get_reg_bytes(sop.memory_root, R.RegId, val))
                     VCD.writeValueChange(R.VCDIdx, [&val](unsigned bit) {
@@ -427,7 +433,9 @@ void VCDWriter::run(const string &VCDFilename, bool NoDate,
     VCD.writeHeader();
 
     VCDVisitor V(VCD, *this, UseTarmacTimestamp, ctopts);
-    index.seqtree.visit(index.seqroot, ref(V));
+    SeqCursor cursor(*this);
+    for (bool ok = cursor.seek_limit(false); ok; ok = cursor.next())
+        V(cursor.node(), 0);
     V.finish();
 }
 